@@ -0,0 +1,23 @@
+#include <stdlib.h>
+#include <new>
+#include "AllocCounter.h"
+
+// Every heap allocation goes through here, so benchmarks can count them
+std::atomic<size_t> allocations (0);
+
+void* operator new (size_t size) {
+    allocations++;
+    void* p = malloc (size ? size : 1);
+    if (!p) {
+        throw std::bad_alloc ();
+    }
+    return p;
+}
+
+void operator delete (void* p) noexcept {
+    free (p);
+}
+
+void operator delete (void* p, size_t) noexcept {
+    free (p);
+}
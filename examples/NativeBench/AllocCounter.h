@@ -0,0 +1,17 @@
+/**
+  * @file AllocCounter.h
+  * @brief Heap allocation counter for NativeBench
+  *
+  * Replacement `operator new` and `operator delete` live in their own translation unit, so that the compiler does
+  * not inline them into callers and warn about mismatched allocation functions.
+  */
+
+#ifndef ALLOC_COUNTER_H
+#define ALLOC_COUNTER_H
+
+#include <stddef.h>
+#include <atomic>
+
+extern std::atomic<size_t> allocations; ///< @brief Heap allocations since start
+
+#endif // ALLOC_COUNTER_H
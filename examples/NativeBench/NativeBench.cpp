@@ -0,0 +1,1899 @@
+/**
+  * @file NativeBench.cpp
+  * @brief Host checks and benchmarks for QuickLoRaWAN
+  *
+  * Runs the library against the simulated LMIC, Arduino core and in-memory filesystem in `extras/native`.
+  * First part checks behaviour of join, uplink queue and session persistence on simulated time.
+  * Second part measures CPU time and heap allocations of library hot paths on host.
+  *
+  * Build and run with `pio run -e native_bench -t exec`. Exit code is the number of failed checks.
+  *
+  * If `BENCH_HISTORY` environment variable names a file, results are compared with last run recorded there and then
+  * appended to it, tagged with `BENCH_LABEL` (a commit id, for instance) or current time. Operations that allocate more
+  * than before count as failures, as allocation count does not depend on host load. Operations more than
+  * `BENCH_TOLERANCE` slower are only reported.
+  */
+
+#include <Arduino.h>
+#include <math.h>
+#include <chrono>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+#include <time.h>
+#include "lorawan.h"
+#include "AllocCounter.h"
+
+const lmic_pinmap lmic_pins = {
+    .nss = 16,
+    .rxtx = LMIC_UNUSED_PIN,
+    .rst = LMIC_UNUSED_PIN,
+    .dio = {5, 4, LMIC_UNUSED_PIN},
+};
+
+static fs::FS memfs;
+static int failures = 0;
+
+#define BENCH_TOLERANCE 0.25 ///< @brief Slowdown over last recorded run that is reported
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        printf ("  FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+        failures++; \
+    } \
+} while (0)
+
+// ---------------------------------------------------------------------------
+// Simulation helpers
+// ---------------------------------------------------------------------------
+
+/**
+  * @brief Runs library loop on simulated time
+  * @param ms Time to run
+  */
+static void run_for (uint32_t ms) {
+    for (uint32_t t = 0; t < ms; t += 10) {
+        lorawan.loop ();
+        sim_advance_ms (10);
+    }
+}
+
+/**
+  * @brief Runs library loop until a number of frames have been sent
+  * @param frames Expected total of sent frames
+  * @param timeout_ms Maximum simulated time
+  * @return Simulated time spent, in milliseconds
+  */
+static uint32_t run_until_sent (unsigned frames, uint32_t timeout_ms = 3600000) {
+    uint32_t t = 0;
+    while (sim_frames_sent () < frames && t < timeout_ms) {
+        lorawan.loop ();
+        sim_advance_ms (10);
+        t += 10;
+    }
+    return t;
+}
+
+/**
+  * @brief Starts from a blank node: empty filesystem, fresh library object and simulated network
+  */
+static void factory_reset () {
+    sim_reset ();
+    sim_configure (1, true, 1500);
+    memfs.format ();
+    memfs.stats = fs::FSStats ();
+    lorawan = LoRaWAN ();
+    lorawan.set_file_system (&memfs);
+}
+
+/**
+  * @brief Simulates a reboot. Filesystem and RTC memory survive, library object is rebuilt
+  * @param setup Configuration applied to new object before `init()`
+  */
+template <typename F>
+static void reboot (F setup) {
+    lorawan = LoRaWAN ();
+    lorawan.set_file_system (&memfs);
+    setup ();
+    lorawan.init ();
+    run_for (20);
+}
+
+static void no_setup () {
+}
+
+// ---------------------------------------------------------------------------
+// Checks
+// ---------------------------------------------------------------------------
+
+static uint8_t join_drs[16];
+static unsigned join_requests = 0;
+static unsigned long join_times[16];
+
+static void record_join_request (ev_t event) {
+    if ((LMIC.opmode & OP_JOINING) && join_requests < sizeof (join_drs)) {
+        join_times[join_requests] = millis ();
+        join_drs[join_requests++] = LMIC.datarate;
+    }
+}
+
+static void check_join () {
+    printf ("join\n");
+    factory_reset ();
+    sim_configure (3, true, 1500);
+    bool joined_cb = false;
+    join_requests = 0;
+    lorawan.on_joined ([&joined_cb](u4_t*, devaddr_t*, xref2u1_t, xref2u1_t) { joined_cb = true; });
+    lorawan.subscribe (EV_TXSTART, record_join_request);
+    lorawan.init ();
+    run_for (120000);
+    CHECK (lorawan.isJoined ());
+    CHECK (joined_cb);
+    // First session save goes to slot B, so that a file left by an older version in A is kept until then
+    CHECK (memfs.exists ("loraconfig_b.cfg"));
+
+    // Sweep lowers one datarate step on every failure, waiting backoff or band duty cycle in between
+    const join_stats_t& stats = lorawan.get_join_stats ();
+    CHECK (join_requests == 3 && stats.attempts == 3);
+    CHECK (join_drs[0] == DR_SF7 && join_drs[1] == DR_SF8 && join_drs[2] == DR_SF9);
+    CHECK (stats.datarate == DR_SF9);
+    CHECK (join_times[1] - join_times[0] >= LORAWAN_JOIN_BACKOFF_MIN / 2);
+    CHECK (join_times[2] - join_times[1] >= lorawan.time_on_air (10, DR_SF8) * 99);
+    uint32_t airtime = lorawan.time_on_air (10, DR_SF7) + lorawan.time_on_air (10, DR_SF8) + lorawan.time_on_air (10, DR_SF9);
+    CHECK (stats.airtime_ms >= airtime - 3 && stats.airtime_ms <= airtime + 3);
+    CHECK (stats.time_ms > join_times[2] - join_times[0]);
+    printf ("  %u requests, %u ms to join, %u ms airtime\n", stats.attempts, stats.time_ms, stats.airtime_ms);
+}
+
+static void check_join_policy () {
+    printf ("join policy\n");
+    factory_reset ();
+    sim_configure (3, true, 1500);
+    lorawan.init ();
+    run_for (120000);
+    CHECK (lorawan.isJoined ());
+
+    // Statistics are stored with session. Rejoin starts at the datarate that worked
+    uint8_t data[4] = { 1, 2, 3, 4 };
+    reboot (no_setup);
+    CHECK (lorawan.get_join_stats ().attempts == 3 && lorawan.get_join_stats ().datarate == DR_SF9);
+    unsigned sent = sim_frames_sent ();
+    CHECK (lorawan.send (data, sizeof (data), 1));
+    sim_configure (2, true, 1500);
+    join_requests = 0;
+    lorawan.subscribe (EV_TXSTART, record_join_request);
+    lorawan.rejoin ();
+    CHECK (!lorawan.isJoined ());
+    run_for (120000);
+    CHECK (lorawan.isJoined ());
+    CHECK (join_requests == 2 && join_drs[0] == DR_SF9 && join_drs[1] == DR_SF10);
+    CHECK (lorawan.get_join_stats ().attempts == 2 && lorawan.get_join_stats ().datarate == DR_SF10);
+    // Queued message waits for join
+    CHECK (sim_frames_sent () == sent + 1 && lorawan.get_queue_length () == 0);
+
+    // A reboot while joining joins again, from last successful datarate
+    sim_configure (0, true, 1500);
+    lorawan.rejoin ();
+    run_for (1000);
+    join_requests = 0;
+    reboot ([] () {
+        join_policy_t policy;
+        policy.attempts_per_dr = 2;
+        policy.min_dr = DR_SF11;
+        policy.backoff_max_ms = 20000;
+        lorawan.set_join_policy (policy);
+        lorawan.subscribe (EV_TXSTART, record_join_request);
+    });
+    CHECK (!lorawan.isJoined ());
+    run_for (3500000);
+    CHECK (!lorawan.isJoined ());
+    // Two requests per datarate, from SF10 down to SF11 and again
+    CHECK (join_requests >= 6);
+    CHECK (join_drs[0] == DR_SF10 && join_drs[1] == DR_SF10 && join_drs[2] == DR_SF11 && join_drs[3] == DR_SF11 &&
+           join_drs[4] == DR_SF10);
+    // Join duty cycle: 36 s of airtime in first hour, and node keeps trying until it is used
+    CHECK (lorawan.get_join_stats ().airtime_ms <= 36000 && lorawan.get_join_stats ().airtime_ms > 30000);
+    printf ("  never accepted: %u requests, %u ms airtime in first hour\n", lorawan.get_join_stats ().attempts,
+            lorawan.get_join_stats ().airtime_ms);
+
+    // Start jitter spreads first request
+    factory_reset ();
+    join_policy_t policy;
+    policy.start_jitter_ms = 60000;
+    lorawan.set_join_policy (policy);
+    join_requests = 0;
+    lorawan.subscribe (EV_TXSTART, record_join_request);
+    lorawan.init ();
+    run_for (61000);
+    CHECK (join_requests == 1 && lorawan.isJoined ());
+    CHECK (join_times[0] <= 60000);
+}
+
+static uplink_result_t results[8];
+static unsigned result_count = 0;
+
+static void record_result (const uplink_result_t& result) {
+    if (result_count < sizeof (results) / sizeof (results[0])) {
+        results[result_count++] = result;
+    }
+}
+
+static void check_uplink_handles () {
+    printf ("uplink handles and retry\n");
+    factory_reset ();
+    lorawan.init ();
+    run_for (3000);
+    result_count = 0;
+    lorawan.on_uplink_complete (record_result);
+    uint8_t data[8] = { 0 };
+    uint16_t first = lorawan.send (data, sizeof (data), 1);
+    uint16_t second = lorawan.send (data, sizeof (data), 1, true);
+    CHECK (first && second && first != second);
+    run_until_sent (2);
+    run_for (2000);
+    CHECK (result_count == 2);
+    CHECK (results[0].handle == first && results[0].delivered && !results[0].confirmed && !results[0].ack);
+    CHECK (results[0].attempts == 1 && results[0].tries == 1 && results[0].datarate == DR_SF7);
+    CHECK (results[0].airtime_ms == lorawan.time_on_air (sizeof (data), DR_SF7));
+    CHECK (results[1].handle == second && results[1].delivered && results[1].ack);
+
+    // Without retry policy an unacknowledged message is reported at once
+    sim_configure (1, false, 1500);
+    result_count = 0;
+    unsigned sent = sim_frames_sent ();
+    uint16_t handle = lorawan.send (data, sizeof (data), 1, true);
+    run_until_sent (sent + 1);
+    run_for (2000);
+    CHECK (sim_frames_sent () == sent + 1);
+    CHECK (result_count == 1 && results[0].handle == handle && !results[0].delivered && results[0].attempts == 1);
+
+    // Retries lower datarate after every miss and wait a growing backoff
+    retry_policy_t policy;
+    policy.max_tries = 3;
+    policy.dr_step_after = 1;
+    policy.min_dr = DR_SF8;
+    policy.backoff_min_ms = 20000;
+    lorawan.set_retry_policy (policy);
+    result_count = 0;
+    sent = sim_frames_sent ();
+    unsigned long start = millis ();
+    handle = lorawan.send (data, sizeof (data), 1, true);
+    uint16_t behind = lorawan.send (data, sizeof (data), 2);
+    run_until_sent (sent + 1);
+    run_for (2000);
+    CHECK (result_count == 0 && lorawan.get_queue_length () == 2);
+    run_until_sent (sent + 3);
+    run_for (2000);
+    CHECK (result_count == 1 && results[0].handle == handle && !results[0].delivered);
+    CHECK (results[0].tries == 3 && results[0].attempts == 3 && results[0].datarate == DR_SF8);
+    CHECK (millis () - start >= 10000 + 20000);
+    // Message behind it keeps its place
+    run_until_sent (sent + 4);
+    run_for (2000);
+    CHECK (result_count == 2 && results[1].handle == behind && results[1].delivered);
+
+    // Acknowledged on second try
+    sim_configure (1, false, 1500);
+    result_count = 0;
+    sent = sim_frames_sent ();
+    handle = lorawan.send (data, sizeof (data), 1, true);
+    run_until_sent (sent + 1);
+    sim_configure (1, true, 1500);
+    run_until_sent (sent + 2);
+    run_for (2000);
+    CHECK (result_count == 1 && results[0].handle == handle && results[0].delivered && results[0].ack);
+    CHECK (results[0].tries == 2 && results[0].datarate == DR_SF8);
+
+    // Discarded messages are reported too
+    lorawan.set_fair_use_budget (10, 3600000);
+    result_count = 0;
+    handle = lorawan.send (data, sizeof (data), 1);
+    run_for (100);
+    CHECK (result_count == 1 && results[0].handle == handle && !results[0].delivered && results[0].attempts == 0);
+}
+
+static void check_queue () {
+    printf ("queue\n");
+    factory_reset ();
+    lorawan.init ();
+    run_for (3000);
+    uint8_t data[LORAWAN_TX_QUEUE_SIZE + 2][1];
+    unsigned accepted = 0;
+    for (unsigned i = 0; i < LORAWAN_TX_QUEUE_SIZE + 2; i++) {
+        data[i][0] = (uint8_t)i;
+        accepted += lorawan.send_data_inmediate (data[i], 1, 1);
+    }
+    CHECK (accepted == LORAWAN_TX_QUEUE_SIZE);
+    CHECK (lorawan.get_queue_dropped () == 2);
+    run_until_sent (LORAWAN_TX_QUEUE_SIZE);
+    run_for (2000);
+    CHECK (sim_frames_sent () == LORAWAN_TX_QUEUE_SIZE);
+    CHECK (lorawan.get_queue_length () == 0);
+    uint8_t port;
+    size_t len;
+    const uint8_t* frame = sim_last_frame (&port, &len);
+    CHECK (len == 1 && frame[0] == LORAWAN_TX_QUEUE_SIZE - 1);
+
+    // Drop oldest keeps the newest messages, in order
+    lorawan.set_queue_overflow_policy (QUEUE_DROP_OLDEST);
+    unsigned sent = sim_frames_sent ();
+    for (unsigned i = 0; i < LORAWAN_TX_QUEUE_SIZE + 2; i++) {
+        CHECK (lorawan.send_data_inmediate (data[i], 1, 1));
+    }
+    run_until_sent (sent + LORAWAN_TX_QUEUE_SIZE);
+    frame = sim_last_frame (&port, &len);
+    CHECK (frame[0] == LORAWAN_TX_QUEUE_SIZE + 1);
+}
+
+static void check_reserve_commit () {
+    printf ("reserve and commit\n");
+    factory_reset ();
+    lorawan.init ();
+    run_for (3000);
+    lorawan.set_sf (EU868_DR_SF12);
+    size_t capacity = 0;
+    uint8_t* payload = lorawan.reserve_uplink (&capacity);
+    CHECK (payload != NULL && capacity == 51);
+    CHECK (lorawan.reserve_uplink (&capacity) == NULL);
+    uint8_t other[] = { 9 };
+    CHECK (!lorawan.send_data_inmediate (other, sizeof (other)));
+    for (uint8_t i = 0; i < 10; i++) {
+        payload[i] = i;
+    }
+    CHECK (lorawan.commit_uplink (10, 3));
+    CHECK (lorawan.get_queue_length () == 1);
+    run_until_sent (1);
+    uint8_t port;
+    size_t len;
+    const uint8_t* frame = sim_last_frame (&port, &len);
+    CHECK (port == 3 && len == 10 && frame[9] == 9);
+
+    // Too long for reserved capacity
+    payload = lorawan.reserve_uplink (&capacity);
+    CHECK (payload != NULL);
+    CHECK (!lorawan.commit_uplink (capacity + 1));
+    CHECK (lorawan.send_data_inmediate (other, sizeof (other)));
+}
+
+static void check_downlink () {
+    printf ("downlink delivery\n");
+    factory_reset ();
+    lorawan.init ();
+    run_for (3000);
+    std::string order;
+    downlink_t last;
+    lorawan.on_tx_complete ([&order] (bool) { order += "T"; });
+    lorawan.on_rx_data ([&order] (uint8_t, const uint8_t*, size_t) { order += "R"; });
+    lorawan.on_downlink ([&last] (const downlink_t& dl) { last = dl; });
+    uint8_t data[] = { 1 };
+    uint8_t command[] = { 0xC0, 0xDE };
+
+    // Synchronous delivery runs inside LMIC receive path, before TX completes
+    sim_queue_downlink (10, command, sizeof (command), -100, 5);
+    lorawan.send_data_inmediate (data, sizeof (data));
+    run_until_sent (1);
+    run_for (100);
+    CHECK (order == "RT");
+    CHECK (last.port == 10 && last.len == 2 && last.data[1] == 0xDE);
+    CHECK (last.rssi == -100 && last.snr == 20);
+
+    // Deferred delivery runs from loop ()
+    lorawan.set_rx_deferred (true);
+    order.clear ();
+    sim_queue_downlink (11, command, sizeof (command), -80, -3);
+    lorawan.send_data_inmediate (data, sizeof (data));
+    run_until_sent (2);
+    run_for (100);
+    CHECK (order == "TR");
+    CHECK (last.port == 11 && last.rssi == -80 && last.snr == -12);
+
+    // Queue full drops newest downlinks
+    for (uint8_t i = 0; i < LORAWAN_RX_QUEUE_SIZE + 1; i++) {
+        LMIC.client.rxMessageCb (LMIC.client.rxMessageUserData, 20 + i, command, sizeof (command));
+    }
+    CHECK (lorawan.get_downlink_pending () == LORAWAN_RX_QUEUE_SIZE);
+    sim_advance_ms (50);
+    lorawan.loop ();
+    CHECK (lorawan.get_downlink_pending () == 0);
+    CHECK (last.port == 20 + LORAWAN_RX_QUEUE_SIZE - 1);
+    const downlink_stats_t& stats = lorawan.get_downlink_stats ();
+    CHECK (stats.received == 2 + LORAWAN_RX_QUEUE_SIZE + 1);
+    CHECK (stats.dropped == 1 && stats.delivered == 2 + LORAWAN_RX_QUEUE_SIZE);
+    CHECK (stats.max_pending == LORAWAN_RX_QUEUE_SIZE && stats.max_latency >= 50);
+}
+
+static void check_session_restore (storage_mode_t mode) {
+    printf ("session restore (%s)\n", mode == STORAGE_JOURNAL ? "journal" : "files");
+    factory_reset ();
+    lorawan.set_storage_mode (mode);
+    lorawan.set_counter_reservation (16);
+    lorawan.init ();
+    run_for (3000);
+    uint8_t data[] = { 1, 2, 3 };
+    for (unsigned i = 1; i <= 5; i++) {
+        lorawan.send_data_inmediate (data, sizeof (data));
+        run_until_sent (i);
+    }
+    run_for (2000);
+    CHECK (lorawan.get_persistence_stats ().counter_writes == 1);
+    CHECK (lorawan.get_persistence_stats ().counter_writes_avoided == 5);
+    u4_t used_up = LMIC.seqnoUp;
+
+    reboot ([mode] () {
+        lorawan.set_storage_mode (mode);
+        lorawan.set_counter_reservation (16);
+    });
+    CHECK (lorawan.isJoined ());
+    CHECK (LMIC.devaddr == 0x260B0001);
+    CHECK (LMIC.seqnoUp > used_up);
+    lorawan.send_data_inmediate (data, sizeof (data));
+    CHECK (run_until_sent (6) < 300000);
+}
+
+static void check_rtc_resume () {
+    printf ("rtc resume and duty cycle carry over\n");
+    factory_reset ();
+    lorawan.set_rtc_resume (true, 4);
+    lorawan.init ();
+    run_for (3000);
+    uint8_t data[] = { 1 };
+    lorawan.send_data_inmediate (data, sizeof (data));
+    run_until_sent (1);
+    run_for (2000);
+    ostime_t wait = LMIC.bands[0].avail - os_getTime ();
+    CHECK (lorawan.prepare_sleep (60000));
+    sim_advance_ms (60000);
+    uint32_t reads = memfs.stats.bytes_read;
+
+    reboot ([] () {
+        lorawan.set_rtc_resume (true, 4);
+    });
+    CHECK (lorawan.is_rtc_resumed ());
+    CHECK (memfs.stats.bytes_read == reads);
+    CHECK (LMIC.seqnoUp == 1);
+    ostime_t new_wait = LMIC.bands[0].avail - os_getTime ();
+    CHECK (new_wait < wait - sec2osticks (59) && new_wait > wait - sec2osticks (61));
+
+    // Counters stored before sleep still cover next uplink. Nothing is written
+    size_t written = memfs.stats.bytes_written;
+    unsigned opens = memfs.stats.opens;
+    lorawan.send_data_inmediate (data, sizeof (data));
+    run_until_sent (2);
+    run_for (2000);
+    CHECK (LMIC.seqnoUp == 2);
+    CHECK (memfs.stats.bytes_written == written && memfs.stats.opens == opens);
+
+    // Sleeps longer than LMIC time range, about 18 h, leave no wait. Elapsed time comes from announced sleep or,
+    // if it is set, from wall clock. Announced sleep is short then, so only wall clock can clear the wait
+    const uint32_t long_sleeps[] = { 86400, 172800 };
+    for (uint32_t sleep_s : long_sleeps) {
+        for (bool clock : { false, true }) {
+            factory_reset ();
+            if (clock) {
+                sim_set_wall_clock (1700000000);
+            }
+            lorawan.set_rtc_resume (true, 4);
+            lorawan.init ();
+            run_for (3000);
+            lorawan.send_data_inmediate (data, sizeof (data));
+            run_until_sent (1);
+            run_for (2000);
+            CHECK (LMIC.bands[0].avail - os_getTime () > 0);
+            CHECK (lorawan.prepare_sleep (clock ? 1000 : sleep_s * 1000));
+            sim_advance_ms (sleep_s * 1000);
+
+            reboot ([] () {
+                lorawan.set_rtc_resume (true, 4);
+            });
+            CHECK (lorawan.is_rtc_resumed ());
+            CHECK (LMIC.bands[0].avail - os_getTime () <= 0);
+            CHECK (LMIC.globalDutyAvail - os_getTime () <= 0);
+            CHECK (lorawan.next_tx_possible (1) == 0);
+        }
+    }
+}
+
+static void check_legacy_session () {
+    printf ("legacy session migration\n");
+    factory_reset ();
+    lorawan.init ();
+    run_for (3000);
+    lmic_t legacy = LMIC;
+    link_counters_t counters;
+    counters.up_counter = 100;
+    counters.down_counter = 5;
+    File f = memfs.open ("loraconfig.cfg", "w");
+    f.write ((uint8_t*)&legacy, sizeof (legacy));
+    f.close ();
+    f = memfs.open ("loracounters.cfg", "w");
+    f.write ((uint8_t*)&counters, sizeof (counters));
+    f.close ();
+    memfs.remove ("loraconfig_b.cfg");
+    memfs.remove ("loracounters_b.cfg");
+
+    reboot (no_setup);
+    CHECK (lorawan.isJoined ());
+    CHECK (LMIC.seqnoUp == 100);
+    // Converted session goes to slot B. Legacy file is kept until next save
+    f = memfs.open ("loraconfig_b.cfg", "r");
+    CHECK (f.size () == sizeof (slot_header_t) + sizeof (session_record_t) + sizeof (uint32_t));
+    f.close ();
+    f = memfs.open ("loraconfig.cfg", "r");
+    CHECK (f.size () == sizeof (lmic_t));
+    f.close ();
+
+    // Session file written by previous format version, not in a slot
+    factory_reset ();
+    lorawan.init ();
+    run_for (3000);
+    lorawan.prepare_sleep (1000);
+    uint8_t record[sizeof (slot_header_t) + sizeof (session_record_t)];
+    f = memfs.open ("loraconfig_b.cfg", "r");
+    f.read (record, sizeof (record));
+    f.close ();
+    memfs.remove ("loraconfig_b.cfg");
+    memfs.remove ("loracounters_b.cfg");
+    f = memfs.open ("loraconfig.cfg", "w");
+    f.write (record + sizeof (slot_header_t), sizeof (session_record_t));
+    f.close ();
+    f = memfs.open ("loracounters.cfg", "w");
+    f.write ((uint8_t*)&counters, sizeof (counters));
+    f.close ();
+    reboot (no_setup);
+    CHECK (lorawan.isJoined () && LMIC.devaddr == 0x260B0001 && LMIC.seqnoUp == 100);
+    CHECK (memfs.exists ("loraconfig_b.cfg") && memfs.exists ("loracounters_b.cfg"));
+}
+
+/**
+  * @brief Gets slot file holding newest generation
+  */
+static const char* newest_slot (const char* a, const char* b) {
+    slot_header_t header_a = {}, header_b = {};
+    File f = memfs.open (a, "r");
+    if (f) {
+        f.read ((uint8_t*)&header_a, sizeof (header_a));
+        f.close ();
+    }
+    f = memfs.open (b, "r");
+    if (f) {
+        f.read ((uint8_t*)&header_b, sizeof (header_b));
+        f.close ();
+    }
+    return (int32_t)(header_b.generation - header_a.generation) > 0 ? b : a;
+}
+
+static void check_session_slots () {
+    printf ("A/B session slots\n");
+    factory_reset ();
+    lorawan.init ();
+    run_for (3000);
+    uint8_t data[] = { 1, 2, 3 };
+    unsigned sent = sim_frames_sent ();
+    for (unsigned i = 1; i <= 2; i++) {
+        lorawan.send_data_inmediate (data, sizeof (data));
+        run_until_sent (sent + i);
+    }
+    run_for (2000);
+    CHECK (memfs.exists ("loracounters.cfg") && memfs.exists ("loracounters_b.cfg"));
+
+    // A failed counters write leaves older copy, and counter skips the value used meanwhile
+    memfs.fail_writes = true;
+    lorawan.send_data_inmediate (data, sizeof (data));
+    run_until_sent (sent + 3);
+    run_for (2000);
+    memfs.fail_writes = false;
+    u4_t next_up = LMIC.seqnoUp;
+    reboot (no_setup);
+    CHECK (lorawan.isJoined () && LMIC.seqnoUp >= next_up);
+
+    // Next write goes to the damaged slot, so intact one is kept
+    sent = sim_frames_sent ();
+    lorawan.send_data_inmediate (data, sizeof (data));
+    run_until_sent (sent + 1);
+    run_for (2000);
+    next_up = LMIC.seqnoUp;
+    reboot (no_setup);
+    CHECK (LMIC.seqnoUp >= next_up && LMIC.seqnoUp <= next_up + LORAWAN_COUNTER_RECOVERY_GAP);
+
+    // Power loss while session is written: older copy is used and no join is needed
+    CHECK (lorawan.prepare_sleep (1000));
+    CHECK (memfs.exists ("loraconfig.cfg") && memfs.exists ("loraconfig_b.cfg"));
+    memfs.truncate_file (newest_slot ("loraconfig.cfg", "loraconfig_b.cfg"), 10);
+    sent = sim_frames_sent ();
+    reboot (no_setup);
+    CHECK (lorawan.isJoined () && LMIC.devaddr == 0x260B0001);
+    CHECK (sim_frames_sent () == sent);
+
+    // With both copies damaged node joins again
+    memfs.truncate_file ("loraconfig.cfg", 0);
+    memfs.truncate_file ("loraconfig_b.cfg", 0);
+    reboot (no_setup);
+    CHECK (!lorawan.isJoined ());
+}
+
+static void check_aggregation () {
+    printf ("record aggregation\n");
+    factory_reset ();
+    lorawan.init ();
+    run_for (3000);
+    unsigned delivered = 0, lost = 0;
+    lorawan.on_record_status ([&delivered, &lost] (uint16_t, bool ok) { ok ? delivered++ : lost++; });
+    lorawan.set_aggregation (2, 60000);
+    lorawan.set_sf (EU868_DR_SF12);
+
+    // 10 records of 4 bytes fill a 51 byte frame, 11th one flushes it
+    uint8_t record[4] = { 0xA0, 0xA1, 0xA2, 0xA3 };
+    for (unsigned i = 0; i < 12; i++) {
+        CHECK (lorawan.append_record (record, sizeof (record)) == i + 1);
+    }
+    CHECK (lorawan.get_queue_length () == 1);
+    CHECK (lorawan.get_pending_records () == 2);
+    run_until_sent (1);
+    uint8_t port;
+    size_t len;
+    const uint8_t* frame = sim_last_frame (&port, &len);
+    CHECK (port == 2 && len == 50 && frame[0] == 4 && frame[5] == 4);
+
+    // Remaining records are sent when they get too old
+    run_until_sent (2);
+    CHECK (lorawan.get_pending_records () == 0);
+    run_for (2000);
+    CHECK (delivered == 12 && lost == 0);
+
+    // A frame too long for the datarate at transmission time is lost
+    uint8_t big[51] = { 0 };
+    CHECK (lorawan.append_record (big, sizeof (big)) == 0);
+    lorawan.set_sf (EU868_DR_SF7);
+    CHECK (lorawan.append_record (big, sizeof (big)) == 13);
+    lorawan.set_sf (EU868_DR_SF12);
+    CHECK (lorawan.flush_records ());
+    run_for (300000);
+    CHECK (lost == 1);
+}
+
+static void check_airtime () {
+    printf ("airtime budget\n");
+    factory_reset ();
+    // SF12, 64 byte frame
+    CHECK (lorawan.time_on_air (51, EU868_DR_SF12) >= 2790 && lorawan.time_on_air (51, EU868_DR_SF12) <= 2800);
+    lorawan.set_fair_use_budget (10000);
+    lorawan.init ();
+    run_for (3000);
+    uint32_t join_airtime = lorawan.get_airtime_used ();
+    CHECK (join_airtime > 0 && join_airtime < 100);
+    lorawan.set_sf (EU868_DR_SF12);
+    uint8_t data[51] = { 0 };
+    lorawan.send_data_inmediate (data, sizeof (data));
+    run_until_sent (1);
+    run_for (2000);
+    // Band duty cycle is known before sending
+    uint32_t wait = lorawan.next_tx_possible (sizeof (data));
+    CHECK (wait > 140000 && wait < 150000);
+    for (unsigned i = 2; i <= 3; i++) {
+        lorawan.send_data_inmediate (data, sizeof (data));
+        run_until_sent (i);
+    }
+    CHECK (lorawan.get_airtime_used () == join_airtime + 3 * lorawan.time_on_air (51));
+
+    // Fourth message exceeds fair use budget: deferred by default, rejected on request
+    CHECK (lorawan.next_tx_possible (sizeof (data)) > 3600000);
+    CHECK (lorawan.send_data_inmediate (data, sizeof (data)));
+    run_for (600000);
+    CHECK (sim_frames_sent () == 3 && lorawan.get_queue_length () == 1);
+    lorawan.set_airtime_policy (AIRTIME_REJECT);
+    CHECK (!lorawan.send_data_inmediate (data, 1));
+    // Deferred message goes out once its airtime leaves the window
+    CHECK (run_until_sent (4, 90000000) < 90000000);
+
+    // Window is kept across deep sleep, minus time spent off. Stored airtime is rounded up
+    uint32_t used = lorawan.get_airtime_used ();
+    CHECK (used > 0);
+    CHECK (lorawan.prepare_sleep (600000));
+    sim_advance_ms (600000);
+    reboot ([] () {
+        lorawan.set_fair_use_budget (10000);
+    });
+    CHECK (lorawan.get_airtime_used () >= used && lorawan.get_airtime_used () < used + 100);
+    CHECK (lorawan.prepare_sleep (LORAWAN_FAIR_USE_WINDOW));
+    sim_advance_ms (LORAWAN_FAIR_USE_WINDOW);
+    reboot ([] () {
+        lorawan.set_fair_use_budget (10000);
+    });
+    CHECK (lorawan.get_airtime_used () == 0);
+}
+
+/**
+  * @brief Output stream that keeps printed text
+  */
+class CapturePrint : public Print {
+public:
+    std::string text;
+    size_t write (const uint8_t* buffer, size_t size) override {
+        text.append ((const char*)buffer, size);
+        return size;
+    }
+};
+
+static void check_log () {
+    printf ("deferred log\n");
+    static LoRaLog log;
+    CapturePrint out;
+    log.record (LORAWAN_LOG_LEVEL_WARN, "Queue full: %u of %u\n", 4, 4u);
+    log.record (LORAWAN_LOG_LEVEL_DEBUG, "devaddr: 0x%X\n", 0x260B0001);
+    CHECK (log.length () == 2);
+    CHECK (log.drain (out, 1) == 1);
+    CHECK (out.text.find ("[W] Queue full: 4 of 4\n") != std::string::npos);
+    CHECK (log.drain (out, 8) == 1);
+    CHECK (out.text.find ("[D] devaddr: 0x260B0001\n") != std::string::npos);
+
+    // Full buffer drops newest entries and reports them on next drain
+    for (unsigned i = 0; i < LORAWAN_LOG_SIZE + 3; i++) {
+        log.record (LORAWAN_LOG_LEVEL_INFO, "entry %u\n", i);
+    }
+    CHECK (log.get_dropped () == 3);
+    out.text.clear ();
+    CHECK (log.drain (out, LORAWAN_LOG_SIZE * 2) == LORAWAN_LOG_SIZE);
+    CHECK (out.text.find ("3 entries dropped") != std::string::npos);
+    CHECK (out.text.find ("entry 0\n") != std::string::npos);
+}
+
+static unsigned tx_starts = 0;
+
+static void count_tx_start (ev_t event) {
+    tx_starts++;
+}
+
+static void check_subscribe () {
+    printf ("event subscribers\n");
+    factory_reset ();
+    unsigned completes = 0;
+    CHECK (lorawan.subscribe (EV_TXSTART, count_tx_start));
+    CHECK (lorawan.subscribe (EV_TXCOMPLETE, [&completes] (ev_t) { completes++; }));
+    CHECK (!lorawan.subscribe ((ev_t)LORAWAN_EVENT_COUNT, count_tx_start));
+    lorawan.init ();
+    run_for (3000);
+    uint8_t data[4] = { 0 };
+    lorawan.send_data_inmediate (data, sizeof (data));
+    run_until_sent (1);
+    // Join request is reported as TX start too
+    CHECK (tx_starts == 2 && completes == 1);
+    CHECK (lorawan.subscribe (EV_TXSTART, nullptr));
+    lorawan.send_data_inmediate (data, sizeof (data));
+    run_until_sent (2);
+    CHECK (tx_starts == 2 && completes == 2);
+    lorawan.subscribe (EV_TXCOMPLETE, nullptr);
+}
+
+static void check_idle () {
+    printf ("tickless loop\n");
+    factory_reset ();
+    // Short frames, so that duty cycle allows sending every 30 s
+    sim_configure (1, true, 100);
+    lorawan.init ();
+    CHECK (lorawan.get_idle_time () == 0);
+
+    // Join and send every 30 s, running loop () only when there is work to do
+    unsigned calls = 0;
+    uint32_t start = millis ();
+    uint32_t next_send = start + 30000;
+    uint8_t data[4] = { 0 };
+    while (millis () - start < 300000) {
+        lorawan.loop ();
+        calls++;
+        if ((int32_t)(millis () - next_send) >= 0) {
+            if (lorawan.isJoined ()) {
+                lorawan.send_data_inmediate (data, sizeof (data));
+            }
+            next_send += 30000;
+        }
+        if (!lorawan.idle (next_send - millis ())) {
+            // Only yielded. Simulated time does not pass by itself
+            sim_advance_ms (1);
+        }
+    }
+    printf ("  %u loop calls in 300 s, %u frames\n", calls, sim_frames_sent ());
+    CHECK (lorawan.isJoined () && sim_frames_sent () == 9);
+    CHECK (calls < 200);
+    CHECK (lorawan.get_idle_time () == LORAWAN_IDLE_FOREVER);
+
+    // Aggregated records are flushed on time
+    lorawan.set_aggregation (2, 5000);
+    lorawan.append_record (data, 2);
+    uint32_t wait = lorawan.get_idle_time ();
+    CHECK (wait > 4900 && wait <= 5000);
+    CHECK (lorawan.idle (60000) == wait);
+    lorawan.loop ();
+    CHECK (lorawan.get_queue_length () == 1);
+    CHECK (lorawan.idle (1) == 0);
+}
+
+/**
+  * @brief Advances simulated time without calling `loop()`, giving radio task real time to run
+  * @param ms Simulated time
+  */
+static void run_task_for (uint32_t ms) {
+    for (uint32_t t = 0; t < ms; t += 10) {
+        sim_advance_ms (10);
+        std::this_thread::sleep_for (std::chrono::microseconds (100));
+    }
+}
+
+static void check_task_mode () {
+    printf ("radio task\n");
+    factory_reset ();
+    sim_configure (1, true, 100);
+    static std::thread::id app_thread;
+    static unsigned completes;
+    static unsigned foreign_calls;
+    app_thread = std::this_thread::get_id ();
+    completes = 0;
+    foreign_calls = 0;
+    lorawan.on_tx_complete ([] (bool ack) {
+        completes++;
+        foreign_calls += std::this_thread::get_id () != app_thread;
+    });
+    lorawan.on_rx_data ([] (uint8_t port, const uint8_t* data, size_t len) {
+        foreign_calls += std::this_thread::get_id () != app_thread;
+    });
+    CHECK (lorawan.set_task_mode (true));
+    lorawan.init ();
+    CHECK (lorawan.is_task_running ());
+
+    // Application is blocked and does not call loop (), radio task joins and sends anyway
+    uint8_t data[4] = { 0 };
+    for (int i = 0; i < 3; i++) {
+        CHECK (lorawan.send_data_inmediate (data, sizeof (data)));
+    }
+    const uint8_t command[] = { 0x01 };
+    sim_queue_downlink (12, command, sizeof (command), -90, 5);
+    run_task_for (60000);
+    CHECK (lorawan.isJoined () && sim_frames_sent () == 3);
+    CHECK (completes == 0 && lorawan.get_downlink_pending () == 1);
+
+    // Events and downlinks are delivered in application context
+    lorawan.loop ();
+    CHECK (completes == 3 && lorawan.get_downlink_pending () == 0);
+    CHECK (foreign_calls == 0);
+    CHECK (lorawan.get_events_dropped () == 0);
+
+    // Back to loop () mode
+    CHECK (lorawan.set_task_mode (false));
+    CHECK (!lorawan.is_task_running ());
+    lorawan.send_data_inmediate (data, sizeof (data));
+    run_until_sent (4, 60000);
+    CHECK (sim_frames_sent () == 4 && completes == 4);
+}
+
+/**
+  * @brief Typical sensor node payload, as it would be sent as a packed C structure
+  */
+typedef struct __attribute__ ((packed)) {
+    float temperature;
+    float humidity;
+    uint16_t battery;
+    int32_t latitude;
+    int32_t longitude;
+    uint8_t flags;
+} sensor_struct_t;
+
+/**
+  * @brief Same payload with bit packed fields
+  */
+typedef LoRaSchema<
+    LoRaFixed<11, -40, 10>,     // Temperature, 0.1 C
+    LoRaFixed<8, 0, 2>,         // Humidity, 0.5 %
+    LoRaFixed<11, 2000, 1>,     // Battery, mV
+    LoRaOptional<LoRaInt<21>>,  // Latitude, 1e-4 degrees
+    LoRaOptional<LoRaInt<22>>,  // Longitude, 1e-4 degrees
+    LoRaBool, LoRaBool, LoRaBool
+> sensor_schema_t;
+
+static_assert (sensor_schema_t::max_bits == 11 + 8 + 11 + 22 + 23 + 3, "Wrong schema size");
+static_assert (sensor_schema_t::max_size == 10 && sensor_schema_t::min_size == 5, "Wrong schema size");
+
+static void check_codec () {
+    printf ("payload codec\n");
+    printf ("  struct %u bytes, schema %u to %u bytes. SF12 airtime %u ms, %u ms\n", (unsigned)sizeof (sensor_struct_t),
+            (unsigned)sensor_schema_t::min_size, (unsigned)sensor_schema_t::max_size,
+            lorawan.time_on_air (sizeof (sensor_struct_t), EU868_DR_SF12), lorawan.time_on_air (sensor_schema_t::max_size, EU868_DR_SF12));
+
+    sensor_schema_t::values_t values (21.37f, 55.5f, 3312, { true, 404168 }, { true, -37038 }, true, false, true);
+    uint8_t buffer[16];
+    CHECK (sensor_schema_t::encoded_size (values) == 10);
+    CHECK (sensor_schema_t::encode (values, buffer, sizeof (buffer)) == 10);
+    sensor_schema_t::values_t decoded;
+    CHECK (sensor_schema_t::decode (buffer, 10, decoded));
+    CHECK (fabsf (std::get<0> (decoded) - 21.4f) < 0.01f && std::get<1> (decoded) == 55.5f && std::get<2> (decoded) == 3312);
+    CHECK (std::get<3> (decoded).present && std::get<3> (decoded).value == 404168);
+    CHECK (std::get<4> (decoded).present && std::get<4> (decoded).value == -37038);
+    CHECK (std::get<5> (decoded) && !std::get<6> (decoded) && std::get<7> (decoded));
+
+    // Out of range values saturate
+    std::get<0> (values) = 500;
+    std::get<2> (values) = 1000;
+    std::get<4> (values).value = -5000000;
+    sensor_schema_t::encode (values, buffer, sizeof (buffer));
+    sensor_schema_t::decode (buffer, 10, decoded);
+    CHECK ((std::get<0> (decoded) == LoRaFixed<11, -40, 10>::max_value) && std::get<2> (decoded) == 2000);
+    CHECK (std::get<4> (decoded).value == LoRaInt<22>::min_value);
+
+    // Missing position only takes presence bits. Short buffers are rejected both ways
+    std::get<3> (values).present = false;
+    std::get<4> (values).present = false;
+    CHECK (sensor_schema_t::encoded_size (values) == 5);
+    CHECK (sensor_schema_t::encode (values, buffer, 4) == 0);
+    CHECK (sensor_schema_t::encode (values, buffer, sizeof (buffer)) == 5);
+    CHECK (sensor_schema_t::decode (buffer, 5, decoded) && !std::get<3> (decoded).present);
+    CHECK (!sensor_schema_t::decode (buffer, 4, decoded));
+
+    // Encoded straight into uplink queue
+    factory_reset ();
+    lorawan.init ();
+    run_for (3000);
+    std::get<3> (values).present = true;
+    CHECK (lorawan.send_encoded<sensor_schema_t> (values, 7));
+    run_until_sent (1);
+    uint8_t port;
+    size_t len;
+    const uint8_t* frame = sim_last_frame (&port, &len);
+    CHECK (port == 7 && len == sensor_schema_t::encoded_size (values));
+    CHECK (sensor_schema_t::decode (frame, len, decoded) && std::get<3> (decoded).value == 404168);
+}
+
+#define CORPUS_SAMPLES 2048
+
+/**
+  * @brief Synthetic sensor data used to measure time series compression
+  */
+typedef struct {
+    const char* name;
+    uint32_t timestamps[CORPUS_SAMPLES];
+    int32_t values[CORPUS_SAMPLES];
+} series_corpus_t;
+
+static series_corpus_t corpus[4];
+
+/**
+  * @brief Fills corpus with repeatable data: slow signal with noise, pulse counter, jittered samples and random words
+  */
+static void make_corpus () {
+    uint32_t seed = 12345;
+    auto rnd = [&seed] () {
+        seed = seed * 1103515245 + 12345;
+        return seed >> 8;
+    };
+    corpus[0].name = "temperature, 60 s period";
+    corpus[1].name = "pulse counter, 10 s period";
+    corpus[2].name = "random walk, 1 s period, 5% jitter";
+    corpus[3].name = "random 32 bit words";
+    int32_t counter = 0;
+    int32_t walk = 0;
+    uint32_t jittered = 0;
+    uint32_t random_time = 0;
+    for (int i = 0; i < CORPUS_SAMPLES; i++) {
+        corpus[0].timestamps[i] = 1633420800 + 60 * i;
+        corpus[0].values[i] = 2150 + (int32_t)lroundf (300 * sinf (i / 100.0f)) + (int32_t)(rnd () % 5) - 2;
+        counter += rnd () % 4;
+        corpus[1].timestamps[i] = 1633420800 + 10 * i;
+        corpus[1].values[i] = counter;
+        jittered += 950 + rnd () % 101;
+        walk += (int32_t)(rnd () % 41) - 20;
+        corpus[2].timestamps[i] = jittered;
+        corpus[2].values[i] = walk;
+        random_time += rnd ();
+        corpus[3].timestamps[i] = random_time;
+        corpus[3].values[i] = (int32_t)(rnd () << 8 ^ rnd ());
+    }
+}
+
+/**
+  * @brief Compresses a corpus into full frames, checking every frame decodes back to its samples
+  * @param data Corpus
+  * @param capacity Frame payload size
+  * @param frames Returns number of frames
+  * @return Total encoded bytes. 0 if decoding failed
+  */
+static size_t compress_corpus (const series_corpus_t& data, size_t capacity, unsigned* frames) {
+    static LoRaSeries series;
+    uint8_t frame[MAX_LEN_PAYLOAD];
+    uint32_t timestamps[LORAWAN_SERIES_MAX_FRAME_SAMPLES];
+    int32_t values[LORAWAN_SERIES_MAX_FRAME_SAMPLES];
+    size_t total = 0;
+    int sent = 0;
+
+    series = LoRaSeries ();
+    *frames = 0;
+    for (int i = 0; i < CORPUS_SAMPLES || series.length (); i++) {
+        if (i < CORPUS_SAMPLES) {
+            series.add (data.timestamps[i], data.values[i]);
+            if (!series.fills (capacity)) {
+                continue;
+            }
+        }
+        uint8_t samples;
+        size_t len = series.encode (frame, capacity, &samples);
+        size_t decoded = LoRaSeries::decode (frame, len, timestamps, values, LORAWAN_SERIES_MAX_FRAME_SAMPLES);
+        if (!len || decoded != samples || len > capacity) {
+            return 0;
+        }
+        for (size_t k = 0; k < decoded; k++) {
+            if (timestamps[k] != data.timestamps[sent + k] || values[k] != data.values[sent + k]) {
+                return 0;
+            }
+        }
+        series.consume (samples);
+        sent += samples;
+        total += len;
+        (*frames)++;
+    }
+    return series.get_dropped () == 0 && sent == CORPUS_SAMPLES ? total : 0;
+}
+
+static void check_series () {
+    printf ("time series compression\n");
+    make_corpus ();
+    for (const series_corpus_t& data : corpus) {
+        for (size_t capacity : { (size_t)51, (size_t)222 }) {
+            unsigned frames;
+            size_t bytes = compress_corpus (data, capacity, &frames);
+            CHECK (bytes > 0);
+            printf ("  %-36s %3u B frames: %4u frames, %5.1f samples/frame, ratio %4.1f\n", data.name, (unsigned)capacity,
+                    frames, (double)CORPUS_SAMPLES / frames, bytes ? 8.0 * CORPUS_SAMPLES / bytes : 0);
+        }
+    }
+
+    // Single sample and truncated frames
+    LoRaSeries series;
+    uint8_t frame[MAX_LEN_PAYLOAD];
+    uint32_t timestamps[4];
+    int32_t values[4];
+    uint8_t samples;
+    series.add (UINT32_MAX, INT32_MIN);
+    size_t len = series.encode (frame, sizeof (frame), &samples);
+    CHECK (samples == 1 && len == 11);
+    CHECK (LoRaSeries::decode (frame, len, timestamps, values, 4) == 1 && timestamps[0] == UINT32_MAX && values[0] == INT32_MIN);
+    CHECK (series.encode (frame, 10, &samples) == 0 && samples == 0);
+    series.add (0, INT32_MAX);
+    series.add (7, 0);
+    len = series.encode (frame, sizeof (frame), &samples);
+    CHECK (samples == 3 && LoRaSeries::decode (frame, len, timestamps, values, 4) == 3);
+    CHECK (timestamps[1] == 0 && timestamps[2] == 7 && values[1] == INT32_MAX && values[2] == 0);
+    CHECK (LoRaSeries::decode (frame, len - 1, timestamps, values, 4) == 0);
+    CHECK (LoRaSeries::decode (frame, len, timestamps, values, 2) == 0);
+
+    // Frame filled to maximum payload of current datarate
+    factory_reset ();
+    lorawan.init ();
+    run_for (3000);
+    lorawan.set_sf (EU868_DR_SF12);
+    series = LoRaSeries ();
+    for (int i = 0; i < 100; i++) {
+        series.add (corpus[0].timestamps[i], corpus[0].values[i]);
+    }
+    CHECK (series.fills (lorawan.get_max_payload ()));
+    CHECK (lorawan.send_series (series, 5));
+    run_until_sent (1);
+    uint8_t port;
+    const uint8_t* sent = sim_last_frame (&port, &len);
+    CHECK (port == 5 && len <= 51 && len > 51 - 4);
+    uint32_t sent_timestamps[100];
+    int32_t sent_values[100];
+    size_t decoded = LoRaSeries::decode (sent, len, sent_timestamps, sent_values, 100);
+    CHECK (decoded > 0 && decoded + series.length () == 100);
+    CHECK (sent_timestamps[decoded - 1] == corpus[0].timestamps[decoded - 1] && sent_values[decoded - 1] == corpus[0].values[decoded - 1]);
+}
+
+#define FRAG_BLOCK 2000
+#define FRAG_SIZE 45
+
+static uint8_t frag_block[FRAG_BLOCK];
+static uint8_t frag_storage[LoRaFragReassembler::storage_size (FRAG_BLOCK / FRAG_SIZE + 1, FRAG_SIZE)];
+
+/**
+  * @brief Sends a block through a lossy channel
+  * @param redundancy Parity fragments
+  * @param loss Probability of losing every fragment
+  * @param seed Random seed
+  * @param needed Returns fragments received when block was rebuilt
+  * @return `True` if block was rebuilt and matches original
+  */
+static bool frag_transfer (uint16_t redundancy, float loss, uint32_t seed, unsigned* needed) {
+    LoRaFragmenter fragmenter;
+    LoRaFragReassembler reassembler;
+    uint8_t frame[LORAWAN_FRAG_HEADER + FRAG_SIZE];
+    static uint8_t rebuilt[FRAG_BLOCK];
+
+    fragmenter.begin (frag_block, FRAG_BLOCK, FRAG_SIZE, redundancy, seed);
+    reassembler.begin (frag_storage, sizeof (frag_storage));
+    for (uint16_t n = 1; n <= fragmenter.get_total (); n++) {
+        seed = seed * 1103515245 + 12345;
+        if ((seed >> 8) % 1000 < loss * 1000) {
+            continue;
+        }
+        size_t len = fragmenter.build (n, frame);
+        if (reassembler.add (frame, len) == FRAG_DONE) {
+            *needed = reassembler.get_received ();
+            return reassembler.copy (rebuilt, sizeof (rebuilt)) == FRAG_BLOCK && !memcmp (rebuilt, frag_block, FRAG_BLOCK);
+        }
+    }
+    return false;
+}
+
+static void check_frag () {
+    printf ("fragmented uplink\n");
+    for (int i = 0; i < FRAG_BLOCK; i++) {
+        frag_block[i] = (uint8_t)(i * 7 + (i >> 5));
+    }
+
+    // No loss: data fragments are enough
+    unsigned needed = 0;
+    CHECK (frag_transfer (0, 0, 1, &needed) && needed == FRAG_BLOCK / FRAG_SIZE + 1);
+
+    // Random loss, half as many parity fragments as data ones
+    const uint16_t redundancy = (FRAG_BLOCK / FRAG_SIZE + 1) / 2;
+    for (float loss : { 0.1f, 0.2f, 0.3f }) {
+        unsigned rebuilt = 0;
+        unsigned total_needed = 0;
+        for (uint32_t trial = 0; trial < 200; trial++) {
+            if (frag_transfer (redundancy, loss, trial + 100, &needed)) {
+                rebuilt++;
+                total_needed += needed;
+            }
+        }
+        printf ("  %2.0f%% loss, %u + %u fragments: %5.1f%% blocks rebuilt, %.1f fragments needed\n", loss * 100,
+                FRAG_BLOCK / FRAG_SIZE + 1, redundancy, rebuilt / 2.0, rebuilt ? (double)total_needed / rebuilt : 0);
+        if (loss < 0.15f) {
+            CHECK (rebuilt == 200);
+        }
+    }
+
+    // Malformed fragments, repeated ones and storage too small
+    LoRaFragmenter fragmenter;
+    LoRaFragReassembler reassembler;
+    uint8_t frame[LORAWAN_FRAG_HEADER + FRAG_SIZE];
+    uint8_t small[64];
+    CHECK (!fragmenter.begin (frag_block, FRAG_SIZE * LORAWAN_FRAG_MAX_FRAGMENTS + 1, FRAG_SIZE, 0, 0));
+    // Fragment numbers have 14 bits, parity ones included
+    CHECK (fragmenter.begin (frag_block, 200, FRAG_SIZE, LORAWAN_FRAG_MAX_INDEX - 5, 1));
+    CHECK (fragmenter.get_total () == LORAWAN_FRAG_MAX_INDEX);
+    CHECK (!fragmenter.begin (frag_block, 200, FRAG_SIZE, LORAWAN_FRAG_MAX_INDEX - 4, 1));
+    CHECK (fragmenter.begin (frag_block, 200, FRAG_SIZE, 4, 1) && fragmenter.get_fragments () == 5);
+    CHECK (fragmenter.build (0, frame) == 0 && fragmenter.build (10, frame) == 0);
+    reassembler.begin (small, sizeof (small));
+    CHECK (reassembler.add (frame, fragmenter.build (1, frame)) == FRAG_ERROR);
+    reassembler.begin (frag_storage, sizeof (frag_storage));
+    CHECK (reassembler.add (frame, LORAWAN_FRAG_HEADER) == FRAG_ERROR);
+    // Fragments 2 and 4 are lost. Parity fragments 8 and 9 hold 2 ^ 4 and 2 ^ 3
+    for (uint16_t n : { 1, 1, 3, 5, 8 }) {
+        CHECK (reassembler.add (frame, fragmenter.build (n, frame)) == FRAG_INCOMPLETE);
+    }
+    CHECK (reassembler.copy (frame, sizeof (frame)) == 0);
+    CHECK (reassembler.add (frame, fragmenter.build (9, frame)) == FRAG_DONE);
+    uint8_t rebuilt[200];
+    CHECK (reassembler.copy (rebuilt, sizeof (rebuilt)) == 200 && !memcmp (rebuilt, frag_block, 200));
+
+    // Node sends a block at SF12, in 51 byte frames. A quarter of them are lost
+    factory_reset ();
+    sim_configure (1, true, 100);
+    lorawan.init ();
+    run_for (3000);
+    lorawan.set_sf (EU868_DR_SF12);
+    uint8_t data[4] = { 1, 2, 3, 4 };
+    CHECK (!lorawan.send_fragmented (frag_block, FRAG_BLOCK, LORAWAN_FRAG_MAX_INDEX));
+    CHECK (lorawan.get_fragments_pending () == 0);
+    CHECK (lorawan.send_fragmented (frag_block, FRAG_BLOCK, redundancy));
+    CHECK (!lorawan.send_fragmented (frag_block, FRAG_BLOCK, redundancy));
+    CHECK (lorawan.get_fragments_pending () == FRAG_BLOCK / FRAG_SIZE + 1 + redundancy - 1);
+    CHECK (lorawan.send_data_inmediate (data, sizeof (data)));
+    reassembler.begin (frag_storage, sizeof (frag_storage));
+    frag_status_t status = FRAG_INCOMPLETE;
+    unsigned sent = sim_frames_sent ();
+    unsigned fragments = 0;
+    unsigned lost = 0;
+    unsigned other = 0;
+    while (run_until_sent (sent + 1) < 3600000) {
+        sent++;
+        uint8_t port;
+        size_t len;
+        const uint8_t* frame_sent = sim_last_frame (&port, &len);
+        if (port != LORAWAN_FRAG_PORT) {
+            other++;
+        } else if (++fragments % 4 == 0) {
+            lost++;
+        } else {
+            CHECK (len == 51);
+            status = reassembler.add (frame_sent, len);
+        }
+    }
+    printf ("  node: %u fragments sent, %u lost\n", fragments, lost);
+    CHECK (fragments == FRAG_BLOCK / FRAG_SIZE + 1 + redundancy && other == 1 && lorawan.get_fragments_pending () == 0);
+    CHECK (status == FRAG_DONE);
+    static uint8_t block[FRAG_BLOCK];
+    CHECK (reassembler.copy (block, sizeof (block)) == FRAG_BLOCK && !memcmp (block, frag_block, FRAG_BLOCK));
+}
+
+static void check_backlog () {
+    printf ("persistent backlog\n");
+    uint8_t record[LORAWAN_BACKLOG_RECORD_SIZE];
+    uint8_t port;
+
+    // Bounded file: oldest records are overwritten, corrupted ones are skipped
+    factory_reset ();
+    LoRaBacklog backlog;
+    CHECK (backlog.begin (&memfs, "test.dat", "test.jnl", 16));
+    for (uint8_t i = 0; i < 40; i++) {
+        CHECK (backlog.push (&i, 1, 2));
+    }
+    CHECK (backlog.flush () && backlog.length () == 16 && backlog.get_dropped () == 24);
+    CHECK (backlog.read (0, record, &port) == 1 && record[0] == 24 && port == 2);
+    backlog.release (backlog.first () + 2);
+    File file = memfs.open ("test.dat", "r+");
+    file.seek (28 * backlog.slot_size () % (16 * backlog.slot_size ()) + sizeof (backlog_header_t));
+    file.write ((uint8_t)0x55);
+    file.close ();
+    CHECK (backlog.begin (&memfs, "test.dat", "test.jnl", 16));
+    CHECK (backlog.length () == 14 && backlog.read (0, record, &port) == 1 && record[0] == 26);
+    CHECK (backlog.read (2, record, &port) == 0);
+    CHECK (!backlog.push (record, LORAWAN_BACKLOG_RECORD_SIZE + 1, 1));
+
+    // Healthy link: records are delivered from RAM cache, backlog file is not written
+    factory_reset ();
+    sim_configure (1, true, 100);
+    lorawan.init ();
+    run_for (3000);
+    CHECK (lorawan.enable_backlog (9));
+    uint32_t written = memfs.stats.bytes_written;
+    unsigned sent = sim_frames_sent ();
+    uint8_t data[4] = { 0, 1, 2, 3 };
+    CHECK (lorawan.send_persistent (data, sizeof (data), 3));
+    run_until_sent (sent + 1);
+    run_for (100);
+    size_t len;
+    const uint8_t* frame = sim_last_frame (&port, &len);
+    CHECK (port == 3 && len == 4 && lorawan.get_backlog_length () == 0);
+    CHECK (memfs.stats.bytes_written - written < 100);
+
+    // Gateway outage: frames are not acknowledged and records pile up. Retries back off
+    sim_configure (1, false, 100);
+    sent = sim_frames_sent ();
+    for (uint8_t i = 0; i < 20; i++) {
+        data[0] = i;
+        CHECK (lorawan.send_persistent (data, sizeof (data), 3));
+        run_for (600000);
+    }
+    printf ("  outage of 200 min: %u backlog frames tried, %u records pending\n", sim_frames_sent () - sent,
+            (unsigned)lorawan.get_backlog_length ());
+    CHECK (lorawan.get_backlog_length () == 20);
+    CHECK (sim_frames_sent () - sent < 20);
+
+    // Reset: records survive. Link is back and stale records are packed together
+    CHECK (lorawan.prepare_sleep (0));
+    reboot ([] () {
+        lorawan.enable_backlog (9);
+    });
+    CHECK (lorawan.get_backlog_length () == 20);
+    sim_configure (1, true, 100);
+    sent = sim_frames_sent ();
+    unsigned next = 0;
+    for (unsigned frames = 0; frames < 10 && lorawan.get_backlog_length (); frames++) {
+        run_until_sent (sim_frames_sent () + 1);
+        run_for (100);
+        frame = sim_last_frame (&port, &len);
+        CHECK (port == 9 && frame[0] == 3);
+        for (size_t pos = 1; pos + 5 <= len; pos += 5) {
+            CHECK (frame[pos] == 4 && frame[pos + 1] == next && frame[pos + 4] == 3);
+            next++;
+        }
+    }
+    printf ("  drained in %u frames\n", sim_frames_sent () - sent);
+    CHECK (next == 20 && lorawan.get_backlog_length () == 0);
+
+    // Delivered records are not sent again after a reset
+    reboot ([] () {
+        lorawan.enable_backlog (9);
+    });
+    CHECK (lorawan.get_backlog_length () == 0);
+}
+
+static void check_datarate () {
+    printf ("datarate table\n");
+    CHECK (LORAWAN_DATARATE_COUNT == EU868_DR_NONE + 1);
+    CHECK (!strcmp (lorawan_datarate (EU868_DR_SF12).name, "SF12") && lorawan_datarate (EU868_DR_SF12).sf == 12);
+    CHECK (lorawan_datarate (EU868_DR_SF7B).bandwidth == 250 && lorawan_datarate (EU868_DR_SF7B).bitrate == 11000);
+    CHECK (lorawan_datarate (EU868_DR_SF9).max_payload == 115 && lorawan_datarate (EU868_DR_NONE).max_payload == 0);
+    CHECK (!strcmp (lorawan_datarate (200).name, "Unknown"));
+    static_assert (lorawan_datarate (EU868_DR_SF10).max_payload == 51, "Table must be usable at compile time");
+
+    factory_reset ();
+    lorawan.init ();
+    run_for (3000);
+    lorawan.set_sf (EU868_DR_SF9);
+    CHECK (!strcmp (lorawan.sf_name (), "SF9") && lorawan.getSFStr () == "SF9");
+    CHECK (lorawan.max_payload () == 115 && lorawan.bitrate () == 1760);
+
+    // Payload longer than datarate limit is rejected, not truncated
+    uint8_t data[MAX_LEN_PAYLOAD] = { 0 };
+    unsigned sent = sim_frames_sent ();
+    CHECK (!lorawan.send_data_inmediate (data, 116, 1));
+    CHECK (lorawan.send_data_inmediate (data, 115, 1));
+    run_until_sent (sent + 1);
+    run_for (2000);
+    uint8_t port;
+    size_t len;
+    sim_last_frame (&port, &len);
+    CHECK (len == 115);
+
+    // A message queued at a faster datarate is discarded if it no longer fits
+    lorawan.set_sf (EU868_DR_SF7);
+    CHECK (lorawan.send_data_inmediate (data, 4, 1));
+    CHECK (lorawan.send_data_inmediate (data, 200, 1));
+    lorawan.set_sf (EU868_DR_SF12);
+    uint32_t dropped = lorawan.get_queue_dropped ();
+    run_until_sent (sent + 2);
+    run_for (5000);
+    CHECK (sim_frames_sent () == sent + 2 && lorawan.get_queue_length () == 0);
+    CHECK (lorawan.get_queue_dropped () == dropped + 1);
+    lorawan.set_sf (EU868_DR_SF7);
+}
+
+static void check_link () {
+    printf ("link quality and datarate policy\n");
+    LoRaLinkTracker tracker;
+    CHECK (tracker.margin (EU868_DR_SF7) == LORAWAN_LINK_NO_MARGIN);
+    CHECK (LoRaLinkTracker::snr_floor (EU868_DR_SF7) == -30 && LoRaLinkTracker::snr_floor (EU868_DR_SF12) == -80);
+    CHECK (LoRaLinkTracker::snr_floor (EU868_DR_SF7B) == -18 && LoRaLinkTracker::snr_floor (EU868_DR_FSK) == LORAWAN_LINK_NO_MARGIN);
+    tracker.add (-100, 8, EU868_DR_SF7, 0);
+    tracker.add (-110, -8, EU868_DR_SF7B, 0);
+    const link_quality_t& quality = tracker.get ();
+    CHECK (quality.samples == 2 && quality.rssi == -110 && quality.snr == -8);
+    // 250 kHz reception is 3 dB better at 125 kHz
+    CHECK (quality.snr_min == 4 && quality.snr_avg == 7 && quality.rssi_avg == -102);
+    CHECK (tracker.margin (EU868_DR_SF7) == 34 && tracker.margin (EU868_DR_SF12) == 84);
+    for (int i = 0; i < LORAWAN_LINK_WINDOW; i++) {
+        tracker.add (-100, 40, EU868_DR_SF7, 1000);
+    }
+    CHECK (quality.snr_min == 40);
+
+    // 17.5 dB margin at SF7: 7.5 dB over target, 6 dB taken from power
+    link_policy_t policy;
+    uint8_t dr = 0;
+    int8_t power = 0;
+    CHECK (tracker.choose (policy, 10, 1000, &dr, &power) && dr == EU868_DR_SF7 && power == 8);
+    CHECK (!tracker.choose (policy, 250, 1000, &dr, &power));
+    policy.max_age_ms = 60000;
+    CHECK (!tracker.choose (policy, 10, 70000, &dr, &power));
+    tracker.miss ();
+    tracker.miss ();
+    tracker.miss ();
+    CHECK (tracker.choose (policy, 10, 1000, &dr, &power) && dr == EU868_DR_SF8 && power == 14);
+    tracker.miss ();
+    tracker.miss ();
+    CHECK (tracker.choose (policy, 10, 1000, &dr, &power) && dr == EU868_DR_SF10 && power == 14);
+    // No datarate where payload fits keeps target margin. Slowest one of them is used
+    CHECK (tracker.choose (policy, 60, 1000, &dr, &power) && dr == EU868_DR_SF9 && power == 14);
+
+    factory_reset ();
+    lorawan.init ();
+    run_for (3000);
+    CHECK (lorawan.link_quality ().samples == 1 && lorawan.link_quality ().rssi == -90);
+    CHECK (lorawan.link_margin () == 70);
+
+    // Policy is not used while ADR is enabled
+    policy = link_policy_t ();
+    policy.enabled = true;
+    lorawan.set_link_policy (policy);
+    lorawan.set_sf (EU868_DR_SF12);
+    uint8_t data[8] = { 0 };
+    unsigned sent = sim_frames_sent ();
+    lorawan.send (data, sizeof (data), 1, true);
+    run_until_sent (++sent);
+    CHECK (LMIC.datarate == EU868_DR_SF12 && lorawan.get_power () == 14);
+
+    lorawan.set_adr (false);
+    lorawan.send (data, sizeof (data), 1, true);
+    run_until_sent (++sent);
+    run_for (2000);
+    CHECK (LMIC.datarate == EU868_DR_SF7 && lorawan.get_power () == 8);
+
+    // Link gets worse. Uplinks are lost until power goes up and datarate down enough
+    sim_link (-125, -12);
+    unsigned acked = lorawan.stats ().confirmed_acked;
+    unsigned tries = 0;
+    while (lorawan.stats ().confirmed_acked == acked && tries < 10) {
+        lorawan.send (data, sizeof (data), 1, true);
+        run_until_sent (++sent);
+        run_for (2000);
+        tries++;
+    }
+    CHECK (lorawan.stats ().confirmed_acked == acked + 1);
+    CHECK (LMIC.datarate == EU868_DR_SF9 && lorawan.get_power () == 14);
+    printf ("  link 22 dB worse: %u uplinks until one got through at %s\n", tries, lorawan.sf_name ());
+    lorawan.send (data, sizeof (data), 1, true);
+    run_until_sent (++sent);
+    run_for (2000);
+    CHECK (LMIC.datarate == EU868_DR_SF12 && lorawan.link_quality ().misses == 0);
+
+    // Good link again. Datarate goes up when weak receptions leave window
+    sim_link (-90, 10);
+    for (int i = 0; i < LORAWAN_LINK_WINDOW + 1; i++) {
+        lorawan.send (data, sizeof (data), 1, true);
+        run_until_sent (++sent);
+        run_for (2000);
+    }
+    CHECK (LMIC.datarate == EU868_DR_SF7 && lorawan.get_power () == 8);
+    lorawan.set_link_policy (link_policy_t ());
+    lorawan.set_adr (true);
+    lorawan.set_power (14);
+}
+
+// ---------------------------------------------------------------------------
+// Benchmarks
+// ---------------------------------------------------------------------------
+
+/**
+  * @brief Result of a benchmark
+  */
+typedef struct {
+    std::string name;   ///< @brief Operation name
+    double ns;          ///< @brief Nanoseconds per operation
+    double allocs;      ///< @brief Heap allocations per operation
+} bench_result_t;
+
+static std::vector<bench_result_t> bench_results;
+
+/**
+  * @brief Prints and stores a benchmark result
+  */
+static void report (const char* name, double ns, double allocs) {
+    printf ("  %-52s %10.1f ns/op %8.2f allocs/op\n", name, ns, allocs);
+    bench_results.push_back ({ name, ns, allocs });
+}
+
+/**
+  * @brief Measures average CPU time and heap allocations of an operation
+  * @param name Operation name
+  * @param iterations Number of runs
+  * @param body Operation
+  * @return Nanoseconds per operation
+  */
+template <typename F>
+static double bench (const char* name, unsigned iterations, F body) {
+    size_t allocs = allocations;
+    auto start = std::chrono::steady_clock::now ();
+    for (unsigned i = 0; i < iterations; i++) {
+        body (i);
+    }
+    auto end = std::chrono::steady_clock::now ();
+    allocs = allocations - allocs;
+    double ns = std::chrono::duration<double, std::nano> (end - start).count () / iterations;
+    report (name, ns, (double)allocs / iterations);
+    return ns;
+}
+
+/**
+  * @brief Compares results with last recorded run and appends them to history file
+  * @param path History file. One line per operation: label, name, ns/op and allocs/op, separated by tabs
+  * @param label Tag of this run
+  * @return Number of operations that allocate more than in last run
+  */
+static int bench_history (const char* path, const char* label) {
+    std::map<std::string, bench_result_t> last;
+    char line[256];
+    int regressions = 0;
+
+    FILE* file = fopen (path, "r");
+    if (file) {
+        while (fgets (line, sizeof (line), file)) {
+            char* fields[4];
+            char* rest = line;
+            int n = 0;
+            while (n < 4 && (fields[n] = strsep (&rest, "\t\n"))) {
+                n++;
+            }
+            if (n == 4) {
+                last[fields[1]] = { fields[1], atof (fields[2]), atof (fields[3]) };
+            }
+        }
+        fclose (file);
+    }
+
+    printf ("history: %s, %u operations recorded before\n", path, (unsigned)last.size ());
+    for (const bench_result_t& result : bench_results) {
+        auto previous = last.find (result.name);
+        if (previous == last.end ()) {
+            continue;
+        }
+        if (result.allocs > previous->second.allocs + 0.005) {
+            printf ("  %-52s %8.2f allocs/op, was %.2f. REGRESSION\n", result.name.c_str (), result.allocs,
+                    previous->second.allocs);
+            regressions++;
+        }
+        if (result.ns > previous->second.ns * (1 + BENCH_TOLERANCE)) {
+            printf ("  %-52s %10.1f ns/op, was %.1f. Slower\n", result.name.c_str (), result.ns,
+                    previous->second.ns);
+        }
+    }
+
+    file = fopen (path, "a");
+    if (!file) {
+        printf ("  cannot write %s\n", path);
+        return regressions;
+    }
+    char stamp[32];
+    if (!label) {
+        // time () returns simulated clock in host builds
+        time_t now = std::chrono::system_clock::to_time_t (std::chrono::system_clock::now ());
+        snprintf (stamp, sizeof (stamp), "%ld", (long)now);
+        label = stamp;
+    }
+    for (const bench_result_t& result : bench_results) {
+        fprintf (file, "%s\t%s\t%.1f\t%.3f\n", label, result.name.c_str (), result.ns, result.allocs);
+    }
+    fclose (file);
+    return regressions;
+}
+
+/**
+  * @brief Gets a joined node with an empty queue
+  */
+static void joined_node (storage_mode_t mode) {
+    factory_reset ();
+    lorawan.set_storage_mode (mode);
+    lorawan.init ();
+    run_for (3000);
+}
+
+/**
+  * @brief Hands front message to LMIC and cancels it, so that its queue slot is released without running the radio
+  */
+static void check_stats () {
+    printf ("runtime metrics\n");
+    LoRaHistogram histogram;
+    histogram.add (0);
+    histogram.add (15);
+    histogram.add (16);
+    histogram.add (1000);
+    histogram.add (10000000);
+    CHECK (histogram.count () == 5 && histogram.get (0) == 2 && histogram.get (1) == 1);
+    CHECK (histogram.get (6) == 1 && LoRaHistogram::bucket_floor (6) <= 1000 && LoRaHistogram::bucket_floor (7) > 1000);
+    CHECK (histogram.get (LORAWAN_STATS_BUCKETS - 1) == 1);
+    CHECK (histogram.percentile (50) == 31);
+    CHECK (histogram.percentile (100) == LoRaHistogram::bucket_floor (LORAWAN_STATS_BUCKETS - 1));
+
+    factory_reset ();
+    lorawan.init ();
+    run_for (3000);
+    const node_stats_t& stats = lorawan.stats ();
+    CHECK (stats.joins == 1 && stats.join_requests == 1 && stats.airtime_ms[DR_SF7] > 0);
+    CHECK (stats.session_writes >= 1 && stats.session_bytes == stats.session_writes * sizeof (session_record_t));
+    CHECK (stats.loop_us.count () > 0);
+
+    // Acknowledged and missed confirmed uplinks, a downlink, and a message lost to queue overflow
+    lorawan.clear_stats ();
+    CHECK (stats.joins == 0 && stats.loop_us.count () == 0);
+    uint8_t data[8] = { 0 };
+    uint8_t command[] = { 0xC0, 0xDE };
+    unsigned sent = sim_frames_sent ();
+    sim_queue_downlink (10, command, sizeof (command), -100, 5);
+    lorawan.send (data, sizeof (data), 1, true);
+    run_until_sent (sent + 1);
+    run_for (2000);
+    sim_configure (1, false, 1500);
+    lorawan.send (data, sizeof (data), 1, true);
+    run_until_sent (sent + 2);
+    run_for (2000);
+    for (int i = 0; i < LORAWAN_TX_QUEUE_SIZE + 1; i++) {
+        lorawan.send (data, sizeof (data), 2);
+    }
+    run_until_sent (sent + 2 + LORAWAN_TX_QUEUE_SIZE);
+    run_for (2000);
+    CHECK (stats.uplinks_queued == 2 + LORAWAN_TX_QUEUE_SIZE && stats.uplinks_dropped == 1);
+    CHECK (stats.uplinks_sent == 2 + LORAWAN_TX_QUEUE_SIZE);
+    CHECK (stats.confirmed_acked == 1 && stats.confirmed_missed == 1);
+    CHECK (stats.airtime_ms[DR_SF7] == stats.uplinks_sent * lorawan.time_on_air (sizeof (data), DR_SF7));
+    CHECK (stats.downlinks == 1 && stats.port_count == 1 && stats.ports[0].port == 10 && stats.ports[0].count == 1);
+    CHECK (stats.counters_writes == stats.uplinks_sent);
+    CHECK (stats.counters_bytes == stats.counters_writes * sizeof (link_counters_t));
+    CHECK (stats.counters_write_us.count () == stats.counters_writes);
+
+    // Export and import give back the same metrics
+    uint8_t buffer[256];
+    node_stats_t decoded;
+    size_t len = lorawan.export_stats (buffer, sizeof (buffer));
+    CHECK (len > 2 && buffer[0] == LORAWAN_STATS_VERSION && buffer[1] == STATS_ALL);
+    CHECK (lorawan_stats_import (buffer, len, &decoded));
+    CHECK (decoded.uplinks_queued == stats.uplinks_queued && decoded.confirmed_missed == 1 && decoded.downlinks == 1);
+    CHECK (decoded.airtime_ms[DR_SF7] == stats.airtime_ms[DR_SF7] && decoded.airtime_ms[DR_SF8] == 0);
+    CHECK (decoded.port_count == 1 && decoded.ports[0].port == 10 && decoded.ports[0].count == 1);
+    CHECK (decoded.counters_bytes == stats.counters_bytes && decoded.session_writes == stats.session_writes);
+    CHECK (decoded.loop_us.get (0) == stats.loop_us.get (0) && decoded.loop_us.count () == stats.loop_us.count ());
+    CHECK (decoded.counters_write_us.count () == stats.counters_writes);
+    printf ("  all sections: %u bytes\n", (unsigned)len);
+    CHECK (!lorawan_stats_import (buffer, len - 1, &decoded));
+
+    // Sections that do not fit are left out
+    len = lorawan.export_stats (buffer, 16);
+    CHECK (len && len <= 16 && (buffer[1] & STATS_COUNTERS) && buffer[1] != STATS_ALL);
+    CHECK (lorawan_stats_import (buffer, len, &decoded) && decoded.uplinks_sent == stats.uplinks_sent);
+    len = lorawan.export_stats (buffer, sizeof (buffer), STATS_LOOP_TIME);
+    CHECK (buffer[1] == STATS_LOOP_TIME && lorawan_stats_import (buffer, len, &decoded) && decoded.uplinks_sent == 0);
+    CHECK (lorawan.export_stats (buffer, 2) == 0);
+
+    // Diagnostics uplink
+    sent = sim_frames_sent ();
+    CHECK (lorawan.send_stats ());
+    run_until_sent (sent + 1);
+    uint8_t port;
+    size_t frame_len;
+    const uint8_t* frame = sim_last_frame (&port, &frame_len);
+    CHECK (port == LORAWAN_STATS_PORT && lorawan_stats_import (frame, frame_len, &decoded));
+    CHECK (decoded.uplinks_queued == stats.uplinks_queued - 1);
+}
+
+static void release_uplink () {
+    lorawan.loop ();
+    LMIC.client.eventCb (LMIC.client.eventUserData, EV_TXCANCELED);
+    os_clearCallback (&LMIC.osjob);
+    LMIC_clrTxData ();
+}
+
+static void run_benchmarks () {
+    printf ("benchmarks\n");
+    uint8_t data[12] = { 0 };
+
+    // Log record is timed alone, buffer is emptied between rounds
+    static LoRaLog log;
+    CapturePrint out;
+    double record_ns = 0;
+    size_t record_allocs = 0;
+    for (unsigned round = 0; round < 10000; round++) {
+        size_t allocs = allocations;
+        auto start = std::chrono::steady_clock::now ();
+        for (unsigned i = 0; i < LORAWAN_LOG_SIZE; i++) {
+            log.record (LORAWAN_LOG_LEVEL_DEBUG, "Port: %u Length: %u --> %08X\n", 1, i, i);
+        }
+        record_ns += std::chrono::duration<double, std::nano> (std::chrono::steady_clock::now () - start).count ();
+        record_allocs += allocations - allocs;
+        log.drain (out, LORAWAN_LOG_SIZE);
+        out.text.clear ();
+    }
+    report ("LoRaLog::record (3 arguments)", record_ns / (10000.0 * LORAWAN_LOG_SIZE),
+            (double)record_allocs / (10000.0 * LORAWAN_LOG_SIZE));
+    out.text.clear ();
+    for (unsigned i = 0; i < LORAWAN_LOG_SIZE; i++) {
+        log.record (LORAWAN_LOG_LEVEL_DEBUG, "Port: %u Length: %u --> %08X\n", 1, i, i);
+    }
+    bench ("LoRaLog::drain (per entry)", LORAWAN_LOG_SIZE, [&out] (unsigned) {
+        log.drain (out, 1);
+    });
+
+    joined_node (STORAGE_FILES);
+    bench ("send_data_inmediate (12 bytes) + release", 100000, [&data] (unsigned) {
+        lorawan.send_data_inmediate (data, sizeof (data));
+        release_uplink ();
+    });
+
+    uint8_t full[51] = { 0 };
+    bench ("send_data_inmediate (51 bytes) + release", 100000, [&full] (unsigned) {
+        lorawan.send_data_inmediate (full, sizeof (full));
+        release_uplink ();
+    });
+    bench ("reserve_uplink + commit_uplink (51 bytes) + release", 100000, [] (unsigned i) {
+        size_t capacity;
+        uint8_t* payload = lorawan.reserve_uplink (&capacity);
+        if (!payload) {
+            printf ("  reserve_uplink failed\n");
+            exit (1);
+        }
+        memset (payload, (int)i, 51);
+        lorawan.commit_uplink (51);
+        release_uplink ();
+    });
+
+    unsigned completed = 0;
+    lorawan.on_uplink_complete ([&completed] (const uplink_result_t&) { completed++; });
+    bench ("send (12 bytes) + release, on_uplink_complete set", 100000, [&data] (unsigned) {
+        lorawan.send (data, sizeof (data));
+        release_uplink ();
+    });
+
+    joined_node (STORAGE_FILES);
+    lorawan.set_sf (EU868_DR_SF12);
+    bench ("append_record (4 bytes)", 100000, [&data] (unsigned i) {
+        lorawan.append_record (data, 4);
+        if (lorawan.get_queue_length ()) {
+            release_uplink ();
+        }
+    });
+
+    joined_node (STORAGE_FILES);
+    lorawan.set_fair_use_budget (30000);
+    bench ("next_tx_possible", 100000, [] (unsigned i) {
+        lorawan.next_tx_possible ((uint8_t)i);
+    });
+
+    static LoRaTask task;
+    task.start ([] (void* arg) {
+        while (!task.is_stopping ()) {
+            task.wait (LORAWAN_TASK_WAIT_FOREVER);
+        }
+    }, nullptr, LORAWAN_TASK_CORE, LORAWAN_TASK_PRIORITY);
+    bench ("LoRaTaskGuard (lock, unlock, notify)", 1000000, [] (unsigned) {
+        LoRaTaskGuard guard (task);
+    });
+    task.stop ();
+
+    sensor_schema_t::values_t values (21.37f, 55.5f, 3312, { true, 404168 }, { true, -37038 }, true, false, true);
+    static uint8_t encoded[sensor_schema_t::max_size];
+    bench ("LoRaSchema::encode (8 fields, 10 bytes)", 1000000, [&values] (unsigned i) {
+        std::get<2> (values) = 2000 + (i & 1023);
+        sensor_schema_t::encode (values, encoded, sizeof (encoded));
+    });
+    bench ("LoRaSchema::decode (8 fields, 10 bytes)", 1000000, [&values] (unsigned i) {
+        encoded[0] = (uint8_t)i;
+        sensor_schema_t::decode (encoded, sizeof (encoded), values);
+    });
+
+    static LoRaSeries series;
+    static uint8_t frame[MAX_LEN_PAYLOAD];
+    for (int i = 0; i < LORAWAN_SERIES_SAMPLES; i++) {
+        series.add (corpus[0].timestamps[i], corpus[0].values[i]);
+    }
+    uint8_t samples = series.fit (222);
+    char name[64];
+    snprintf (name, sizeof (name), "LoRaSeries::encode (222 bytes, %u samples)", samples);
+    double ns = bench (name, 100000, [] (unsigned) {
+        uint8_t n;
+        series.encode (frame, 222, &n);
+    });
+    printf ("    per sample: %.1f ns\n", ns / samples);
+
+    static LoRaFragmenter fragmenter;
+    static uint8_t fragment[LORAWAN_FRAG_HEADER + FRAG_SIZE];
+    fragmenter.begin (frag_block, FRAG_BLOCK, FRAG_SIZE, FRAG_BLOCK / FRAG_SIZE + 1, 0);
+    bench ("LoRaFragmenter::build (data, 45 bytes)", 1000000, [] (unsigned i) {
+        fragmenter.build (1 + i % fragmenter.get_fragments (), fragment);
+    });
+    bench ("LoRaFragmenter::build (parity, 45 bytes, M=45)", 100000, [] (unsigned i) {
+        fragmenter.build (fragmenter.get_fragments () + 1 + i % fragmenter.get_fragments (), fragment);
+    });
+    bench ("LoRaFragReassembler (2000 bytes, 10% loss)", 1000, [] (unsigned i) {
+        unsigned needed;
+        frag_transfer (FRAG_BLOCK / FRAG_SIZE / 2, 0.1f, i, &needed);
+    });
+
+    static LoRaBacklog backlog;
+    backlog.begin (&memfs, "bench.dat", "bench.jnl", 64);
+    bench ("LoRaBacklog::push + read + release (cached)", 1000000, [&data] (unsigned) {
+        uint8_t record[LORAWAN_BACKLOG_RECORD_SIZE];
+        uint8_t port;
+        backlog.push (data, sizeof (data), 1);
+        backlog.read (0, record, &port);
+        backlog.release (backlog.first () + 1);
+    });
+    bench ("LoRaBacklog::flush (8 records)", 10000, [&data] (unsigned) {
+        for (int i = 0; i < LORAWAN_BACKLOG_CACHE; i++) {
+            backlog.push (data, sizeof (data), 1);
+        }
+        backlog.flush ();
+        backlog.release (backlog.first () + LORAWAN_BACKLOG_CACHE);
+    });
+
+    static LoRaHistogram histogram;
+    bench ("LoRaHistogram::add", 1000000, [] (unsigned i) {
+        histogram.add (i);
+    });
+
+    bench ("get_idle_time", 1000000, [] (unsigned) {
+        lorawan.get_idle_time ();
+    });
+
+    joined_node (STORAGE_FILES);
+    bench ("on_event (EV_TXSTART)", 1000000, [] (unsigned) {
+        LMIC.client.eventCb (LMIC.client.eventUserData, EV_TXSTART);
+    });
+    unsigned starts = 0;
+    lorawan.subscribe (EV_TXSTART, [&starts] (ev_t) { starts++; });
+    bench ("on_event (EV_TXSTART, subscribed)", 1000000, [] (unsigned) {
+        LMIC.client.eventCb (LMIC.client.eventUserData, EV_TXSTART);
+    });
+    lorawan.subscribe (EV_TXSTART, nullptr);
+    // Counters are written on every uplink, so this is mostly save_counters ()
+    bench ("on_event (EV_TXCOMPLETE, files)", 20000, [] (unsigned) {
+        LMIC.seqnoUp++;
+        LMIC.client.eventCb (LMIC.client.eventUserData, EV_TXCOMPLETE);
+    });
+    // Session and counters are saved on every join
+    bench ("on_event (EV_JOINED, files)", 20000, [] (unsigned) {
+        LMIC.client.eventCb (LMIC.client.eventUserData, EV_JOINED);
+    });
+    bench ("getSFStr", 1000000, [] (unsigned i) {
+        LMIC.datarate = i % 7;
+        lorawan.getSFStr ();
+    });
+    bench ("LoRaLinkTracker::add", 1000000, [] (unsigned i) {
+        static LoRaLinkTracker tracker;
+        tracker.add (-100 - (int16_t)(i % 20), (int8_t)(i % 40) - 20, i % 7, i);
+    });
+    bench ("sf_name", 1000000, [] (unsigned i) {
+        LMIC.datarate = i % 7;
+        volatile const char* name = lorawan.sf_name ();
+        (void)name;
+    });
+    LMIC.datarate = DR_SF7;
+
+    joined_node (STORAGE_FILES);
+    lorawan.set_counter_reservation (64);
+    bench ("on_event (EV_TXCOMPLETE, files, N=64)", 20000, [] (unsigned) {
+        LMIC.seqnoUp++;
+        LMIC.client.eventCb (LMIC.client.eventUserData, EV_TXCOMPLETE);
+    });
+
+    static uint8_t stats_buffer[256];
+    bench ("export_stats (all sections)", 100000, [] (unsigned) {
+        lorawan.export_stats (stats_buffer, sizeof (stats_buffer));
+    });
+
+    joined_node (STORAGE_JOURNAL);
+    bench ("on_event (EV_TXCOMPLETE, journal)", 20000, [] (unsigned) {
+        LMIC.seqnoUp++;
+        LMIC.client.eventCb (LMIC.client.eventUserData, EV_TXCOMPLETE);
+    });
+
+    // Session save and restore, comparing rewrite and journal storage
+    for (int mode = STORAGE_FILES; mode <= STORAGE_JOURNAL; mode++) {
+        joined_node ((storage_mode_t)mode);
+        memfs.stats = fs::FSStats ();
+        char name[64];
+        snprintf (name, sizeof (name), "session save (%s)", mode == STORAGE_JOURNAL ? "journal" : "files");
+        bench (name, 20000, [] (unsigned i) {
+            LMIC.seqnoUp++;
+            lorawan.prepare_sleep (1000);
+        });
+        printf ("    per save: %.1f bytes written, %.2f truncations, %.2f opens\n",
+                memfs.stats.bytes_written / 20000.0, memfs.stats.truncations / 20000.0, memfs.stats.opens / 20000.0);
+        snprintf (name, sizeof (name), "session restore (%s)", mode == STORAGE_JOURNAL ? "journal" : "files");
+        bench (name, 2000, [mode] (unsigned) {
+            lorawan = LoRaWAN ();
+            lorawan.set_file_system (&memfs);
+            lorawan.set_storage_mode ((storage_mode_t)mode);
+            lorawan.init ();
+        });
+    }
+}
+
+int main () {
+    check_join ();
+    check_join_policy ();
+    check_queue ();
+    check_reserve_commit ();
+    check_downlink ();
+    check_session_restore (STORAGE_FILES);
+    check_session_restore (STORAGE_JOURNAL);
+    check_rtc_resume ();
+    check_legacy_session ();
+    check_session_slots ();
+    check_aggregation ();
+    check_airtime ();
+    check_log ();
+    check_subscribe ();
+    check_idle ();
+    check_task_mode ();
+    check_codec ();
+    check_series ();
+    check_frag ();
+    check_backlog ();
+    check_uplink_handles ();
+    check_stats ();
+    check_datarate ();
+    check_link ();
+    printf ("%d failed checks\n\n", failures);
+
+    run_benchmarks ();
+    const char* history = getenv ("BENCH_HISTORY");
+    if (history) {
+        failures += bench_history (history, getenv ("BENCH_LABEL"));
+    }
+    return failures;
+}
@@ -107,7 +107,7 @@ void on_rx (uint8_t port, const uint8_t* pMessage, size_t nMessage) {
 }
 
 void on_tx (bool ack) {
-    Serial.printf ("Message transitted with SF: %s\n", lorawan.getSFStr().c_str());
+    Serial.printf ("Message transitted with SF: %s\n", lorawan.sf_name ());
     if (ack) {
         Serial.print (" CONFIRMED");
     }
@@ -137,10 +137,13 @@ void loop () {
 
     if (millis () - last_sent > PERIOD && /*!sent &&*/ lorawan.isJoined()) {
         last_sent = millis ();
-        lorawan.send_data_inmediate ((uint8_t*)mydata, sizeof (uint8_t), 1);
-        Serial.println ("Send");
+        if (lorawan.send_data_inmediate ((uint8_t*)mydata, sizeof (uint8_t), 1)) {
+            Serial.println ("Send");
+        } else {
+            Serial.println ("Uplink queue full");
+        }
         Serial.printf ("Power: %d\n", lorawan.get_power ());
-        Serial.printf ("SF: %s\n", lorawan.getSFStr ().c_str ());
+        Serial.printf ("SF: %s\n", lorawan.sf_name ());
     }
     lorawan.loop ();
 }
\ No newline at end of file
@@ -0,0 +1,82 @@
+/**
+ * Decoder for time series frames built by LoRaSeries (src/lorawan_series.h).
+ *
+ * Can be pasted as uplink payload formatter in The Things Stack, or used from Node.js:
+ *
+ *     const { decodeSeries } = require ("./series_decoder.js");
+ *     decodeSeries ([0x03, ...]); // { timestamps: [...], values: [...] }
+ */
+
+function decodeSeries (bytes) {
+    var pos = 0;
+
+    function varint () {
+        var result = 0;
+        for (var i = 0; i < 5; i++) {
+            if (pos >= bytes.length) {
+                throw new Error ("Frame too short");
+            }
+            var b = bytes[pos++];
+            result = (result | ((b & 0x7F) << (7 * i))) >>> 0;
+            if (!(b & 0x80)) {
+                return result;
+            }
+        }
+        throw new Error ("Bad varint");
+    }
+
+    function unzigzag (z) {
+        return ((z >>> 1) ^ -(z & 1)) >>> 0;
+    }
+
+    var bitPos = 0;
+    function bits (width) {
+        var result = 0;
+        for (var i = 0; i < width; i++) {
+            var index = pos + (bitPos >> 3);
+            if (index >= bytes.length) {
+                throw new Error ("Frame too short");
+            }
+            result = ((result << 1) | ((bytes[index] >> (7 - (bitPos & 7))) & 1)) >>> 0;
+            bitPos++;
+        }
+        return result;
+    }
+
+    if (!bytes.length) {
+        throw new Error ("Empty frame");
+    }
+    var count = bytes[pos++];
+    var timestamps = [varint ()];
+    var values = [unzigzag (varint ()) | 0];
+    if (count > 1) {
+        var delta = unzigzag (varint ());
+        var timeBits = bytes[pos++];
+        var valueBits = bytes[pos++];
+        if (timeBits > 32 || valueBits > 32) {
+            throw new Error ("Bad field width");
+        }
+        timestamps.push ((timestamps[0] + delta) >>> 0);
+        for (var i = 2; i < count; i++) {
+            delta = (delta + unzigzag (bits (timeBits))) >>> 0;
+            timestamps.push ((timestamps[i - 1] + delta) >>> 0);
+        }
+        for (var j = 1; j < count; j++) {
+            values.push ((values[j - 1] + unzigzag (bits (valueBits))) | 0);
+        }
+    }
+    return { timestamps: timestamps, values: values };
+}
+
+// The Things Stack uplink payload formatter entry point
+function decodeUplink (input) {
+    try {
+        return { data: decodeSeries (input.bytes) };
+    } catch (e) {
+        return { errors: [e.message] };
+    }
+}
+
+if (typeof module !== "undefined") {
+    module.exports = { decodeSeries: decodeSeries, decodeUplink: decodeUplink };
+}
@@ -0,0 +1,81 @@
+/**
+  * @file Arduino.h
+  * @brief Minimal Arduino core stand-in for host builds
+  */
+
+#ifndef ARDUINO_NATIVE_STUB_H
+#define ARDUINO_NATIVE_STUB_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <string>
+
+#define PROGMEM
+#define PSTR(s) (s)
+#define F(s) (s)
+#define IRAM_ATTR
+#define memcpy_P memcpy
+#define snprintf_P snprintf
+#define HEX 16
+#define DEC 10
+
+unsigned long millis ();
+unsigned long micros ();
+void delay (unsigned long ms);
+void yield ();
+
+class String : public std::string {
+public:
+    String () {}
+    String (const char* s) : std::string (s) {}
+    String (const std::string& s) : std::string (s) {}
+};
+
+class Print {
+public:
+    virtual ~Print () {}
+    virtual size_t write (const uint8_t* buffer, size_t size) = 0;
+    size_t print (const char* s) { return write ((const uint8_t*)s, strlen (s)); }
+};
+
+class HardwareSerial : public Print {
+public:
+    void begin (unsigned long) {}
+    size_t write (const uint8_t* buffer, size_t size) override { return fwrite (buffer, 1, size, stdout); }
+    size_t print (const char* s) { return fputs (s, stdout) >= 0 ? strlen (s) : 0; }
+    size_t print (char c) { return fputc (c, stdout) != EOF; }
+    size_t print (unsigned v, int base = DEC) { return printf (base == HEX ? "%X" : "%u", v); }
+    size_t print (int v, int base = DEC) { return printf (base == HEX ? "%X" : "%d", v); }
+    size_t print (unsigned long v, int base = DEC) { return printf (base == HEX ? "%lX" : "%lu", v); }
+    size_t println (const char* s = "") { return printf ("%s\n", s); }
+    size_t println (unsigned v, int base = DEC) { return print (v, base) + println (); }
+    size_t println (unsigned long v, int base = DEC) { return print (v, base) + println (); }
+    size_t printf (const char* fmt, ...) __attribute__ ((format (printf, 2, 3))) {
+        va_list args;
+        va_start (args, fmt);
+        int n = vprintf (fmt, args);
+        va_end (args);
+        return n < 0 ? 0 : n;
+    }
+    size_t printf_P (const char* fmt, ...) {
+        va_list args;
+        va_start (args, fmt);
+        int n = vprintf (fmt, args);
+        va_end (args);
+        return n < 0 ? 0 : n;
+    }
+};
+
+extern HardwareSerial Serial;
+
+class EspClass {
+public:
+    uint32_t getFreeHeap () { return 0; }
+};
+
+extern EspClass ESP;
+
+#endif // ARDUINO_NATIVE_STUB_H
@@ -0,0 +1,95 @@
+/**
+  * @file FS.h
+  * @brief In-memory filesystem with the subset of the Arduino `fs::FS` API used by QuickLoRaWAN
+  *
+  * Files live in RAM for the lifetime of the `FS` object. Every open, write and close is counted so that
+  * benchmarks can compare storage strategies by I/O volume as well as by time.
+  */
+
+#ifndef FS_NATIVE_STUB_H
+#define FS_NATIVE_STUB_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace fs {
+
+enum SeekMode {
+    SeekSet = 0,
+    SeekCur = 1,
+    SeekEnd = 2
+};
+
+/**
+ * @brief I/O counters of an in-memory filesystem
+ */
+struct FSStats {
+    uint32_t opens = 0;
+    uint32_t closes = 0;
+    uint32_t truncations = 0;
+    uint32_t bytes_written = 0;
+    uint32_t bytes_read = 0;
+};
+
+typedef std::shared_ptr<std::vector<uint8_t>> FileData;
+
+class File {
+public:
+    File () {}
+    File (FileData data, bool writable, FSStats* stats) : data (data), writable (writable), stats (stats) {}
+
+    explicit operator bool () const { return (bool)data; }
+    size_t size () const { return data ? data->size () : 0; }
+    size_t position () const { return pos; }
+    bool seek (uint32_t p, SeekMode mode = SeekSet);
+    size_t write (const uint8_t* buf, size_t len);
+    size_t write (uint8_t c) { return write (&c, 1); }
+    size_t read (uint8_t* buf, size_t len);
+    size_t readBytes (char* buf, size_t len) { return read ((uint8_t*)buf, len); }
+    int available () const { return data ? (int)(data->size () - pos) : 0; }
+    void flush () {}
+    void close ();
+
+private:
+    FileData data;
+    bool writable = false;
+    size_t pos = 0;
+    FSStats* stats = nullptr;
+};
+
+class FS {
+public:
+    File open (const char* path, const char* mode);
+    bool exists (const char* path) { return files.count (path) > 0; }
+    bool remove (const char* path) { return files.erase (path) > 0; }
+    bool rename (const char* from, const char* to);
+    bool begin () { return true; }
+    void format () { files.clear (); }
+
+    /**
+     * @brief Simulates a write that is cut short by a power loss
+     * @param path File name
+     * @param keep Number of bytes that survive
+     */
+    void truncate_file (const char* path, size_t keep);
+
+    FSStats stats;
+    bool fail_writes = false;   ///< @brief Simulates a failing flash: files can be opened, and truncated, but not written
+
+private:
+    std::map<std::string, FileData> files;
+};
+
+} // namespace fs
+
+using fs::FS;
+using fs::File;
+using fs::SeekSet;
+using fs::SeekCur;
+using fs::SeekEnd;
+
+#endif // FS_NATIVE_STUB_H
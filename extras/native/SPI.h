@@ -0,0 +1,17 @@
+/**
+  * @file SPI.h
+  * @brief SPI stand-in for host builds. Pins are accepted and ignored
+  */
+
+#ifndef SPI_NATIVE_STUB_H
+#define SPI_NATIVE_STUB_H
+
+class SPIClass {
+public:
+    void begin (int, int, int, int) {}
+    void pins (int, int, int, int) {}
+};
+
+extern SPIClass SPI;
+
+#endif // SPI_NATIVE_STUB_H
@@ -0,0 +1,27 @@
+/**
+  * @file arduino_stub.cpp
+  * @brief Arduino core stand-in for host builds. Time is simulated and shared with the LMIC stub
+  */
+
+#include "Arduino.h"
+#include "SPI.h"
+#include "lmic.h"
+
+HardwareSerial Serial;
+EspClass ESP;
+SPIClass SPI;
+
+unsigned long millis () {
+    return (unsigned long)(sim_micros () / 1000);
+}
+
+unsigned long micros () {
+    return (unsigned long)sim_micros ();
+}
+
+void delay (unsigned long ms) {
+    sim_advance_ms (ms);
+}
+
+void yield () {
+}
@@ -0,0 +1,99 @@
+/**
+  * @file fs_stub.cpp
+  * @brief In-memory filesystem for host builds
+  */
+
+#include "FS.h"
+#include <string.h>
+
+namespace fs {
+
+bool File::seek (uint32_t p, SeekMode mode) {
+    if (!data) {
+        return false;
+    }
+    size_t base = mode == SeekSet ? 0 : (mode == SeekCur ? pos : data->size ());
+    if (base + p > data->size ()) {
+        return false;
+    }
+    pos = base + p;
+    return true;
+}
+
+size_t File::write (const uint8_t* buf, size_t len) {
+    if (!data || !writable) {
+        return 0;
+    }
+    if (pos + len > data->size ()) {
+        data->resize (pos + len);
+    }
+    memcpy (data->data () + pos, buf, len);
+    pos += len;
+    if (stats) {
+        stats->bytes_written += len;
+    }
+    return len;
+}
+
+size_t File::read (uint8_t* buf, size_t len) {
+    if (!data) {
+        return 0;
+    }
+    size_t avail = data->size () - pos;
+    if (len > avail) {
+        len = avail;
+    }
+    memcpy (buf, data->data () + pos, len);
+    pos += len;
+    if (stats) {
+        stats->bytes_read += len;
+    }
+    return len;
+}
+
+void File::close () {
+    if (data && stats) {
+        stats->closes++;
+    }
+    data.reset ();
+}
+
+File FS::open (const char* path, const char* mode) {
+    bool write = mode[0] == 'w' || mode[0] == 'a' || strchr (mode, '+');
+    auto it = files.find (path);
+    if (mode[0] == 'r' && it == files.end ()) {
+        return File ();
+    }
+    if (it == files.end ()) {
+        it = files.emplace (path, std::make_shared<std::vector<uint8_t>> ()).first;
+    }
+    if (mode[0] == 'w') {
+        it->second->clear ();
+        stats.truncations++;
+    }
+    stats.opens++;
+    File f (it->second, write && !fail_writes, &stats);
+    if (mode[0] == 'a') {
+        f.seek (0, SeekEnd);
+    }
+    return f;
+}
+
+bool FS::rename (const char* from, const char* to) {
+    auto it = files.find (from);
+    if (it == files.end ()) {
+        return false;
+    }
+    files[to] = it->second;
+    files.erase (from);
+    return true;
+}
+
+void FS::truncate_file (const char* path, size_t keep) {
+    auto it = files.find (path);
+    if (it != files.end () && it->second->size () > keep) {
+        it->second->resize (keep);
+    }
+}
+
+} // namespace fs
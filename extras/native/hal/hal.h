@@ -0,0 +1,22 @@
+/**
+  * @file hal.h
+  * @brief LMIC HAL pin map stand-in for host builds
+  */
+
+#ifndef LMIC_NATIVE_HAL_H
+#define LMIC_NATIVE_HAL_H
+
+#include <stdint.h>
+
+#define LMIC_UNUSED_PIN 0xff
+
+struct lmic_pinmap {
+    uint8_t nss;
+    uint8_t rxtx;
+    uint8_t rst;
+    uint8_t dio[3];
+};
+
+extern const lmic_pinmap lmic_pins;
+
+#endif // LMIC_NATIVE_HAL_H
@@ -0,0 +1,245 @@
+/**
+  * @file lmic.h
+  * @brief Minimal LMIC stand-in for host builds
+  *
+  * Mirrors the subset of the MCCI arduino-lmic API used by QuickLoRaWAN, with EU868 band plan constants.
+  * Radio activity is simulated: transmissions complete after a configurable delay and can be acknowledged
+  * or answered with a downlink through the `sim_*` helpers.
+  */
+
+#ifndef LMIC_NATIVE_STUB_H
+#define LMIC_NATIVE_STUB_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#ifndef CFG_eu868
+#define CFG_eu868 1
+#endif
+#define CFG_LMIC_EU_like 1
+#define CFG_LMIC_US_like 0
+
+typedef uint8_t bit_t;
+typedef uint8_t u1_t;
+typedef int8_t s1_t;
+typedef uint16_t u2_t;
+typedef int16_t s2_t;
+typedef uint32_t u4_t;
+typedef int32_t s4_t;
+typedef int32_t ostime_t;
+typedef u4_t devaddr_t;
+typedef u1_t* xref2u1_t;
+typedef const u1_t* xref2cu1_t;
+typedef u1_t dr_t;
+typedef u2_t rps_t;
+
+#define OSTICKS_PER_SEC 32768
+#define us2osticks(us) ((ostime_t)(((int64_t)(us) * OSTICKS_PER_SEC) / 1000000))
+#define ms2osticks(ms) ((ostime_t)(((int64_t)(ms) * OSTICKS_PER_SEC) / 1000))
+#define sec2osticks(sec) ((ostime_t)((int64_t)(sec) * OSTICKS_PER_SEC))
+#define osticks2ms(os) ((s4_t)(((os) * (int64_t)1000) / OSTICKS_PER_SEC))
+#define osticks2us(os) ((s4_t)(((os) * (int64_t)1000000) / OSTICKS_PER_SEC))
+
+enum { MAX_LEN_PAYLOAD = 255 - 13 };
+enum { MAX_LEN_FRAME = 255 };
+enum { MAX_BANDS = 4 };
+enum { MAX_CHANNELS = 16 };
+#define KEEP_TXPOW -128
+
+enum _dr_eu868_t { EU868_DR_SF12 = 0, EU868_DR_SF11, EU868_DR_SF10, EU868_DR_SF9, EU868_DR_SF8, EU868_DR_SF7,
+                   EU868_DR_SF7B, EU868_DR_FSK, EU868_DR_NONE };
+enum { DR_SF12 = EU868_DR_SF12, DR_SF11, DR_SF10, DR_SF9, DR_SF8, DR_SF7, DR_SF7B, DR_FSK, DR_NONE };
+
+enum _sf_t { FSK = 0, SF7, SF8, SF9, SF10, SF11, SF12, SFrfu };
+enum _bw_t { BW125 = 0, BW250, BW500, BWrfu };
+#define MAKERPS(sf, bw) ((rps_t)((sf) | ((bw) << 3)))
+#define getSf(rps) ((rps) & 0x7)
+#define getBw(rps) (((rps) >> 3) & 0x3)
+
+enum _ev_t { EV_SCAN_TIMEOUT = 1, EV_BEACON_FOUND,
+             EV_BEACON_MISSED, EV_BEACON_TRACKED, EV_JOINING,
+             EV_JOINED, EV_RFU1, EV_JOIN_FAILED, EV_REJOIN_FAILED,
+             EV_TXCOMPLETE, EV_LOST_TSYNC, EV_RESET,
+             EV_RXCOMPLETE, EV_LINK_DEAD, EV_LINK_ALIVE, EV_SCAN_FOUND,
+             EV_TXSTART, EV_TXCANCELED, EV_RXSTART, EV_JOIN_TXCOMPLETE };
+typedef enum _ev_t ev_t;
+
+enum { OP_NONE = 0x0000, OP_SCAN = 0x0001, OP_TRACK = 0x0002, OP_JOINING = 0x0004, OP_TXDATA = 0x0008,
+       OP_POLL = 0x0010, OP_REJOIN = 0x0020, OP_SHUTDOWN = 0x0040, OP_TXRXPEND = 0x0080, OP_RNDTX = 0x0100,
+       OP_PINGINI = 0x0200, OP_PINGABLE = 0x0400, OP_NEXTCHNL = 0x0800, OP_LINKDEAD = 0x1000,
+       OP_TESTMODE = 0x2000, OP_UNJOIN = 0x4000 };
+
+enum { TXRX_ACK = 0x80, TXRX_NACK = 0x40, TXRX_NOPORT = 0x20, TXRX_PORT = 0x10, TXRX_LENERR = 0x08,
+       TXRX_DNW1 = 0x01, TXRX_DNW2 = 0x02, TXRX_PING = 0x04 };
+
+enum { LMIC_ERROR_SUCCESS = 0, LMIC_ERROR_TX_BUSY = -1, LMIC_ERROR_TX_TOO_LARGE = -2,
+       LMIC_ERROR_TX_NOT_FEASIBLE = -3, LMIC_ERROR_TX_FAILED = -4 };
+typedef int lmic_tx_error_t;
+
+struct osjob_t;
+typedef void osjobcb_t (struct osjob_t*);
+struct osjob_t {
+    struct osjob_t* next;
+    ostime_t deadline;
+    osjobcb_t* func;
+};
+typedef struct osjob_t osjob_t;
+
+typedef void lmic_event_cb_t (void* pUserData, ev_t e);
+typedef void lmic_rxmessage_cb_t (void* pUserData, uint8_t port, const uint8_t* pMessage, size_t nMessage);
+
+typedef struct {
+    lmic_event_cb_t* eventCb;
+    void* eventUserData;
+    lmic_rxmessage_cb_t* rxMessageCb;
+    void* rxMessageUserData;
+} lmic_client_data_t;
+
+struct band_t {
+    u2_t txcap;
+    s1_t txpow;
+    u1_t lastchnl;
+    ostime_t avail;
+};
+typedef struct band_t band_t;
+
+struct lmic_t {
+    lmic_client_data_t client;
+    osjob_t osjob;
+    ostime_t txend;
+    ostime_t rxtime;
+    u4_t freq;
+    ostime_t globalDutyAvail;
+    u4_t netid;
+    devaddr_t devaddr;
+    u4_t seqnoDn;
+    u4_t seqnoUp;
+    u4_t dn2Freq;
+    rps_t rps;
+    u2_t opmode;
+    u2_t devNonce;
+    s2_t adrAckReq;
+    s1_t rssi;
+    s1_t snr;
+    u1_t rxsyms;
+    u1_t dndr;
+    s1_t txpow;
+    u1_t txChnl;
+    u1_t globalDutyRate;
+    u1_t upRepeat;
+    s1_t adrTxPow;
+    u1_t datarate;
+    u1_t errcr;
+    u1_t rejoinCnt;
+    bit_t initBandplanAfterReset;
+    u1_t pendTxPort;
+    u1_t pendTxConf;
+    u1_t pendTxLen;
+    u1_t pendTxData[MAX_LEN_PAYLOAD];
+    u1_t nwkKey[16];
+    u1_t artKey[16];
+    u1_t dnConf;
+    u1_t adrChanged;
+    u1_t rxDelay;
+    u1_t margin;
+    u1_t adrEnabled;
+    u1_t rx1DrOffset;
+    u1_t dn2Dr;
+    band_t bands[MAX_BANDS];
+    u4_t channelFreq[MAX_CHANNELS];
+    u2_t channelDrMap[MAX_CHANNELS];
+    u2_t channelMap;
+    u1_t txCnt;
+    u1_t txrxFlags;
+    u1_t dataBeg;
+    u1_t dataLen;
+    u1_t frame[MAX_LEN_FRAME];
+};
+typedef struct lmic_t lmic_t;
+
+extern lmic_t LMIC;
+
+void os_init (void);
+ostime_t os_getTime (void);
+void os_setCallback (osjob_t* job, osjobcb_t* cb);
+void os_setTimedCallback (osjob_t* job, ostime_t time, osjobcb_t* cb);
+void os_clearCallback (osjob_t* job);
+void os_runloop_once (void);
+ostime_t os_getNextDeadline (bit_t* pfDeadlineValid);
+u1_t os_getRndU1 (void);
+
+rps_t updr2rps (dr_t dr);
+ostime_t calcAirTime (rps_t rps, u1_t plen);
+
+void LMIC_reset (void);
+bit_t LMIC_startJoining (void);
+void LMIC_setSession (u4_t netid, devaddr_t devaddr, xref2u1_t nwkKey, xref2u1_t artKey);
+void LMIC_getSessionKeys (u4_t* netid, devaddr_t* devaddr, xref2u1_t nwkKey, xref2u1_t artKey);
+lmic_tx_error_t LMIC_setTxData2 (u1_t port, xref2u1_t data, u1_t dlen, u1_t confirmed);
+void LMIC_setTxData (void);
+void LMIC_clrTxData (void);
+void LMIC_setDrTxpow (dr_t dr, s1_t txpow);
+void LMIC_setAdrMode (bit_t enabled);
+void LMIC_setLinkCheckMode (bit_t enabled);
+int LMIC_registerEventCb (lmic_event_cb_t* pEventCb, void* pUserData);
+int LMIC_registerRxMessageCb (lmic_rxmessage_cb_t* pRxMessageCb, void* pUserData);
+
+// ---- Simulation controls (host only) ----
+
+/**
+ * @brief Advances simulated clock
+ * @param ms Milliseconds to advance
+ */
+void sim_advance_ms (uint32_t ms);
+
+/**
+ * @brief Returns simulated clock in microseconds
+ */
+uint64_t sim_micros (void);
+
+/**
+ * @brief Configures simulated network behaviour. Join request count starts again from 0
+ * @param join_after_attempts Number of join requests needed before JoinAccept. 0 means never joins
+ * @param ack_confirmed `true` if confirmed uplinks get acknowledged
+ * @param tx_duration_ms Time from transmission start to `EV_TXCOMPLETE`
+ */
+void sim_configure (unsigned join_after_attempts, bool ack_confirmed, uint32_t tx_duration_ms);
+
+/**
+ * @brief Sets simulated wall clock returned by `time()`. It runs with simulated time from then on
+ * @param seconds Seconds since epoch. 0 leaves clock unset, and `time()` returns 0
+ */
+void sim_set_wall_clock (uint32_t seconds);
+
+/**
+ * @brief Sets quality of simulated link. Acks and JoinAccept are received with these values. An uplink whose SNR at
+ *        gateway, lowered by TX power under 14 dBm, is below demodulation floor of its spreading factor is lost
+ * @param rssi Reception RSSI in dBm
+ * @param snr SNR in dB of a 125 kHz frame sent at 14 dBm
+ */
+void sim_link (s1_t rssi, s1_t snr);
+
+/**
+ * @brief Queues a downlink to be delivered after next uplink
+ * @param rssi Reception RSSI in dBm
+ * @param snr Reception SNR in dB
+ */
+void sim_queue_downlink (uint8_t port, const uint8_t* data, size_t len, s1_t rssi, s1_t snr);
+
+/**
+ * @brief Number of frames sent by simulated radio since last reset
+ */
+unsigned sim_frames_sent (void);
+
+/**
+ * @brief Last frame sent by simulated radio
+ */
+const uint8_t* sim_last_frame (uint8_t* port, size_t* len);
+
+/**
+ * @brief Resets simulation state
+ */
+void sim_reset (void);
+
+#endif // LMIC_NATIVE_STUB_H
@@ -0,0 +1,432 @@
+/**
+  * @file lmic_stub.cpp
+  * @brief Simulated LMIC MAC and scheduler for host builds
+  *
+  * Jobs are kept in a single list ordered by deadline, as in LMIC's `oslmic.c`. The radio side is reduced to
+  * a fixed transmission time followed by `EV_TXCOMPLETE`, a simple 1% duty cycle on band 0 and a scripted
+  * network that accepts joins, acknowledges confirmed frames and returns queued downlinks.
+  */
+
+#include "lmic.h"
+#include <math.h>
+#include <time.h>
+#include <atomic>
+#include <deque>
+#include <vector>
+
+lmic_t LMIC;
+
+// Time and sent frames are read by test code while radio task runs
+static std::atomic<uint64_t> sim_time_us (0);
+static osjob_t* joblist = nullptr;
+
+static unsigned sim_join_after = 1;
+static bool sim_ack = true;
+static uint32_t sim_tx_ms = 1500;
+static unsigned sim_join_attempts = 0;
+static std::atomic<unsigned> sim_sent (0);
+static uint8_t sim_frame[MAX_LEN_PAYLOAD];
+static size_t sim_frame_len = 0;
+static uint8_t sim_frame_port = 0;
+static s1_t sim_rssi = -90;
+static uint32_t sim_clock_base = 0;
+static s1_t sim_snr = 10;
+
+struct sim_downlink_t {
+    uint8_t port;
+    std::vector<uint8_t> data;
+    s1_t rssi;
+    s1_t snr;
+};
+static std::deque<sim_downlink_t> sim_downlinks;
+
+static const uint8_t sim_max_payload[] = { 51, 51, 51, 115, 222, 222, 222, 222 };
+
+rps_t updr2rps (dr_t dr) {
+    static const rps_t dr2rps[] = { MAKERPS (SF12, BW125), MAKERPS (SF11, BW125), MAKERPS (SF10, BW125),
+                                    MAKERPS (SF9, BW125), MAKERPS (SF8, BW125), MAKERPS (SF7, BW125),
+                                    MAKERPS (SF7, BW250), MAKERPS (FSK, BW125) };
+    return dr < sizeof (dr2rps) / sizeof (dr2rps[0]) ? dr2rps[dr] : MAKERPS (SF12, BW125);
+}
+
+ostime_t calcAirTime (rps_t rps, u1_t plen) {
+    int sf = getSf (rps);
+    if (sf == FSK) {
+        // 5 bytes preamble, 3 sync, 1 length, 2 CRC at 50 kbps
+        return us2osticks ((plen + 11) * 8 * 20);
+    }
+    sf += 6;
+    double bw = 125000.0 * (1 << getBw (rps));
+    double tsym = (1 << sf) / bw;
+    int de = (sf >= 11 && getBw (rps) == BW125) ? 1 : 0;
+    // Explicit header, CRC on, coding rate 4/5, 8 symbols preamble
+    double n = ceil ((8.0 * plen - 4 * sf + 28 + 16) / (4.0 * (sf - 2 * de)));
+    double symbols = 8 + 4.25 + 8 + (n > 0 ? n * 5 : 0);
+    return us2osticks (symbols * tsym * 1000000);
+}
+
+static void report (ev_t e) {
+    if (LMIC.client.eventCb) {
+        LMIC.client.eventCb (LMIC.client.eventUserData, e);
+    }
+}
+
+static void unlink (osjob_t* job) {
+    for (osjob_t** pnext = &joblist; *pnext; pnext = &((*pnext)->next)) {
+        if (*pnext == job) {
+            *pnext = job->next;
+            return;
+        }
+    }
+}
+
+void os_init (void) {
+    memset (&LMIC, 0, sizeof (LMIC));
+    joblist = nullptr;
+    LMIC.datarate = EU868_DR_SF12;
+    LMIC.adrTxPow = 14;
+    LMIC.adrEnabled = 1;
+}
+
+ostime_t os_getTime (void) {
+    return (ostime_t)((sim_time_us * OSTICKS_PER_SEC) / 1000000);
+}
+
+u1_t os_getRndU1 (void) {
+    static uint32_t seed = 0x1234567;
+    seed = seed * 1103515245 + 12345;
+    return (u1_t)(seed >> 16);
+}
+
+void os_setTimedCallback (osjob_t* job, ostime_t time, osjobcb_t* cb) {
+    unlink (job);
+    job->deadline = time;
+    job->func = cb;
+    job->next = nullptr;
+    osjob_t** pnext = &joblist;
+    while (*pnext && (*pnext)->deadline - time <= 0) {
+        pnext = &((*pnext)->next);
+    }
+    job->next = *pnext;
+    *pnext = job;
+}
+
+void os_setCallback (osjob_t* job, osjobcb_t* cb) {
+    os_setTimedCallback (job, os_getTime (), cb);
+}
+
+void os_clearCallback (osjob_t* job) {
+    unlink (job);
+}
+
+void os_runloop_once (void) {
+    osjob_t* j = joblist;
+    if (j && j->deadline - os_getTime () <= 0) {
+        joblist = j->next;
+        j->func (j);
+    }
+}
+
+ostime_t os_getNextDeadline (bit_t* pfDeadlineValid) {
+    *pfDeadlineValid = joblist != nullptr;
+    return joblist ? joblist->deadline : 0;
+}
+
+void sim_advance_ms (uint32_t ms) {
+    sim_time_us += (uint64_t)ms * 1000;
+}
+
+uint64_t sim_micros (void) {
+    return sim_time_us;
+}
+
+void sim_configure (unsigned join_after_attempts, bool ack_confirmed, uint32_t tx_duration_ms) {
+    sim_join_after = join_after_attempts;
+    sim_ack = ack_confirmed;
+    sim_tx_ms = tx_duration_ms;
+    sim_join_attempts = 0;
+}
+
+void sim_set_wall_clock (uint32_t seconds) {
+    sim_clock_base = seconds ? seconds - (uint32_t)(sim_time_us / 1000000) : 0;
+}
+
+// Replaces C library time (), so that library code reads simulated wall clock
+extern "C" time_t time (time_t* t) {
+    time_t now = sim_clock_base ? sim_clock_base + (time_t)(sim_time_us / 1000000) : 0;
+    if (t) {
+        *t = now;
+    }
+    return now;
+}
+
+void sim_link (s1_t rssi, s1_t snr) {
+    sim_rssi = rssi;
+    sim_snr = snr;
+}
+
+// Gateway hears an uplink if its SNR is above demodulation floor of its spreading factor. Uplink SNR goes down
+// with TX power below 14 dBm and with bandwidth above 125 kHz
+static bool sim_uplink_heard (void) {
+    rps_t rps = updr2rps (LMIC.datarate);
+    if (getSf (rps) == FSK) {
+        return true;
+    }
+    double sf = getSf (rps) + 6;
+    double snr = sim_snr - (14 - LMIC.adrTxPow) - 3.0 * getBw (rps);
+    return snr >= -5 - 2.5 * (sf - 6);
+}
+
+static void sim_receive (s1_t rssi, s1_t snr) {
+    // Same encoding as LMIC radio driver: RSSI + 64 and SNR in quarter dB
+    LMIC.rssi = (s1_t)(rssi + 64);
+    LMIC.snr = (s1_t)(snr * 4);
+    LMIC.dndr = LMIC.datarate;
+    LMIC.txrxFlags |= TXRX_DNW1;
+}
+
+void sim_queue_downlink (uint8_t port, const uint8_t* data, size_t len, s1_t rssi, s1_t snr) {
+    sim_downlinks.push_back ({ port, std::vector<uint8_t> (data, data + len), rssi, snr });
+}
+
+unsigned sim_frames_sent (void) {
+    return sim_sent;
+}
+
+const uint8_t* sim_last_frame (uint8_t* port, size_t* len) {
+    *port = sim_frame_port;
+    *len = sim_frame_len;
+    return sim_frame;
+}
+
+void sim_reset (void) {
+    sim_time_us = 0;
+    sim_join_attempts = 0;
+    sim_sent = 0;
+    sim_frame_len = 0;
+    sim_downlinks.clear ();
+    sim_rssi = -90;
+    sim_snr = 10;
+    sim_clock_base = 0;
+    joblist = nullptr;
+}
+
+static void engine_update (void);
+
+static void tx_done (osjob_t* j) {
+    (void)j;
+    LMIC.opmode &= ~(OP_TXRXPEND | OP_TXDATA);
+    LMIC.txrxFlags = 0;
+    LMIC.dataLen = 0;
+    LMIC.dataBeg = 0;
+    if (LMIC.pendTxLen > sim_max_payload[LMIC.datarate < sizeof (sim_max_payload) ? LMIC.datarate : 0]) {
+        LMIC.txrxFlags = TXRX_LENERR;
+        report (EV_TXCOMPLETE);
+        return;
+    }
+    sim_sent++;
+    sim_frame_port = LMIC.pendTxPort;
+    sim_frame_len = LMIC.pendTxLen;
+    memcpy (sim_frame, LMIC.pendTxData, LMIC.pendTxLen);
+    LMIC.seqnoUp++;
+    LMIC.bands[0].avail = os_getTime () + ms2osticks (sim_tx_ms) * 99;
+    bool heard = sim_uplink_heard ();
+    if (heard && LMIC.pendTxConf && sim_ack) {
+        LMIC.txrxFlags |= TXRX_ACK;
+        sim_receive (sim_rssi, sim_snr);
+    }
+    if (heard && !sim_downlinks.empty ()) {
+        sim_downlink_t dl = sim_downlinks.front ();
+        sim_downlinks.pop_front ();
+        LMIC.seqnoDn++;
+        sim_receive (dl.rssi, dl.snr);
+        LMIC.frame[0] = dl.port;
+        LMIC.dataBeg = 1;
+        LMIC.dataLen = (u1_t)dl.data.size ();
+        memcpy (LMIC.frame + 1, dl.data.data (), dl.data.size ());
+        LMIC.txrxFlags |= TXRX_PORT;
+        if (LMIC.client.rxMessageCb) {
+            LMIC.client.rxMessageCb (LMIC.client.rxMessageUserData, dl.port, LMIC.frame + 1, LMIC.dataLen);
+        }
+    }
+    report (EV_TXCOMPLETE);
+    engine_update ();
+}
+
+static void tx_start (osjob_t* j) {
+    (void)j;
+    LMIC.opmode |= OP_TXRXPEND;
+    LMIC.txChnl = 0;
+    LMIC.rps = updr2rps (LMIC.datarate);
+    LMIC.dataLen = LMIC.pendTxLen + 13;
+    report (EV_TXSTART);
+    os_setTimedCallback (&LMIC.osjob, os_getTime () + ms2osticks (sim_tx_ms), tx_done);
+}
+
+static void join_done (osjob_t* j);
+
+static void join_tx (osjob_t* j) {
+    (void)j;
+    LMIC.opmode |= OP_TXRXPEND;
+    LMIC.rps = updr2rps (LMIC.datarate);
+    LMIC.dataLen = 23;
+    report (EV_TXSTART);
+    os_setTimedCallback (&LMIC.osjob, os_getTime () + ms2osticks (sim_tx_ms), join_done);
+}
+
+static void join_done (osjob_t* j) {
+    (void)j;
+    LMIC.opmode &= ~OP_TXRXPEND;
+    sim_join_attempts++;
+    if (sim_join_after && sim_join_attempts >= sim_join_after) {
+        LMIC.opmode &= ~OP_JOINING;
+        LMIC.netid = 0x13;
+        LMIC.devaddr = 0x260B0001;
+        for (int i = 0; i < 16; i++) {
+            LMIC.nwkKey[i] = (u1_t)i;
+            LMIC.artKey[i] = (u1_t)(0xA0 + i);
+        }
+        LMIC.seqnoUp = 0;
+        LMIC.seqnoDn = 0;
+        sim_receive (sim_rssi, sim_snr);
+        report (EV_JOINED);
+        engine_update ();
+    } else {
+        report (EV_JOIN_TXCOMPLETE);
+        if (LMIC.opmode & OP_JOINING) {
+            if (LMIC.datarate > EU868_DR_SF12) {
+                LMIC.datarate--;
+            }
+            os_setTimedCallback (&LMIC.osjob, os_getTime () + sec2osticks (5), join_tx);
+        }
+    }
+}
+
+static void engine_update (void) {
+    if (LMIC.opmode & (OP_TXRXPEND | OP_JOINING)) {
+        return;
+    }
+    if (LMIC.opmode & OP_TXDATA) {
+        ostime_t when = os_getTime ();
+        if (LMIC.bands[0].avail - when > 0) {
+            when = LMIC.bands[0].avail;
+        }
+        if (LMIC.globalDutyAvail - when > 0) {
+            when = LMIC.globalDutyAvail;
+        }
+        os_setTimedCallback (&LMIC.osjob, when, tx_start);
+    }
+}
+
+void LMIC_reset (void) {
+    os_clearCallback (&LMIC.osjob);
+    lmic_client_data_t client = LMIC.client;
+    memset (&LMIC, 0, sizeof (LMIC));
+    LMIC.client = client;
+    LMIC.datarate = EU868_DR_SF12;
+    LMIC.adrTxPow = 14;
+    LMIC.adrEnabled = 1;
+    LMIC.rxDelay = 1;
+    LMIC.dn2Dr = EU868_DR_SF12;
+    LMIC.dn2Freq = 869525000;
+    LMIC.channelMap = 0x07;
+    LMIC.channelFreq[0] = 868100000;
+    LMIC.channelFreq[1] = 868300000;
+    LMIC.channelFreq[2] = 868500000;
+    for (int i = 0; i < 3; i++) {
+        LMIC.channelDrMap[i] = 0x3F;
+    }
+    LMIC.bands[0].txcap = 100;
+    LMIC.bands[0].txpow = 14;
+}
+
+bit_t LMIC_startJoining (void) {
+    if (LMIC.devaddr != 0) {
+        return 0;
+    }
+    // As in LMIC, join request is sent from a job, so datarate may still be changed
+    LMIC.opmode |= OP_JOINING;
+    LMIC.datarate = EU868_DR_SF7;
+    report (EV_JOINING);
+    os_setCallback (&LMIC.osjob, join_tx);
+    return 1;
+}
+
+void LMIC_setSession (u4_t netid, devaddr_t devaddr, xref2u1_t nwkKey, xref2u1_t artKey) {
+    LMIC.netid = netid;
+    LMIC.devaddr = devaddr;
+    if (nwkKey) {
+        memcpy (LMIC.nwkKey, nwkKey, 16);
+    }
+    if (artKey) {
+        memcpy (LMIC.artKey, artKey, 16);
+    }
+    LMIC.opmode &= ~(OP_JOINING | OP_TXRXPEND);
+    LMIC.opmode |= OP_NEXTCHNL;
+    LMIC.seqnoUp = 0;
+    LMIC.seqnoDn = 0;
+}
+
+void LMIC_getSessionKeys (u4_t* netid, devaddr_t* devaddr, xref2u1_t nwkKey, xref2u1_t artKey) {
+    *netid = LMIC.netid;
+    *devaddr = LMIC.devaddr;
+    memcpy (nwkKey, LMIC.nwkKey, 16);
+    memcpy (artKey, LMIC.artKey, 16);
+}
+
+void LMIC_setTxData (void) {
+    LMIC.opmode |= OP_TXDATA;
+    if (LMIC.devaddr == 0 && !(LMIC.opmode & OP_JOINING)) {
+        LMIC_startJoining ();
+    }
+    engine_update ();
+}
+
+lmic_tx_error_t LMIC_setTxData2 (u1_t port, xref2u1_t data, u1_t dlen, u1_t confirmed) {
+    if (dlen > MAX_LEN_PAYLOAD) {
+        return LMIC_ERROR_TX_TOO_LARGE;
+    }
+    if (LMIC.opmode & OP_TXRXPEND) {
+        return LMIC_ERROR_TX_BUSY;
+    }
+    if (data) {
+        memcpy (LMIC.pendTxData, data, dlen);
+    }
+    LMIC.pendTxConf = confirmed;
+    LMIC.pendTxPort = port;
+    LMIC.pendTxLen = dlen;
+    LMIC_setTxData ();
+    return LMIC_ERROR_SUCCESS;
+}
+
+void LMIC_clrTxData (void) {
+    LMIC.opmode &= ~OP_TXDATA;
+    LMIC.pendTxLen = 0;
+}
+
+void LMIC_setDrTxpow (dr_t dr, s1_t txpow) {
+    LMIC.datarate = dr;
+    if (txpow != -128) {
+        LMIC.adrTxPow = txpow;
+    }
+}
+
+void LMIC_setAdrMode (bit_t enabled) {
+    LMIC.adrEnabled = enabled;
+}
+
+void LMIC_setLinkCheckMode (bit_t enabled) {
+    LMIC.adrAckReq = enabled ? 0 : -1;
+}
+
+int LMIC_registerEventCb (lmic_event_cb_t* pEventCb, void* pUserData) {
+    LMIC.client.eventCb = pEventCb;
+    LMIC.client.eventUserData = pUserData;
+    return 1;
+}
+
+int LMIC_registerRxMessageCb (lmic_rxmessage_cb_t* pRxMessageCb, void* pUserData) {
+    LMIC.client.rxMessageCb = pRxMessageCb;
+    LMIC.client.rxMessageUserData = pUserData;
+    return 1;
+}
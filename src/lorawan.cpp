@@ -1,54 +1,177 @@
 #include <Arduino.h>
 #include <SPI.h>
+#include <time.h>
 #include "lorawan.h"
+#include "lorawan_crc.h"
+
+#if defined ESP32
+#include <esp_sleep.h>
+#include <driver/gpio.h>
+#elif defined ESP8266
+#include <user_interface.h>
+#endif
 
 #ifndef DEBUG_PORT
 #define DEBUG_PORT Serial ///< @brief Stream to output debug info. It will normally be `Serial`
 #endif // DEBUG_ESP_PORT
 
-#if defined DEBUG_PORT && DEBUG_LORAWAN_LIB
+#define LORAWAN_RSSI_OFFSET 64 ///< @brief Offset LMIC radio driver adds to RSSI so that it fits in a signed byte
+#define LORAWAN_JOIN_REQUEST_SIZE 23 ///< @brief Join request frame length
+#define LORAWAN_MAX_JOB_WAIT 3600000 ///< @brief Longest wait a job is scheduled for, so that it fits in LMIC time range
 
-#ifdef ESP8266
+// Library messages go to deferred log, which is printed to DEBUG_PORT from loop ()
+#define DEBUG_LORAWAN(...) LORAWAN_LOG_DEBUG(__VA_ARGS__)
 
-const char* IRAM_ATTR extractFileName (const char* path) {
-    size_t i = 0;
-    size_t pos = 0;
-    char* p = (char*)path;
-    while (*p) {
-        i++;
-        if (*p == '/' || *p == '\\') {
-            pos = i;
-        }
-        p++;
-    }
-    return path + pos;
+#if LORAWAN_LOG_LEVEL >= LORAWAN_LOG_LEVEL_DEBUG
+/**
+  * @brief Gets 4 bytes of a key as a big endian word, so that keys can be logged with integer arguments
+  * @param key Key buffer
+  * @param offset First byte
+  * @return Key bytes
+  */
+static uint32_t key_word (const uint8_t* key, size_t offset) {
+    return ((uint32_t)key[offset] << 24) | ((uint32_t)key[offset + 1] << 16) | ((uint32_t)key[offset + 2] << 8) | key[offset + 3];
 }
 
-#define DEBUG_LINE_PREFIX() DEBUG_PORT.printf_P (PSTR("[%lu][H:%5lu][%s:%d] %s() | "),millis(),(unsigned long)ESP.getFreeHeap(),extractFileName(__FILE__),__LINE__,__FUNCTION__)
-#define DEBUG_LORAWAN(text,...) DEBUG_LINE_PREFIX();DEBUG_PORT.printf_P(PSTR(text),##__VA_ARGS__)
+#define DEBUG_KEY(name, key) DEBUG_LORAWAN (name ": %08X%08X%08X%08X\n", key_word (key, 0), key_word (key, 4), key_word (key, 8), key_word (key, 12))
+#endif
 
-#elif defined ESP32
 
-#define DEFAULT_LOG_TAG "EnigmaIOT"
-#define DEBUG_LORAWAN(format,...) ESP_LOGD (DEFAULT_LOG_TAG,"%d Heap: %6d. " format, millis(), ESP.getFreeHeap(), ##__VA_ARGS__)
+LoRaWAN lorawan;
 
-#else
+auto constexpr CONFIG_FILE = "loraconfig.cfg";
+auto constexpr CONFIG_FILE_B = "loraconfig_b.cfg";
+auto constexpr COUNTERS_FILE = "loracounters.cfg";
+auto constexpr COUNTERS_FILE_B = "loracounters_b.cfg";
+auto constexpr SESSION_JOURNAL_FILE = "lorasession.jnl";
+auto constexpr COUNTERS_JOURNAL_FILE = "loracounters.jnl";
+auto constexpr BACKLOG_FILE = "lorabacklog.dat";
+auto constexpr BACKLOG_CURSOR_FILE = "lorabacklog.jnl";
+constexpr uint16_t SESSION_JOURNAL_RECORD_SIZE = 256; ///< @brief Leaves room for session record to grow without changing journal layout
+constexpr uint16_t COUNTERS_JOURNAL_RECORD_SIZE = 16;
+
+static_assert (sizeof (session_record_t) <= SESSION_JOURNAL_RECORD_SIZE, "Session record does not fit in journal");
+static_assert (sizeof (link_counters_t) <= COUNTERS_JOURNAL_RECORD_SIZE, "Counters do not fit in journal");
+
+#define RTC_SNAPSHOT_MAGIC 0x52574C51 ///< @brief RTC snapshot signature ("QLWR")
 
-#define DEBUG_LORAWAN(...)
+/**
+  * @brief Session and counters copy kept in RTC memory across deep sleep
+  */
+typedef struct __attribute__ ((packed)) {
+    uint32_t magic;     ///< @brief Must be `RTC_SNAPSHOT_MAGIC`
+    uint32_t cycles;    ///< @brief Uplinks since session was last saved to filesystem
+    u4_t up_counter;    ///< @brief Exact uplink counter
+    u4_t stored_up_counter; ///< @brief Uplink counter in filesystem, end of reserved block
+    u4_t down_counter;  ///< @brief Exact downlink counter
+    session_record_t session;   ///< @brief Session data
+    uint32_t crc;       ///< @brief CRC32 of all previous fields
+} rtc_snapshot_t;
 
-#endif // ESP8266
+#if defined ESP32
+RTC_DATA_ATTR static rtc_snapshot_t rtc_snapshot;
+#elif defined ESP8266
+static rtc_snapshot_t rtc_snapshot __attribute__ ((aligned (4))); ///< @brief Working copy. Actual data lives in RTC user memory
+static_assert (LORAWAN_RTC_USER_MEMORY_OFFSET * 4 + sizeof (rtc_snapshot_t) <= 512, "RTC snapshot does not fit in RTC user memory");
+#else
+static rtc_snapshot_t rtc_snapshot; ///< @brief Survives calls to init () only, which is enough for host builds
+#endif
 
+/**
+  * @brief Gets wall clock time
+  * @return Seconds since epoch. 0 if clock has not been set
+  */
+static u4_t wall_clock () {
+#if LORAWAN_WALL_CLOCK
+    time_t now = time (NULL);
+    // Any date before 2021 means clock was never set
+    return now > 1609459200 ? (u4_t)now : 0;
 #else
+    // Elapsed time is only taken from announced sleep time
+    return 0;
+#endif
+}
 
-#define DEBUG_LORAWAN(...)
+/**
+  * @brief Checks if this boot is a wake up from deep sleep, so that announced sleep time really passed
+  * @return `True` if chip woke from deep sleep
+  */
+static bool woke_from_deep_sleep () {
+#if defined ESP32
+    return esp_sleep_get_wakeup_cause () != ESP_SLEEP_WAKEUP_UNDEFINED;
+#elif defined ESP8266
+    return ESP.getResetInfoPtr ()->reason == REASON_DEEP_SLEEP_AWAKE;
+#else
+    return true;
+#endif
+}
 
-#endif // DEBUG_PORT
+/**
+  * @brief Rebases a stored wait onto current LMIC time, discounting time spent off
+  * @param now Current LMIC time
+  * @param wait Remaining wait when session was saved, in LMIC ticks
+  * @param elapsed_ms Time since session was saved, in milliseconds. It may be longer than LMIC time range
+  * @return LMIC time when wait ends. `now` if it has already ended
+  */
+static ostime_t rebase_wait (ostime_t now, ostime_t wait, uint64_t elapsed_ms) {
+    // Compared in milliseconds. Elapsed time is never converted to ticks unless it is shorter than the wait
+    uint64_t wait_ms = wait > 0 ? (uint64_t)osticks2ms (wait) : 0;
+    if (elapsed_ms >= wait_ms) {
+        return now;
+    }
+    return now + wait - ms2osticks (elapsed_ms);
+}
 
+/**
+  * @brief Gets a random value from LMIC random generator
+  * @param min Lowest value
+  * @param max Highest value
+  * @return Value between `min` and `max`, both included
+  */
+static uint32_t random_between (uint32_t min, uint32_t max) {
+    uint32_t r = ((uint32_t)os_getRndU1 () << 8) | os_getRndU1 ();
+    return min + (uint32_t)((uint64_t)(max - min) * r / 0xFFFF);
+}
 
-LoRaWAN lorawan;
+/**
+  * @brief Calculates exponential backoff
+  * @param min Backoff after first failure
+  * @param max Longest backoff
+  * @param failures Consecutive failures
+  * @return `min` doubled on every failure after the first one, up to `max`
+  */
+static uint32_t backoff_time (uint32_t min, uint32_t max, uint16_t failures) {
+    uint32_t backoff = min;
+    for (uint16_t i = 1; i < failures && backoff < max; i++) {
+        backoff = backoff > max / 2 ? max : backoff * 2;
+    }
+    return backoff < max ? backoff : max;
+}
 
-auto constexpr CONFIG_FILE = "loraconfig.cfg";
-auto constexpr COUNTERS_FILE = "loracounters.cfg";
+/**
+  * @brief Gets join duty cycle window, as set by LoRaWAN retransmission back-off rules: 36 s of airtime in first
+  *        hour, 36 s in next 10 hours and 8.7 s every 24 hours after that
+  * @param elapsed Time since start of join, in milliseconds
+  * @param end Returns end of window, in milliseconds since start of join
+  * @param cap Returns airtime allowed in window, in milliseconds
+  * @return Window index
+  */
+static uint32_t join_duty_window (uint32_t elapsed, uint32_t* end, uint32_t* cap) {
+    if (elapsed < 3600000) {
+        *end = 3600000;
+        *cap = 36000;
+        return 0;
+    }
+    if (elapsed < 39600000) {
+        *end = 39600000;
+        *cap = 36000;
+        return 1;
+    }
+    uint32_t day = (elapsed - 39600000) / 86400000;
+    *end = 39600000 + (day + 1) * 86400000;
+    *cap = 8700;
+    return 2 + day;
+}
 
 void LoRaWAN::set_SPI_pins (int sck, int miso, int mosi, int cs) {
     spi_pins.sck = sck;
@@ -63,122 +186,259 @@ void LoRaWAN::set_SPI_pins (int sck, int miso, int mosi, int cs) {
 #endif
 }
 
-#if defined DEBUG_PORT && DEBUG_LORAWAN_LIB
-void printHex2 (unsigned v) {
-    v &= 0xff;
-    if (v < 16)
-        DEBUG_PORT.print ('0');
-    DEBUG_PORT.print (v, HEX);
-}
-#endif
-
 void LoRaWAN::on_lmic_rx (void* pUserData, uint8_t port, const uint8_t* pMessage, size_t nMessage) {
     LoRaWAN* instance = (LoRaWAN*)pUserData;
 
-#if defined DEBUG_PORT && DEBUG_LORAWAN_LIB
-    DEBUG_LORAWAN ("<------ Got data. Port: %u Length: %u --> ", port, nMessage);
-    for (size_t i = 0; i < nMessage; ++i) {
-        if (i != 0)
-            DEBUG_PORT.print ("-");
-        printHex2 (pMessage[i]);
+#if LORAWAN_LOG_LEVEL >= LORAWAN_LOG_LEVEL_DEBUG
+    // Only the first bytes are logged, to keep entry size constant
+    uint32_t head = 0;
+    for (size_t i = 0; i < 4; ++i) {
+        head = (head << 8) | (i < nMessage ? pMessage[i] : 0);
     }
-    DEBUG_PORT.println ();
+    DEBUG_LORAWAN ("<------ Got data. Port: %u Length: %u --> %08X...\n", port, nMessage, head);
 #endif
+    if (nMessage > MAX_LEN_PAYLOAD) {
+        nMessage = MAX_LEN_PAYLOAD;
+    }
+    instance->downlink_stats.received++;
+    lorawan_stats_count_port (instance->metrics, port);
+
+    // Reception metadata is only valid now
+    downlink_t* downlink;
+    downlink_t local;
+    if (instance->rx_deferred) {
+        if (instance->rx_queue_count >= LORAWAN_RX_QUEUE_SIZE) {
+            LORAWAN_LOG_WARN ("Downlink queue full. Message dropped\n");
+            instance->downlink_stats.dropped++;
+            return;
+        }
+        downlink = &instance->rx_queue[(instance->rx_queue_head + instance->rx_queue_count) % LORAWAN_RX_QUEUE_SIZE];
+    } else {
+        if (!instance->on_downlink_cb) {
+            // Nothing needs a copy
+            DEBUG_LORAWAN ("RX_DATA_CB\n");
+            if (instance->on_rx_data_cb) {
+                instance->on_rx_data_cb (port, pMessage, nMessage);
+            }
+            instance->downlink_stats.delivered++;
+            return;
+        }
+        downlink = &local;
+    }
+    memcpy (downlink->data, pMessage, nMessage);
+    downlink->len = nMessage;
+    downlink->port = port;
+    downlink->rssi = LMIC.rssi - LORAWAN_RSSI_OFFSET;
+    downlink->snr = LMIC.snr;
+    downlink->timestamp = millis ();
+
+    if (instance->rx_deferred) {
+        instance->rx_queue_count++;
+        if (instance->rx_queue_count > instance->downlink_stats.max_pending) {
+            instance->downlink_stats.max_pending = instance->rx_queue_count;
+        }
+    } else {
+        instance->deliver_downlink (*downlink);
+    }
+}
+
+void LoRaWAN::deliver_downlink (const downlink_t& downlink) {
     DEBUG_LORAWAN ("RX_DATA_CB\n");
-    if (instance->on_rx_data_cb) {
-        instance->on_rx_data_cb (port, pMessage, nMessage);
+    if (on_rx_data_cb) {
+        on_rx_data_cb (downlink.port, downlink.data, downlink.len);
+    }
+    if (on_downlink_cb) {
+        on_downlink_cb (downlink);
+    }
+    downlink_stats.delivered++;
+}
+
+void LoRaWAN::drain_downlinks () {
+    while (rx_queue_count) {
+        downlink_t* downlink = &rx_queue[rx_queue_head];
+        uint32_t latency = millis () - downlink->timestamp;
+        if (latency > downlink_stats.max_latency) {
+            downlink_stats.max_latency = latency;
+        }
+        deliver_downlink (*downlink);
+        // Slot is released after callback, so that payload is valid while it runs
+        LoRaTaskGuard guard (task);
+        rx_queue_head = (rx_queue_head + 1) % LORAWAN_RX_QUEUE_SIZE;
+        rx_queue_count--;
+    }
+}
+
+void LoRaWAN::notify_event (ev_t event, bool ack) {
+    if (!task.is_running ()) {
+        dispatch_event (event, ack);
+        return;
+    }
+    // Radio task holds lock here. Only events somebody listens to are queued
+    if (!(event == EV_JOINED && on_joined_cb) && !(event == EV_TXCOMPLETE && on_tx_complete_cb) &&
+        !(event < LORAWAN_EVENT_COUNT && event_subscribers[event])) {
+        return;
+    }
+    if (event_queue_count >= LORAWAN_EVENT_QUEUE_SIZE) {
+        LORAWAN_LOG_WARN ("Event queue full. Event %u dropped\n", (unsigned)event);
+        events_dropped++;
+        return;
+    }
+    queued_event_t* queued = &event_queue[(event_queue_head + event_queue_count) % LORAWAN_EVENT_QUEUE_SIZE];
+    queued->event = event;
+    queued->ack = ack;
+    event_queue_count++;
+}
+
+void LoRaWAN::dispatch_event (ev_t event, bool ack) {
+    if (event == EV_JOINED && on_joined_cb) {
+        // Session record is packed. Pass aligned copies
+        u4_t netid = session.netid;
+        devaddr_t devaddr = session.devaddr;
+        on_joined_cb (&netid, &devaddr, session.nwkKey, session.artKey);
+    } else if (event == EV_TXCOMPLETE && on_tx_complete_cb) {
+        DEBUG_LORAWAN ("TX_COMPLETE_CALLBACK\n");
+        on_tx_complete_cb (ack);
+    }
+    if (event < LORAWAN_EVENT_COUNT && event_subscribers[event]) {
+        event_subscribers[event] (event);
+    }
+}
+
+void LoRaWAN::drain_events () {
+    while (event_queue_count) {
+        queued_event_t queued;
+        {
+            LoRaTaskGuard guard (task);
+            queued = event_queue[event_queue_head];
+            event_queue_head = (event_queue_head + 1) % LORAWAN_EVENT_QUEUE_SIZE;
+            event_queue_count--;
+        }
+        dispatch_event (queued.event, queued.ack);
+    }
+}
+
+void LoRaWAN::report_uplink (const send_data_t& msg, bool delivered) {
+    if (!on_uplink_complete_cb) {
+        return;
+    }
+    uplink_result_t result;
+    result.handle = msg.handle;
+    result.delivered = delivered;
+    result.confirmed = msg.confirmed;
+    result.ack = delivered && msg.confirmed;
+    result.tries = msg.tries;
+    result.attempts = msg.attempts;
+    result.datarate = msg.datarate;
+    result.airtime_ms = msg.airtime_ms;
+    if (!task.is_running ()) {
+        on_uplink_complete_cb (result);
+        return;
+    }
+    // Radio task holds lock here
+    if (result_queue_count >= LORAWAN_EVENT_QUEUE_SIZE) {
+        LORAWAN_LOG_WARN ("Result queue full. Result of message %u dropped\n", msg.handle);
+        events_dropped++;
+        return;
+    }
+    result_queue[(result_queue_head + result_queue_count) % LORAWAN_EVENT_QUEUE_SIZE] = result;
+    result_queue_count++;
+}
+
+void LoRaWAN::drain_results () {
+    while (result_queue_count) {
+        uplink_result_t result;
+        {
+            LoRaTaskGuard guard (task);
+            result = result_queue[result_queue_head];
+            result_queue_head = (result_queue_head + 1) % LORAWAN_EVENT_QUEUE_SIZE;
+            result_queue_count--;
+        }
+        on_uplink_complete_cb (result);
     }
 }
 
 void LoRaWAN::on_event (void* pUserData, ev_t e) {
     LoRaWAN* instance = (LoRaWAN*)pUserData;
-    bool ack;
-    
+    bool ack = false;
+
+#if LORAWAN_LOG_LEVEL >= LORAWAN_LOG_LEVEL_DEBUG
+    // One log call for every event. EV_RXSTART is not logged, as it happens right before RX window
+    static const char* const event_names[LORAWAN_EVENT_COUNT] = {
+        NULL, "EV_SCAN_TIMEOUT\n", "EV_BEACON_FOUND\n", "EV_BEACON_MISSED\n", "EV_BEACON_TRACKED\n", "EV_JOINING\n",
+        "EV_JOINED\n", "EV_RFU1\n", "EV_JOIN_FAILED\n", "EV_REJOIN_FAILED\n",
+        "EV_TXCOMPLETE (includes waiting for RX windows)\n", "EV_LOST_TSYNC\n", "EV_RESET\n", "EV_RXCOMPLETE\n",
+        "EV_LINK_DEAD\n", "EV_LINK_ALIVE\n", "EV_SCAN_FOUND\n", "EV_TXSTART\n", "EV_TXCANCELED\n", NULL,
+        "EV_JOIN_TXCOMPLETE: no JoinAccept\n"
+    };
+    if (e >= LORAWAN_EVENT_COUNT) {
+        DEBUG_LORAWAN ("Unknown event: %u\n", (unsigned)e);
+    } else if (event_names[e]) {
+        lorawan_log.record (LORAWAN_LOG_LEVEL_DEBUG, event_names[e]);
+    }
+#endif
+
     switch (e) {
-    case EV_SCAN_TIMEOUT:
-        DEBUG_LORAWAN ("EV_SCAN_TIMEOUT\n");
-        break;
-    case EV_BEACON_FOUND:
-        DEBUG_LORAWAN ("EV_BEACON_FOUND\n");
-        break;
-    case EV_BEACON_MISSED:
-        DEBUG_LORAWAN ("EV_BEACON_MISSED\n");
-        break;
-    case EV_BEACON_TRACKED:
-        DEBUG_LORAWAN ("EV_BEACON_TRACKED\n");
-        break;
-    case EV_JOINING:
-        DEBUG_LORAWAN ("EV_JOINING\n");
-        break;
     case EV_JOINED:
-        DEBUG_LORAWAN ("EV_JOINED\n");
         {
+            instance->metrics.joins++;
+            instance->link.add (LMIC.rssi - LORAWAN_RSSI_OFFSET, LMIC.snr, LMIC.dndr, millis ());
+            if (instance->joining) {
+                instance->joining = false;
+                instance->join_pending = false;
+                instance->join_stats.time_ms = millis () - instance->join_started;
+                DEBUG_LORAWAN ("Join took %u requests, %u ms, %u ms airtime\n", instance->join_stats.attempts,
+                               instance->join_stats.time_ms, instance->join_stats.airtime_ms);
+            }
             instance->joined = true;
-            LMIC_getSessionKeys (
-                &instance->otaa_data.netid,
-                &instance->otaa_data.devaddr,
-                instance->otaa_data.nwkKey,
-                instance->otaa_data.artKey);
             instance->link_counters.up_counter = LMIC.seqnoUp;
             instance->link_counters.down_counter = LMIC.seqnoDn;
-#if defined DEBUG_PORT && DEBUG_LORAWAN_LIB
-            if (instance->save_session_data ()) {
-                DEBUG_LORAWAN ("Joined. Saved session keys\n");
-            }
-            DEBUG_LORAWAN ("netid: %d\n", &instance->otaa_data.netid);
-            DEBUG_LORAWAN ("devaddr: 0x%X\n", &instance->otaa_data.devaddr);
-            DEBUG_LORAWAN ("AppSKey: ");
-            for (size_t i = 0; i < sizeof (instance->otaa_data.artKey); ++i) {
-                if (i != 0)
-                    DEBUG_PORT.print ("-");
-                printHex2 (instance->otaa_data.artKey[i]);
+            // save_session_data gets session keys from LMIC
+            bool saved = instance->save_session_data ();
+            instance->save_counters ();
+            if (instance->rtc_resume) {
+                instance->rtc_save ();
             }
-            DEBUG_PORT.println ("");
-            DEBUG_LORAWAN ("NwkSKey: ");
-            for (size_t i = 0; i < sizeof (instance->otaa_data.nwkKey); ++i) {
-                if (i != 0)
-                    DEBUG_PORT.print ("-");
-                printHex2 (instance->otaa_data.nwkKey[i]);
+            if (saved) {
+                LORAWAN_LOG_INFO ("Joined. Saved session keys\n");
             }
-            DEBUG_PORT.println ();
+#if LORAWAN_LOG_LEVEL >= LORAWAN_LOG_LEVEL_DEBUG
+            DEBUG_LORAWAN ("netid: %d\n", instance->session.netid);
+            DEBUG_LORAWAN ("devaddr: 0x%X\n", instance->session.devaddr);
+            DEBUG_KEY ("AppSKey", instance->session.artKey);
+            DEBUG_KEY ("NwkSKey", instance->session.nwkKey);
 #endif
-            if (instance->on_joined_cb) {
-                instance->on_joined_cb (
-                    &instance->otaa_data.netid,
-                    &instance->otaa_data.devaddr,
-                    instance->otaa_data.nwkKey,
-                    instance->otaa_data.artKey);
-            }
+        }
+        // Messages sent while joining may be waiting for TX to be free
+        if (instance->tx_queue_count && !instance->tx_in_flight) {
+            os_setCallback (&instance->sendjob, do_send);
         }
         // Disable link check validation (automatically enabled
         // during join, but because slow data rates change max TX
     // size, we don't use it in this example.
         LMIC_setLinkCheckMode (0);
         break;
-    /*
-    || This event is defined but not used in the code. No
-    || point in wasting codespace on it.
-    ||
-    || case EV_RFU1:
-    ||     DEBUG_LORAWAN ("EV_RFU1\n");
-    ||     break;
-    */
     case EV_JOIN_FAILED:
-        DEBUG_LORAWAN ("EV_JOIN_FAILED\n");
         instance->joined = false;
+        instance->join_failed ();
+        break;
+    case EV_JOIN_TXCOMPLETE:
+        instance->join_failed ();
         break;
     case EV_REJOIN_FAILED:
-        DEBUG_LORAWAN ("EV_REJOIN_FAILED\n");
         instance->joined = false;
         break;
     case EV_TXCOMPLETE:
-        DEBUG_LORAWAN ("EV_TXCOMPLETE (includes waiting for RX windows)\n");
-        ack = false;
+        if (instance->rtc_resume) {
+            instance->rtc_save ();
+        }
         instance->save_counters ();
         if (LMIC.txrxFlags & TXRX_ACK) {
             DEBUG_LORAWAN ("Received ack\n");
             ack = true;
         }
+        if (LMIC.txrxFlags & (TXRX_DNW1 | TXRX_DNW2)) {
+            instance->link.add (LMIC.rssi - LORAWAN_RSSI_OFFSET, LMIC.snr, LMIC.dndr, millis ());
+        }
         // if (LMIC.dataLen) {
         //     // Data was received. Extract port number if any.
         //     DEBUG_LORAWAN ("Got data\n");
@@ -202,320 +462,1549 @@ void LoRaWAN::on_event (void* pUserData, ev_t e) {
         //         instance->on_rx_data_cb (bPort, data, LMIC.dataLen);
         //     }
         // }
-        DEBUG_LORAWAN ("TX_COMPLETE_CALLBACK\n");
-        if (instance->on_tx_complete_cb) {
-            instance->on_tx_complete_cb (ack);
+        // Drain next queued message, if any. An unconfirmed frame counts as delivered once it is transmitted
+        if (instance->tx_in_flight && instance->tx_queue_count) {
+            const send_data_t& msg = instance->tx_queue[instance->tx_queue_head];
+            bool delivered = !(LMIC.txrxFlags & TXRX_LENERR) && (ack || !msg.confirmed);
+            if (msg.confirmed && !(LMIC.txrxFlags & TXRX_LENERR)) {
+                ack ? instance->metrics.confirmed_acked++ : instance->metrics.confirmed_missed++;
+                if (!ack) {
+                    instance->link.miss ();
+                }
+            }
+            // Unacknowledged confirmed message may be kept for another try
+            if (delivered || (LMIC.txrxFlags & TXRX_LENERR) || !instance->retry_uplink ()) {
+                instance->tx_queue_pop (delivered);
+            }
+        } else {
+            instance->tx_queue_pop (false);
         }
         // Schedule next transmission
         //os_setTimedCallback (&sendjob, os_getTime () + sec2osticks (TX_INTERVAL), do_send);
     break;
-    case EV_LOST_TSYNC:
-        DEBUG_LORAWAN ("EV_LOST_TSYNC\n");
-        break;
-    case EV_RESET:
-        DEBUG_LORAWAN ("EV_RESET\n");
-        break;
-    case EV_RXCOMPLETE:
-        // data received in ping slot
-        DEBUG_LORAWAN ("EV_RXCOMPLETE\n");
-        break;
     case EV_LINK_DEAD:
-        DEBUG_LORAWAN ("EV_LINK_DEAD\n");
+        instance->metrics.link_dead++;
         instance->joined = false;
         break;
-    case EV_LINK_ALIVE:
-        DEBUG_LORAWAN ("EV_LINK_ALIVE\n");
-        break;
-    /*
-    || This event is defined but not used in the code. No
-    || point in wasting codespace on it.
-    ||
-    || case EV_SCAN_FOUND:
-    ||    DEBUG_LORAWAN ("EV_SCAN_FOUND\n"));
-    ||    break;
-    */
     case EV_TXSTART:
-        DEBUG_LORAWAN ("EV_TXSTART\n");
+        instance->account_airtime ();
         break;
     case EV_TXCANCELED:
-        DEBUG_LORAWAN ("EV_TXCANCELED\n");
-        break;
-    case EV_RXSTART:
-        /* do not print anything -- it wrecks timing */
-        break;
-    case EV_JOIN_TXCOMPLETE:
-        DEBUG_LORAWAN ("EV_JOIN_TXCOMPLETE: no JoinAccept\n");
+        if (instance->tx_in_flight) {
+            instance->tx_queue_dropped++;
+            instance->metrics.uplinks_dropped++;
+            instance->tx_queue_pop (false);
+        }
         break;
-
     default:
-        DEBUG_LORAWAN ("Unknown event: %u\n", (unsigned)e);
         break;
     }
+
+    instance->notify_event (e, ack);
 }
 
 void LoRaWAN::init_func (osjob_t* j) {
     // Reset the MAC state. Session and pending data transfers will be discarded.
     LMIC_reset ();
     lorawan.set_session_data ();
-    LMIC_startJoining ();
     DEBUG_LORAWAN ("Init func\n");
+    if (lorawan.joining) {
+        lorawan.join_next = millis () + random_between (0, lorawan.join_policy.start_jitter_ms);
+        join_wait_func (&lorawan.joinjob);
+    }
+}
+
+void LoRaWAN::start_join () {
+    uint8_t dr = join_stats.attempts ? join_stats.datarate : join_policy.first_dr;
+    join_start_dr = dr > join_policy.min_dr ? dr : join_policy.min_dr;
+    join_stats = join_stats_t ();
+    join_stats.datarate = join_start_dr;
+    join_failures = 0;
+    join_window = 0;
+    join_window_used = 0;
+    join_started = millis ();
+    joining = true;
+    join_pending = false;
+}
+
+void LoRaWAN::join_attempt () {
+    uint8_t dr = join_datarate ();
+    if (!LMIC_startJoining ()) {
+        // LMIC has a session already
+        joining = false;
+        return;
+    }
+    // Join request is sent from a LMIC job, so datarate can still be set
+    LMIC_setDrTxpow (dr, KEEP_TXPOW);
+    join_stats.datarate = dr;
+    join_pending = true;
+}
+
+uint8_t LoRaWAN::join_datarate () {
+    uint8_t per_dr = join_policy.attempts_per_dr ? join_policy.attempts_per_dr : 1;
+    uint8_t step = join_policy.dr_step ? join_policy.dr_step : 1;
+    // Number of datarates in sweep, from first one down to minimum
+    uint16_t span = (join_start_dr - join_policy.min_dr) / step + 1;
+    return join_start_dr - ((join_failures / per_dr) % span) * step;
+}
+
+void LoRaWAN::join_failed () {
+    if (!join_pending) {
+        return;
+    }
+    join_pending = false;
+    join_failures++;
+    // LMIC would retry on its own. It is stopped from a job, as it cannot be reset inside its event callback
+    os_setCallback (&joinjob, join_retry_func);
+}
+
+void LoRaWAN::join_retry_func (osjob_t* j) {
+    LMIC_reset ();
+    uint32_t wait = lorawan.join_wait ();
+    DEBUG_LORAWAN ("Join request not accepted. Next one at DR%u in %u ms\n", lorawan.join_datarate (), wait);
+    lorawan.join_next = millis () + wait;
+    join_wait_func (j);
+}
+
+void LoRaWAN::join_wait_func (osjob_t* j) {
+    long wait = (long)(lorawan.join_next - millis ());
+    if (wait > 0) {
+        os_setTimedCallback (j, os_getTime () + ms2osticks (wait < LORAWAN_MAX_JOB_WAIT ? wait : LORAWAN_MAX_JOB_WAIT), join_wait_func);
+        return;
+    }
+    lorawan.join_attempt ();
+}
+
+uint32_t LoRaWAN::join_wait () {
+    uint32_t now = millis ();
+    uint32_t backoff = backoff_time (join_policy.backoff_min_ms, join_policy.backoff_max_ms, join_failures);
+    uint32_t wait = random_between (backoff / 2, backoff);
+
+#if CFG_LMIC_EU_like
+    // LMIC_reset () forgets band duty cycle. Join requests go on 1% bands
+    uint32_t since = now - join_tx_time;
+    uint32_t duty = join_last_airtime * 99;
+    if (duty > since && duty - since > wait) {
+        wait = duty - since;
+    }
+#endif
+    // Aggregated join duty cycle. If next request does not fit in its window, it waits for next one
+    uint32_t airtime = osticks2ms (calcAirTime (updr2rps (join_datarate ()), LORAWAN_JOIN_REQUEST_SIZE));
+    uint32_t elapsed = now - join_started;
+    uint32_t end, cap;
+    uint32_t window = join_duty_window (elapsed + wait, &end, &cap);
+    uint32_t used = window == join_window ? join_window_used : 0;
+    if (used + airtime > cap) {
+        wait = end - elapsed;
+    }
+    return wait;
+}
+
+void LoRaWAN::rejoin () {
+    LoRaTaskGuard guard (task);
+
+    joined = false;
+    // Stored session is not valid anymore. Join statistics are kept, so that join starts at last datarate
+    session_from_lmic (LMIC);
+    session.devaddr = 0;
+    if (rtc_resume) {
+        rtc_store ();
+    }
+    if (file_system) {
+        write_session_record ();
+    }
+    // LMIC reset drops front message. It is handed again after join
+    tx_in_flight = false;
+    os_clearCallback (&joinjob);
+    start_join ();
+    os_setCallback (&initjob, init_func);
 }
 
 void LoRaWAN::set_session_data () {
-    //LMIC_setSession (otaa_data.netid, otaa_data.devaddr, otaa_data.nwkKey, otaa_data.artKey);
-    if (otaa_data.devaddr != 0) {
+    if (session.devaddr != 0) {
         joined = true;
-        otaa_data.client = LMIC.client; // Need to restore pointer so that they do not break after code editing
-        otaa_data.osjob = LMIC.osjob;
+        LMIC_setSession (session.netid, session.devaddr, session.nwkKey, session.artKey);
 
-        LMIC = otaa_data;
+        LMIC.datarate = session.datarate;
+        LMIC.adrTxPow = session.adrTxPow;
+        LMIC.adrEnabled = session.adrEnabled;
+        LMIC.adrAckReq = session.adrAckReq;
+        LMIC.rx1DrOffset = session.rx1DrOffset;
+        LMIC.dn2Dr = session.dn2Dr;
+        LMIC.dn2Freq = session.dn2Freq;
+        LMIC.rxDelay = session.rxDelay;
+        LMIC.globalDutyRate = session.globalDutyRate;
+        // Stored wait times are rebased onto current LMIC time, discounting time spent off
+        ostime_t now = os_getTime ();
+        uint64_t elapsed_ms = session_elapsed_time ();
+        LMIC.globalDutyAvail = rebase_wait (now, session.globalDutyAvail, elapsed_ms);
+#if CFG_LMIC_EU_like
+        for (int i = 0; i < MAX_BANDS; i++) {
+            LMIC.bands[i].txcap = session.bands[i].txcap;
+            LMIC.bands[i].txpow = session.bands[i].txpow;
+            LMIC.bands[i].lastchnl = session.bands[i].lastchnl;
+            LMIC.bands[i].avail = rebase_wait (now, session.bands[i].avail, elapsed_ms);
+        }
+        memcpy (LMIC.channelFreq, session.channelFreq, sizeof (LMIC.channelFreq));
+        memcpy (LMIC.channelDrMap, session.channelDrMap, sizeof (LMIC.channelDrMap));
+        LMIC.channelMap = session.channelMap;
+#elif CFG_LMIC_US_like
+        memcpy (LMIC.channelMap, session.channelMap, sizeof (LMIC.channelMap));
+        LMIC.activeChannels125khz = session.activeChannels125khz;
+        LMIC.activeChannels500khz = session.activeChannels500khz;
+#endif
 
-        LMIC.seqnoUp = link_counters.up_counter;
+        // Stored uplink counter is beyond any value used before reboot, including reserved ones. RTC memory keeps
+        // exact one
+        LMIC.seqnoUp = rtc_resumed ? rtc_snapshot.up_counter : link_counters.up_counter;
         LMIC.seqnoDn = link_counters.down_counter;
     }
 }
 
-bool LoRaWAN::get_session_data () {
-    File configFile;
-    File countersFile;
+void LoRaWAN::session_from_lmic (const lmic_t& lmic) {
+    memset (&session, 0, sizeof (session));
+    session.magic = SESSION_RECORD_MAGIC;
+    session.version = SESSION_RECORD_VERSION;
+    session.length = offsetof (session_record_t, crc);
+    session.netid = lmic.netid;
+    session.devaddr = lmic.devaddr;
+    memcpy (session.nwkKey, lmic.nwkKey, sizeof (session.nwkKey));
+    memcpy (session.artKey, lmic.artKey, sizeof (session.artKey));
+    session.datarate = lmic.datarate;
+    session.adrTxPow = lmic.adrTxPow;
+    session.adrEnabled = lmic.adrEnabled;
+    session.adrAckReq = lmic.adrAckReq;
+    session.rx1DrOffset = lmic.rx1DrOffset;
+    session.dn2Dr = lmic.dn2Dr;
+    session.dn2Freq = lmic.dn2Freq;
+    session.rxDelay = lmic.rxDelay;
+    session.globalDutyRate = lmic.globalDutyRate;
+    session.globalDutyAvail = lmic.globalDutyAvail;
+#if CFG_LMIC_EU_like
+    for (int i = 0; i < MAX_BANDS; i++) {
+        session.bands[i].txcap = lmic.bands[i].txcap;
+        session.bands[i].txpow = lmic.bands[i].txpow;
+        session.bands[i].lastchnl = lmic.bands[i].lastchnl;
+        session.bands[i].avail = lmic.bands[i].avail;
+    }
+    memcpy (session.channelFreq, lmic.channelFreq, sizeof (session.channelFreq));
+    memcpy (session.channelDrMap, lmic.channelDrMap, sizeof (session.channelDrMap));
+    session.channelMap = lmic.channelMap;
+#elif CFG_LMIC_US_like
+    memcpy (session.channelMap, lmic.channelMap, sizeof (session.channelMap));
+    session.activeChannels125khz = lmic.activeChannels125khz;
+    session.activeChannels500khz = lmic.activeChannels500khz;
+#endif
+    session.join_dr = join_stats.datarate;
+    session.join_attempts = join_stats.attempts;
+    session.join_time_ms = join_stats.time_ms;
+    session.join_airtime_ms = join_stats.airtime_ms;
+    fair_use.save (millis (), &session.fair_use);
+}
 
-    if (!file_system) {
-        DEBUG_LORAWAN ("No FS present\n");
+bool LoRaWAN::load_session_record (const uint8_t* buffer, size_t size) {
+    session_record_t record;
+    uint32_t crc;
+
+    if (size < offsetof (session_record_t, netid) + sizeof (crc)) {
+        DEBUG_LORAWAN ("Session file too short: %u bytes\n", size);
         return false;
     }
-    // if (!file_system->begin ()) {
-    //     DEBUG_LORAWAN ("Error starting FS\n");
-    //     return false;
-    // }
-    if (!file_system->exists (CONFIG_FILE) || !file_system->exists (COUNTERS_FILE)) {
-        DEBUG_LORAWAN ("Cannot find config file\n");
+    memcpy (&record, buffer, offsetof (session_record_t, netid));
+    if (record.magic != SESSION_RECORD_MAGIC) {
+        DEBUG_LORAWAN ("Wrong session file signature\n");
         return false;
     }
-    configFile = file_system->open (CONFIG_FILE, "r");
-    countersFile = file_system->open (COUNTERS_FILE, "r");
-    if (!configFile || !countersFile) {
-        DEBUG_LORAWAN ("Error opening config file\n");
+    if (record.version > SESSION_RECORD_VERSION) {
+        DEBUG_LORAWAN ("Unsupported session file version: %u\n", record.version);
         return false;
     }
-    size_t file_size = configFile.size ();
-    if (file_size != sizeof (otaa_data)) {
-        DEBUG_LORAWAN ("Wrong config file size: %u bytes. Should be %u\n", file_size, sizeof (otaa_data));
-        configFile.close ();
+    if (record.length < offsetof (session_record_t, netid) || record.length + sizeof (crc) > size) {
+        DEBUG_LORAWAN ("Wrong session record length: %u\n", record.length);
         return false;
     }
-    file_size = countersFile.size ();
-    if (file_size != sizeof (link_counters_t)) {
-        DEBUG_LORAWAN ("Wrong counters file size: %u bytes. Should be %u\n", file_size, sizeof (link_counters_t));
-        configFile.close ();
+    memcpy (&crc, buffer + record.length, sizeof (crc));
+    if (crc != lorawan_crc32 (buffer, record.length)) {
+        LORAWAN_LOG_WARN ("Session file CRC error\n");
         return false;
     }
 
-    size_t bytes_read = configFile.readBytes ((char*)&otaa_data, sizeof (otaa_data));
-    configFile.close ();
+    // Fields added after record version are left zeroed
+    size_t length = record.length < offsetof (session_record_t, crc) ? record.length : offsetof (session_record_t, crc);
+    memset (&record, 0, sizeof (record));
+    memcpy (&record, buffer, length);
+    // Migrations from older record versions go here. Version 1 lacks save time, which is left as unknown (0).
+    // Version 2 lacks join statistics, also left as unknown. Version 3 lacks fair use window, which starts empty
+    record.version = SESSION_RECORD_VERSION;
+    record.length = offsetof (session_record_t, crc);
+    session = record;
+    return true;
+}
 
-    if (bytes_read != sizeof (otaa_data)) {
-        DEBUG_LORAWAN ("Wrong config data length: %u bytes. Should be %u\n", bytes_read, sizeof (otaa_data));
+bool LoRaWAN::migrate_legacy_session (File& configFile) {
+    lmic_t* legacy = new lmic_t;
+    if (!legacy) {
         return false;
     }
-
-    bytes_read = countersFile.readBytes ((char*)&link_counters, sizeof (link_counters_t));
-    countersFile.close ();
-
-    if (bytes_read != sizeof (link_counters_t)) {
-        DEBUG_LORAWAN ("Wrong counters data length: %u bytes. Should be %u\n", bytes_read, sizeof (link_counters_t));
+    size_t bytes_read = configFile.readBytes ((char*)legacy, sizeof (lmic_t));
+    if (bytes_read == sizeof (lmic_t)) {
+        session_from_lmic (*legacy);
+        // Times in a raw dump belong to a previous boot and cannot be rebased
+#if CFG_LMIC_EU_like
+        for (int i = 0; i < MAX_BANDS; i++) {
+            session.bands[i].avail = 0;
+        }
+#endif
+        session.globalDutyAvail = 0;
+    }
+    delete legacy;
+    if (bytes_read != sizeof (lmic_t)) {
+        DEBUG_LORAWAN ("Wrong legacy config data length: %u bytes. Should be %u\n", bytes_read, sizeof (lmic_t));
         return false;
     }
-
-#if defined DEBUG_PORT && DEBUG_LORAWAN_LIB
-    DEBUG_LORAWAN ("------------------\n");
-    DEBUG_LORAWAN ("Config file read\n");
-    DEBUG_LORAWAN ("netid: %d\n", otaa_data.netid);
-    DEBUG_LORAWAN ("devaddr: 0x%X\n", otaa_data.devaddr);
-    DEBUG_LORAWAN ("AppSKey: ");
-    for (size_t i = 0; i < 16; ++i) {
-        if (i != 0)
-            DEBUG_PORT.print ("-");
-        printHex2 (otaa_data.artKey[i]);
-    }
-    DEBUG_PORT.println ("");
-    DEBUG_LORAWAN ("NwkSKey: ");
-    for (size_t i = 0; i < 16; ++i) {
-        if (i != 0)
-            DEBUG_PORT.print ("-");
-        printHex2 (otaa_data.nwkKey[i]);
-    }
-    DEBUG_PORT.println ();
-    DEBUG_LORAWAN ("Up counter: %u\n", link_counters.up_counter);
-    DEBUG_LORAWAN ("Down counter: %u\n", link_counters.down_counter);
-    DEBUG_LORAWAN ("------------------\n");
-#endif
-    
     return true;
 }
 
-bool LoRaWAN::save_counters () {
-    File countersFile;
-    if (!file_system) {
-        DEBUG_LORAWAN ("No FS present\n");
-        return false;
+bool LoRaWAN::begin_storage () {
+    if (storage_ready) {
+        return true;
     }
-    // if (!file_system->begin ()) {
-    //     DEBUG_LORAWAN ("Error starting FS\n");
-    //     return false;
-    // }
-    countersFile = file_system->open (COUNTERS_FILE, "w");
-    if (!countersFile) {
-        DEBUG_LORAWAN ("Error opening counters file\n");
+    if (!file_system) {
         return false;
     }
-    link_counters.up_counter = LMIC.seqnoUp;
-    link_counters.down_counter = LMIC.seqnoDn;
-
-    size_t bytes_written = countersFile.write ((uint8_t*)&link_counters, sizeof (link_counters));
-    countersFile.flush ();
-    countersFile.close ();
-
-    if (bytes_written != sizeof (link_counters)) {
-        DEBUG_LORAWAN ("Wrong file size: %u bytes. Should be %u\n", bytes_written, sizeof (link_counters));
-        return false;
+    if (storage_mode == STORAGE_JOURNAL) {
+        session_journal.begin (file_system, SESSION_JOURNAL_FILE, SESSION_JOURNAL_RECORD_SIZE, LORAWAN_SESSION_JOURNAL_SLOTS);
+        counters_journal.begin (file_system, COUNTERS_JOURNAL_FILE, COUNTERS_JOURNAL_RECORD_SIZE, LORAWAN_COUNTERS_JOURNAL_SLOTS);
     } else {
-        DEBUG_LORAWAN ("------------------------\n");
-        DEBUG_LORAWAN ("Counters file written: %u bytes\n", bytes_written);
-        DEBUG_LORAWAN ("Up counter: %u\n", link_counters.up_counter);
-        DEBUG_LORAWAN ("Down counter: %u\n", link_counters.down_counter);
-        DEBUG_LORAWAN ("------------------------\n");
+        session_slots.begin (file_system, CONFIG_FILE, CONFIG_FILE_B);
+        counters_slots.begin (file_system, COUNTERS_FILE, COUNTERS_FILE_B);
     }
-
+    storage_ready = true;
     return true;
+}
 
+bool LoRaWAN::rtc_load () {
+#if defined ESP8266
+    if (!ESP.rtcUserMemoryRead (LORAWAN_RTC_USER_MEMORY_OFFSET, (uint32_t*)&rtc_snapshot, sizeof (rtc_snapshot))) {
+        return false;
+    }
+#endif
+    if (rtc_snapshot.magic != RTC_SNAPSHOT_MAGIC ||
+        rtc_snapshot.crc != lorawan_crc32 (&rtc_snapshot, offsetof (rtc_snapshot_t, crc))) {
+        DEBUG_LORAWAN ("No valid session in RTC memory\n");
+        return false;
+    }
+    if (!load_session_record ((uint8_t*)&rtc_snapshot.session, sizeof (rtc_snapshot.session))) {
+        return false;
+    }
+    // Counters keep value stored in filesystem, so that uplinks inside reserved block do not write it again.
+    // Exact counter goes to LMIC in set_session_data ()
+    link_counters.up_counter = rtc_snapshot.stored_up_counter;
+    link_counters.down_counter = rtc_snapshot.down_counter;
+    DEBUG_LORAWAN ("Session restored from RTC memory. Up counter: %u\n", rtc_snapshot.up_counter);
     return true;
 }
 
-void LoRaWAN::calculate_duty_cycle () {
-    // unsigned long now = millis ();
-// #if defined(CFG_LMIC_EU_like)
-//     for (int i = 0; i < MAX_BANDS; i++) {
-//         ostime_t correctedAvail = otaa_data.bands[i].avail - ((now / 1000.0 + deepsleep_sec) * OSTICKS_PER_SEC);
-//         if (correctedAvail < 0) {
-//             correctedAvail = 0;
-//         }
-//         otaa_data.bands[i].avail = correctedAvail;
-//     }
-
-//     otaa_data.globalDutyAvail = otaa_data.globalDutyAvail - ((now / 1000.0 + deepsleep_sec) * OSTICKS_PER_SEC);
-//     if (otaa_data.globalDutyAvail < 0) {
-//         otaa_data.globalDutyAvail = 0;
-//     }
-// #else
-//     DEBUG_LORAWAN ("No DutyCycle recalculation function!\n")
-// #endif
-#if CFG_LMIC_EU_like
-    for (int i = 0; i < MAX_BANDS; i++) {
-        otaa_data.bands[i].avail = 0;
+void LoRaWAN::rtc_save () {
+    session_from_lmic (LMIC);
+    calculate_duty_cycle ();
+    if (++rtc_snapshot.cycles >= rtc_fs_save_cycles) {
+        if (write_session_record ()) {
+            rtc_snapshot.cycles = 0;
+        }
     }
+    rtc_store ();
+}
+
+void LoRaWAN::rtc_store () {
+    session.crc = lorawan_crc32 (&session, offsetof (session_record_t, crc));
+    rtc_snapshot.magic = RTC_SNAPSHOT_MAGIC;
+    rtc_snapshot.session = session;
+    rtc_snapshot.up_counter = LMIC.seqnoUp;
+    rtc_snapshot.stored_up_counter = link_counters.up_counter;
+    rtc_snapshot.down_counter = LMIC.seqnoDn;
+    rtc_snapshot.crc = lorawan_crc32 (&rtc_snapshot, offsetof (rtc_snapshot_t, crc));
+#if defined ESP8266
+    ESP.rtcUserMemoryWrite (LORAWAN_RTC_USER_MEMORY_OFFSET, (uint32_t*)&rtc_snapshot, sizeof (rtc_snapshot));
 #endif
-    otaa_data.globalDutyAvail = 0;
 }
 
-bool LoRaWAN::save_session_data () {
-    File configFile;
+bool LoRaWAN::prepare_sleep (uint32_t sleep_ms) {
+    LoRaTaskGuard guard (task);
 
-    if (!file_system) {
-        DEBUG_LORAWAN ("No FS present\n");
-        return false;
+    if (backlog_enabled && !backlog.flush ()) {
+        LORAWAN_LOG_WARN ("Cannot write backlog file\n");
     }
-    // if (!file_system->begin ()) {
-    //     DEBUG_LORAWAN ("Error starting FS\n");
-    //     return false;
-    // }
-    configFile = file_system->open (CONFIG_FILE, "w");
-    if (!configFile) {
-        DEBUG_LORAWAN ("Error opening config file\n");
+    if (!joined || LMIC.devaddr == 0) {
         return false;
     }
-    otaa_data = LMIC;
+    session_from_lmic (LMIC);
     calculate_duty_cycle ();
-    
-    size_t bytes_written = configFile.write ((uint8_t*)&otaa_data, sizeof (otaa_data));
-    if (bytes_written != sizeof (otaa_data)) {
-        DEBUG_LORAWAN ("Wrong file size: %u bytes. Should be %u\n", bytes_written, sizeof (otaa_data));
-        configFile.close ();
-        return false;
-    } else {
-#if defined DEBUG_PORT && DEBUG_LORAWAN_LIB
-        DEBUG_LORAWAN ("------------------------\n");
-        DEBUG_LORAWAN ("Config file written: %u bytes\n", bytes_written);
-        DEBUG_LORAWAN ("netid: %d\n", otaa_data.netid);
-        DEBUG_LORAWAN ("devaddr: 0x%X\n", otaa_data.devaddr);
-        DEBUG_LORAWAN ("AppSKey: ");
-        for (size_t i = 0; i < 16; ++i) {
-            if (i != 0)
-                DEBUG_PORT.print ("-");
-            printHex2 (otaa_data.artKey[i]);
-        }
-        DEBUG_PORT.println ("");
-        DEBUG_LORAWAN ("NwkSKey: ");
-        for (size_t i = 0; i < 16; ++i) {
-            if (i != 0)
-                DEBUG_PORT.print ("-");
-            printHex2 (otaa_data.nwkKey[i]);
-        }
-        DEBUG_PORT.println ();
-        DEBUG_LORAWAN ("------------------------\n");
-#endif
+    session.sleep_ms = sleep_ms;
+    if (rtc_resume) {
+        rtc_store ();
+        return true;
     }
-    configFile.flush ();
-    configFile.close ();
-
-    return true;
+    bool result = write_session_record ();
+    return save_counters () && result;
 }
 
-void LoRaWAN::init () {
-    // LMIC init
-    os_init ();
-    LMIC_registerEventCb (on_event, this);
-    LMIC_registerRxMessageCb (on_lmic_rx, this);
-    os_setCallback (&initjob, init_func);
-    
-    if (get_session_data ()) {
-        //LMIC_setSession (otaa_data.netid, otaa_data.devaddr, otaa_data.nwkKey, otaa_data.artKey);
-        //LMIC_setSeqnoUp (link_counters.up_counter);
-        //LMIC.seqnoDn = link_counters.down_counter;
-        DEBUG_LORAWAN ("Got session keys from file\n");
+bool LoRaWAN::read_session_files () {
+    if (storage_mode == STORAGE_JOURNAL) {
+        // Journal is empty. Files are only read to move a session from them
+        session_slots.begin (file_system, CONFIG_FILE, CONFIG_FILE_B);
+        counters_slots.begin (file_system, COUNTERS_FILE, COUNTERS_FILE_B);
+    }
+    if (!session_slots.has_record () || !counters_slots.has_record ()) {
+        if (!read_legacy_files ()) {
+            return false;
+        }
+        if (storage_mode == STORAGE_FILES) {
+            LORAWAN_LOG_INFO ("Session files converted to A/B slots\n");
+            write_session_record ();
+            counters_slots.write (&link_counters, sizeof (link_counters));
+        }
+        return true;
     }
-}
 
-void LoRaWAN::do_send (osjob_t* j) {
-    //lmic_tx_error_t result = LMIC_ERROR_TX_FAILED;
+    uint8_t buffer[sizeof (session_record_t)];
+    size_t len = session_slots.read_latest (buffer, sizeof (buffer));
+    if (!load_session_record (buffer, len < sizeof (buffer) ? len : sizeof (buffer))) {
+        return false;
+    }
+    if (counters_slots.read_latest (&link_counters, sizeof (link_counters)) != sizeof (link_counters)) {
+        DEBUG_LORAWAN ("Wrong counters record length\n");
+        return false;
+    }
+    if (counters_slots.recovered ()) {
+        // Uplinks sent after intact copy was written must not reuse their counters
+        LORAWAN_LOG_WARN ("Last counters write did not complete. Uplink counter advanced\n");
+        link_counters.up_counter += LORAWAN_COUNTER_RECOVERY_GAP;
+    }
+    return true;
+}
 
-    if (LMIC.opmode & OP_TXRXPEND) {
-        DEBUG_LORAWAN ("OP_TXRXPEND, not sending\n");
+bool LoRaWAN::read_legacy_files () {
+    File configFile;
+    File countersFile;
+
+    if (!file_system->exists (CONFIG_FILE) || !file_system->exists (COUNTERS_FILE)) {
+        DEBUG_LORAWAN ("Cannot find config file\n");
+        return false;
+    }
+    configFile = file_system->open (CONFIG_FILE, "r");
+    countersFile = file_system->open (COUNTERS_FILE, "r");
+    if (!configFile || !countersFile) {
+        LORAWAN_LOG_ERROR ("Error opening config file\n");
+        return false;
+    }
+    size_t file_size = configFile.size ();
+    bool legacy = false;
+    if (file_size == sizeof (lmic_t)) {
+        // Written by a previous library version. Only usable if LMIC has not changed since then
+        if (!migrate_legacy_session (configFile)) {
+            configFile.close ();
+            countersFile.close ();
+            return false;
+        }
+        legacy = true;
     } else {
+        uint8_t buffer[sizeof (session_record_t)];
+        size_t bytes_read = configFile.readBytes ((char*)buffer, sizeof (buffer));
+        if (!load_session_record (buffer, bytes_read)) {
+            configFile.close ();
+            countersFile.close ();
+            return false;
+        }
+    }
+    configFile.close ();
+
+    file_size = countersFile.size ();
+    if (file_size != sizeof (link_counters_t)) {
+        DEBUG_LORAWAN ("Wrong counters file size: %u bytes. Should be %u\n", file_size, sizeof (link_counters_t));
+        countersFile.close ();
+        return false;
+    }
+
+    size_t bytes_read = countersFile.readBytes ((char*)&link_counters, sizeof (link_counters_t));
+    countersFile.close ();
+
+    if (bytes_read != sizeof (link_counters_t)) {
+        DEBUG_LORAWAN ("Wrong counters data length: %u bytes. Should be %u\n", bytes_read, sizeof (link_counters_t));
+        return false;
+    }
+
+    if (legacy) {
+        LORAWAN_LOG_INFO ("Legacy session file converted\n");
+    }
+    return true;
+}
+
+bool LoRaWAN::read_session_journal () {
+    uint8_t buffer[sizeof (session_record_t)];
+    link_counters_t counters;
+
+    if (!session_journal.read_latest (buffer, sizeof (buffer)) || !counters_journal.read_latest (&counters, sizeof (counters))) {
+        DEBUG_LORAWAN ("No valid records in journal\n");
+        return false;
+    }
+    if (!load_session_record (buffer, sizeof (buffer))) {
+        return false;
+    }
+    link_counters = counters;
+    return true;
+}
+
+bool LoRaWAN::get_session_data () {
+    if (!file_system) {
+        LORAWAN_LOG_WARN ("No FS present\n");
+        return false;
+    }
+    // if (!file_system->begin ()) {
+    //     DEBUG_LORAWAN ("Error starting FS\n");
+    //     return false;
+    // }
+    if (storage_mode == STORAGE_JOURNAL) {
+        begin_storage ();
+        if (!read_session_journal ()) {
+            if (!read_session_files ()) {
+                return false;
+            }
+            // Move session to journal
+            LORAWAN_LOG_INFO ("Session moved from files to journal\n");
+            write_session_record ();
+            counters_journal.append (&link_counters, sizeof (link_counters));
+        }
+    } else if (!begin_storage () || !read_session_files ()) {
+        return false;
+    }
+
+#if LORAWAN_LOG_LEVEL >= LORAWAN_LOG_LEVEL_DEBUG
+    DEBUG_LORAWAN ("------------------\n");
+    DEBUG_LORAWAN ("Config file read\n");
+    DEBUG_LORAWAN ("netid: %d\n", session.netid);
+    DEBUG_LORAWAN ("devaddr: 0x%X\n", session.devaddr);
+    DEBUG_KEY ("AppSKey", session.artKey);
+    DEBUG_KEY ("NwkSKey", session.nwkKey);
+    DEBUG_LORAWAN ("Up counter: %u\n", link_counters.up_counter);
+    DEBUG_LORAWAN ("Down counter: %u\n", link_counters.down_counter);
+    DEBUG_LORAWAN ("------------------\n");
+#endif
+    
+    return true;
+}
+
+bool LoRaWAN::save_counters () {
+    if (!file_system) {
+        LORAWAN_LOG_WARN ("No FS present\n");
+        return false;
+    }
+    // if (!file_system->begin ()) {
+    //     DEBUG_LORAWAN ("Error starting FS\n");
+    //     return false;
+    // }
+    uint16_t reservation = counter_reservation;
+    if (rtc_resume && reservation < rtc_fs_save_cycles) {
+        // Stored counters have to cover all uplinks done between filesystem saves
+        reservation = rtc_fs_save_cycles;
+    }
+    if (reservation && LMIC.seqnoUp < link_counters.up_counter && LMIC.seqnoDn == link_counters.down_counter) {
+        // Stored value is still ahead of current counter. No need to write
+        persistence_stats.counter_writes_avoided++;
+        return true;
+    }
+    link_counters.up_counter = LMIC.seqnoUp + reservation;
+    link_counters.down_counter = LMIC.seqnoDn;
+
+    uint32_t start = micros ();
+    size_t bytes_written;
+    if (storage_mode == STORAGE_JOURNAL) {
+        begin_storage ();
+        bytes_written = counters_journal.append (&link_counters, sizeof (link_counters)) ? sizeof (link_counters) : 0;
+    } else {
+        begin_storage ();
+        bytes_written = counters_slots.write (&link_counters, sizeof (link_counters)) ? sizeof (link_counters) : 0;
+    }
+    persistence_stats.counter_writes++;
+    metrics.counters_writes++;
+    metrics.counters_bytes += bytes_written;
+    metrics.counters_write_us.add (micros () - start);
+
+    if (bytes_written != sizeof (link_counters)) {
+        LORAWAN_LOG_ERROR ("Wrong file size: %u bytes. Should be %u\n", bytes_written, sizeof (link_counters));
+        link_counters.up_counter = LMIC.seqnoUp; // Reserved block was not stored. Retry on next uplink
+        return false;
+    } else {
+        DEBUG_LORAWAN ("------------------------\n");
+        DEBUG_LORAWAN ("Counters file written: %u bytes\n", bytes_written);
+        DEBUG_LORAWAN ("Up counter: %u\n", link_counters.up_counter);
+        DEBUG_LORAWAN ("Down counter: %u\n", link_counters.down_counter);
+        DEBUG_LORAWAN ("------------------------\n");
+    }
+
+    return true;
+}
+
+void LoRaWAN::calculate_duty_cycle () {
+    ostime_t now = os_getTime ();
+    ostime_t remaining;
+
+#if CFG_LMIC_EU_like
+    for (int i = 0; i < MAX_BANDS; i++) {
+        remaining = session.bands[i].avail - now;
+        session.bands[i].avail = remaining > 0 ? remaining : 0;
+    }
+#endif
+    remaining = session.globalDutyAvail - now;
+    session.globalDutyAvail = remaining > 0 ? remaining : 0;
+    session.saved_clock = wall_clock ();
+}
+
+uint64_t LoRaWAN::session_elapsed_time () {
+    u4_t clock = wall_clock ();
+
+    if (session.saved_clock && clock >= session.saved_clock) {
+        // Clock has 1 second resolution. Do not count an incomplete second
+        u4_t elapsed_s = clock - session.saved_clock;
+        return elapsed_s ? (uint64_t)(elapsed_s - 1) * 1000 : 0;
+    }
+    if (session.sleep_ms && woke_from_deep_sleep ()) {
+        return session.sleep_ms;
+    }
+    return 0;
+}
+
+bool LoRaWAN::save_session_data () {
+    session_from_lmic (LMIC);
+    calculate_duty_cycle ();
+    return write_session_record ();
+}
+
+bool LoRaWAN::write_session_record () {
+    if (!file_system) {
+        LORAWAN_LOG_WARN ("No FS present\n");
+        return false;
+    }
+    // if (!file_system->begin ()) {
+    //     DEBUG_LORAWAN ("Error starting FS\n");
+    //     return false;
+    // }
+    session.crc = lorawan_crc32 (&session, offsetof (session_record_t, crc));
+
+    uint32_t start = micros ();
+    size_t bytes_written;
+    if (storage_mode == STORAGE_JOURNAL) {
+        begin_storage ();
+        bytes_written = session_journal.append (&session, sizeof (session)) ? sizeof (session) : 0;
+    } else {
+        begin_storage ();
+        bytes_written = session_slots.write (&session, sizeof (session)) ? sizeof (session) : 0;
+    }
+    metrics.session_writes++;
+    metrics.session_bytes += bytes_written;
+    metrics.session_write_us.add (micros () - start);
+
+    if (bytes_written != sizeof (session)) {
+        LORAWAN_LOG_ERROR ("Wrong file size: %u bytes. Should be %u\n", bytes_written, sizeof (session));
+        return false;
+    } else {
+#if LORAWAN_LOG_LEVEL >= LORAWAN_LOG_LEVEL_DEBUG
+        DEBUG_LORAWAN ("------------------------\n");
+        DEBUG_LORAWAN ("Config file written: %u bytes\n", bytes_written);
+        DEBUG_LORAWAN ("netid: %d\n", session.netid);
+        DEBUG_LORAWAN ("devaddr: 0x%X\n", session.devaddr);
+        DEBUG_KEY ("AppSKey", session.artKey);
+        DEBUG_KEY ("NwkSKey", session.nwkKey);
+        DEBUG_LORAWAN ("------------------------\n");
+#endif
+    }
+
+    return true;
+}
+
+void LoRaWAN::init () {
+    if (!fair_use_budget) {
+        fair_use.begin (LORAWAN_FAIR_USE_WINDOW);
+    }
+#if CFG_LMIC_EU_like
+    for (uint8_t band = 0; band < MAX_BANDS; band++) {
+        band_airtime[band].begin (LORAWAN_BAND_DUTY_WINDOW);
+    }
+#endif
+
+    // LMIC init
+    os_init ();
+    LMIC_registerEventCb (on_event, this);
+    LMIC_registerRxMessageCb (on_lmic_rx, this);
+    os_setCallback (&initjob, init_func);
+
+    rtc_resumed = rtc_resume && rtc_load ();
+    if (rtc_resumed) {
+        LORAWAN_LOG_INFO ("Got session keys from RTC memory\n");
+    } else if (get_session_data ()) {
+        LORAWAN_LOG_INFO ("Got session keys from file\n");
+    }
+    // Outcome of last join is kept even if session is not, so that join starts at the datarate that worked
+    join_stats.attempts = session.join_attempts;
+    join_stats.time_ms = session.join_time_ms;
+    join_stats.airtime_ms = session.join_airtime_ms;
+    join_stats.datarate = session.join_dr;
+    // Airtime used before sleep still counts, minus what left the window meanwhile
+    fair_use.restore (millis (), session.fair_use, session_elapsed_time ());
+    if (session.devaddr == 0) {
+        start_join ();
+    }
+
+    if (task_mode) {
+        // Downlinks are copied by radio task and delivered from loop ()
+        rx_deferred = true;
+#if LORAWAN_LOG_LEVEL > LORAWAN_LOG_LEVEL_NONE
+        // Application logs too, from loop () and callbacks
+        lorawan_log.set_task (&task);
+#endif
+        if (!task.start (radio_task, this, task_core, task_priority)) {
+            LORAWAN_LOG_ERROR ("Radio task not started. LMIC runs from loop ()\n");
+        }
+    }
+}
+
+bool LoRaWAN::set_task_mode (bool enable, int core, uint8_t priority) {
+#if LORAWAN_TASK_SUPPORTED
+    if (!enable && task.is_running ()) {
+        task.stop ();
+    }
+    task_mode = enable;
+    task_core = core;
+    task_priority = priority;
+    return true;
+#else
+    return !enable;
+#endif
+}
+
+void LoRaWAN::radio_task (void* arg) {
+    LoRaWAN* instance = (LoRaWAN*)arg;
+
+    while (!instance->task.is_stopping ()) {
+        instance->task.lock ();
+        instance->radio_loop ();
+        uint32_t wait = instance->radio_idle_time ();
+        if ((LMIC.opmode & OP_TXRXPEND) && wait > LORAWAN_IDLE_RADIO_POLL) {
+            // LMIC polls DIO lines while radio is busy
+            wait = LORAWAN_IDLE_RADIO_POLL;
+        }
+        instance->task.unlock ();
+        if (wait) {
+            instance->task.wait (wait);
+        }
+    }
+}
+
+void LoRaWAN::do_send (osjob_t* j) {
+    lmic_tx_error_t result;
+
+    while (lorawan.tx_queue_count && !lorawan.tx_in_flight) {
+        if (lorawan.joining) {
+            // Will be retried after EV_JOINED. LMIC would start a join of its own
+            DEBUG_LORAWAN ("Joining, not sending\n");
+            return;
+        }
+        if (LMIC.opmode & OP_TXRXPEND) {
+            // Will be retried after EV_TXCOMPLETE
+            DEBUG_LORAWAN ("OP_TXRXPEND, not sending\n");
+            return;
+        }
+        send_data_t* msg = &lorawan.tx_queue[lorawan.tx_queue_head];
+        long retry_wait = (long)(msg->retry_time - millis ());
+        if (msg->tries && retry_wait > 0) {
+            // Confirmed message waiting for its retry backoff
+            os_setTimedCallback (&lorawan.sendjob, os_getTime () + ms2osticks (retry_wait < LORAWAN_MAX_JOB_WAIT ? retry_wait : LORAWAN_MAX_JOB_WAIT), do_send);
+            return;
+        }
+        if (!msg->tries && lorawan.link_policy.enabled && !LMIC.adrEnabled) {
+            lorawan.apply_link_policy (msg->len);
+        }
+        if (lorawan.airtime_policy == AIRTIME_DEFER) {
+            uint32_t wait = lorawan.budget_wait (lorawan.time_on_air (msg->len));
+            if (wait == AIRTIME_NEVER) {
+                LORAWAN_LOG_WARN ("Packet longer than airtime budget. Discarded\n");
+                lorawan.discard_message (*msg);
+                lorawan.tx_queue_head = (lorawan.tx_queue_head + 1) % LORAWAN_TX_QUEUE_SIZE;
+                lorawan.tx_queue_count--;
+                continue;
+            }
+            if (wait) {
+                DEBUG_LORAWAN ("Airtime budget exhausted. Waiting %u ms\n", wait);
+                // Long waits are split so that they fit in LMIC time range
+                if (wait > LORAWAN_MAX_JOB_WAIT) {
+                    wait = LORAWAN_MAX_JOB_WAIT;
+                }
+                os_setTimedCallback (&lorawan.sendjob, os_getTime () + ms2osticks (wait), do_send);
+                return;
+            }
+        }
+        uint8_t max_payload = lorawan.get_max_payload ();
+        if (max_payload && msg->len > max_payload) {
+            // Datarate went down since message was queued. Network server would drop the frame
+            LORAWAN_LOG_WARN ("Packet of %u bytes does not fit in %u at DR%u. Discarded\n",
+                              msg->len, max_payload, LMIC.datarate);
+            lorawan.discard_message (*msg);
+            lorawan.tx_queue_head = (lorawan.tx_queue_head + 1) % LORAWAN_TX_QUEUE_SIZE;
+            lorawan.tx_queue_count--;
+            continue;
+        }
         // Prepare upstream data transmission at the next possible time.
-        /*result = */LMIC_setTxData2 (lorawan.job_data.port, lorawan.job_data.data, lorawan.job_data.len, lorawan.job_data.confirmed);
-        DEBUG_LORAWAN ("Packet queued\n");
+        result = LMIC_setTxData2 (msg->port, msg->data, msg->len, msg->confirmed);
+        if (result == LMIC_ERROR_SUCCESS) {
+            lorawan.tx_in_flight = true;
+            msg->tries++;
+            DEBUG_LORAWAN ("Packet queued\n");
+        } else if (result == LMIC_ERROR_TX_BUSY) {
+            DEBUG_LORAWAN ("LMIC busy, not sending\n");
+            return;
+        } else {
+            LORAWAN_LOG_WARN ("Packet rejected by LMIC: %d\n", result);
+            lorawan.discard_message (*msg);
+            lorawan.tx_queue_head = (lorawan.tx_queue_head + 1) % LORAWAN_TX_QUEUE_SIZE;
+            lorawan.tx_queue_count--;
+        }
     }
 }
 
-bool LoRaWAN::send_data_inmediate (uint8_t* data, size_t len, uint8_t port, bool confirmed) {
+bool LoRaWAN::retry_uplink () {
+    send_data_t& msg = tx_queue[tx_queue_head];
+
+    if (!msg.confirmed || msg.tries >= retry_policy.max_tries) {
+        return false;
+    }
+    tx_in_flight = false;
+    if (retry_policy.dr_step_after && !(msg.tries % retry_policy.dr_step_after) && LMIC.datarate > retry_policy.min_dr) {
+        dr_t dr = LMIC.datarate;
+        LMIC_setDrTxpow (dr - 1, KEEP_TXPOW);
+        if (get_max_payload () < msg.len) {
+            // Message does not fit at a lower datarate
+            LMIC_setDrTxpow (dr, KEEP_TXPOW);
+        }
+    }
+    uint32_t backoff = backoff_time (retry_policy.backoff_min_ms, retry_policy.backoff_max_ms, msg.tries);
+    uint32_t wait = random_between (backoff / 2, backoff);
+    msg.retry_time = millis () + wait;
+    DEBUG_LORAWAN ("Message %u not acknowledged. Try %u at DR%u in %u ms\n", msg.handle, msg.tries + 1, LMIC.datarate, wait);
+    os_setTimedCallback (&sendjob, os_getTime () + ms2osticks (wait < LORAWAN_MAX_JOB_WAIT ? wait : LORAWAN_MAX_JOB_WAIT), do_send);
+    return true;
+}
+
+void LoRaWAN::tx_queue_pop (bool delivered) {
+    if (tx_in_flight && tx_queue_count) {
+        report_records (tx_queue[tx_queue_head], delivered);
+        report_uplink (tx_queue[tx_queue_head], delivered);
+        if (tx_queue[tx_queue_head].backlog) {
+            backlog_sent (delivered);
+        }
+        tx_queue_head = (tx_queue_head + 1) % LORAWAN_TX_QUEUE_SIZE;
+        tx_queue_count--;
+    }
+    tx_in_flight = false;
+    if (tx_queue_count) {
+        os_setCallback (&sendjob, do_send);
+    }
+}
+
+void LoRaWAN::discard_message (const send_data_t& msg) {
+    tx_queue_dropped++;
+    metrics.uplinks_dropped++;
+    report_records (msg, false);
+    report_uplink (msg, false);
+    if (msg.backlog) {
+        backlog_sent (false);
+    }
+}
+
+void LoRaWAN::report_records (const send_data_t& msg, bool delivered) {
+    uint16_t id = msg.first_record;
+
+    if (!on_record_status_cb) {
+        return;
+    }
+    for (uint8_t i = 0; i < msg.records; i++) {
+        on_record_status_cb (id, delivered);
+        // Ids wrap skipping 0, same as when they are assigned
+        if (++id == 0) {
+            id = 1;
+        }
+    }
+}
+
+uint16_t LoRaWAN::send (const uint8_t* data, size_t len, uint8_t port, bool confirmed) {
+    LoRaTaskGuard guard (task);
+    uint8_t max_payload = get_max_payload ();
+
+    if (!max_payload) {
+        // Datarate not known yet. LMIC buffer is the only limit
+        max_payload = MAX_LEN_PAYLOAD;
+    }
+    if (len > max_payload) {
+        LORAWAN_LOG_WARN ("Payload of %u bytes does not fit in %u at DR%u. Use send_fragmented () for longer data\n",
+                          len, max_payload, LMIC.datarate);
+        return 0;
+    }
+    if (!enqueue (data, len, port, confirmed)) {
+        return 0;
+    }
+    return tx_queue[(tx_queue_head + tx_queue_count - 1) % LORAWAN_TX_QUEUE_SIZE].handle;
+}
+
+void LoRaWAN::apply_link_policy (uint8_t len) {
+    uint8_t dr;
+    int8_t power;
+
+    if (!link.choose (link_policy, len, millis (), &dr, &power)) {
+        return;
+    }
+    if (dr != LMIC.datarate || power != LMIC.adrTxPow) {
+        DEBUG_LORAWAN ("Link margin %d dB. Using DR%u at %d dBm\n", link.margin (dr) / 4, dr, power);
+        LMIC_setDrTxpow (dr, power);
+    }
+}
+
+uint16_t LoRaWAN::new_handle () {
+    uint16_t handle = next_handle;
+    if (++next_handle == 0) {
+        next_handle = 1;
+    }
+    return handle;
+}
+
+bool LoRaWAN::airtime_allows (size_t len) {
+    if (airtime_policy != AIRTIME_REJECT) {
+        return true;
+    }
+    // Messages waiting in queue are sent first, so their airtime is added
+    uint32_t airtime = time_on_air (len);
+    for (uint8_t i = 0; i < tx_queue_count; i++) {
+        airtime += time_on_air (tx_queue[(tx_queue_head + i) % LORAWAN_TX_QUEUE_SIZE].len);
+    }
+    if (budget_wait (airtime)) {
+        LORAWAN_LOG_WARN ("Message exceeds airtime budget. Discarded\n");
+        return false;
+    }
+    return true;
+}
+
+bool LoRaWAN::make_room () {
+    if (tx_queue_count < LORAWAN_TX_QUEUE_SIZE) {
+        return true;
+    }
+    // A message owned by LMIC cannot be replaced
+    if (overflow_policy == QUEUE_DROP_NEWEST || (tx_in_flight && LORAWAN_TX_QUEUE_SIZE < 2)) {
+        LORAWAN_LOG_WARN ("Queue full. Message discarded\n");
+        tx_queue_dropped++;
+        metrics.uplinks_dropped++;
+        return false;
+    }
+    LORAWAN_LOG_WARN ("Queue full. Oldest message discarded\n");
+    if (!tx_in_flight) {
+        discard_message (tx_queue[tx_queue_head]);
+        tx_queue_head = (tx_queue_head + 1) % LORAWAN_TX_QUEUE_SIZE;
+    } else {
+        // Front message is owned by LMIC. Discard the next one and close the gap so that order is kept
+        discard_message (tx_queue[(tx_queue_head + 1) % LORAWAN_TX_QUEUE_SIZE]);
+        for (uint8_t i = 1; i < tx_queue_count - 1; i++) {
+            tx_queue[(tx_queue_head + i) % LORAWAN_TX_QUEUE_SIZE] = tx_queue[(tx_queue_head + i + 1) % LORAWAN_TX_QUEUE_SIZE];
+        }
+    }
+    tx_queue_count--;
+    return true;
+}
+
+bool LoRaWAN::enqueue (const uint8_t* data, size_t len, uint8_t port, bool confirmed, uint16_t first_record, uint8_t records) {
     if (len > MAX_LEN_PAYLOAD) {
+        LORAWAN_LOG_WARN ("Payload truncated to %u bytes. Use send_fragmented () for longer data\n", MAX_LEN_PAYLOAD);
         len = MAX_LEN_PAYLOAD;
     }
 
-    memcpy (job_data.data, data, len);
-    job_data.len = len;
-    job_data.port = port;
-    job_data.confirmed = confirmed;
+    if (tx_reserved) {
+        // Reserved slot is the one this message would use
+        LORAWAN_LOG_WARN ("Uplink slot reserved. Message discarded\n");
+        return false;
+    }
+    if (!airtime_allows (len) || !make_room ()) {
+        return false;
+    }
+
+    send_data_t* msg = &tx_queue[(tx_queue_head + tx_queue_count) % LORAWAN_TX_QUEUE_SIZE];
+    memcpy (msg->data, data, len);
+    msg->len = len;
+    msg->port = port;
+    msg->confirmed = confirmed;
+    msg->first_record = first_record;
+    msg->records = records;
+    msg->backlog = false;
+    msg->handle = new_handle ();
+    msg->tries = 0;
+    msg->attempts = 0;
+    msg->airtime_ms = 0;
+    tx_queue_count++;
+    metrics.uplinks_queued++;
+
+    if (!tx_in_flight) {
+        os_setCallback (&sendjob, do_send);
+    }
+
+    return true;
+}
+
+uint8_t* LoRaWAN::reserve_uplink (size_t* capacity) {
+    LoRaTaskGuard guard (task);
+
+    if (tx_reserved || !make_room ()) {
+        return NULL;
+    }
+    uint8_t max_payload = get_max_payload ();
+    tx_reserved = true;
+    tx_reserved_capacity = max_payload ? max_payload : (uint8_t)MAX_LEN_PAYLOAD;
+    if (capacity) {
+        *capacity = tx_reserved_capacity;
+    }
+    return tx_queue[(tx_queue_head + tx_queue_count) % LORAWAN_TX_QUEUE_SIZE].data;
+}
+
+bool LoRaWAN::commit_uplink (size_t len, uint8_t port, bool confirmed) {
+    LoRaTaskGuard guard (task);
+
+    if (!tx_reserved) {
+        return false;
+    }
+    tx_reserved = false;
+    if (len > tx_reserved_capacity) {
+        LORAWAN_LOG_WARN ("Committed length %u exceeds reserved capacity %u\n", len, tx_reserved_capacity);
+        return false;
+    }
+    if (!airtime_allows (len)) {
+        return false;
+    }
+
+    // Payload is already in place
+    send_data_t* msg = &tx_queue[(tx_queue_head + tx_queue_count) % LORAWAN_TX_QUEUE_SIZE];
+    msg->len = len;
+    msg->port = port;
+    msg->confirmed = confirmed;
+    msg->first_record = 0;
+    msg->records = 0;
+    msg->backlog = false;
+    msg->handle = new_handle ();
+    msg->tries = 0;
+    msg->attempts = 0;
+    msg->airtime_ms = 0;
+    tx_queue_count++;
+    metrics.uplinks_queued++;
+
+    if (!tx_in_flight) {
+        os_setCallback (&sendjob, do_send);
+    }
+
+    return true;
+}
+
+bool LoRaWAN::send_series (LoRaSeries& series, uint8_t port, bool confirmed) {
+    LoRaTaskGuard guard (task);
+    size_t capacity;
+
+    uint8_t* payload = reserve_uplink (&capacity);
+    if (!payload) {
+        return false;
+    }
+    uint8_t samples;
+    size_t len = series.encode (payload, capacity, &samples);
+    if (!len) {
+        cancel_uplink ();
+        return false;
+    }
+    if (!commit_uplink (len, port, confirmed)) {
+        return false;
+    }
+    DEBUG_LORAWAN ("Series frame queued: %u samples, %u bytes\n", samples, len);
+    series.consume (samples);
+    return true;
+}
+
+void LoRaWAN::clear_stats () {
+    LoRaTaskGuard guard (task);
+    metrics = node_stats_t ();
+}
+
+size_t LoRaWAN::export_stats (uint8_t* buffer, size_t size, uint8_t sections) {
+    LoRaTaskGuard guard (task);
+    return lorawan_stats_export (metrics, buffer, size, sections);
+}
+
+bool LoRaWAN::send_stats (uint8_t port, uint8_t sections) {
+    LoRaTaskGuard guard (task);
+    size_t capacity;
+
+    uint8_t* payload = reserve_uplink (&capacity);
+    if (!payload) {
+        return false;
+    }
+    size_t len = lorawan_stats_export (metrics, payload, capacity, sections);
+    if (!len) {
+        cancel_uplink ();
+        return false;
+    }
+    DEBUG_LORAWAN ("Stats frame: %u bytes, sections 0x%02X\n", len, payload[1]);
+    return commit_uplink (len, port, false);
+}
+
+bool LoRaWAN::send_fragmented (const uint8_t* data, size_t len, uint16_t redundancy, uint8_t port) {
+    LoRaTaskGuard guard (task);
 
-    os_setCallback (&sendjob, do_send);
+    if (frag_next) {
+        LORAWAN_LOG_WARN ("Fragmented block already being sent\n");
+        return false;
+    }
+    uint8_t max_payload = get_max_payload ();
+    if (max_payload <= LORAWAN_FRAG_HEADER) {
+        return false;
+    }
+    uint8_t session = (frag_session + 1) & 0x03;
+    if (!fragmenter.begin (data, len, max_payload - LORAWAN_FRAG_HEADER, redundancy, session)) {
+        LORAWAN_LOG_WARN ("Block of %u bytes needs too many fragments\n", len);
+        return false;
+    }
+    frag_session = session;
+    frag_port = port;
+    frag_next = 1;
+    DEBUG_LORAWAN ("Fragmented block: %u bytes in %u + %u fragments of %u bytes\n", len, fragmenter.get_fragments (),
+                   redundancy, max_payload - LORAWAN_FRAG_HEADER);
+    feed_fragments ();
+    return true;
+}
+
+void LoRaWAN::feed_fragments () {
+    LoRaTaskGuard guard (task);
 
+    while (frag_next && tx_queue_count < LORAWAN_FRAG_QUEUE_DEPTH && !tx_reserved) {
+        size_t capacity;
+        uint8_t* payload = reserve_uplink (&capacity);
+        if (!payload) {
+            return;
+        }
+        if (capacity < fragmenter.get_frame_size ()) {
+            LORAWAN_LOG_WARN ("Datarate too low for fragment size. Block aborted\n");
+            cancel_uplink ();
+            frag_next = 0;
+            return;
+        }
+        size_t len = fragmenter.build (frag_next, payload);
+        // A fragment rejected by airtime policy is lost as any other one. Redundancy covers it
+        commit_uplink (len, frag_port, false);
+        if (++frag_next > fragmenter.get_total ()) {
+            DEBUG_LORAWAN ("All fragments queued\n");
+            frag_next = 0;
+        }
+    }
+}
+
+bool LoRaWAN::enable_backlog (uint8_t aggregate_port, bool confirmed) {
+    LoRaTaskGuard guard (task);
+
+    backlog_port = aggregate_port;
+    backlog_confirmed = confirmed;
+    if (backlog_enabled) {
+        return true;
+    }
+    if (!backlog.begin (file_system, BACKLOG_FILE, BACKLOG_CURSOR_FILE)) {
+        LORAWAN_LOG_ERROR ("Cannot open backlog files\n");
+        return false;
+    }
+    backlog_enabled = true;
+    if (backlog.length ()) {
+        LORAWAN_LOG_INFO ("%u records pending in backlog\n", backlog.length ());
+    }
     return true;
 }
 
+bool LoRaWAN::send_persistent (const uint8_t* data, uint8_t len, uint8_t port) {
+    LoRaTaskGuard guard (task);
+
+    if (!backlog_enabled) {
+        return false;
+    }
+    if (!backlog.push (data, len, port)) {
+        LORAWAN_LOG_WARN ("Record not stored in backlog: %u bytes\n", len);
+        return false;
+    }
+    feed_backlog ();
+    return true;
+}
+
+void LoRaWAN::feed_backlog () {
+    LoRaTaskGuard guard (task);
+    uint8_t record[LORAWAN_BACKLOG_RECORD_SIZE];
+    uint8_t port;
+
+    if (backlog_wait ()) {
+        return;
+    }
+    size_t capacity;
+    uint8_t* payload = reserve_uplink (&capacity);
+    if (!payload) {
+        return;
+    }
+    uint8_t len = backlog.read (0, record, &port);
+    if (!len) {
+        LORAWAN_LOG_WARN ("Corrupted backlog record skipped\n");
+        cancel_uplink ();
+        backlog.skip ();
+        return;
+    }
+    if (len > capacity) {
+        // Wait for a faster datarate
+        cancel_uplink ();
+        backlog_sent (false);
+        return;
+    }
+
+    size_t frame_len;
+    uint8_t frame_port;
+    size_t count = 0;
+    if (backlog_port && backlog.length () > 1 && len + 2u <= capacity) {
+        // Stale records: original port, then length prefixed records
+        uint8_t next_port = port;
+        payload[0] = port;
+        frame_len = 1;
+        while (len && next_port == port && frame_len + 1 + len <= capacity && count < UINT8_MAX) {
+            payload[frame_len++] = len;
+            memcpy (payload + frame_len, record, len);
+            frame_len += len;
+            count++;
+            len = count < backlog.length () ? backlog.read (count, record, &next_port) : 0;
+        }
+        frame_port = backlog_port;
+    } else {
+        memcpy (payload, record, len);
+        frame_len = len;
+        frame_port = port;
+        count = 1;
+    }
+    if (!commit_uplink (frame_len, frame_port, backlog_confirmed)) {
+        backlog_sent (false);
+        return;
+    }
+    tx_queue[(tx_queue_head + tx_queue_count - 1) % LORAWAN_TX_QUEUE_SIZE].backlog = true;
+    backlog_end = backlog.first () + count;
+    backlog_in_flight = true;
+    DEBUG_LORAWAN ("Backlog frame queued: %u records, %u bytes\n", count, frame_len);
+}
+
+uint32_t LoRaWAN::backlog_wait () {
+    if (!backlog_enabled || backlog_in_flight || !backlog.length () || tx_queue_count || tx_reserved) {
+        return LORAWAN_IDLE_FOREVER;
+    }
+    uint32_t elapsed = millis () - backlog_failed;
+    return backlog_backoff > elapsed ? backlog_backoff - elapsed : 0;
+}
+
+void LoRaWAN::backlog_sent (bool delivered) {
+    backlog_in_flight = false;
+    if (delivered) {
+        backlog.release (backlog_end);
+        backlog_backoff = 0;
+        return;
+    }
+    backlog_failed = millis ();
+    backlog_backoff = backlog_backoff ? backlog_backoff * 2 : LORAWAN_BACKLOG_RETRY_MIN;
+    if (backlog_backoff > LORAWAN_BACKLOG_RETRY_MAX) {
+        backlog_backoff = LORAWAN_BACKLOG_RETRY_MAX;
+    }
+    // Link is not working. Keep cached records safe from a reset
+    if (backlog.cached () && !backlog.flush ()) {
+        LORAWAN_LOG_WARN ("Cannot write backlog file\n");
+    }
+    DEBUG_LORAWAN ("Backlog frame not delivered. Retry in %u ms\n", backlog_backoff);
+}
+
+uint16_t LoRaWAN::append_record (const uint8_t* data, uint8_t len) {
+    LoRaTaskGuard guard (task);
+    uint8_t max_payload = get_max_payload ();
+
+    if (!len || len + 1 > max_payload) {
+        LORAWAN_LOG_WARN ("Record does not fit in a frame: %u bytes\n", len);
+        return 0;
+    }
+    if (aggregate.len + 1 + len > max_payload && !flush_records ()) {
+        LORAWAN_LOG_WARN ("Record discarded. Aggregated frame cannot be queued\n");
+        return 0;
+    }
+    if (!aggregate.records) {
+        aggregate.first_record = next_record_id;
+        aggregate_started = millis ();
+    }
+    aggregate.data[aggregate.len++] = len;
+    memcpy (aggregate.data + aggregate.len, data, len);
+    aggregate.len += len;
+    aggregate.records++;
+
+    uint16_t id = next_record_id;
+    if (++next_record_id == 0) {
+        next_record_id = 1;
+    }
+
+    // No other record fits, or record counter in message is exhausted
+    if (aggregate.len + 2 > max_payload || aggregate.records == UINT8_MAX) {
+        flush_records ();
+    }
+    return id;
+}
+
+bool LoRaWAN::flush_records () {
+    LoRaTaskGuard guard (task);
+
+    if (!aggregate.records) {
+        return true;
+    }
+    if (tx_reserved || (tx_queue_count >= LORAWAN_TX_QUEUE_SIZE && (overflow_policy == QUEUE_DROP_NEWEST || (tx_in_flight && LORAWAN_TX_QUEUE_SIZE < 2)))) {
+        // Records are kept in frame until there is room in queue
+        return false;
+    }
+    DEBUG_LORAWAN ("Sending %u aggregated records, %u bytes\n", aggregate.records, aggregate.len);
+    if (!enqueue (aggregate.data, aggregate.len, aggregate.port, aggregate.confirmed, aggregate.first_record, aggregate.records)) {
+        return false;
+    }
+    aggregate.len = 0;
+    aggregate.records = 0;
+    return true;
+}
+
+uint32_t LoRaWAN::time_on_air (uint8_t len, dr_t dr) {
+    return osticks2ms (calcAirTime (updr2rps (dr), len + LORAWAN_FRAME_OVERHEAD));
+}
+
+void LoRaWAN::account_airtime () {
+    // LMIC.dataLen holds the whole frame being transmitted, MAC overhead included
+    uint32_t airtime = osticks2ms (calcAirTime (LMIC.rps, LMIC.dataLen));
+    uint32_t now = millis ();
+
+    metrics.airtime_ms[LMIC.datarate % LORAWAN_STATS_DATARATES] += airtime;
+    if (LMIC.opmode & OP_JOINING) {
+        metrics.join_requests++;
+        join_stats.attempts++;
+        join_stats.airtime_ms += airtime;
+        join_last_airtime = airtime;
+        join_tx_time = now;
+        uint32_t end, cap;
+        uint32_t window = join_duty_window (now - join_started, &end, &cap);
+        if (window != join_window) {
+            join_window = window;
+            join_window_used = 0;
+        }
+        join_window_used += airtime;
+    } else if (tx_in_flight && tx_queue_count) {
+        send_data_t& msg = tx_queue[tx_queue_head];
+        metrics.uplinks_sent++;
+        msg.attempts++;
+        msg.airtime_ms += airtime;
+        msg.datarate = LMIC.datarate;
+    }
+
+    fair_use.add (now, airtime);
+#if CFG_LMIC_EU_like
+    // Band index is stored in the lower bits of channel frequency
+    band_airtime[LMIC.channelFreq[LMIC.txChnl] & 0x3].add (now, airtime);
+#endif
+    DEBUG_LORAWAN ("Airtime: %u ms. Fair use window: %u ms\n", airtime, fair_use.used (now));
+}
+
+uint32_t LoRaWAN::budget_wait (uint32_t airtime_ms) {
+    uint32_t now = millis ();
+    uint32_t wait = 0;
+
+    if (fair_use_budget) {
+        wait = fair_use.wait_for (now, airtime_ms, fair_use_budget);
+    }
+#if CFG_LMIC_EU_like
+    // Any enabled channel may be used, so the band that frees first is the one that counts
+    uint32_t band_wait = AIRTIME_NEVER;
+    for (uint8_t ch = 0; ch < MAX_CHANNELS; ch++) {
+        if (!(LMIC.channelMap & (1 << ch))) {
+            continue;
+        }
+        uint8_t band = LMIC.channelFreq[ch] & 0x3;
+        if (!LMIC.bands[band].txcap) {
+            band_wait = 0;
+            break;
+        }
+        uint32_t w = band_airtime[band].wait_for (now, airtime_ms, LORAWAN_BAND_DUTY_WINDOW / LMIC.bands[band].txcap);
+        if (w < band_wait) {
+            band_wait = w;
+        }
+    }
+    if (LMIC.channelMap && band_wait > wait) {
+        wait = band_wait;
+    }
+#endif
+    return wait;
+}
+
+uint32_t LoRaWAN::next_tx_possible (uint8_t len) {
+    LoRaTaskGuard guard (task);
+    uint32_t wait = budget_wait (time_on_air (len));
+    ostime_t now = os_getTime ();
+    ostime_t avail = LMIC.globalDutyAvail;
+
+    if (wait == AIRTIME_NEVER) {
+        return wait;
+    }
+#if CFG_LMIC_EU_like
+    // Earliest band with an enabled channel, delayed by global duty cycle if it is set
+    ostime_t band_avail = 0;
+    bool found = false;
+    for (uint8_t ch = 0; ch < MAX_CHANNELS; ch++) {
+        if (LMIC.channelMap & (1 << ch)) {
+            ostime_t a = LMIC.bands[LMIC.channelFreq[ch] & 0x3].avail;
+            if (!found || a - band_avail < 0) {
+                band_avail = a;
+                found = true;
+            }
+        }
+    }
+    if (found && band_avail - avail > 0) {
+        avail = band_avail;
+    }
+#endif
+    if (avail - now > 0 && (uint32_t)osticks2ms (avail - now) > wait) {
+        wait = osticks2ms (avail - now);
+    }
+    return wait;
+}
+
 void LoRaWAN::loop () {
+    uint32_t start = micros ();
+
+#if LORAWAN_LOG_LEVEL > LORAWAN_LOG_LEVEL_NONE
+    lorawan_log.drain (DEBUG_PORT, LORAWAN_LOG_DRAIN_MAX);
+#endif
+    if (rx_queue_count) {
+        drain_downlinks ();
+    }
+    if (result_queue_count) {
+        drain_results ();
+    }
+    if (event_queue_count) {
+        drain_events ();
+    }
+    if (!task.is_running ()) {
+        radio_loop ();
+    }
+    metrics.loop_us.add (micros () - start);
+}
+
+void LoRaWAN::radio_loop () {
+    if (aggregate.records && aggregate_max_age && millis () - aggregate_started >= aggregate_max_age) {
+        flush_records ();
+    }
+    if (frag_next) {
+        feed_fragments ();
+    }
+    if (backlog_enabled && backlog.length ()) {
+        feed_backlog ();
+    }
     os_runloop_once ();
 }
 
+uint32_t LoRaWAN::get_idle_time () {
+#if LORAWAN_LOG_LEVEL > LORAWAN_LOG_LEVEL_NONE
+    if (lorawan_log.length ()) {
+        return 0;
+    }
+#endif
+    if (rx_queue_count || event_queue_count || result_queue_count) {
+        return 0;
+    }
+    // Radio task keeps its own deadlines
+    return task.is_running () ? LORAWAN_IDLE_FOREVER : radio_idle_time ();
+}
+
+uint32_t LoRaWAN::radio_idle_time () {
+    uint32_t idle_time = LORAWAN_IDLE_FOREVER;
+
+    if (aggregate.records && aggregate_max_age) {
+        uint32_t age = millis () - aggregate_started;
+        if (age >= aggregate_max_age) {
+            return 0;
+        }
+        idle_time = aggregate_max_age - age;
+    }
+    if (frag_next && tx_queue_count < LORAWAN_FRAG_QUEUE_DEPTH && !tx_reserved) {
+        return 0;
+    }
+    uint32_t backlog_time = backlog_wait ();
+    if (backlog_time < idle_time) {
+        idle_time = backlog_time;
+    }
+
+    bit_t valid;
+    ostime_t deadline = os_getNextDeadline (&valid);
+    if (valid) {
+        ostime_t wait = deadline - os_getTime ();
+        if (wait <= 0) {
+            return 0;
+        }
+        // Rounded up, so that job is due when loop () is called again
+        uint32_t wait_ms = (uint32_t)osticks2ms (wait) + 1;
+        if (wait_ms < idle_time) {
+            idle_time = wait_ms;
+        }
+    }
+    return idle_time;
+}
+
+uint32_t LoRaWAN::idle (uint32_t max_ms) {
+    uint32_t wait = get_idle_time ();
+    uint32_t start = millis ();
+
+    if (wait > max_ms) {
+        wait = max_ms;
+    }
+    if (wait < LORAWAN_IDLE_MIN_SLEEP) {
+        yield ();
+        return 0;
+    }
+    if (task.is_running ()) {
+        // CPU cannot sleep under radio task. Only calling task is blocked
+        delay (wait);
+        return millis () - start;
+    }
+#if defined ESP32
+    // Pending log output would be cut while CPU sleeps
+    DEBUG_PORT.flush ();
+    if (wait != LORAWAN_IDLE_FOREVER) {
+        esp_sleep_enable_timer_wakeup ((uint64_t)wait * 1000);
+    }
+    for (uint8_t i = 0; i < sizeof (lmic_pins.dio) / sizeof (lmic_pins.dio[0]); i++) {
+        if (lmic_pins.dio[i] != LMIC_UNUSED_PIN) {
+            gpio_wakeup_enable ((gpio_num_t)lmic_pins.dio[i], GPIO_INTR_HIGH_LEVEL);
+        }
+    }
+    esp_sleep_enable_gpio_wakeup ();
+    esp_light_sleep_start ();
+    // Leave deep sleep wake up configuration as application set it
+    esp_sleep_disable_wakeup_source (ESP_SLEEP_WAKEUP_TIMER);
+    esp_sleep_disable_wakeup_source (ESP_SLEEP_WAKEUP_GPIO);
+#elif defined ESP8266
+    if ((LMIC.opmode & OP_TXRXPEND) && wait > LORAWAN_IDLE_RADIO_POLL) {
+        wait = LORAWAN_IDLE_RADIO_POLL;
+    }
+    delay (wait);
+#else
+    // Simulated radio reports TX and RX completion through scheduled jobs
+    if (wait != LORAWAN_IDLE_FOREVER) {
+        delay (wait);
+    }
+#endif
+    return millis () - start;
+}
+
 // bool LoRaWAN::send_data (uint8_t* data, size_t len, uint8_t port = 1, bool confirmed = false) {
 //     lmic_tx_error_t result = LMIC_ERROR_TX_FAILED;
 
@@ -533,198 +2022,3 @@ void LoRaWAN::loop () {
 //     sendjob.
 // }
 
-String LoRaWAN::getSFStr () {
-    String sf;
-    switch (LMIC.datarate) {
-#if defined(CFG_eu868)
-    case EU868_DR_SF12:
-        sf = "SF12";
-        break;
-    case EU868_DR_SF11:
-        sf = "SF11";
-        break;
-    case EU868_DR_SF10:
-        sf = "SF10";
-        break;
-    case EU868_DR_SF9:
-        sf = "SF9";
-        break;
-    case EU868_DR_SF8:
-        sf = "SF8";
-        break;
-    case EU868_DR_SF7:
-        sf = "SF7";
-        break;
-    case EU868_DR_SF7B:
-        sf = "SF7B";
-        break;
-    case EU868_DR_FSK:
-        sf = "FSK";
-        break;
-    case EU868_DR_NONE:
-        sf = "NONE";
-        break;
-#elif defined(CFG_us915) 
-    case US915_DR_SF10:
-        sf = "SF10";
-        break;
-    case US915_DR_SF9:
-        sf = "SF9";
-        break;
-    case US915_DR_SF8:
-        sf = "SF8";
-        break;
-    case US915_DR_SF7:
-        sf = "SF7";
-        break;
-    case US915_DR_SF8C:
-        sf = "SF8C";
-        break;
-    case US915_DR_NONE:
-        sf = "NONE";
-        break;
-    case US915_DR_SF12CR:
-        sf = "SF12CR";
-        break;
-    case US915_DR_SF11CR:
-        sf = "SF11CR";
-        break;
-    case US915_DR_SF10CR:
-        sf = "SF10CR";
-        break;
-    case US915_DR_SF9CR:
-        sf = "SF9CR";
-        break;
-    case US915_DR_SF8CR:
-        sf = "SF8CR";
-        break;
-    case US915_DR_SF7CR:
-        sf = "SF7CR";
-        break;
-#elif defined(CFG_au915)
-    case AU915_DR_SF12:
-        sf = "SF12";
-        break;
-    case AU915_DR_SF11:
-        sf = "SF11";
-        break;
-    case AU915_DR_SF10:
-        sf = "SF10";
-        break;
-    case AU915_DR_SF9:
-        sf = "SF9";
-        break;
-    case AU915_DR_SF8:
-        sf = "SF8";
-        break;
-    case AU915_DR_SF7:
-        sf = "SF7";
-        break;
-    case AU915_DR_SF8C:
-        sf = "SF8C";
-        break;
-    case AU915_DR_NONE:
-        sf = "NONE";
-        break;
-    case AU915_DR_SF12CR:
-        sf = "SF12CR";
-        break;
-    case AU915_DR_SF11CR:
-        sf = "SF11CR";
-        break;
-    case AU915_DR_SF10CR:
-        sf = "SF10CR";
-        break;
-    case AU915_DR_SF9CR:
-        sf = "SF9CR";
-        break;
-    case AU915_DR_SF8CR:
-        sf = "SF8CR";
-        break;
-    case AU915_DR_SF7CR:
-        sf = "SF7CR";
-        break;
-#elif defined(CFG_as923)
-    case AS923_DR_SF12:
-        sf = "SF12";
-        break;
-    case AS923_DR_SF11:
-        sf = "SF11";
-        break;
-    case AS923_DR_SF10:
-        sf = "SF10";
-        break;
-    case AS923_DR_SF9:
-        sf = "SF9";
-        break;
-    case AS923_DR_SF8:
-        sf = "SF8";
-        break;
-    case AS923_DR_SF7:
-        sf = "SF7";
-        break;
-    case AS923_DR_SF7B:
-        sf = "SF7C";
-        break;
-    case AS923_DR_FSK:
-        sf = "FSK";
-        break;
-    case AS923_DR_NONE:
-        sf = "NONE";
-        break;
-#elif defined(CFG_kr920)
-    case KR920_DR_SF12:
-        sf = "SF12";
-        break;
-    case KR920_DR_SF11:
-        sf = "SF11";
-        break;
-    case KR920_DR_SF10:
-        sf = "SF10";
-        break;
-    case KR920_DR_SF9:
-        sf = "SF9";
-        break;
-    case KR920_DR_SF8:
-        sf = "SF8";
-        break;
-    case KR920_DR_SF7:
-        sf = "SF7";
-        break;
-    case KR920_DR_NONE:
-        sf = "NONE";
-        break;
-#elif defined(CFG_in866)
-    case IN866_DR_SF12:
-        sf = "SF12";
-        break;
-    case IN866_DR_SF11:
-        sf = "SF11";
-        break;
-    case IN866_DR_SF10:
-        sf = "SF10";
-        break;
-    case IN866_DR_SF9:
-        sf = "SF9";
-        break;
-    case IN866_DR_SF8:
-        sf = "SF8";
-        break;
-    case IN866_DR_SF7:
-        sf = "SF7";
-        break;
-    case IN866_DR_RFU:
-        sf = "RFU";
-        break;
-    case IN866_DR_FSK:
-        sf = "FSK";
-        break;
-    case IN866_DR_NONE:
-        sf = "NONE";
-        break;
-#endif
-    default:
-        sf = "Unknown";
-    }
-    return sf;
-}
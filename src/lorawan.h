@@ -14,11 +14,119 @@
 
 #include <lmic.h>
 #include <hal/hal.h>
-#include <functional>
 #include "FS.h"
+#include "lorawan_journal.h"
+#include "lorawan_slots.h"
+#include "lorawan_airtime.h"
+#include "lorawan_datarate.h"
+#include "lorawan_link.h"
+#include "lorawan_delegate.h"
+#include "lorawan_task.h"
+#include "lorawan_codec.h"
+#include "lorawan_series.h"
+#include "lorawan_frag.h"
+#include "lorawan_backlog.h"
+#include "lorawan_stats.h"
 
+#ifndef DEBUG_LORAWAN_LIB
 #define DEBUG_LORAWAN_LIB 1
+#endif // DEBUG_LORAWAN_LIB
 
+#include "lorawan_log.h"
+
+#ifndef LORAWAN_TX_QUEUE_SIZE
+#define LORAWAN_TX_QUEUE_SIZE 4 ///< @brief Number of uplink messages that may wait for transmission
+#endif // LORAWAN_TX_QUEUE_SIZE
+
+#ifndef LORAWAN_COUNTER_RESERVATION
+#define LORAWAN_COUNTER_RESERVATION 0 ///< @brief Default number of uplink counter values reserved on each counters write. 0 writes on every uplink
+#endif // LORAWAN_COUNTER_RESERVATION
+
+#ifndef LORAWAN_COUNTER_RECOVERY_GAP
+#define LORAWAN_COUNTER_RECOVERY_GAP 1 ///< @brief Uplink counter values skipped when counters are restored from older file because last write did not complete
+#endif // LORAWAN_COUNTER_RECOVERY_GAP
+
+#ifndef LORAWAN_RTC_FS_SAVE_CYCLES
+#define LORAWAN_RTC_FS_SAVE_CYCLES 10 ///< @brief Default number of uplinks between filesystem saves when RTC memory resume is enabled
+#endif // LORAWAN_RTC_FS_SAVE_CYCLES
+
+#ifndef LORAWAN_RTC_USER_MEMORY_OFFSET
+#define LORAWAN_RTC_USER_MEMORY_OFFSET 0 ///< @brief ESP8266 RTC user memory offset where snapshot is stored, in 4 byte blocks
+#endif // LORAWAN_RTC_USER_MEMORY_OFFSET
+
+#ifndef LORAWAN_WALL_CLOCK
+#if defined ESP32 || defined ESP8266
+#define LORAWAN_WALL_CLOCK 1 ///< @brief 1 if platform has `time()` and it can be set, e.g. by NTP
+#else
+#define LORAWAN_WALL_CLOCK 0 ///< @brief 1 if platform has `time()` and it can be set, e.g. by NTP
+#endif
+#endif // LORAWAN_WALL_CLOCK
+
+#ifndef LORAWAN_SESSION_JOURNAL_SLOTS
+#define LORAWAN_SESSION_JOURNAL_SLOTS 4 ///< @brief Number of session records in session journal file
+#endif // LORAWAN_SESSION_JOURNAL_SLOTS
+
+#ifndef LORAWAN_COUNTERS_JOURNAL_SLOTS
+#define LORAWAN_COUNTERS_JOURNAL_SLOTS 64 ///< @brief Number of counter records in counters journal file
+#endif // LORAWAN_COUNTERS_JOURNAL_SLOTS
+
+#ifndef LORAWAN_RX_QUEUE_SIZE
+#define LORAWAN_RX_QUEUE_SIZE 2 ///< @brief Number of downlink messages that may wait for delivery in deferred mode
+#endif // LORAWAN_RX_QUEUE_SIZE
+
+#ifndef LORAWAN_FAIR_USE_WINDOW
+#define LORAWAN_FAIR_USE_WINDOW 86400000 ///< @brief Window of network fair use airtime budget, in milliseconds
+#endif // LORAWAN_FAIR_USE_WINDOW
+
+#ifndef LORAWAN_BAND_DUTY_WINDOW
+#define LORAWAN_BAND_DUTY_WINDOW 3600000 ///< @brief Window of band duty cycle airtime budget, in milliseconds
+#endif // LORAWAN_BAND_DUTY_WINDOW
+
+#define LORAWAN_EVENT_COUNT (EV_JOIN_TXCOMPLETE + 1) ///< @brief Size of LMIC event subscriber table
+
+#define LORAWAN_FRAME_OVERHEAD 13 ///< @brief Bytes added by LoRaWAN MAC to application payload, without MAC options
+
+#ifndef LORAWAN_FRAG_QUEUE_DEPTH
+#define LORAWAN_FRAG_QUEUE_DEPTH 1 ///< @brief Fragments are queued only while uplink queue holds fewer messages than this
+#endif // LORAWAN_FRAG_QUEUE_DEPTH
+
+#ifndef LORAWAN_BACKLOG_RETRY_MIN
+#define LORAWAN_BACKLOG_RETRY_MIN 30000 ///< @brief Wait before retrying an undelivered backlog frame, in milliseconds. It doubles on every failure
+#endif // LORAWAN_BACKLOG_RETRY_MIN
+
+#ifndef LORAWAN_BACKLOG_RETRY_MAX
+#define LORAWAN_BACKLOG_RETRY_MAX 3600000 ///< @brief Longest wait between backlog delivery attempts, in milliseconds
+#endif // LORAWAN_BACKLOG_RETRY_MAX
+
+#ifndef LORAWAN_JOIN_BACKOFF_MIN
+#define LORAWAN_JOIN_BACKOFF_MIN 15000 ///< @brief Default wait after first failed join attempt, in milliseconds. It doubles on every failure
+#endif // LORAWAN_JOIN_BACKOFF_MIN
+
+#ifndef LORAWAN_JOIN_BACKOFF_MAX
+#define LORAWAN_JOIN_BACKOFF_MAX 3600000 ///< @brief Default longest wait between join attempts, in milliseconds
+#endif // LORAWAN_JOIN_BACKOFF_MAX
+
+#ifndef LORAWAN_RETRY_BACKOFF_MIN
+#define LORAWAN_RETRY_BACKOFF_MIN 10000 ///< @brief Default wait before first retry of an unacknowledged confirmed message, in milliseconds
+#endif // LORAWAN_RETRY_BACKOFF_MIN
+
+#ifndef LORAWAN_RETRY_BACKOFF_MAX
+#define LORAWAN_RETRY_BACKOFF_MAX 600000 ///< @brief Default longest wait between retries of a confirmed message, in milliseconds
+#endif // LORAWAN_RETRY_BACKOFF_MAX
+
+#ifndef LORAWAN_IDLE_MIN_SLEEP
+#define LORAWAN_IDLE_MIN_SLEEP 2 ///< @brief Shortest idle time, in milliseconds, worth entering light sleep for
+#endif // LORAWAN_IDLE_MIN_SLEEP
+
+#ifndef LORAWAN_IDLE_RADIO_POLL
+#define LORAWAN_IDLE_RADIO_POLL 1 ///< @brief Maximum idle time while radio is busy, on platforms that cannot wake on DIO
+#endif // LORAWAN_IDLE_RADIO_POLL
+
+#ifndef LORAWAN_EVENT_QUEUE_SIZE
+#define LORAWAN_EVENT_QUEUE_SIZE 8 ///< @brief Number of events that may wait for delivery to application in task mode
+#endif // LORAWAN_EVENT_QUEUE_SIZE
+
+#define LORAWAN_IDLE_FOREVER UINT32_MAX ///< @brief Idle time returned when nothing is scheduled
 
 /**
   * @brief SPI pins definition
@@ -39,8 +147,111 @@ typedef struct {
     uint8_t len = 0;
     uint8_t port = 1;
     bool confirmed = false;
+    uint16_t first_record = 0;  ///< @brief Id of first aggregated record carried by this message. 0 if there is none
+    uint8_t records = 0;    ///< @brief Number of aggregated records carried by this message
+    bool backlog = false;   ///< @brief `True` if message carries backlog records
+    uint16_t handle = 0;    ///< @brief Message handle, reported in `uplink_result_t`
+    uint8_t tries = 0;      ///< @brief Times message has been handed to LMIC
+    uint8_t attempts = 0;   ///< @brief Transmissions, including LMIC retransmissions
+    uint8_t datarate = 0;   ///< @brief Datarate of last transmission
+    uint32_t airtime_ms = 0;    ///< @brief Airtime of all transmissions, in milliseconds
+    unsigned long retry_time = 0;   ///< @brief `millis()` when message may be handed to LMIC again, after a failed try
 } send_data_t;
 
+/**
+  * @brief Outcome of an uplink message
+  */
+typedef struct {
+    uint16_t handle = 0;    ///< @brief Handle returned by `send()`
+    bool delivered = false; ///< @brief `True` if message was transmitted, and acknowledged if it is confirmed
+    bool confirmed = false; ///< @brief `True` if message was confirmed
+    bool ack = false;       ///< @brief `True` if network acknowledged message
+    uint8_t tries = 0;      ///< @brief Times library handed message to LMIC
+    uint8_t attempts = 0;   ///< @brief Transmissions, including LMIC retransmissions. 0 if message was discarded before
+    uint8_t datarate = 0;   ///< @brief Datarate of last transmission
+    uint32_t airtime_ms = 0;    ///< @brief Airtime of all transmissions, in milliseconds
+} uplink_result_t;
+
+/**
+  * @brief Library level retry of confirmed messages that get no acknowledge
+  */
+typedef struct {
+    uint8_t max_tries = 1;  ///< @brief Times a confirmed message is handed to LMIC before it is reported as not delivered. 1 disables retries
+    uint8_t dr_step_after = 0;  ///< @brief Datarate is lowered one step every this number of failed tries. 0 keeps datarate
+    uint8_t min_dr = 0;     ///< @brief Datarate is not lowered below this one
+    uint32_t backoff_min_ms = LORAWAN_RETRY_BACKOFF_MIN;    ///< @brief Wait after first failed try. It doubles on every failure
+    uint32_t backoff_max_ms = LORAWAN_RETRY_BACKOFF_MAX;    ///< @brief Longest wait between tries
+} retry_policy_t;
+
+/**
+  * @brief How OTAA join requests are scheduled
+  */
+typedef struct {
+    uint8_t first_dr = DR_SF7;  ///< @brief Datarate of first join request, if no join has succeeded before
+    uint8_t min_dr = 0;     ///< @brief Lowest datarate of sweep. Sweep starts again from first datarate after it
+    uint8_t attempts_per_dr = 1;    ///< @brief Join requests sent at every datarate before stepping down
+    uint8_t dr_step = 1;    ///< @brief Datarate steps lowered every time
+    uint32_t backoff_min_ms = LORAWAN_JOIN_BACKOFF_MIN; ///< @brief Wait after first failed attempt. It doubles on every failure
+    uint32_t backoff_max_ms = LORAWAN_JOIN_BACKOFF_MAX; ///< @brief Longest wait between attempts, before duty cycle limits
+    uint32_t start_jitter_ms = 0;   ///< @brief First join request is delayed a random time up to this, so that nodes powered on together do not collide
+} join_policy_t;
+
+/**
+  * @brief Join statistics. They describe last successful join while node is joined, and current one while it is joining
+  */
+typedef struct {
+    uint16_t attempts = 0;  ///< @brief Join requests sent. 0 if unknown
+    uint32_t time_ms = 0;   ///< @brief Time from start of join until JoinAccept, in milliseconds
+    uint32_t airtime_ms = 0;    ///< @brief Airtime of all join requests, in milliseconds
+    uint8_t datarate = 0;   ///< @brief Datarate of last join request
+} join_stats_t;
+
+/**
+  * @brief Downlink message and reception metadata
+  */
+typedef struct {
+    uint8_t data[MAX_LEN_PAYLOAD];  ///< @brief Payload
+    uint8_t len = 0;        ///< @brief Payload length
+    uint8_t port = 0;       ///< @brief LoRaWAN port
+    int16_t rssi = 0;       ///< @brief Reception RSSI in dBm
+    int8_t snr = 0;         ///< @brief Reception SNR in 0.25 dB steps
+    uint32_t timestamp = 0; ///< @brief `millis()` on reception
+} downlink_t;
+
+/**
+  * @brief Deferred downlink delivery statistics
+  */
+typedef struct {
+    uint32_t received = 0;  ///< @brief Downlinks received from LMIC
+    uint32_t delivered = 0; ///< @brief Downlinks passed to application
+    uint32_t dropped = 0;   ///< @brief Downlinks lost because queue was full
+    uint8_t max_pending = 0;    ///< @brief Highest number of downlinks waiting at the same time
+    uint32_t max_latency = 0;   ///< @brief Longest time a downlink waited for delivery, in milliseconds
+} downlink_stats_t;
+
+/**
+  * @brief Event waiting for delivery to application in task mode
+  */
+typedef struct {
+    ev_t event; ///< @brief LMIC event
+    bool ack;   ///< @brief Acknowledge flag, for `EV_TXCOMPLETE`
+} queued_event_t;
+
+/**
+  * @brief Behaviour of uplink queue when a message is sent while it is full
+  */
+typedef enum {
+    QUEUE_DROP_NEWEST = 0,  ///< @brief New message is rejected and queue is kept untouched
+    QUEUE_DROP_OLDEST = 1   ///< @brief Oldest waiting message is discarded to make room for the new one
+} queue_overflow_policy_t;
+
+/**
+  * @brief What to do with a message that does not fit in airtime budget
+  */
+typedef enum {
+    AIRTIME_DEFER = 0,  ///< @brief Message is kept in queue until budget allows it
+    AIRTIME_REJECT = 1  ///< @brief Message is rejected when it is sent
+} airtime_policy_t;
 
 /**
   * @brief Struct to store counters persistently
@@ -50,16 +261,90 @@ typedef struct {
     u4_t down_counter = 0;
 } link_counters_t;
 
-// typedef struct {
-//     u4_t netid = 0;
-//     devaddr_t devaddr = 0;
-//     u1_t nwkKey[16];
-//     u1_t artKey[16];
-// } otaa_data_t;
+/**
+  * @brief How session data and counters are stored in filesystem
+  */
+typedef enum {
+    STORAGE_FILES = 0,  ///< @brief Every save rewrites the older of two files, so that the newer one survives a power loss
+    STORAGE_JOURNAL = 1 ///< @brief Every save appends a record to a preallocated journal file
+} storage_mode_t;
+
+/**
+  * @brief Persistent storage activity counters
+  */
+typedef struct {
+    uint32_t counter_writes = 0;    ///< @brief Number of times counters file has been written
+    uint32_t counter_writes_avoided = 0;    ///< @brief Number of uplinks whose counter was already covered by a reserved block
+} persistence_stats_t;
 
-typedef std::function<void (u4_t* netid, devaddr_t* devaddr, xref2u1_t nwkKey, xref2u1_t artKey)> on_joined_cb_t;
-typedef std::function<void (bool ack)> on_tx_complete_cb_t;
-typedef std::function<void (uint8_t port, const uint8_t* pMessage, size_t nMessage)> on_rx_data_cb_t;
+#define SESSION_RECORD_MAGIC 0x53574C51 ///< @brief Session file signature ("QLWS")
+#define SESSION_RECORD_VERSION 4 ///< @brief Current session file format version
+
+/**
+  * @brief Duty cycle state of a band, as stored in session file
+  */
+typedef struct __attribute__ ((packed)) {
+    u2_t txcap;     ///< @brief Duty cycle limitation: 1/txcap
+    s1_t txpow;     ///< @brief Maximum TX power
+    u1_t lastchnl;  ///< @brief Last used channel
+    s4_t avail;     ///< @brief Time until band is available, relative to save time
+} session_band_t;
+
+/**
+  * @brief Subset of LMIC context needed to resume a session without rejoining.
+  *
+  *        This is what is stored in filesystem instead of the whole `lmic_t`, so that session survives LMIC and
+  *        compiler updates. Fields are only appended in new versions. `length` tells where `crc` is
+  */
+typedef struct __attribute__ ((packed)) {
+    uint32_t magic;     ///< @brief Must be `SESSION_RECORD_MAGIC`
+    uint8_t version;    ///< @brief Format version
+    uint8_t reserved;
+    uint16_t length;    ///< @brief Bytes covered by CRC, from start of record. CRC comes right after them
+    u4_t netid;         ///< @brief Network ID
+    devaddr_t devaddr;  ///< @brief Device address. 0 means no session
+    u1_t nwkKey[16];    ///< @brief Network session key
+    u1_t artKey[16];    ///< @brief Application session key
+    u1_t datarate;      ///< @brief Current data rate
+    s1_t adrTxPow;      ///< @brief ADR adjusted TX power
+    u1_t adrEnabled;    ///< @brief ADR mode
+    s2_t adrAckReq;     ///< @brief ADR acknowledge request counter
+    u1_t rx1DrOffset;   ///< @brief RX1 data rate offset
+    u1_t dn2Dr;         ///< @brief RX2 data rate
+    u4_t dn2Freq;       ///< @brief RX2 frequency
+    u1_t rxDelay;       ///< @brief RX1 delay
+    u1_t globalDutyRate;    ///< @brief Global duty cycle rate: 1/2^k
+    s4_t globalDutyAvail;   ///< @brief Time until global duty cycle allows next TX, relative to save time
+#if CFG_LMIC_EU_like
+    session_band_t bands[MAX_BANDS];    ///< @brief Duty cycle state of every band
+    u4_t channelFreq[MAX_CHANNELS];     ///< @brief Channel frequencies
+    u2_t channelDrMap[MAX_CHANNELS];    ///< @brief Enabled data rates for every channel
+    u2_t channelMap;    ///< @brief Enabled channels
+#elif CFG_LMIC_US_like
+    u2_t channelMap[(72 + 15) / 16];    ///< @brief Enabled channels
+    u2_t activeChannels125khz;  ///< @brief Number of enabled 125 kHz channels
+    u2_t activeChannels500khz;  ///< @brief Number of enabled 500 kHz channels
+#endif
+    // Version 2
+    u4_t saved_clock;   ///< @brief Wall clock at save time, in seconds. 0 if clock was not set
+    u4_t sleep_ms;      ///< @brief Deep sleep duration announced with `prepare_sleep()`. 0 if unknown
+    // Version 3
+    u1_t join_dr;       ///< @brief Datarate of accepted join request
+    u2_t join_attempts; ///< @brief Join requests sent in last join. 0 if unknown
+    u4_t join_time_ms;  ///< @brief Duration of last join, in milliseconds
+    u4_t join_airtime_ms;   ///< @brief Airtime of last join, in milliseconds
+    // Version 4
+    airtime_snapshot_t fair_use;    ///< @brief Fair use airtime window. `age_ms` is relative to save time
+    uint32_t crc;       ///< @brief CRC32 of the first `length` bytes
+} session_record_t;
+
+typedef LoRaDelegate<void (u4_t* netid, devaddr_t* devaddr, xref2u1_t nwkKey, xref2u1_t artKey)> on_joined_cb_t;
+typedef LoRaDelegate<void (bool ack)> on_tx_complete_cb_t;
+typedef LoRaDelegate<void (uint8_t port, const uint8_t* pMessage, size_t nMessage)> on_rx_data_cb_t;
+typedef LoRaDelegate<void (uint16_t record_id, bool delivered)> on_record_status_cb_t;
+typedef LoRaDelegate<void (const downlink_t& downlink)> on_downlink_cb_t;
+typedef LoRaDelegate<void (const uplink_result_t& result)> on_uplink_complete_cb_t;
+typedef LoRaDelegate<void (ev_t event), sizeof (void*)> on_event_cb_t; ///< @brief Smaller storage, as there is one per event
 
 class LoRaWAN {
 public:
@@ -78,20 +363,442 @@ public:
     void init ();
 
     /**
-     * @brief Asks LMIC to send this data as soon as it is ready to do so
+     * @brief Runs LMIC in a dedicated task, so that blocking application code cannot make it miss RX windows.
+     *        It has to be called before `init()`, which starts the task. Calling it with `false` after `init()`
+     *        stops the task, LMIC is then run from `loop()` again.
+     *
+     *        In task mode application keeps calling `loop()`, which delivers downlinks, events and log output in
+     *        application context: `on_joined()`, `on_tx_complete()`, `on_uplink_complete()`, `on_rx_data()`,
+     *        `on_downlink()` and `subscribe()` callbacks. Only `on_record_status()` callbacks run in radio task. Sending functions may be called from
+     *        any task. Configuration functions should only be used before `init()`.
+     *
+     *        Only available on ESP32 and host builds
+     *
+     * @param enable `True` to run LMIC in its own task
+     * @param core ESP32 core the task is pinned to
+     * @param priority Task priority
+     * @return `True` if mode was set
+     */
+    bool set_task_mode (bool enable, int core = LORAWAN_TASK_CORE, uint8_t priority = LORAWAN_TASK_PRIORITY);
+
+    /**
+     * @brief Checks if LMIC runs in its own task
+     * @return `True` if radio task is running
+     */
+    bool is_task_running () {
+        return task.is_running ();
+    }
+
+    /**
+     * @brief Gets number of events lost because event queue was full, in task mode
+     * @return Dropped events since boot
+     */
+    uint32_t get_events_dropped () {
+        return events_dropped;
+    }
+
+    /**
+     * @brief Queues data to be sent by LMIC as soon as it is ready to do so.
+     *
+     *        Messages are sent in order, one after each `EV_TXCOMPLETE`. If queue is full, result depends on
+     *        overflow policy set with `set_queue_overflow_policy()`. Outcome of message is reported to
+     *        `on_uplink_complete()` callback with returned handle. Payload longer than `max_payload()` at current
+     *        datarate is rejected. A queued message that does not fit after a datarate change is discarded
+     *
+     * @param data Data buffer to be sent
+     * @param len Data length
+     * @param port LoRaWAN port
+     * @param confirmed `True` if node requires this message to be confirmed
+     * @return Message handle. 0 if packet was not queued
+     */
+    uint16_t send (const uint8_t* data, size_t len, uint8_t port = 1, bool confirmed = false);
+
+    /**
+     * @brief Queues data to be sent by LMIC as soon as it is ready to do so. Same as `send()`
      * @param data Data buffer to be sent
      * @param len Data length
      * @param port LoRaWAN port
      * @param confirmed `True` if node requires this message to be confirmed
-     * @return `True`if packet was accepted
+     * @return `True` if packet was queued
      */
-    bool send_data_inmediate (uint8_t* data, size_t len, uint8_t port = 1, bool confirmed = false);
+    bool send_data_inmediate (uint8_t* data, size_t len, uint8_t port = 1, bool confirmed = false) {
+        return send (data, len, port, confirmed) != 0;
+    }
+
+    /**
+     * @brief Configures a function to be called with the outcome of every uplink message: handle, acknowledge,
+     *        transmissions, datarate and airtime. Every queued message gets a handle, including aggregated, fragment
+     *        and backlog frames, and it is reported once, when it is delivered or given up
+     * @param cb Callback function
+     */
+    void on_uplink_complete (on_uplink_complete_cb_t cb) {
+        on_uplink_complete_cb = cb;
+    }
+
+    /**
+     * @brief Sets library level retry of confirmed messages. An unacknowledged message is kept at queue front and
+     *        handed to LMIC again after a random wait between half and all of current backoff, so that nodes that
+     *        lost the same gateway do not retry together. LMIC duty cycle and airtime budgets still apply to every
+     *        try. Messages behind it wait, so that order is kept.
+     *
+     *        LMIC may retransmit a confirmed frame on its own before reporting it. Those transmissions are counted
+     *        in `uplink_result_t::attempts`
+     *
+     * @param policy Retry policy
+     */
+    void set_retry_policy (const retry_policy_t& policy) {
+        retry_policy = policy;
+    }
+
+    /**
+     * @brief Sets how join requests are scheduled.
+     *
+     *        First request uses datarate of last successful join, if it is known, or `first_dr`. After every
+     *        `attempts_per_dr` failed requests datarate is lowered `dr_step` steps, down to `min_dr`, and then sweep
+     *        starts again. Wait between requests is random between half and all of current backoff, and never shorter
+     *        than band duty cycle or join duty cycle limits: 36 s of airtime in first hour, 36 s in next 10 hours
+     *        and 8.7 s every 24 hours after that. It has to be called before `init()` or `rejoin()`
+     *
+     * @param policy Join policy
+     */
+    void set_join_policy (const join_policy_t& policy) {
+        join_policy = policy;
+    }
+
+    /**
+     * @brief Gets join statistics. They are stored with session, so they survive reboots
+     * @return Statistics of last join, or of join in progress
+     */
+    const join_stats_t& get_join_stats () {
+        return join_stats;
+    }
+
+    /**
+     * @brief Drops current session and joins again with join policy. Stored session is invalidated, so a reboot
+     *        joins too. Queued messages are sent after join
+     */
+    void rejoin ();
+
+    /**
+     * @brief Reserves next free uplink queue slot, so that application can write message payload directly into it,
+     *        avoiding a copy. Message is queued by `commit_uplink()`.
+     *
+     *        If queue is full overflow policy is applied at this moment. While a reservation is open other messages
+     *        cannot be queued, so it should be committed or cancelled right after payload is written
+     *
+     * @param capacity Returns maximum payload length at current datarate
+     * @return Payload buffer. `NULL` if there is no free slot or a reservation is already open
+     */
+    uint8_t* reserve_uplink (size_t* capacity);
+
+    /**
+     * @brief Queues message written in buffer returned by `reserve_uplink()`
+     * @param len Payload length. It cannot exceed reserved capacity
+     * @param port LoRaWAN port
+     * @param confirmed `True` if node requires this message to be confirmed
+     * @return `True` if packet was queued. Reservation is released in any case
+     */
+    bool commit_uplink (size_t len, uint8_t port = 1, bool confirmed = false);
+
+    /**
+     * @brief Releases reserved slot without sending anything
+     */
+    void cancel_uplink () {
+        LoRaTaskGuard guard (task);
+        tx_reserved = false;
+    }
+
+    /**
+     * @brief Encodes values with a payload schema directly into uplink queue and queues the message.
+     *        Nothing is copied or allocated. Payload is rejected if it is longer than maximum payload at
+     *        current datarate. `Schema::max_size` may be checked against `get_max_payload()` in advance
+     * @tparam Schema `LoRaSchema` type describing payload layout
+     * @param values Field values
+     * @param port LoRaWAN port
+     * @param confirmed `True` if node requires this message to be confirmed
+     * @return `True` if packet was queued
+     */
+    template <typename Schema>
+    bool send_encoded (const typename Schema::values_t& values, uint8_t port = 1, bool confirmed = false) {
+        size_t capacity;
+        uint8_t* payload = reserve_uplink (&capacity);
+        if (!payload) {
+            return false;
+        }
+        size_t len = Schema::encode (values, payload, capacity);
+        if (!len) {
+            LORAWAN_LOG_WARN ("Encoded payload does not fit in %u bytes\n", capacity);
+            cancel_uplink ();
+            return false;
+        }
+        return commit_uplink (len, port, confirmed);
+    }
+
+    /**
+     * @brief Packs as many buffered time series samples as fit in maximum payload of current datarate, directly
+     *        into uplink queue. Packed samples are removed from series once message is queued.
+     *
+     *        `series.fills (get_max_payload ())` tells when there are enough samples to fill a frame
+     *
+     * @param series Sample buffer
+     * @param port LoRaWAN port
+     * @param confirmed `True` if node requires this message to be confirmed
+     * @return `True` if packet was queued
+     */
+    bool send_series (LoRaSeries& series, uint8_t port = 1, bool confirmed = false);
+
+    /**
+     * @brief Sends a data block longer than maximum payload as a sequence of unconfirmed fragments, followed by
+     *        `redundancy` parity fragments. Receiver rebuilds the block from any set of fragments that is
+     *        large enough, so some of them may be lost. See `lorawan_frag.h` for frame format and
+     *        `LoRaFragReassembler` for a reference receiver.
+     *
+     *        Fragment size is maximum payload of current datarate minus fragment header, and it is kept for the whole
+     *        block. If datarate gets lower, so that fragments do not fit anymore, block is aborted. Fragments are fed
+     *        to uplink queue from `loop()`, one at a time while it holds fewer than `LORAWAN_FRAG_QUEUE_DEPTH`
+     *        messages, so other uplinks may be sent in between.
+     *
+     *        Data is not copied. It has to be kept unchanged until `get_fragments_pending()` returns 0
+     *
+     * @param data Data block
+     * @param len Block length. Up to `LORAWAN_FRAG_MAX_FRAGMENTS` fragments
+     * @param redundancy Number of parity fragments. Data and parity fragments together cannot be more than
+     *                   `LORAWAN_FRAG_MAX_INDEX`
+     * @param port LoRaWAN port
+     * @return `True` if block was accepted. `False` if another block is being sent or it needs too many fragments
+     */
+    bool send_fragmented (const uint8_t* data, size_t len, uint16_t redundancy, uint8_t port = LORAWAN_FRAG_PORT);
+
+    /**
+     * @brief Gets number of fragments of current block not queued yet
+     * @return Pending fragments. 0 if no block is being sent
+     */
+    uint16_t get_fragments_pending () {
+        return frag_next ? fragmenter.get_total () - frag_next + 1 : 0;
+    }
+
+    /**
+     * @brief Stops sending current fragmented block. Fragments already queued are still sent
+     */
+    void cancel_fragmented () {
+        LoRaTaskGuard guard (task);
+        frag_next = 0;
+    }
+
+    /**
+     * @brief Enables persistent uplink backlog on configured filesystem. Records sent with `send_persistent()` wait
+     *        there until they are delivered, across link outages and resets. See `lorawan_backlog.h`.
+     *
+     *        Backlog is drained one frame at a time, when uplink queue is empty, filling maximum payload of current
+     *        datarate. An undelivered frame is retried after `LORAWAN_BACKLOG_RETRY_MIN`, doubling up to
+     *        `LORAWAN_BACKLOG_RETRY_MAX`, and then cached records are written to file
+     *
+     * @param aggregate_port If not 0, when several records are pending, consecutive records with the same port are
+     *        packed in a single frame sent to this port: original port byte, then every record as a length byte
+     *        followed by record data. 0 sends every record alone on its own port
+     * @param confirmed `True` to release records only when frame is acknowledged. Unconfirmed frames count as delivered
+     *        once transmitted, so records sent during a gateway outage are lost
+     * @return `True` if backlog files could be opened
+     */
+    bool enable_backlog (uint8_t aggregate_port = 0, bool confirmed = true);
+
+    /**
+     * @brief Adds a record to persistent backlog, to be sent as soon as possible
+     * @param data Record data
+     * @param len Record length, up to `LORAWAN_BACKLOG_RECORD_SIZE`
+     * @param port LoRaWAN port
+     * @return `True` if record was stored
+     */
+    bool send_persistent (const uint8_t* data, uint8_t len, uint8_t port = 1);
+
+    /**
+     * @brief Writes backlog records still in RAM cache to file. It is done by `prepare_sleep()` too
+     * @return `True` if no record is left in cache
+     */
+    bool flush_backlog () {
+        LoRaTaskGuard guard (task);
+        return !backlog_enabled || backlog.flush ();
+    }
+
+    /**
+     * @brief Gets number of records waiting in backlog
+     * @return Pending records
+     */
+    size_t get_backlog_length () {
+        return backlog.length ();
+    }
+
+    /**
+     * @brief Gets number of backlog records lost because backlog file was full or corrupted
+     * @return Dropped records since boot
+     */
+    uint32_t get_backlog_dropped () {
+        return backlog.get_dropped ();
+    }
+
+    /**
+     * @brief Sets what to do when a message is sent while uplink queue is full
+     * @param policy `QUEUE_DROP_NEWEST` to reject new message, `QUEUE_DROP_OLDEST` to replace oldest waiting one
+     */
+    void set_queue_overflow_policy (queue_overflow_policy_t policy) {
+        overflow_policy = policy;
+    }
+
+    /**
+     * @brief Gets number of messages waiting in uplink queue, including the one being transmitted
+     * @return Queued messages
+     */
+    size_t get_queue_length () {
+        return tx_queue_count;
+    }
+
+    /**
+     * @brief Gets number of messages discarded because uplink queue was full
+     * @return Dropped messages since boot
+     */
+    uint32_t get_queue_dropped () {
+        return tx_queue_dropped;
+    }
+
+    /**
+     * @brief Configures record aggregation. Records added with `append_record()` are packed together and sent
+     *        as a single message.
+     *
+     *        Every record is stored in the frame as a length byte followed by record data, so that application server
+     *        can split them again. A frame is queued when next record does not fit in maximum payload of current
+     *        datarate, when oldest record in it reaches `max_age_ms` or when `flush_records()` is called
+     *
+     * @param port LoRaWAN port used for aggregated frames
+     * @param max_age_ms Maximum time a record may wait for more records, in milliseconds. 0 disables age flush
+     * @param confirmed `True` if aggregated frames require confirmation
+     */
+    void set_aggregation (uint8_t port, uint32_t max_age_ms = 0, bool confirmed = false) {
+        LoRaTaskGuard guard (task);
+        aggregate.port = port;
+        aggregate.confirmed = confirmed;
+        aggregate_max_age = max_age_ms;
+    }
+
+    /**
+     * @brief Adds a record to aggregated frame
+     * @param data Record data
+     * @param len Record length. It must fit in maximum payload of current datarate together with its length byte
+     * @return Record id, to be matched in `on_record_status()` callback. 0 if record could not be added
+     */
+    uint16_t append_record (const uint8_t* data, uint8_t len);
+
+    /**
+     * @brief Queues aggregated frame right now, if it holds any record
+     * @return `True` if frame was queued or there was nothing to send
+     */
+    bool flush_records ();
+
+    /**
+     * @brief Gets number of records waiting in aggregated frame, not queued yet
+     * @return Pending records
+     */
+    uint8_t get_pending_records () {
+        return aggregate.records;
+    }
+
+    /**
+     * @brief Configures a function to be called with the fate of every aggregated record. A record is delivered when
+     *        its frame has been transmitted, and acknowledged if frame is confirmed. It is lost if its frame is discarded
+     * @param cb Callback function
+     */
+    void on_record_status (on_record_status_cb_t cb) {
+        on_record_status_cb = cb;
+    }
+
+    /**
+     * @brief Calculates time on air of an uplink message
+     * @param len Application payload length
+     * @param dr Datarate
+     * @return Time on air in milliseconds, including LoRaWAN MAC overhead
+     */
+    uint32_t time_on_air (uint8_t len, dr_t dr);
+
+    /**
+     * @brief Calculates time on air of an uplink message at current datarate
+     * @param len Application payload length
+     * @return Time on air in milliseconds, including LoRaWAN MAC overhead
+     */
+    uint32_t time_on_air (uint8_t len) {
+        return time_on_air (len, LMIC.datarate);
+    }
+
+    /**
+     * @brief Sets network fair use airtime budget (e.g. 30 seconds a day on public networks).
+     *
+     *        Airtime of every transmission, including join requests and retries, is accounted on a rolling window.
+     *        Band duty cycle is accounted the same way on a `LORAWAN_BAND_DUTY_WINDOW` window.
+     *
+     *        Fair use window is stored with session, so it is kept across deep sleep and reboots. Time spent off is
+     *        discounted as with LMIC duty cycle, when it is known. Otherwise airtime used before reboot is counted
+     *        as if no time had passed. Band windows start empty on every boot, but LMIC band availability is kept
+     *        with session, so duty cycle is still enforced. Call it before `init()`, as it clears the window
+     *
+     * @param budget_ms Allowed airtime in milliseconds. 0 disables fair use budget
+     * @param window_ms Window length in milliseconds
+     */
+    void set_fair_use_budget (uint32_t budget_ms, uint32_t window_ms = LORAWAN_FAIR_USE_WINDOW) {
+        fair_use_budget = budget_ms;
+        fair_use.begin (window_ms);
+    }
+
+    /**
+     * @brief Sets what to do with messages that do not fit in airtime budget
+     * @param policy `AIRTIME_DEFER` (default) to wait in queue until they fit, `AIRTIME_REJECT` to reject them
+     *               in `send_data_inmediate()`
+     */
+    void set_airtime_policy (airtime_policy_t policy) {
+        airtime_policy = policy;
+    }
+
+    /**
+     * @brief Calculates when a message could be transmitted, considering LMIC duty cycle state and airtime budgets.
+     *        Messages already in queue are not considered
+     * @param len Application payload length
+     * @return Time to wait in milliseconds. 0 if it could be sent now, `AIRTIME_NEVER` if it does not fit in budget
+     */
+    uint32_t next_tx_possible (uint8_t len = 0);
+
+    /**
+     * @brief Gets airtime used inside fair use window
+     * @return Used airtime in milliseconds
+     */
+    uint32_t get_airtime_used () {
+        return fair_use.used (millis ());
+    }
 
     /**
      * @brief Do periodic tasks inside library and LMIC behind
      */
     void loop ();
 
+    /**
+     * @brief Gets how long `loop()` may be left uncalled, considering LMIC scheduled jobs, pending log entries
+     *        and downlinks and record aggregation age. Radio interrupts are not predictable, so while radio is
+     *        busy DIO lines have to be watched too, as `idle()` does
+     * @return Time in milliseconds. 0 if `loop()` has work to do now, `LORAWAN_IDLE_FOREVER` if nothing is scheduled
+     */
+    uint32_t get_idle_time ();
+
+    /**
+     * @brief Lets CPU rest until `loop()` has work to do, a DIO line rises or `max_ms` pass.
+     *
+     *        On ESP32 CPU enters light sleep, woken by timer or DIO pins in `lmic_pins`. On ESP8266 it waits with
+     *        `delay()`, so that SDK can enter automatic light sleep, but only for `LORAWAN_IDLE_RADIO_POLL` ms while
+     *        radio is busy, as DIO lines are polled. Waits shorter than `LORAWAN_IDLE_MIN_SLEEP` ms only yield.
+     *
+     *        Typical use is calling `lorawan.loop ()` and then `lorawan.idle (time_to_next_app_task)` in `loop()`
+     *
+     * @param max_ms Maximum idle time in milliseconds. Application tasks that are not driven by library have to be
+     *               considered here, as CPU does not wake up for them
+     * @return Time actually spent idle, in milliseconds
+     */
+    uint32_t idle (uint32_t max_ms);
+
     /**
      * @brief Configures a function to be called when node is joined to network using OTAA
      * @param cb Callback function
@@ -116,6 +823,59 @@ public:
         on_rx_data_cb = cb;
     }
     
+    /**
+     * @brief Configures a function to be called when LMIC reports an event. There is one subscriber per event,
+     *        and it is called after library has processed the event
+     * @param event LMIC event
+     * @param cb Callback function. A lambda may capture a single pointer or reference. `nullptr` removes subscriber
+     * @return `True` if event is valid
+     */
+    bool subscribe (ev_t event, on_event_cb_t cb) {
+        if (event >= LORAWAN_EVENT_COUNT) {
+            return false;
+        }
+        event_subscribers[event] = cb;
+        return true;
+    }
+
+    /**
+     * @brief Configures a function to be called with every downlink message and its reception metadata.
+     *        It is called after `on_rx_data()` callback, from the same context
+     * @param cb Callback function
+     */
+    void on_downlink (on_downlink_cb_t cb) {
+        on_downlink_cb = cb;
+    }
+
+    /**
+     * @brief Enables deferred downlink delivery.
+     *
+     *        By default downlink callbacks run inside LMIC receive path, so a slow handler delays MAC processing.
+     *        In deferred mode every downlink is copied to a queue of `LORAWAN_RX_QUEUE_SIZE` messages and callbacks
+     *        are called from `loop()`. If queue is full new downlinks are dropped and counted
+     *
+     * @param enable `True` to deliver downlinks from `loop()`
+     */
+    void set_rx_deferred (bool enable) {
+        rx_deferred = enable;
+    }
+
+    /**
+     * @brief Gets number of downlinks waiting for delivery in deferred mode
+     * @return Pending downlinks
+     */
+    uint8_t get_downlink_pending () {
+        return rx_queue_count;
+    }
+
+    /**
+     * @brief Gets deferred downlink delivery statistics
+     * @return Statistics since boot
+     */
+    const downlink_stats_t& get_downlink_stats () {
+        return downlink_stats;
+    }
+
     /**
      * @brief Configures an already initialized filesystem to store session data. This is recommended for OTAA nodes
      * @param fs Filesystem
@@ -124,6 +884,108 @@ public:
         file_system = fs;
     }
 
+    /**
+     * @brief Selects how session data and counters are stored. It has to be called before `init()`.
+     *
+     *        In journal mode, if journal files are empty, session is read from files once and saved in journal
+     *        from then on
+     *
+     * @param mode `STORAGE_FILES` (default) or `STORAGE_JOURNAL`
+     */
+    void set_storage_mode (storage_mode_t mode) {
+        storage_mode = mode;
+    }
+
+    /**
+     * @brief Enables session resume from RTC memory, for nodes that deep sleep between uplinks. It has to be called before `init()`.
+     *
+     *        A checksummed copy of session and counters is kept in RTC memory (`RTC_DATA_ATTR` on ESP32, RTC user memory
+     *        on ESP8266) and updated after every uplink. If it is valid on boot, filesystem is not read at all.
+     *        Session is written to filesystem only once every `fs_save_cycles` uplinks, and counters reservation is
+     *        raised to at least that value so that a power loss never makes uplink counter go back
+     *
+     * @param enable `True` to enable RTC memory resume
+     * @param fs_save_cycles Number of uplinks between filesystem saves
+     */
+    void set_rtc_resume (bool enable, uint8_t fs_save_cycles = LORAWAN_RTC_FS_SAVE_CYCLES) {
+        rtc_resume = enable;
+        rtc_fs_save_cycles = fs_save_cycles ? fs_save_cycles : 1;
+    }
+
+    /**
+     * @brief Saves session right before deep sleep, so that duty cycle wait can be carried over to next boot.
+     *
+     *        Remaining duty cycle wait of every band is stored together with sleep duration. On resume after a deep
+     *        sleep wake, or with wall clock set (e.g. by NTP), elapsed time is discounted so that node may transmit
+     *        at the earliest legal moment. If elapsed time is unknown the whole remaining wait is kept.
+     *        Backlog records still in RAM cache are written to file
+     *
+     * @param sleep_ms Deep sleep duration in milliseconds
+     * @return `True` if session was saved
+     */
+    bool prepare_sleep (uint32_t sleep_ms);
+
+    /**
+     * @brief Checks if session was restored from RTC memory on last `init()`
+     * @return `True` if filesystem was skipped on resume
+     */
+    bool is_rtc_resumed () {
+        return rtc_resumed;
+    }
+
+    /**
+     * @brief Enables frame counter reservation to reduce flash writes.
+     *
+     *        Counters file stores uplink counter plus `block` and it is only written again when that value is reached
+     *        or a downlink changes down counter. After a reboot uplink counter restarts from stored value, so some
+     *        counter values are skipped but never repeated
+     *
+     * @param block Number of uplink counter values to reserve on every write. 0 writes counters after every uplink
+     */
+    void set_counter_reservation (uint16_t block) {
+        counter_reservation = block;
+    }
+
+    /**
+     * @brief Gets persistent storage activity counters
+     * @return Storage statistics since boot
+     */
+    const persistence_stats_t& get_persistence_stats () {
+        return persistence_stats;
+    }
+
+    /**
+     * @brief Gets runtime metrics: uplink and join outcomes, airtime per datarate, downlinks per port, storage writes
+     *        and `loop()` latency
+     * @return Metrics since `init()` or last `clear_stats()`
+     */
+    const node_stats_t& stats () {
+        return metrics;
+    }
+
+    /**
+     * @brief Resets runtime metrics
+     */
+    void clear_stats ();
+
+    /**
+     * @brief Exports runtime metrics in compact binary format, described in `lorawan_stats.h`
+     * @param buffer Output buffer
+     * @param size Buffer size. Sections that do not fit are left out
+     * @param sections Bitmap of `stats_section_t` to export
+     * @return Exported length. 0 if no section fits
+     */
+    size_t export_stats (uint8_t* buffer, size_t size, uint8_t sections = STATS_ALL);
+
+    /**
+     * @brief Queues an uplink with runtime metrics. Sections that do not fit in maximum payload of current datarate
+     *        are left out
+     * @param port LoRaWAN port
+     * @param sections Bitmap of `stats_section_t` to send
+     * @return `True` if message was queued
+     */
+    bool send_stats (uint8_t port = LORAWAN_STATS_PORT, uint8_t sections = STATS_ALL);
+
     /**
      * @brief Returns node join status
      * @return For OTAA nodes `true` if node is joined to network and `false` otherwise. For ABP nodes it always returns `true`
@@ -155,11 +1017,95 @@ public:
         LMIC_setAdrMode (enabled);
     }
 
+    /**
+     * @brief Gets name of current datarate in human readable form, like "SF7". Does not allocate memory
+     * @return Datarate name, in flash. "Unknown" if datarate is not in region table
+     */
+    const char* sf_name () {
+        return lorawan_datarate (LMIC.datarate).name;
+    }
+
     /**
      * @brief Gets a string that represents spread factor mode in human readable form
      * @return Spread factor name
+     * @deprecated Builds a `String` on every call. Use `sf_name()`
+     */
+    String getSFStr () {
+        return String (sf_name ());
+    }
+
+    /**
+     * @brief Gets maximum application payload length allowed at current datarate, without MAC options
+     * @return Maximum payload length in bytes. 0 if datarate is not valid
+     */
+    uint8_t max_payload () {
+        uint8_t limit = lorawan_datarate (LMIC.datarate).max_payload;
+        return limit < MAX_LEN_PAYLOAD ? limit : (uint8_t)MAX_LEN_PAYLOAD;
+    }
+
+    /**
+     * @brief Gets maximum application payload length allowed at current datarate, without MAC options
+     * @return Maximum payload length in bytes. 0 if datarate is not valid
+     */
+    uint8_t get_max_payload () {
+        return max_payload ();
+    }
+
+    /**
+     * @brief Gets physical bitrate of current datarate
+     * @return Bitrate in bit/s. 0 if datarate is not valid
+     */
+    uint32_t bitrate () {
+        return lorawan_datarate (LMIC.datarate).bitrate;
+    }
+
+    /**
+     * @brief Gets link quality statistics from every downlink, ack and JoinAccept received
+     * @return Link quality since `init()` or last `reset_link_quality()`
+     */
+    const link_quality_t& link_quality () {
+        return link.get ();
+    }
+
+    /**
+     * @brief Clears link quality statistics, for instance after node is moved
+     */
+    void reset_link_quality () {
+        link.reset ();
+    }
+
+    /**
+     * @brief Estimates link margin over demodulation floor at a datarate, from lowest SNR of last receptions.
+     *        Link is assumed to be symmetric
+     * @param dr Datarate
+     * @return Margin in 0.25 dB steps. `LORAWAN_LINK_NO_MARGIN` if nothing has been received
+     */
+    int16_t link_margin (uint8_t dr) {
+        return link.margin (dr);
+    }
+
+    /**
+     * @brief Estimates link margin at current datarate
+     * @return Margin in 0.25 dB steps. `LORAWAN_LINK_NO_MARGIN` if nothing has been received
+     */
+    int16_t link_margin () {
+        return link.margin (LMIC.datarate);
+    }
+
+    /**
+     * @brief Sets local datarate and power selection. While ADR is disabled, before first try of every message
+     *        library picks fastest datarate that keeps target margin and lowest power that keeps it at that
+     *        datarate, among those where message fits. Every confirmed uplink that gets no acknowledge lowers
+     *        estimated margin, so power is raised and then datarate lowered until one gets through.
+     *
+     *        Retries of confirmed messages keep datarate of retry policy. Datarate and power are left as they are
+     *        while there is no recent reception
+     *
+     * @param policy Datarate and power policy
      */
-    String getSFStr ();
+    void set_link_policy (const link_policy_t& policy) {
+        link_policy = policy;
+    }
 
     /**
      * @brief Gets current LoRa module RF power
@@ -182,11 +1128,85 @@ private:
     SPI_pins_t spi_pins; ///< @brief SPI pin configuration
     osjob_t sendjob;    ///< @brief Message send job handler
     osjob_t initjob;    ///< @brief Initialization job handler
-    send_data_t job_data;   ///< @brief Data to send and metadata
+    send_data_t tx_queue[LORAWAN_TX_QUEUE_SIZE]; ///< @brief Uplink ring buffer. Front message is the one handed to LMIC
+    uint8_t tx_queue_head = 0;  ///< @brief Index of oldest message in `tx_queue`
+    uint8_t tx_queue_count = 0; ///< @brief Number of messages in `tx_queue`
+    bool tx_in_flight = false;  ///< @brief `True` while front message is owned by LMIC, until `EV_TXCOMPLETE`
+    bool tx_reserved = false;   ///< @brief `True` while slot after last queued message is reserved by application
+    uint8_t tx_reserved_capacity = 0;   ///< @brief Payload capacity announced on reservation
+    uint32_t tx_queue_dropped = 0;  ///< @brief Messages lost because of queue overflow or LMIC rejection
+    queue_overflow_policy_t overflow_policy = QUEUE_DROP_NEWEST; ///< @brief Behaviour on full queue
+    downlink_t rx_queue[LORAWAN_RX_QUEUE_SIZE]; ///< @brief Downlinks waiting for delivery in deferred mode
+    uint8_t rx_queue_head = 0;  ///< @brief Index of oldest downlink in `rx_queue`
+    uint8_t rx_queue_count = 0; ///< @brief Number of downlinks in `rx_queue`
+    bool rx_deferred = false;   ///< @brief `True` if downlinks are delivered from `loop()`
+    downlink_stats_t downlink_stats;    ///< @brief Deferred downlink delivery statistics
+    send_data_t aggregate;  ///< @brief Frame where records are being aggregated
+    uint16_t next_record_id = 1;    ///< @brief Id for next aggregated record. 0 is never used
+    unsigned long aggregate_started = 0;    ///< @brief `millis()` when first record of aggregated frame was added
+    uint32_t aggregate_max_age = 0; ///< @brief Maximum time a record waits in aggregated frame. 0 to wait forever
+    LoRaFragmenter fragmenter;  ///< @brief Block being sent with `send_fragmented()`
+    uint16_t frag_next = 0;     ///< @brief Next fragment number to queue. 0 if no block is being sent
+    uint8_t frag_port = LORAWAN_FRAG_PORT;  ///< @brief Port for fragments
+    uint8_t frag_session = 0;   ///< @brief Session number of last fragmented block
+    LoRaBacklog backlog;        ///< @brief Persistent uplink backlog
+    bool backlog_enabled = false;   ///< @brief `True` if backlog files are open
+    uint8_t backlog_port = 0;   ///< @brief Port for aggregated backlog frames. 0 if aggregation is disabled
+    bool backlog_confirmed = true;  ///< @brief `True` if backlog frames are confirmed
+    bool backlog_in_flight = false; ///< @brief `True` while a backlog frame is in uplink queue
+    uint32_t backlog_end = 0;   ///< @brief Sequence number after last record of backlog frame in uplink queue
+    uint32_t backlog_backoff = 0;   ///< @brief Wait before next backlog frame, after a failed one. 0 if last one was delivered
+    unsigned long backlog_failed = 0;   ///< @brief `millis()` when last backlog frame failed
+    LoRaAirtimeBudget fair_use;     ///< @brief Airtime used on fair use window
+    uint32_t fair_use_budget = 0;   ///< @brief Allowed airtime on fair use window. 0 if disabled
+#if CFG_LMIC_EU_like
+    LoRaAirtimeBudget band_airtime[MAX_BANDS];  ///< @brief Airtime used on every band duty cycle window
+#endif
+    airtime_policy_t airtime_policy = AIRTIME_DEFER;    ///< @brief Behaviour on messages exceeding airtime budget
     FS* file_system = 0;    ///< @brief Pointer to filesystem used to store LoRaWAN LMIC context
-    lmic_t otaa_data;   ///< @brief LMIC context for storing in filesystem
-    link_counters_t link_counters;  ///< @brief Downlink and uplink message counters to be stored in filesystem
+    session_record_t session;   ///< @brief Session data for storing in filesystem
+    link_counters_t link_counters;  ///< @brief Downlink and uplink message counters to be stored in filesystem. Uplink counter includes reserved block
+    uint16_t counter_reservation = LORAWAN_COUNTER_RESERVATION; ///< @brief Uplink counter values reserved on every counters write
+    persistence_stats_t persistence_stats;  ///< @brief Storage activity counters
+    node_stats_t metrics;   ///< @brief Runtime metrics
+    storage_mode_t storage_mode = STORAGE_FILES;    ///< @brief How session and counters are stored
+    LoRaJournal session_journal;    ///< @brief Session records journal, used in `STORAGE_JOURNAL` mode
+    LoRaJournal counters_journal;   ///< @brief Counter records journal, used in `STORAGE_JOURNAL` mode
+    LoRaSlotPair session_slots;     ///< @brief Session record files, used in `STORAGE_FILES` mode
+    LoRaSlotPair counters_slots;    ///< @brief Counters files, used in `STORAGE_FILES` mode
+    bool storage_ready = false; ///< @brief `True` after journals and slot files have been opened
+    bool rtc_resume = false;    ///< @brief `True` if session is kept in RTC memory
+    uint8_t rtc_fs_save_cycles = LORAWAN_RTC_FS_SAVE_CYCLES;    ///< @brief Uplinks between filesystem saves in RTC resume mode
+    bool rtc_resumed = false;   ///< @brief `True` if session was restored from RTC memory
     bool joined = false;    ///< @brief Join status flag. `True` if node has joined network using OTAA or this is a APB node.
+    LoRaTask task;          ///< @brief Radio task, used in task mode
+    bool task_mode = false; ///< @brief `True` if LMIC has to run in its own task
+    int task_core = LORAWAN_TASK_CORE;  ///< @brief Core radio task is pinned to
+    uint8_t task_priority = LORAWAN_TASK_PRIORITY;  ///< @brief Radio task priority
+    queued_event_t event_queue[LORAWAN_EVENT_QUEUE_SIZE];   ///< @brief Events waiting for delivery in task mode
+    uint8_t event_queue_head = 0;   ///< @brief Index of oldest event in `event_queue`
+    uint8_t event_queue_count = 0;  ///< @brief Number of events in `event_queue`
+    uint32_t events_dropped = 0;    ///< @brief Events lost because `event_queue` or `result_queue` was full
+    uplink_result_t result_queue[LORAWAN_EVENT_QUEUE_SIZE]; ///< @brief Uplink results waiting for delivery in task mode
+    uint8_t result_queue_head = 0;  ///< @brief Index of oldest result in `result_queue`
+    uint8_t result_queue_count = 0; ///< @brief Number of results in `result_queue`
+    uint16_t next_handle = 1;   ///< @brief Handle for next uplink message. 0 is never used
+    retry_policy_t retry_policy;    ///< @brief Retry of unacknowledged confirmed messages
+    LoRaLinkTracker link;       ///< @brief Link quality statistics
+    link_policy_t link_policy;  ///< @brief Local datarate and power selection
+    join_policy_t join_policy;  ///< @brief Join request scheduling
+    join_stats_t join_stats;    ///< @brief Statistics of last or current join
+    osjob_t joinjob;            ///< @brief Job that schedules next join attempt after a failed one
+    bool joining = false;       ///< @brief `True` from start of join until JoinAccept
+    bool join_pending = false;  ///< @brief `True` while a join request is owned by LMIC
+    uint8_t join_start_dr = 0;  ///< @brief Datarate join sweep starts from
+    uint16_t join_failures = 0; ///< @brief Failed join requests since start of join
+    unsigned long join_next = 0;    ///< @brief `millis()` when next join request may be sent
+    unsigned long join_started = 0; ///< @brief `millis()` at start of join
+    unsigned long join_tx_time = 0; ///< @brief `millis()` when last join request started
+    uint32_t join_last_airtime = 0; ///< @brief Airtime of last join request, in milliseconds
+    uint32_t join_window = 0;   ///< @brief Join duty cycle window of last join request
+    uint32_t join_window_used = 0;  ///< @brief Join airtime used in `join_window`, in milliseconds
 
     /**
      * @brief Message sending job
@@ -194,6 +1214,133 @@ private:
      */
     static void do_send (osjob_t* j);
 
+    /**
+     * @brief Removes front message from uplink queue and schedules next one, if any
+     * @param delivered `True` if front message was transmitted successfully, to report its aggregated records
+     */
+    void tx_queue_pop (bool delivered);
+
+    /**
+     * @brief Adds a message to uplink queue, applying overflow policy
+     * @param data Data buffer to be sent
+     * @param len Data length
+     * @param port LoRaWAN port
+     * @param confirmed `True` if node requires this message to be confirmed
+     * @param first_record Id of first aggregated record in message
+     * @param records Number of aggregated records in message
+     * @return `True` if packet was queued
+     */
+    bool enqueue (const uint8_t* data, size_t len, uint8_t port, bool confirmed, uint16_t first_record = 0, uint8_t records = 0);
+
+    /**
+     * @brief Calculates how long a transmission has to wait to fit in airtime budgets
+     * @param airtime_ms Transmission airtime in milliseconds
+     * @return Time to wait in milliseconds. 0 if it fits now, `AIRTIME_NEVER` if it never fits
+     */
+    uint32_t budget_wait (uint32_t airtime_ms);
+
+    /**
+     * @brief Accounts airtime of the transmission that is starting, to airtime budgets and to join statistics or
+     *        front message
+     */
+    void account_airtime ();
+
+    /**
+     * @brief Sets datarate and power for a new message according to link policy
+     * @param len Message length
+     */
+    void apply_link_policy (uint8_t len);
+
+    /**
+     * @brief Gets a handle for a new uplink message
+     * @return Message handle, never 0
+     */
+    uint16_t new_handle ();
+
+    /**
+     * @brief Keeps front message in queue for another try if retry policy allows it, lowering datarate if needed
+     * @return `True` if message will be retried
+     */
+    bool retry_uplink ();
+
+    /**
+     * @brief Reports outcome of a message to application, or queues it for `loop()` in task mode
+     * @param msg Message
+     * @param delivered `True` if message was delivered
+     */
+    void report_uplink (const send_data_t& msg, bool delivered);
+
+    /**
+     * @brief Delivers uplink results waiting in task mode result queue
+     */
+    void drain_results ();
+
+    /**
+     * @brief Starts join controller: join statistics are cleared and datarate sweep starts from last successful
+     *        datarate
+     */
+    void start_join ();
+
+    /**
+     * @brief Sends a join request at datarate given by join policy
+     */
+    void join_attempt ();
+
+    /**
+     * @brief Handles a join request that got no JoinAccept
+     */
+    void join_failed ();
+
+    /**
+     * @brief Gets datarate for next join request
+     * @return Datarate
+     */
+    uint8_t join_datarate ();
+
+    /**
+     * @brief Calculates wait before next join request, from backoff and duty cycle limits
+     * @return Time in milliseconds
+     */
+    uint32_t join_wait ();
+
+    /**
+     * @brief Stops LMIC join and schedules next join request
+     * @param j Job handler
+     */
+    static void join_retry_func (osjob_t* j);
+
+    /**
+     * @brief Sends next join request once wait is over. Long waits are split to fit in LMIC time range
+     * @param j Job handler
+     */
+    static void join_wait_func (osjob_t* j);
+
+    /**
+     * @brief Frees a slot in uplink queue if it is full, applying overflow policy
+     * @return `True` if there is a free slot
+     */
+    bool make_room ();
+
+    /**
+     * @brief Checks if a new message fits in airtime budget when `AIRTIME_REJECT` policy is set
+     * @param len Payload length of new message
+     * @return `True` if message may be queued
+     */
+    bool airtime_allows (size_t len);
+
+    /**
+     * @brief Accounts a message that is discarded without being transmitted
+     * @param msg Discarded message
+     */
+    void discard_message (const send_data_t& msg);
+
+    /**
+     * @brief Calls record status callback for every aggregated record in a message
+     * @param msg Message
+     * @param delivered `True` if records were delivered, `false` if they were lost
+     */
+    void report_records (const send_data_t& msg, bool delivered);
+
     /**
      * @brief Internal LMIC event handler
      * @param pUserData Pointer to user data. In this case this is used to point lorawan singleton object (this)
@@ -210,9 +1357,82 @@ private:
      */
     static void on_lmic_rx (void* pUserData, uint8_t port, const uint8_t* pMessage, size_t nMessage);
     
-    on_joined_cb_t on_joined_cb = 0;    ///< @brief Callback to be executed after node is joined to network
-    on_tx_complete_cb_t on_tx_complete_cb = 0;  ///< @brief Callback to be executed when transmission and rx window are finished
-    on_rx_data_cb_t on_rx_data_cb = 0;  ///< @brief Callback to be executed when downlink data is received
+    on_joined_cb_t on_joined_cb;    ///< @brief Callback to be executed after node is joined to network
+    on_tx_complete_cb_t on_tx_complete_cb;  ///< @brief Callback to be executed when transmission and rx window are finished
+    on_rx_data_cb_t on_rx_data_cb;  ///< @brief Callback to be executed when downlink data is received
+    on_record_status_cb_t on_record_status_cb;  ///< @brief Callback to be executed when an aggregated record is delivered or lost
+    on_downlink_cb_t on_downlink_cb;    ///< @brief Callback to be executed with downlink data and metadata
+    on_uplink_complete_cb_t on_uplink_complete_cb;  ///< @brief Callback to be executed with outcome of every uplink message
+    on_event_cb_t event_subscribers[LORAWAN_EVENT_COUNT];  ///< @brief Application callbacks for LMIC events, indexed by event
+
+    /**
+     * @brief Calls application callbacks for an event, or queues it for `loop()` in task mode
+     * @param event LMIC event
+     * @param ack Acknowledge flag, for `EV_TXCOMPLETE`
+     */
+    void notify_event (ev_t event, bool ack);
+
+    /**
+     * @brief Calls application callbacks for an event
+     * @param event LMIC event
+     * @param ack Acknowledge flag, for `EV_TXCOMPLETE`
+     */
+    void dispatch_event (ev_t event, bool ack);
+
+    /**
+     * @brief Delivers events waiting in task mode event queue
+     */
+    void drain_events ();
+
+    /**
+     * @brief Radio task body. Runs LMIC until task is stopped
+     * @param arg Pointer to LoRaWAN object
+     */
+    static void radio_task (void* arg);
+
+    /**
+     * @brief Does LMIC related periodic tasks. Called from `loop()`, or from radio task in task mode
+     */
+    void radio_loop ();
+
+    /**
+     * @brief Queues fragments of current block while uplink queue has room for them
+     */
+    void feed_fragments ();
+
+    /**
+     * @brief Queues a frame with oldest backlog records if uplink queue is empty and no retry wait is running
+     */
+    void feed_backlog ();
+
+    /**
+     * @brief Gets time until next backlog frame may be queued
+     * @return Time in milliseconds. `LORAWAN_IDLE_FOREVER` if there is nothing to send or a frame is in queue
+     */
+    uint32_t backlog_wait ();
+
+    /**
+     * @brief Updates backlog after its frame left uplink queue
+     * @param delivered `True` if records were delivered and may be released
+     */
+    void backlog_sent (bool delivered);
+
+    /**
+     * @brief Gets how long radio related work may wait: LMIC jobs and record aggregation age
+     * @return Time in milliseconds. `LORAWAN_IDLE_FOREVER` if nothing is scheduled
+     */
+    uint32_t radio_idle_time ();
+
+    /**
+     * @brief Calls downlink callbacks
+     * @param downlink Downlink message
+     */
+    void deliver_downlink (const downlink_t& downlink);
+
+    /**
+     * @brief Delivers downlinks waiting in deferred queue
+     */
+    void drain_downlinks ();
 
     /**
      * @brief LMIC initialization job
@@ -226,6 +1446,55 @@ private:
      */
     bool get_session_data ();
 
+    /**
+     * @brief Opens journals or session and counters files, depending on storage mode. It is done only once
+     * @return `True` if storage is ready
+     */
+    bool begin_storage ();
+
+    /**
+     * @brief Loads session and counters from RTC memory snapshot
+     * @return `True` if snapshot was valid
+     */
+    bool rtc_load ();
+
+    /**
+     * @brief Updates RTC memory snapshot with current LMIC session and counters. Every `rtc_fs_save_cycles` calls
+     *        session is also saved to filesystem
+     */
+    void rtc_save ();
+
+    /**
+     * @brief Writes `session` and current counters to RTC memory
+     */
+    void rtc_store ();
+
+    /**
+     * @brief Calculates how much time passed since session was saved
+     * @return Elapsed time in milliseconds. 0 if it is unknown. Days of sleep do not fit in LMIC time range, so it is
+     *         not returned in ticks
+     */
+    uint64_t session_elapsed_time ();
+
+    /**
+     * @brief Reads session data and counters from newest intact copy of their files. Files written by an older
+     *        library version are read too, and converted
+     * @return `True` if operation was successful
+     */
+    bool read_session_files ();
+
+    /**
+     * @brief Reads session data and counters from single files written by an older library version
+     * @return `True` if operation was successful
+     */
+    bool read_legacy_files ();
+
+    /**
+     * @brief Reads newest session data and counters from journals
+     * @return `True` if operation was successful
+     */
+    bool read_session_journal ();
+
     /**
      * @brief Loads session data into LMIC
      */
@@ -237,6 +1506,33 @@ private:
      */
     bool save_session_data ();
 
+    /**
+     * @brief Copies session related fields from a LMIC context to `session`
+     * @param lmic LMIC context
+     */
+    void session_from_lmic (const lmic_t& lmic);
+
+    /**
+     * @brief Validates a session file content and loads it into `session`, migrating it from older versions
+     * @param buffer File content
+     * @param size File content length
+     * @return `True` if buffer holds a valid session record
+     */
+    bool load_session_record (const uint8_t* buffer, size_t size);
+
+    /**
+     * @brief Converts a session file written by previous library versions, which held a raw `lmic_t` dump
+     * @param configFile Open session file
+     * @return `True` if file could be converted
+     */
+    bool migrate_legacy_session (File& configFile);
+
+    /**
+     * @brief Writes `session` to file system, updating its CRC
+     * @return `True` if operation was successful
+     */
+    bool write_session_record ();
+
     /**
      * @brief Save message counters to file system
      * @return `True` if operation was successful
@@ -244,7 +1540,8 @@ private:
     bool save_counters ();
 
     /**
-     * @brief Recalculates duty cycle. Currently this only clears duty cycle counters
+     * @brief Converts duty cycle availability times of stored session from LMIC time to wait time from now,
+     *        and records wall clock so that elapsed time can be discounted on resume
      */
     void calculate_duty_cycle ();
 };
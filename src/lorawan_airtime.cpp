@@ -0,0 +1,105 @@
+#include <string.h>
+#include "lorawan_airtime.h"
+
+void LoRaAirtimeBudget::begin (uint32_t window_ms) {
+    memset (buckets, 0, sizeof (buckets));
+    bucket_ms = window_ms / LORAWAN_AIRTIME_BUCKETS;
+    if (!bucket_ms) {
+        bucket_ms = 1;
+    }
+    bucket_start = 0;
+    current = 0;
+}
+
+void LoRaAirtimeBudget::advance (uint32_t now) {
+    uint32_t elapsed = now - bucket_start;
+
+    if (!bucket_ms || elapsed < bucket_ms) {
+        return;
+    }
+    if (elapsed / bucket_ms >= LORAWAN_AIRTIME_BUCKETS) {
+        // Whole window has passed
+        memset (buckets, 0, sizeof (buckets));
+        bucket_start = now - elapsed % bucket_ms;
+        return;
+    }
+    while (now - bucket_start >= bucket_ms) {
+        current = (current + 1) % LORAWAN_AIRTIME_BUCKETS;
+        buckets[current] = 0;
+        bucket_start += bucket_ms;
+    }
+}
+
+void LoRaAirtimeBudget::add (uint32_t now, uint32_t airtime_ms) {
+    advance (now);
+    buckets[current] += airtime_ms;
+}
+
+uint32_t LoRaAirtimeBudget::used (uint32_t now) {
+    uint32_t total = 0;
+
+    advance (now);
+    for (uint8_t i = 0; i < LORAWAN_AIRTIME_BUCKETS; i++) {
+        total += buckets[i];
+    }
+    return total;
+}
+
+uint32_t LoRaAirtimeBudget::wait_for (uint32_t now, uint32_t airtime_ms, uint32_t budget_ms) {
+    uint32_t total = used (now);
+
+    if (airtime_ms > budget_ms) {
+        return AIRTIME_NEVER;
+    }
+    // Oldest bucket is the one after current. It leaves the window when current bucket ends
+    for (uint8_t k = 0; k < LORAWAN_AIRTIME_BUCKETS; k++) {
+        if (total + airtime_ms <= budget_ms) {
+            return k ? k * bucket_ms - (now - bucket_start) : 0;
+        }
+        total -= buckets[(current + 1 + k) % LORAWAN_AIRTIME_BUCKETS];
+    }
+    return LORAWAN_AIRTIME_BUCKETS * bucket_ms - (now - bucket_start);
+}
+
+void LoRaAirtimeBudget::save (uint32_t now, airtime_snapshot_t* snapshot) {
+    uint32_t largest = 0;
+
+    advance (now);
+    for (uint8_t i = 0; i < LORAWAN_AIRTIME_BUCKETS; i++) {
+        largest = buckets[i] > largest ? buckets[i] : largest;
+    }
+    // Smallest unit where every bucket fits in a byte
+    uint8_t shift = 0;
+    while (shift < 31 && (largest + (1UL << shift) - 1) >> shift > UINT8_MAX) {
+        shift++;
+    }
+    for (uint8_t k = 0; k < LORAWAN_AIRTIME_BUCKETS; k++) {
+        uint32_t airtime = buckets[(current + 1 + k) % LORAWAN_AIRTIME_BUCKETS];
+        snapshot->buckets[k] = (airtime + (1UL << shift) - 1) >> shift;
+    }
+    snapshot->shift = shift;
+    snapshot->age_ms = now - bucket_start;
+}
+
+void LoRaAirtimeBudget::restore (uint32_t now, const airtime_snapshot_t& snapshot, uint64_t elapsed_ms) {
+    memset (buckets, 0, sizeof (buckets));
+    current = 0;
+    if (!bucket_ms || snapshot.shift > 31) {
+        bucket_start = now;
+        return;
+    }
+    // Newest saved bucket started this long ago
+    uint64_t since = elapsed_ms + snapshot.age_ms;
+    bucket_start = now - (uint32_t)(since % bucket_ms);
+    uint64_t passed = since / bucket_ms;
+    if (passed >= LORAWAN_AIRTIME_BUCKETS) {
+        return;
+    }
+    for (uint8_t k = 0; k < LORAWAN_AIRTIME_BUCKETS; k++) {
+        // Saved bucket k is this many buckets older than current one
+        uint32_t age = LORAWAN_AIRTIME_BUCKETS - 1 - k + (uint32_t)passed;
+        if (age < LORAWAN_AIRTIME_BUCKETS) {
+            buckets[(LORAWAN_AIRTIME_BUCKETS - age) % LORAWAN_AIRTIME_BUCKETS] = (uint32_t)snapshot.buckets[k] << snapshot.shift;
+        }
+    }
+}
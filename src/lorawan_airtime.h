@@ -0,0 +1,91 @@
+/**
+  * @file lorawan_airtime.h
+  * @version 0.0.2
+  * @date 05/10/2021
+  * @author German Martin
+  * @brief Rolling window airtime accounting
+  *
+  * Airtime is added to a ring of buckets that together cover the window length. Buckets are dropped whole when
+  * they leave the window, so used airtime may be overestimated by up to one bucket, never underestimated.
+  */
+
+#ifndef LORAWAN_AIRTIME_H
+#define LORAWAN_AIRTIME_H
+
+#include <stdint.h>
+
+#ifndef LORAWAN_AIRTIME_BUCKETS
+#define LORAWAN_AIRTIME_BUCKETS 24 ///< @brief Number of buckets a rolling airtime window is split into
+#endif // LORAWAN_AIRTIME_BUCKETS
+
+#define AIRTIME_NEVER UINT32_MAX ///< @brief Wait returned when airtime does not fit in budget at all
+
+/**
+  * @brief Compact copy of a window, to keep it across deep sleep
+  */
+typedef struct __attribute__ ((packed)) {
+    uint8_t buckets[LORAWAN_AIRTIME_BUCKETS];   ///< @brief Airtime of every bucket, oldest first, in units of `2^shift` ms rounded up
+    uint8_t shift;      ///< @brief Unit of `buckets`
+    uint32_t age_ms;    ///< @brief Time from start of newest bucket to save time
+} airtime_snapshot_t;
+
+class LoRaAirtimeBudget {
+public:
+    /**
+     * @brief Sets window length and clears accounted airtime
+     * @param window_ms Window length in milliseconds
+     */
+    void begin (uint32_t window_ms);
+
+    /**
+     * @brief Accounts a transmission
+     * @param now Current time in milliseconds
+     * @param airtime_ms Transmission airtime in milliseconds
+     */
+    void add (uint32_t now, uint32_t airtime_ms);
+
+    /**
+     * @brief Gets airtime used inside window
+     * @param now Current time in milliseconds
+     * @return Used airtime in milliseconds
+     */
+    uint32_t used (uint32_t now);
+
+    /**
+     * @brief Calculates how long to wait until a transmission fits in budget
+     * @param now Current time in milliseconds
+     * @param airtime_ms Transmission airtime in milliseconds
+     * @param budget_ms Airtime allowed inside window, in milliseconds
+     * @return Time to wait in milliseconds. 0 if transmission fits now, `AIRTIME_NEVER` if it is longer than budget
+     */
+    uint32_t wait_for (uint32_t now, uint32_t airtime_ms, uint32_t budget_ms);
+
+    /**
+     * @brief Copies window state. Airtime is rounded up, so that it is never underestimated after restore
+     * @param now Current time in milliseconds
+     * @param snapshot Returns window state
+     */
+    void save (uint32_t now, airtime_snapshot_t* snapshot);
+
+    /**
+     * @brief Restores window state saved on a previous boot. Window length must have been set with `begin()`
+     * @param now Current time in milliseconds
+     * @param snapshot Saved window state
+     * @param elapsed_ms Time since it was saved. Buckets that left the window meanwhile are dropped
+     */
+    void restore (uint32_t now, const airtime_snapshot_t& snapshot, uint64_t elapsed_ms);
+
+private:
+    uint32_t buckets[LORAWAN_AIRTIME_BUCKETS] = { 0 };  ///< @brief Airtime accounted in every bucket
+    uint32_t bucket_ms = 0;     ///< @brief Time covered by a bucket
+    uint32_t bucket_start = 0;  ///< @brief Start time of current bucket
+    uint8_t current = 0;        ///< @brief Index of current bucket
+
+    /**
+     * @brief Moves current bucket forward to `now`, clearing buckets that leave the window
+     * @param now Current time in milliseconds
+     */
+    void advance (uint32_t now);
+};
+
+#endif // LORAWAN_AIRTIME_H
@@ -0,0 +1,193 @@
+#include <string.h>
+#include "lorawan_backlog.h"
+#include "lorawan_crc.h"
+
+bool LoRaBacklog::begin (FS* fs, const char* path, const char* cursor_path, uint16_t slots) {
+    backlog_header_t header;
+    uint32_t oldest = 0;
+    bool found = false;
+
+    file_system = fs;
+    this->path = path;
+    this->slots = slots;
+    head = stored = tail = saved_cursor = 0;
+    file.close ();
+
+    if (!file_system || slots < LORAWAN_BACKLOG_CACHE) {
+        return false;
+    }
+    cursor.begin (file_system, cursor_path, sizeof (saved_cursor), BACKLOG_CURSOR_SLOTS);
+    bool has_cursor = cursor.read_latest (&saved_cursor, sizeof (saved_cursor));
+
+    if (file_system->exists (path)) {
+        file = file_system->open (path, "r+");
+    }
+    if (!file || file.size () != slot_size () * slots) {
+        file.close ();
+        head = stored = tail = saved_cursor;
+        return preallocate ();
+    }
+
+    // Pending records are those not older than cursor. They have consecutive sequence numbers
+    for (uint16_t i = 0; i < slots; i++) {
+        if (!read_slot (i, &header, NULL) || (has_cursor && (int32_t)(header.sequence - saved_cursor) < 0)) {
+            continue;
+        }
+        if (!found || (int32_t)(header.sequence - oldest) < 0) {
+            oldest = header.sequence;
+        }
+        if (!found || (int32_t)(header.sequence + 1 - tail) > 0) {
+            tail = header.sequence + 1;
+        }
+        found = true;
+    }
+    head = found ? oldest : saved_cursor;
+    tail = found ? tail : saved_cursor;
+    stored = tail;
+    return true;
+}
+
+bool LoRaBacklog::preallocate () {
+    uint8_t empty[32];
+    size_t total = slot_size () * slots;
+
+    memset (empty, 0xFF, sizeof (empty));
+    file = file_system->open (path, "w+");
+    if (!file) {
+        return false;
+    }
+    while (total) {
+        size_t chunk = total < sizeof (empty) ? total : sizeof (empty);
+        if (file.write (empty, chunk) != chunk) {
+            file.close ();
+            return false;
+        }
+        total -= chunk;
+    }
+    file.flush ();
+    return true;
+}
+
+bool LoRaBacklog::read_slot (uint16_t slot, backlog_header_t* header, uint8_t* data) {
+    uint8_t buffer[LORAWAN_BACKLOG_RECORD_SIZE];
+    uint32_t stored_crc;
+
+    if (!file || !file.seek (slot * slot_size ())) {
+        return false;
+    }
+    if (file.read ((uint8_t*)header, sizeof (*header)) != sizeof (*header)) {
+        return false;
+    }
+    if (header->magic != BACKLOG_RECORD_MAGIC || !header->length || header->length > LORAWAN_BACKLOG_RECORD_SIZE) {
+        return false;
+    }
+    if (file.read (buffer, sizeof (buffer)) != sizeof (buffer) ||
+        file.read ((uint8_t*)&stored_crc, sizeof (stored_crc)) != sizeof (stored_crc)) {
+        return false;
+    }
+    uint32_t crc = lorawan_crc32 (header, sizeof (*header));
+    if (lorawan_crc32 (buffer, sizeof (buffer), crc) != stored_crc) {
+        return false;
+    }
+    if (data) {
+        memcpy (data, buffer, header->length);
+    }
+    return true;
+}
+
+bool LoRaBacklog::write_slot (uint32_t sequence, const backlog_record_t& record) {
+    backlog_header_t header;
+    uint8_t buffer[LORAWAN_BACKLOG_RECORD_SIZE];
+
+    if (!file || !file.seek ((sequence % slots) * slot_size ())) {
+        return false;
+    }
+    header.magic = BACKLOG_RECORD_MAGIC;
+    header.port = record.port;
+    header.length = record.length;
+    header.sequence = sequence;
+    memcpy (buffer, record.data, record.length);
+    memset (buffer + record.length, 0, sizeof (buffer) - record.length);
+    uint32_t crc = lorawan_crc32 (&header, sizeof (header));
+    crc = lorawan_crc32 (buffer, sizeof (buffer), crc);
+
+    size_t written = file.write ((const uint8_t*)&header, sizeof (header));
+    written += file.write (buffer, sizeof (buffer));
+    written += file.write ((const uint8_t*)&crc, sizeof (crc));
+    return written == slot_size ();
+}
+
+bool LoRaBacklog::push (const uint8_t* data, uint8_t len, uint8_t port) {
+    if (!len || len > LORAWAN_BACKLOG_RECORD_SIZE) {
+        return false;
+    }
+    if (tail - stored >= LORAWAN_BACKLOG_CACHE && !flush ()) {
+        return false;
+    }
+    backlog_record_t& record = cache[tail % LORAWAN_BACKLOG_CACHE];
+    record.port = port;
+    record.length = len;
+    memcpy (record.data, data, len);
+    tail++;
+    return true;
+}
+
+bool LoRaBacklog::flush () {
+    if (stored == tail) {
+        return true;
+    }
+    while (stored != tail) {
+        if (!write_slot (stored, cache[stored % LORAWAN_BACKLOG_CACHE])) {
+            // Records not written stay in cache
+            file.flush ();
+            return false;
+        }
+        stored++;
+    }
+    file.flush ();
+    // File keeps last `slots` records. Older ones have been overwritten
+    if (stored - head > slots) {
+        dropped += stored - slots - head;
+        head = stored - slots;
+    }
+    return true;
+}
+
+uint8_t LoRaBacklog::read (size_t index, uint8_t* data, uint8_t* port) {
+    backlog_header_t header;
+
+    if (index >= length ()) {
+        return 0;
+    }
+    uint32_t sequence = head + index;
+    if ((int32_t)(sequence - stored) >= 0) {
+        const backlog_record_t& record = cache[sequence % LORAWAN_BACKLOG_CACHE];
+        memcpy (data, record.data, record.length);
+        *port = record.port;
+        return record.length;
+    }
+    if (!read_slot (sequence % slots, &header, data) || header.sequence != sequence) {
+        return 0;
+    }
+    *port = header.port;
+    return header.length;
+}
+
+void LoRaBacklog::release (uint32_t end) {
+    if ((int32_t)(end - head) <= 0) {
+        return;
+    }
+    if ((int32_t)(end - tail) > 0) {
+        end = tail;
+    }
+    bool from_file = (int32_t)(head - stored) < 0;
+    head = end;
+    if ((int32_t)(head - stored) > 0) {
+        // Delivered straight from cache
+        stored = head;
+    }
+    // Cursor only matters for records that are in file
+    if (from_file && head != saved_cursor && cursor.append (&head, sizeof (head))) {
+        saved_cursor = head;
+    }
+}
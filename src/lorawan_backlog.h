@@ -0,0 +1,187 @@
+/**
+  * @file lorawan_backlog.h
+  * @version 0.0.2
+  * @date 05/10/2021
+  * @author German Martin
+  * @brief Persistent store-and-forward uplink backlog
+  *
+  * Records wait in a bounded FIFO until they are delivered. Newest records are kept in a RAM cache, and written to a
+  * file of fixed-size slots only when the cache is full or on `flush()`. While link is healthy records are delivered
+  * straight from cache and flash is never written.
+  *
+  * Every record gets a sequence number and is stored in slot `sequence % slots`, with a CRC. When file is full oldest
+  * record is overwritten. Sequence of oldest undelivered record is saved in a small journal whenever records that were
+  * in file are delivered. After a reset the backlog is rebuilt from valid slots newer than that cursor, so records
+  * are delivered at least once. A slot cut by a power loss fails its CRC and is skipped.
+  */
+
+#ifndef LORAWAN_BACKLOG_H
+#define LORAWAN_BACKLOG_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "FS.h"
+#include "lorawan_journal.h"
+
+#ifndef LORAWAN_BACKLOG_RECORD_SIZE
+#define LORAWAN_BACKLOG_RECORD_SIZE 32 ///< @brief Maximum length of a backlog record
+#endif // LORAWAN_BACKLOG_RECORD_SIZE
+
+#ifndef LORAWAN_BACKLOG_SLOTS
+#define LORAWAN_BACKLOG_SLOTS 256 ///< @brief Number of records backlog file holds
+#endif // LORAWAN_BACKLOG_SLOTS
+
+#ifndef LORAWAN_BACKLOG_CACHE
+#define LORAWAN_BACKLOG_CACHE 8 ///< @brief Number of records kept in RAM before they are written to file
+#endif // LORAWAN_BACKLOG_CACHE
+
+#define BACKLOG_RECORD_MAGIC 0x4251 ///< @brief Slot signature ("QB")
+#define BACKLOG_CURSOR_SLOTS 16     ///< @brief Number of cursor journal records
+
+/**
+  * @brief Header of every backlog slot
+  */
+typedef struct __attribute__ ((packed)) {
+    uint16_t magic;     ///< @brief Must be `BACKLOG_RECORD_MAGIC`
+    uint8_t port;       ///< @brief LoRaWAN port of record
+    uint8_t length;     ///< @brief Record length
+    uint32_t sequence;  ///< @brief Record sequence number
+} backlog_header_t;
+
+/**
+  * @brief Record waiting in RAM cache
+  */
+typedef struct {
+    uint8_t port;       ///< @brief LoRaWAN port of record
+    uint8_t length;     ///< @brief Record length
+    uint8_t data[LORAWAN_BACKLOG_RECORD_SIZE];  ///< @brief Record data
+} backlog_record_t;
+
+class LoRaBacklog {
+public:
+    /**
+     * @brief Opens backlog files and rebuilds pending records. Data file is created and preallocated if it does not
+     *        exist or if its size does not match
+     * @param fs Filesystem
+     * @param path Data file name
+     * @param cursor_path Cursor journal file name
+     * @param slots Number of records that fit in data file. At least `LORAWAN_BACKLOG_CACHE`
+     * @return `True` if backlog is ready to be used
+     */
+    bool begin (FS* fs, const char* path, const char* cursor_path, uint16_t slots = LORAWAN_BACKLOG_SLOTS);
+
+    /**
+     * @brief Adds a record to cache. If cache is full it is written to file first
+     * @param data Record data
+     * @param len Record length, 1 to `LORAWAN_BACKLOG_RECORD_SIZE`
+     * @param port LoRaWAN port
+     * @return `True` if record was added
+     */
+    bool push (const uint8_t* data, uint8_t len, uint8_t port);
+
+    /**
+     * @brief Writes cached records to file, so that they survive a reset
+     * @return `True` if cache is empty now
+     */
+    bool flush ();
+
+    /**
+     * @brief Reads a pending record
+     * @param index Record index, 0 being the oldest
+     * @param data Buffer of `LORAWAN_BACKLOG_RECORD_SIZE` bytes
+     * @param port Returns record port
+     * @return Record length. 0 if record is corrupted or index is out of range
+     */
+    uint8_t read (size_t index, uint8_t* data, uint8_t* port);
+
+    /**
+     * @brief Removes delivered records
+     * @param end Sequence number after last delivered record. Records removed meanwhile, because file was full, are
+     *        not removed twice
+     */
+    void release (uint32_t end);
+
+    /**
+     * @brief Removes oldest record, counting it as dropped. Used when it cannot be read back
+     */
+    void skip () {
+        if (length ()) {
+            dropped++;
+            release (head + 1);
+        }
+    }
+
+    /**
+     * @brief Gets sequence number of oldest pending record
+     */
+    uint32_t first () {
+        return head;
+    }
+
+    /**
+     * @brief Gets number of pending records
+     */
+    size_t length () {
+        return tail - head;
+    }
+
+    /**
+     * @brief Gets number of records in RAM cache, that would be lost on a reset
+     */
+    size_t cached () {
+        return tail - stored;
+    }
+
+    /**
+     * @brief Gets number of records lost because file was full or their slot was corrupted
+     */
+    uint32_t get_dropped () {
+        return dropped;
+    }
+
+    /**
+     * @brief Gets total size of a slot in file, including header and CRC
+     * @return Slot size in bytes
+     */
+    size_t slot_size () {
+        return sizeof (backlog_header_t) + LORAWAN_BACKLOG_RECORD_SIZE + sizeof (uint32_t);
+    }
+
+private:
+    FS* file_system = 0;    ///< @brief Filesystem where backlog lives
+    const char* path = 0;   ///< @brief Data file name
+    File file;              ///< @brief Data file. It is kept open
+    LoRaJournal cursor;     ///< @brief Journal of oldest undelivered sequence number
+    uint16_t slots = 0;     ///< @brief Number of slots in data file
+    uint32_t head = 0;      ///< @brief Sequence number of oldest pending record
+    uint32_t stored = 0;    ///< @brief Sequence number of first record still in cache. Older ones are in file
+    uint32_t tail = 0;      ///< @brief Sequence number for next record
+    uint32_t saved_cursor = 0;  ///< @brief Last cursor written to journal
+    uint32_t dropped = 0;   ///< @brief Records lost
+    backlog_record_t cache[LORAWAN_BACKLOG_CACHE];  ///< @brief Newest records, indexed by sequence number
+
+    /**
+     * @brief Creates data file with all slots empty
+     * @return `True` if file was created
+     */
+    bool preallocate ();
+
+    /**
+     * @brief Reads and checks a slot
+     * @param slot Slot number
+     * @param header Returns slot header
+     * @param data Buffer for record data. May be `NULL` if only validation is needed
+     * @return `True` if slot holds a valid record
+     */
+    bool read_slot (uint16_t slot, backlog_header_t* header, uint8_t* data);
+
+    /**
+     * @brief Writes a record in its slot
+     * @param sequence Record sequence number
+     * @param record Record
+     * @return `True` if record was written
+     */
+    bool write_slot (uint32_t sequence, const backlog_record_t& record);
+};
+
+#endif // LORAWAN_BACKLOG_H
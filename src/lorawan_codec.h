@@ -0,0 +1,396 @@
+/**
+  * @file lorawan_codec.h
+  * @version 0.0.2
+  * @date 05/10/2021
+  * @author German Martin
+  * @brief Schema driven bit packed payload codec
+  *
+  * A payload layout is declared as a list of typed fields, each one using only the bits it needs:
+  *
+  *     typedef LoRaSchema<
+  *         LoRaFixed<11, -40, 10>,             // Temperature, -40 to 164.7 in 0.1 steps
+  *         LoRaUInt<7>,                        // Humidity, 0 to 127
+  *         LoRaOptional<LoRaUInt<12>>          // Battery voltage in mV / 2, only when measured
+  *     > sensor_schema_t;
+  *
+  *     sensor_schema_t::values_t values;      // std::tuple<float, uint32_t, LoRaOptionalValue<uint32_t>>
+  *
+  * Encoded size is known at compile time (`max_size`, `min_size`), so that it can be checked against maximum
+  * payload of a datarate. Encoding and decoding do not allocate memory. Fields are packed most significant bit
+  * first, without padding between fields. Last byte is padded with zeros.
+  *
+  * Values out of field range are saturated to the nearest representable value.
+  */
+
+#ifndef LORAWAN_CODEC_H
+#define LORAWAN_CODEC_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <tuple>
+
+/**
+  * @brief Writes bit fields into a byte buffer, most significant bit first
+  */
+class LoRaBitWriter {
+public:
+    /**
+     * @param buffer Output buffer
+     * @param size Buffer size in bytes
+     */
+    LoRaBitWriter (uint8_t* buffer, size_t size) : buffer (buffer), size_bits (size * 8) {}
+
+    /**
+     * @brief Appends the lowest bits of a value
+     * @param value Value to write
+     * @param bits Number of bits, up to 32
+     * @return `False` if value does not fit in buffer. Nothing is written then
+     */
+    bool put (uint32_t value, uint8_t bits) {
+        if (position + bits > size_bits) {
+            return false;
+        }
+        while (bits) {
+            uint8_t room = 8 - (position & 7);
+            uint8_t n = bits < room ? bits : room;
+            uint8_t chunk = (uint8_t)((value >> (bits - n)) & ((1u << n) - 1));
+            uint8_t* byte = &buffer[position >> 3];
+            if (room == 8) {
+                *byte = 0;
+            }
+            *byte |= (uint8_t)(chunk << (room - n));
+            position += n;
+            bits -= n;
+        }
+        return true;
+    }
+
+    /**
+     * @brief Gets number of bits written
+     */
+    size_t bits () const {
+        return position;
+    }
+
+    /**
+     * @brief Gets number of bytes used, including last partial byte
+     */
+    size_t bytes () const {
+        return (position + 7) / 8;
+    }
+
+private:
+    uint8_t* buffer;    ///< @brief Output buffer
+    size_t size_bits;   ///< @brief Buffer size in bits
+    size_t position = 0;    ///< @brief Next bit to write
+};
+
+/**
+  * @brief Reads bit fields from a byte buffer, most significant bit first
+  */
+class LoRaBitReader {
+public:
+    /**
+     * @param buffer Input buffer
+     * @param size Buffer size in bytes
+     */
+    LoRaBitReader (const uint8_t* buffer, size_t size) : buffer (buffer), size_bits (size * 8) {}
+
+    /**
+     * @brief Reads next bits as an unsigned value
+     * @param value Read value
+     * @param bits Number of bits, up to 32
+     * @return `False` if buffer has not enough bits left
+     */
+    bool get (uint32_t* value, uint8_t bits) {
+        if (position + bits > size_bits) {
+            return false;
+        }
+        uint32_t result = 0;
+        while (bits) {
+            uint8_t room = 8 - (position & 7);
+            uint8_t n = bits < room ? bits : room;
+            uint8_t chunk = (uint8_t)((buffer[position >> 3] >> (room - n)) & ((1u << n) - 1));
+            result = (result << n) | chunk;
+            position += n;
+            bits -= n;
+        }
+        *value = result;
+        return true;
+    }
+
+    /**
+     * @brief Gets number of bits read
+     */
+    size_t bits () const {
+        return position;
+    }
+
+private:
+    const uint8_t* buffer;  ///< @brief Input buffer
+    size_t size_bits;   ///< @brief Buffer size in bits
+    size_t position = 0;    ///< @brief Next bit to read
+};
+
+/**
+  * @brief Unsigned integer field
+  * @tparam Bits Field width, 1 to 32
+  */
+template <uint8_t Bits>
+struct LoRaUInt {
+    static_assert (Bits >= 1 && Bits <= 32, "Field width must be 1 to 32 bits");
+    typedef uint32_t value_type;
+    static constexpr size_t min_bits = Bits;
+    static constexpr size_t max_bits = Bits;
+    static constexpr uint32_t max_raw = (uint32_t)((1ull << Bits) - 1);
+
+    static constexpr size_t bits (const value_type&) {
+        return Bits;
+    }
+
+    static bool encode (LoRaBitWriter& writer, const value_type& value) {
+        return writer.put (value > max_raw ? max_raw : value, Bits);
+    }
+
+    static bool decode (LoRaBitReader& reader, value_type& value) {
+        return reader.get (&value, Bits);
+    }
+};
+
+/**
+  * @brief Signed integer field, in two's complement
+  * @tparam Bits Field width, 2 to 32
+  */
+template <uint8_t Bits>
+struct LoRaInt {
+    static_assert (Bits >= 2 && Bits <= 32, "Field width must be 2 to 32 bits");
+    typedef int32_t value_type;
+    static constexpr size_t min_bits = Bits;
+    static constexpr size_t max_bits = Bits;
+    static constexpr int32_t max_value = (int32_t)((1ull << (Bits - 1)) - 1);
+    static constexpr int32_t min_value = -max_value - 1;
+
+    static constexpr size_t bits (const value_type&) {
+        return Bits;
+    }
+
+    static bool encode (LoRaBitWriter& writer, const value_type& value) {
+        int32_t v = value > max_value ? max_value : value < min_value ? min_value : value;
+        return writer.put ((uint32_t)v, Bits);
+    }
+
+    static bool decode (LoRaBitReader& reader, value_type& value) {
+        uint32_t raw;
+        if (!reader.get (&raw, Bits)) {
+            return false;
+        }
+        // Sign extension
+        if (Bits < 32 && (raw & (1u << (Bits - 1)))) {
+            raw |= ~(uint32_t)max_value;
+        }
+        value = (int32_t)raw;
+        return true;
+    }
+};
+
+/**
+  * @brief Fixed point field. Stores `round ((value - Min) * Scale)` as an unsigned integer
+  * @tparam Bits Field width, 1 to 32
+  * @tparam Min Lowest value
+  * @tparam Scale Steps per unit. Resolution is `1 / Scale`
+  */
+template <uint8_t Bits, int32_t Min, uint32_t Scale = 1>
+struct LoRaFixed {
+    static_assert (Bits >= 1 && Bits <= 32, "Field width must be 1 to 32 bits");
+    static_assert (Scale >= 1, "Scale must be 1 or higher");
+    typedef float value_type;
+    static constexpr size_t min_bits = Bits;
+    static constexpr size_t max_bits = Bits;
+    static constexpr uint32_t max_raw = LoRaUInt<Bits>::max_raw;
+    static constexpr float max_value = Min + (float)max_raw / Scale; ///< @brief Highest representable value
+
+    static constexpr size_t bits (const value_type&) {
+        return Bits;
+    }
+
+    static bool encode (LoRaBitWriter& writer, const value_type& value) {
+        float scaled = (value - Min) * Scale + 0.5f;
+        // NaN is stored as lowest value
+        uint32_t raw = !(scaled > 0) ? 0 : scaled >= (float)max_raw ? max_raw : (uint32_t)scaled;
+        return writer.put (raw, Bits);
+    }
+
+    static bool decode (LoRaBitReader& reader, value_type& value) {
+        uint32_t raw;
+        if (!reader.get (&raw, Bits)) {
+            return false;
+        }
+        value = Min + (float)raw / Scale;
+        return true;
+    }
+};
+
+/**
+  * @brief Single bit flag field
+  */
+struct LoRaBool {
+    typedef bool value_type;
+    static constexpr size_t min_bits = 1;
+    static constexpr size_t max_bits = 1;
+
+    static constexpr size_t bits (const value_type&) {
+        return 1;
+    }
+
+    static bool encode (LoRaBitWriter& writer, const value_type& value) {
+        return writer.put (value ? 1 : 0, 1);
+    }
+
+    static bool decode (LoRaBitReader& reader, value_type& value) {
+        uint32_t raw;
+        if (!reader.get (&raw, 1)) {
+            return false;
+        }
+        value = raw != 0;
+        return true;
+    }
+};
+
+/**
+  * @brief Value of an optional field
+  */
+template <typename T>
+struct LoRaOptionalValue {
+    bool present;   ///< @brief `True` if value is included in payload
+    T value;        ///< @brief Field value. Only valid if `present` is `true`
+};
+
+/**
+  * @brief Optional field. A presence bit is followed by field bits only if value is present
+  * @tparam Field Wrapped field type
+  */
+template <typename Field>
+struct LoRaOptional {
+    typedef LoRaOptionalValue<typename Field::value_type> value_type;
+    static constexpr size_t min_bits = 1;
+    static constexpr size_t max_bits = 1 + Field::max_bits;
+
+    static constexpr size_t bits (const value_type& value) {
+        return value.present ? 1 + Field::bits (value.value) : 1;
+    }
+
+    static bool encode (LoRaBitWriter& writer, const value_type& value) {
+        return writer.put (value.present ? 1 : 0, 1) && (!value.present || Field::encode (writer, value.value));
+    }
+
+    static bool decode (LoRaBitReader& reader, value_type& value) {
+        uint32_t present;
+        if (!reader.get (&present, 1)) {
+            return false;
+        }
+        value.present = present != 0;
+        return !value.present || Field::decode (reader, value.value);
+    }
+};
+
+/**
+  * @brief Walks schema fields recursively, from field `I` to the end. Keeps codec usable with C++11
+  * @tparam I Index of first field in values tuple
+  * @tparam Fields Remaining field types
+  */
+template <size_t I, typename... Fields>
+struct LoRaSchemaFields {
+    static constexpr size_t max_bits = 0;
+    static constexpr size_t min_bits = 0;
+
+    template <typename Values>
+    static size_t bits (const Values&) {
+        return 0;
+    }
+
+    template <typename Values>
+    static bool encode (LoRaBitWriter&, const Values&) {
+        return true;
+    }
+
+    template <typename Values>
+    static bool decode (LoRaBitReader&, Values&) {
+        return true;
+    }
+};
+
+template <size_t I, typename Field, typename... Rest>
+struct LoRaSchemaFields<I, Field, Rest...> {
+    typedef LoRaSchemaFields<I + 1, Rest...> next_t;
+    static constexpr size_t max_bits = Field::max_bits + next_t::max_bits;
+    static constexpr size_t min_bits = Field::min_bits + next_t::min_bits;
+
+    template <typename Values>
+    static size_t bits (const Values& values) {
+        return Field::bits (std::get<I> (values)) + next_t::bits (values);
+    }
+
+    template <typename Values>
+    static bool encode (LoRaBitWriter& writer, const Values& values) {
+        return Field::encode (writer, std::get<I> (values)) && next_t::encode (writer, values);
+    }
+
+    template <typename Values>
+    static bool decode (LoRaBitReader& reader, Values& values) {
+        return Field::decode (reader, std::get<I> (values)) && next_t::decode (reader, values);
+    }
+};
+
+/**
+  * @brief Payload layout made of a sequence of fields
+  * @tparam Fields Field types, in payload order
+  */
+template <typename... Fields>
+class LoRaSchema {
+public:
+    typedef std::tuple<typename Fields::value_type...> values_t; ///< @brief Field values, in schema order
+    typedef LoRaSchemaFields<0, Fields...> fields_t; ///< @brief Field walker
+
+    static constexpr size_t max_bits = fields_t::max_bits;  ///< @brief Bits with all optional fields present
+    static constexpr size_t min_bits = fields_t::min_bits;  ///< @brief Bits with no optional field present
+    static constexpr size_t max_size = (max_bits + 7) / 8;  ///< @brief Largest encoded payload, in bytes
+    static constexpr size_t min_size = (min_bits + 7) / 8;  ///< @brief Smallest encoded payload, in bytes
+
+    /**
+     * @brief Calculates encoded length of some values
+     * @param values Field values
+     * @return Payload length in bytes
+     */
+    static size_t encoded_size (const values_t& values) {
+        return (fields_t::bits (values) + 7) / 8;
+    }
+
+    /**
+     * @brief Encodes values into a buffer
+     * @param values Field values
+     * @param buffer Output buffer
+     * @param size Buffer size
+     * @return Payload length in bytes. 0 if it does not fit in buffer
+     */
+    static size_t encode (const values_t& values, uint8_t* buffer, size_t size) {
+        LoRaBitWriter writer (buffer, size);
+        if (!fields_t::encode (writer, values)) {
+            return 0;
+        }
+        return writer.bytes ();
+    }
+
+    /**
+     * @brief Decodes a payload
+     * @param buffer Payload
+     * @param size Payload length
+     * @param values Decoded field values
+     * @return `False` if payload is too short for this schema
+     */
+    static bool decode (const uint8_t* buffer, size_t size, values_t& values) {
+        LoRaBitReader reader (buffer, size);
+        return fields_t::decode (reader, values);
+    }
+};
+
+#endif // LORAWAN_CODEC_H
@@ -0,0 +1,34 @@
+/**
+  * @file lorawan_crc.h
+  * @version 0.0.2
+  * @date 05/10/2021
+  * @author German Martin
+  * @brief CRC used to validate data stored by QuickLoRaWAN
+  */
+
+#ifndef LORAWAN_CRC_H
+#define LORAWAN_CRC_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+  * @brief Calculates CRC-32 (IEEE 802.3) of a buffer. Bitwise implementation, no table is stored in flash
+  * @param data Data buffer
+  * @param len Data length
+  * @param crc Previous CRC value, to calculate CRC of data split in several buffers
+  * @return CRC value
+  */
+inline uint32_t lorawan_crc32 (const void* data, size_t len, uint32_t crc = 0) {
+    const uint8_t* p = (const uint8_t*)data;
+    crc = ~crc;
+    while (len--) {
+        crc ^= *p++;
+        for (int i = 0; i < 8; i++) {
+            crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+        }
+    }
+    return ~crc;
+}
+
+#endif // LORAWAN_CRC_H
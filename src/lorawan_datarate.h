@@ -0,0 +1,148 @@
+/**
+  * @file lorawan_datarate.h
+  * @version 0.0.2
+  * @date 05/10/2021
+  * @author German Martin
+  * @brief Datarate parameters of the configured LoRaWAN region
+  *
+  * One table per region, indexed by datarate number, with values from LoRaWAN Regional Parameters (RP002).
+  * Maximum payload is the repeater compatible application payload, without MAC options. Table is constant data and
+  * its accessors do not allocate memory. It stays in flash on ESP32, but ESP8266 copies `.rodata` to DRAM, so there
+  * it takes 20 bytes of RAM per datarate, plus names. It is not in PROGMEM, so that entries can be read as
+  * plain references.
+  */
+
+#ifndef LORAWAN_DATARATE_H
+#define LORAWAN_DATARATE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <lmic.h>
+
+/**
+  * @brief Parameters of a datarate
+  */
+typedef struct {
+    const char* name;       ///< @brief Human readable name
+    uint8_t sf;             ///< @brief Spreading factor. 0 for FSK or unused datarates
+    uint16_t bandwidth;     ///< @brief Bandwidth in kHz. 0 for FSK or unused datarates
+    uint8_t coding_rate;    ///< @brief Coding rate denominator, 5 for 4/5. 0 for FSK or unused datarates
+    uint32_t bitrate;       ///< @brief Physical bitrate in bit/s
+    uint8_t max_payload;    ///< @brief Maximum application payload in bytes. 0 if datarate cannot be used
+} datarate_info_t;
+
+#if defined(CFG_eu868)
+static_assert (EU868_DR_SF12 == 0 && EU868_DR_FSK == 7 && EU868_DR_NONE == 8, "Unexpected EU868 datarate numbers");
+constexpr datarate_info_t LORAWAN_DATARATES[] = {
+    { "SF12", 12, 125, 5, 250, 51 },
+    { "SF11", 11, 125, 5, 440, 51 },
+    { "SF10", 10, 125, 5, 980, 51 },
+    { "SF9", 9, 125, 5, 1760, 115 },
+    { "SF8", 8, 125, 5, 3125, 222 },
+    { "SF7", 7, 125, 5, 5470, 222 },
+    { "SF7B", 7, 250, 5, 11000, 222 },
+    { "FSK", 0, 0, 0, 50000, 222 },
+    { "NONE", 0, 0, 0, 0, 0 },
+};
+#elif defined(CFG_us915)
+static_assert (US915_DR_SF10 == 0 && US915_DR_NONE == 5 && US915_DR_SF12CR == 8 && US915_DR_SF7CR == 13,
+               "Unexpected US915 datarate numbers");
+constexpr datarate_info_t LORAWAN_DATARATES[] = {
+    { "SF10", 10, 125, 5, 980, 11 },
+    { "SF9", 9, 125, 5, 1760, 53 },
+    { "SF8", 8, 125, 5, 3125, 125 },
+    { "SF7", 7, 125, 5, 5470, 242 },
+    { "SF8C", 8, 500, 5, 12500, 242 },
+    { "NONE", 0, 0, 0, 0, 0 },
+    { "RFU", 0, 0, 0, 0, 0 },
+    { "RFU", 0, 0, 0, 0, 0 },
+    { "SF12CR", 12, 500, 5, 980, 53 },
+    { "SF11CR", 11, 500, 5, 1760, 129 },
+    { "SF10CR", 10, 500, 5, 3900, 242 },
+    { "SF9CR", 9, 500, 5, 7000, 242 },
+    { "SF8CR", 8, 500, 5, 12500, 242 },
+    { "SF7CR", 7, 500, 5, 21900, 242 },
+};
+#elif defined(CFG_au915)
+static_assert (AU915_DR_SF12 == 0 && AU915_DR_NONE == 7 && AU915_DR_SF12CR == 8 && AU915_DR_SF7CR == 13,
+               "Unexpected AU915 datarate numbers");
+constexpr datarate_info_t LORAWAN_DATARATES[] = {
+    { "SF12", 12, 125, 5, 250, 51 },
+    { "SF11", 11, 125, 5, 440, 51 },
+    { "SF10", 10, 125, 5, 980, 51 },
+    { "SF9", 9, 125, 5, 1760, 115 },
+    { "SF8", 8, 125, 5, 3125, 242 },
+    { "SF7", 7, 125, 5, 5470, 242 },
+    { "SF8C", 8, 500, 5, 12500, 242 },
+    { "NONE", 0, 0, 0, 0, 0 },
+    { "SF12CR", 12, 500, 5, 980, 53 },
+    { "SF11CR", 11, 500, 5, 1760, 129 },
+    { "SF10CR", 10, 500, 5, 3900, 242 },
+    { "SF9CR", 9, 500, 5, 7000, 242 },
+    { "SF8CR", 8, 500, 5, 12500, 242 },
+    { "SF7CR", 7, 500, 5, 21900, 242 },
+};
+#elif defined(CFG_as923)
+static_assert (AS923_DR_SF12 == 0 && AS923_DR_FSK == 7 && AS923_DR_NONE == 8, "Unexpected AS923 datarate numbers");
+constexpr datarate_info_t LORAWAN_DATARATES[] = {
+    { "SF12", 12, 125, 5, 250, 51 },
+    { "SF11", 11, 125, 5, 440, 51 },
+    { "SF10", 10, 125, 5, 980, 51 },
+    { "SF9", 9, 125, 5, 1760, 115 },
+    { "SF8", 8, 125, 5, 3125, 222 },
+    { "SF7", 7, 125, 5, 5470, 222 },
+    { "SF7B", 7, 250, 5, 11000, 222 },
+    { "FSK", 0, 0, 0, 50000, 222 },
+    { "NONE", 0, 0, 0, 0, 0 },
+};
+#elif defined(CFG_kr920)
+static_assert (KR920_DR_SF12 == 0 && KR920_DR_SF7 == 5 && KR920_DR_NONE == 6, "Unexpected KR920 datarate numbers");
+constexpr datarate_info_t LORAWAN_DATARATES[] = {
+    { "SF12", 12, 125, 5, 250, 51 },
+    { "SF11", 11, 125, 5, 440, 51 },
+    { "SF10", 10, 125, 5, 980, 51 },
+    { "SF9", 9, 125, 5, 1760, 115 },
+    { "SF8", 8, 125, 5, 3125, 222 },
+    { "SF7", 7, 125, 5, 5470, 222 },
+    { "NONE", 0, 0, 0, 0, 0 },
+};
+#elif defined(CFG_in866)
+static_assert (IN866_DR_SF12 == 0 && IN866_DR_RFU == 6 && IN866_DR_FSK == 7 && IN866_DR_NONE == 8,
+               "Unexpected IN866 datarate numbers");
+constexpr datarate_info_t LORAWAN_DATARATES[] = {
+    { "SF12", 12, 125, 5, 250, 51 },
+    { "SF11", 11, 125, 5, 440, 51 },
+    { "SF10", 10, 125, 5, 980, 51 },
+    { "SF9", 9, 125, 5, 1760, 115 },
+    { "SF8", 8, 125, 5, 3125, 222 },
+    { "SF7", 7, 125, 5, 5470, 222 },
+    { "RFU", 0, 0, 0, 0, 0 },
+    { "FSK", 0, 0, 0, 50000, 222 },
+    { "NONE", 0, 0, 0, 0, 0 },
+};
+#else
+// Region without datarate table. Every datarate is unknown
+constexpr datarate_info_t LORAWAN_DATARATES[] = {
+    { "Unknown", 0, 0, 0, 0, 0 },
+};
+#define LORAWAN_DATARATES_UNKNOWN
+#endif
+
+#ifdef LORAWAN_DATARATES_UNKNOWN
+constexpr size_t LORAWAN_DATARATE_COUNT = 0; ///< @brief Number of datarates in table
+#else
+constexpr size_t LORAWAN_DATARATE_COUNT = sizeof (LORAWAN_DATARATES) / sizeof (LORAWAN_DATARATES[0]); ///< @brief Number of datarates in table
+#endif
+
+constexpr datarate_info_t LORAWAN_DATARATE_UNKNOWN = { "Unknown", 0, 0, 0, 0, 0 }; ///< @brief Returned for datarates out of table
+
+/**
+  * @brief Gets parameters of a datarate
+  * @param dr Datarate number
+  * @return Datarate parameters. `LORAWAN_DATARATE_UNKNOWN` if datarate is not in region table
+  */
+constexpr const datarate_info_t& lorawan_datarate (uint8_t dr) {
+    return dr < LORAWAN_DATARATE_COUNT ? LORAWAN_DATARATES[dr] : LORAWAN_DATARATE_UNKNOWN;
+}
+
+#endif // LORAWAN_DATARATE_H
@@ -0,0 +1,92 @@
+/**
+  * @file lorawan_delegate.h
+  * @version 0.0.2
+  * @date 05/10/2021
+  * @author German Martin
+  * @brief Allocation free callback holder
+  *
+  * `LoRaDelegate` stores a function pointer, or a lambda with small captures, inside the object itself. It never
+  * allocates memory and calling it costs a single indirect call. Callables bigger than storage size, which is
+  * `LORAWAN_DELEGATE_SIZE` unless given as second template argument, or that are not trivially copyable, are
+  * rejected at compile time.
+  */
+
+#ifndef LORAWAN_DELEGATE_H
+#define LORAWAN_DELEGATE_H
+
+#include <stddef.h>
+#include <string.h>
+#include <new>
+#include <type_traits>
+
+#ifndef LORAWAN_DELEGATE_SIZE
+#define LORAWAN_DELEGATE_SIZE (2 * sizeof (void*)) ///< @brief Inline storage for callable captures, in bytes
+#endif // LORAWAN_DELEGATE_SIZE
+
+template <typename Signature, size_t Size = LORAWAN_DELEGATE_SIZE>
+class LoRaDelegate;
+
+template <typename R, typename... Args, size_t Size>
+class LoRaDelegate<R (Args...), Size> {
+public:
+    LoRaDelegate () {}
+
+    /**
+     * @brief Builds an empty delegate. Allows `cb = 0` and `cb = nullptr`
+     */
+    LoRaDelegate (decltype (nullptr)) {}
+
+    /**
+     * @brief Builds a delegate from a function pointer or a lambda
+     * @param f Callable. A lambda may capture at most `Size` bytes, by value or by reference
+     */
+    template <typename F, typename = typename std::enable_if<!std::is_same<typename std::decay<F>::type, LoRaDelegate>::value &&
+                                                             !std::is_integral<typename std::decay<F>::type>::value>::type>
+    LoRaDelegate (F f) {
+        typedef typename std::decay<F>::type callable_t;
+        static_assert (sizeof (callable_t) <= Size, "Callable is too big for LoRaDelegate. Capture less or raise LORAWAN_DELEGATE_SIZE");
+        static_assert (std::is_trivially_copyable<callable_t>::value && std::is_trivially_destructible<callable_t>::value,
+                       "LoRaDelegate only holds trivially copyable callables. Capture pointers or references instead of objects");
+        if (is_null (f)) {
+            return;
+        }
+        new (storage) callable_t (f);
+        invoker = &invoke<callable_t>;
+    }
+
+    /**
+     * @brief Calls stored callable. Delegate must not be empty
+     */
+    R operator() (Args... args) const {
+        return invoker (storage, args...);
+    }
+
+    /**
+     * @brief Checks if delegate holds a callable
+     */
+    explicit operator bool () const {
+        return invoker != nullptr;
+    }
+
+private:
+    typedef R (*invoker_t) (const void* storage, Args... args);
+
+    alignas (void*) unsigned char storage[Size] = { 0 }; ///< @brief Callable object
+    invoker_t invoker = nullptr;    ///< @brief Calls callable in `storage` with its real type
+
+    template <typename F>
+    static R invoke (const void* storage, Args... args) {
+        return (*(F*)storage) (args...);
+    }
+
+    template <typename F>
+    static bool is_null (const F&) {
+        return false;
+    }
+
+    static bool is_null (R (*f) (Args...)) {
+        return f == nullptr;
+    }
+};
+
+#endif // LORAWAN_DELEGATE_H
@@ -0,0 +1,214 @@
+#include <string.h>
+#include "lorawan_frag.h"
+
+/**
+  * @brief Pseudo random generator used by TS004 parity matrix
+  */
+static uint32_t prbs23 (uint32_t x) {
+    uint32_t b0 = x & 1;
+    uint32_t b1 = (x & 0x20) >> 5;
+    return (x >> 1) + ((b0 ^ b1) << 22);
+}
+
+static bool is_power2 (uint32_t n) {
+    return n && !(n & (n - 1));
+}
+
+static inline bool bit_test (const uint8_t* bitmap, uint16_t i) {
+    return bitmap[i >> 3] & (1 << (i & 7));
+}
+
+void LoRaFragmenter::parity_line (uint16_t n, uint16_t m, uint8_t* line) {
+    memset (line, 0, (m + 7) / 8);
+    uint32_t modulo = m + (is_power2 (m) ? 1 : 0);
+    uint32_t x = 1 + 1001 * (uint32_t)n;
+
+    // A position may be drawn twice, so lines have up to m / 2 coefficients. Kept as is to match other TS004 decoders
+    for (uint16_t coeff = 0; coeff < m / 2; coeff++) {
+        uint32_t r = 1 << 16;
+        while (r >= m) {
+            x = prbs23 (x);
+            r = x % modulo;
+        }
+        line[r >> 3] |= 1 << (r & 7);
+    }
+}
+
+bool LoRaFragmenter::begin (const uint8_t* data, size_t len, uint8_t frag_size, uint16_t redundancy, uint8_t session) {
+    if (!frag_size || !len || (len + frag_size - 1) / frag_size > LORAWAN_FRAG_MAX_FRAGMENTS) {
+        return false;
+    }
+    // Fragment numbers above it do not fit in header
+    if ((len + frag_size - 1) / frag_size + redundancy > LORAWAN_FRAG_MAX_INDEX) {
+        return false;
+    }
+    this->data = data;
+    this->len = len;
+    this->frag_size = frag_size;
+    this->redundancy = redundancy;
+    this->session = session & 0x03;
+    fragments = (len + frag_size - 1) / frag_size;
+    return true;
+}
+
+void LoRaFragmenter::xor_fragment (uint16_t index, uint8_t* buffer) {
+    size_t offset = (size_t)index * frag_size;
+    size_t available = len - offset < frag_size ? len - offset : frag_size;
+    for (size_t i = 0; i < available; i++) {
+        buffer[i] ^= data[offset + i];
+    }
+}
+
+size_t LoRaFragmenter::build (uint16_t n, uint8_t* buffer) {
+    if (!n || n > get_total ()) {
+        return 0;
+    }
+    uint16_t index_and_n = (uint16_t)(session << 14) | (n & 0x3FFF);
+    buffer[0] = LORAWAN_FRAG_CID;
+    buffer[1] = (uint8_t)index_and_n;
+    buffer[2] = (uint8_t)(index_and_n >> 8);
+    buffer[3] = (uint8_t)fragments;
+    buffer[4] = (uint8_t)(fragments >> 8);
+    buffer[5] = (uint8_t)(fragments * frag_size - len);
+
+    uint8_t* payload = buffer + LORAWAN_FRAG_HEADER;
+    memset (payload, 0, frag_size);
+    if (n <= fragments) {
+        xor_fragment (n - 1, payload);
+    } else {
+        uint8_t line[(LORAWAN_FRAG_MAX_FRAGMENTS + 7) / 8];
+        parity_line (n - fragments, fragments, line);
+        for (uint16_t i = 0; i < fragments; i++) {
+            if (bit_test (line, i)) {
+                xor_fragment (i, payload);
+            }
+        }
+    }
+    return LORAWAN_FRAG_HEADER + frag_size;
+}
+
+void LoRaFragReassembler::begin (uint8_t* storage, size_t size) {
+    this->storage = storage;
+    storage_len = size;
+    started = false;
+    done = false;
+    rank = 0;
+    received = 0;
+}
+
+frag_status_t LoRaFragReassembler::add (const uint8_t* frame, size_t len) {
+    if (len <= LORAWAN_FRAG_HEADER || frame[0] != LORAWAN_FRAG_CID) {
+        return FRAG_ERROR;
+    }
+    uint16_t index_and_n = frame[1] | (frame[2] << 8);
+    uint8_t frame_session = index_and_n >> 14;
+    uint16_t n = index_and_n & 0x3FFF;
+    uint16_t frame_fragments = frame[3] | (frame[4] << 8);
+    uint8_t frame_padding = frame[5];
+    size_t frame_size = len - LORAWAN_FRAG_HEADER;
+
+    if (!started || frame_session != session) {
+        // First fragment of a new block
+        if (!frame_fragments || frame_fragments > LORAWAN_FRAG_MAX_FRAGMENTS || frame_size > UINT8_MAX ||
+            frame_padding >= frame_size || storage_size (frame_fragments, (uint8_t)frame_size) > storage_len) {
+            return FRAG_ERROR;
+        }
+        started = true;
+        done = false;
+        session = frame_session;
+        fragments = frame_fragments;
+        frag_size = (uint8_t)frame_size;
+        padding = frame_padding;
+        rank = 0;
+        received = 0;
+        memset (storage, 0, storage_size (fragments, frag_size));
+    } else if (frame_fragments != fragments || frame_size != frag_size) {
+        return FRAG_ERROR;
+    }
+    if (!n) {
+        return FRAG_ERROR;
+    }
+    received++;
+    if (done) {
+        return FRAG_DONE;
+    }
+
+    // Candidate row: coefficients and data. Kept in stack, as it is discarded if it adds no information
+    size_t line_len = (fragments + 7) / 8;
+    uint8_t line[(LORAWAN_FRAG_MAX_FRAGMENTS + 7) / 8];
+    uint8_t payload[UINT8_MAX];
+    if (n <= fragments) {
+        memset (line, 0, line_len);
+        line[(n - 1) >> 3] = 1 << ((n - 1) & 7);
+    } else {
+        LoRaFragmenter::parity_line (n - fragments, fragments, line);
+    }
+    memcpy (payload, frame + LORAWAN_FRAG_HEADER, frag_size);
+
+    // Eliminate coefficients that already have a pivot row. First remaining one becomes pivot of this row
+    for (uint16_t i = 0; i < fragments; i++) {
+        if (!bit_test (line, i)) {
+            continue;
+        }
+        uint8_t* pivot = row (i);
+        if (!pivot[0]) {
+            pivot[0] = 1;
+            memcpy (pivot + 1, line, line_len);
+            memcpy (pivot + 1 + line_len, payload, frag_size);
+            rank++;
+            if (rank == fragments) {
+                solve ();
+                done = true;
+                return FRAG_DONE;
+            }
+            return FRAG_INCOMPLETE;
+        }
+        for (size_t k = 0; k < line_len; k++) {
+            line[k] ^= pivot[1 + k];
+        }
+        for (size_t k = 0; k < frag_size; k++) {
+            payload[k] ^= pivot[1 + line_len + k];
+        }
+    }
+    // Linear combination of stored rows. Nothing new
+    return FRAG_INCOMPLETE;
+}
+
+void LoRaFragReassembler::solve () {
+    size_t line_len = (fragments + 7) / 8;
+
+    // Every row only has coefficients at or after its pivot. Clear them from last row backwards
+    for (int i = fragments - 1; i >= 0; i--) {
+        uint8_t* current = row (i);
+        for (uint16_t j = i + 1; j < fragments; j++) {
+            if (!bit_test (current + 1, j)) {
+                continue;
+            }
+            const uint8_t* solved = row (j);
+            for (size_t k = 0; k < line_len; k++) {
+                current[1 + k] ^= solved[1 + k];
+            }
+            for (size_t k = 0; k < frag_size; k++) {
+                current[1 + line_len + k] ^= solved[1 + line_len + k];
+            }
+        }
+    }
+}
+
+size_t LoRaFragReassembler::copy (uint8_t* buffer, size_t size) {
+    if (!done) {
+        return 0;
+    }
+    size_t block_len = (size_t)fragments * frag_size - padding;
+    if (size < block_len) {
+        return 0;
+    }
+    size_t line_len = (fragments + 7) / 8;
+    size_t offset = 0;
+    for (uint16_t i = 0; i < fragments; i++) {
+        size_t chunk = block_len - offset < frag_size ? block_len - offset : frag_size;
+        memcpy (buffer + offset, row (i) + 1 + line_len, chunk);
+        offset += chunk;
+    }
+    return block_len;
+}
@@ -0,0 +1,201 @@
+/**
+  * @file lorawan_frag.h
+  * @version 0.0.2
+  * @date 05/10/2021
+  * @author German Martin
+  * @brief Fragmented uplink of large data blocks with forward error correction
+  *
+  * A data block is split in `M` fragments of equal size, last one padded with zeros. Fragments `1` to `M` carry
+  * data as is. Fragments after `M` are parity fragments: XOR of up to half of the data fragments, chosen with the
+  * parity matrix of LoRaWAN Fragmented Data Block Transport (TS004). Any `M` fragments that are linearly independent
+  * rebuild the block, usually `M` plus a few more.
+  *
+  * Every fragment is sent in its own uplink:
+  *
+  *     0x08            DataFragment command, as in TS004
+  *     index_and_n     2 bytes, little endian. Bits 15:14 session, bits 13:0 fragment number N, starting at 1
+  *     nb_frag         2 bytes, little endian. Number of data fragments M
+  *     padding         1 byte. Zeros appended to last data fragment
+  *     payload         fragment data. Fragment size is frame length minus header
+  *
+  * TS004 sends `nb_frag`, fragment size and padding once, in a session setup exchange. Here they travel in every
+  * fragment, so that no downlink round trip is needed and any subset of fragments is enough to start rebuilding.
+  */
+
+#ifndef LORAWAN_FRAG_H
+#define LORAWAN_FRAG_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifndef LORAWAN_FRAG_MAX_FRAGMENTS
+#define LORAWAN_FRAG_MAX_FRAGMENTS 256 ///< @brief Maximum number of data fragments in a block
+#endif // LORAWAN_FRAG_MAX_FRAGMENTS
+
+#ifndef LORAWAN_FRAG_PORT
+#define LORAWAN_FRAG_PORT 201 ///< @brief Default port for fragments, same as TS004 package
+#endif // LORAWAN_FRAG_PORT
+
+#define LORAWAN_FRAG_CID 0x08   ///< @brief DataFragment command id
+#define LORAWAN_FRAG_HEADER 6   ///< @brief Bytes of header before fragment data
+#define LORAWAN_FRAG_MAX_INDEX 0x3FFF  ///< @brief Highest fragment number, including parity ones. Index field has 14 bits
+
+/**
+  * @brief Splits a data block in fragments and builds parity fragments
+  */
+class LoRaFragmenter {
+public:
+    /**
+     * @brief Prepares fragmentation of a block. Data is not copied, so it has to be kept unchanged until all
+     *        fragments have been built
+     * @param data Data block
+     * @param len Block length
+     * @param frag_size Data bytes per fragment
+     * @param redundancy Number of parity fragments
+     * @param session Session number, 0 to 3. Lets receiver tell consecutive blocks apart
+     * @return `False` if block needs more than `LORAWAN_FRAG_MAX_FRAGMENTS` fragments, or data and parity fragments
+     *         together are more than `LORAWAN_FRAG_MAX_INDEX`
+     */
+    bool begin (const uint8_t* data, size_t len, uint8_t frag_size, uint16_t redundancy, uint8_t session);
+
+    /**
+     * @brief Builds a fragment frame
+     * @param n Fragment number, 1 to `get_total()`
+     * @param buffer Output buffer. It must have room for `LORAWAN_FRAG_HEADER + frag_size` bytes
+     * @return Frame length. 0 if `n` is out of range
+     */
+    size_t build (uint16_t n, uint8_t* buffer);
+
+    /**
+     * @brief Gets number of data fragments, M
+     */
+    uint16_t get_fragments () {
+        return fragments;
+    }
+
+    /**
+     * @brief Gets number of fragments including parity ones
+     */
+    uint16_t get_total () {
+        return fragments + redundancy;
+    }
+
+    /**
+     * @brief Gets length of every fragment frame, header included
+     */
+    size_t get_frame_size () {
+        return LORAWAN_FRAG_HEADER + frag_size;
+    }
+
+    /**
+     * @brief Calculates TS004 parity matrix line. Bit `i` is set if data fragment `i + 1` is part of parity fragment
+     * @param n Parity fragment index, starting at 1 for fragment `M + 1`
+     * @param m Number of data fragments
+     * @param line Output bitmap, `(m + 7) / 8` bytes, least significant bit first
+     */
+    static void parity_line (uint16_t n, uint16_t m, uint8_t* line);
+
+private:
+    const uint8_t* data = nullptr;  ///< @brief Data block
+    size_t len = 0;             ///< @brief Data block length
+    uint8_t frag_size = 0;      ///< @brief Data bytes per fragment
+    uint16_t fragments = 0;     ///< @brief Number of data fragments
+    uint16_t redundancy = 0;    ///< @brief Number of parity fragments
+    uint8_t session = 0;        ///< @brief Session number
+
+    /**
+     * @brief XORs a data fragment into a buffer, treating bytes after end of block as padding zeros
+     * @param index Data fragment index, starting at 0
+     * @param buffer Buffer of `frag_size` bytes
+     */
+    void xor_fragment (uint16_t index, uint8_t* buffer);
+};
+
+/**
+  * @brief Result of adding a fragment to reassembler
+  */
+typedef enum {
+    FRAG_INCOMPLETE = 0,    ///< @brief More fragments are needed
+    FRAG_DONE = 1,          ///< @brief Block has been rebuilt
+    FRAG_ERROR = 2          ///< @brief Malformed fragment or block does not fit in storage
+} frag_status_t;
+
+/**
+  * @brief Rebuilds a block from any sufficient set of fragments, using incremental Gaussian elimination over GF(2).
+  *        It works in storage given by caller and allocates nothing
+  */
+class LoRaFragReassembler {
+public:
+    /**
+     * @brief Calculates storage needed for a block
+     * @param fragments Number of data fragments
+     * @param frag_size Data bytes per fragment
+     * @return Storage size in bytes
+     */
+    static constexpr size_t storage_size (uint16_t fragments, uint8_t frag_size) {
+        return (size_t)fragments * (frag_size + (fragments + 7) / 8 + 1);
+    }
+
+    /**
+     * @brief Sets storage and waits for first fragment of a new block
+     * @param storage Working memory
+     * @param size Storage size
+     */
+    void begin (uint8_t* storage, size_t size);
+
+    /**
+     * @brief Adds a received fragment frame. Fragments of other sessions, or repeated ones, are ignored
+     * @param frame Fragment frame as built by `LoRaFragmenter::build()`
+     * @param len Frame length
+     * @return Reassembly status
+     */
+    frag_status_t add (const uint8_t* frame, size_t len);
+
+    /**
+     * @brief Copies rebuilt block
+     * @param buffer Output buffer
+     * @param size Output buffer size
+     * @return Block length. 0 if block is not complete or buffer is too small
+     */
+    size_t copy (uint8_t* buffer, size_t size);
+
+    /**
+     * @brief Gets number of fragments received for current block, including useless ones
+     */
+    uint16_t get_received () {
+        return received;
+    }
+
+private:
+    uint8_t* storage = nullptr; ///< @brief Rows: pivot flag, coefficient bitmap and data
+    size_t storage_len = 0;     ///< @brief Storage size
+    bool started = false;       ///< @brief First fragment has been received
+    uint8_t session = 0;        ///< @brief Session of current block
+    uint16_t fragments = 0;     ///< @brief Number of data fragments
+    uint8_t frag_size = 0;      ///< @brief Data bytes per fragment
+    uint8_t padding = 0;        ///< @brief Padding bytes in last fragment
+    uint16_t rank = 0;          ///< @brief Number of independent fragments stored
+    uint16_t received = 0;      ///< @brief Fragments received
+    bool done = false;          ///< @brief Block has been rebuilt
+
+    /**
+     * @brief Gets row size in storage
+     */
+    size_t row_size () {
+        return 1 + (fragments + 7) / 8 + frag_size;
+    }
+
+    /**
+     * @brief Gets row whose pivot is data fragment `index`
+     */
+    uint8_t* row (uint16_t index) {
+        return storage + index * row_size ();
+    }
+
+    /**
+     * @brief Solves stored rows once all pivots are present, so that every row holds one data fragment
+     */
+    void solve ();
+};
+
+#endif // LORAWAN_FRAG_H
@@ -0,0 +1,144 @@
+#include <string.h>
+#include "lorawan_journal.h"
+#include "lorawan_crc.h"
+
+bool LoRaJournal::begin (FS* fs, const char* path, uint16_t record_size, uint16_t slots) {
+    uint32_t seq;
+
+    file_system = fs;
+    this->path = path;
+    this->record_size = record_size;
+    this->slots = slots;
+    latest_slot = -1;
+    sequence = 0;
+    file.close ();
+
+    if (!file_system || !slots || !record_size) {
+        return false;
+    }
+
+    if (!file_system->exists (path) || !open_file () || file.size () != slot_size () * slots) {
+        file.close ();
+        return preallocate ();
+    }
+
+    for (uint16_t i = 0; i < slots; i++) {
+        if (read_slot (i, &seq, NULL, 0) && (latest_slot < 0 || (int32_t)(seq - sequence) > 0)) {
+            latest_slot = i;
+            sequence = seq;
+        }
+    }
+    return true;
+}
+
+bool LoRaJournal::open_file () {
+    if (!file) {
+        file = file_system->open (path, "r+");
+    }
+    return (bool)file;
+}
+
+bool LoRaJournal::preallocate () {
+    uint8_t empty[32];
+    size_t total = slot_size () * slots;
+
+    memset (empty, 0xFF, sizeof (empty));
+    file = file_system->open (path, "w+");
+    if (!file) {
+        return false;
+    }
+    while (total) {
+        size_t chunk = total < sizeof (empty) ? total : sizeof (empty);
+        if (file.write (empty, chunk) != chunk) {
+            file.close ();
+            return false;
+        }
+        total -= chunk;
+    }
+    file.flush ();
+    return true;
+}
+
+bool LoRaJournal::read_slot (uint16_t slot, uint32_t* seq, uint8_t* data, size_t len) {
+    journal_header_t header;
+    uint8_t buffer[32];
+    uint32_t stored_crc;
+
+    if (!open_file () || !file.seek (slot * slot_size ())) {
+        return false;
+    }
+    if (file.read ((uint8_t*)&header, sizeof (header)) != sizeof (header)) {
+        return false;
+    }
+    if (header.magic != JOURNAL_RECORD_MAGIC || header.length != record_size) {
+        return false;
+    }
+    uint32_t crc = lorawan_crc32 (&header, sizeof (header));
+    size_t copy_len = (data && len < record_size) ? len : (data ? record_size : 0);
+    size_t offset = 0;
+    while (offset < record_size) {
+        uint8_t* chunk = buffer;
+        size_t chunk_len = record_size - offset < sizeof (buffer) ? record_size - offset : sizeof (buffer);
+        if (offset < copy_len) {
+            // Payload goes straight to caller buffer, padding to scratch buffer
+            chunk = data + offset;
+            chunk_len = copy_len - offset;
+        }
+        if (file.read (chunk, chunk_len) != chunk_len) {
+            return false;
+        }
+        crc = lorawan_crc32 (chunk, chunk_len, crc);
+        offset += chunk_len;
+    }
+    if (file.read ((uint8_t*)&stored_crc, sizeof (stored_crc)) != sizeof (stored_crc) || stored_crc != crc) {
+        return false;
+    }
+    *seq = header.sequence;
+    return true;
+}
+
+bool LoRaJournal::append (const void* data, size_t len) {
+    journal_header_t header;
+    uint8_t padding[32];
+
+    if (!file_system || len > record_size || !open_file ()) {
+        return false;
+    }
+    memset (padding, 0, sizeof (padding));
+    uint16_t slot = latest_slot < 0 ? 0 : (latest_slot + 1) % slots;
+    header.magic = JOURNAL_RECORD_MAGIC;
+    header.length = record_size;
+    header.sequence = sequence + 1;
+
+    if (!file.seek (slot * slot_size ())) {
+        return false;
+    }
+    uint32_t crc = lorawan_crc32 (&header, sizeof (header));
+    size_t written = file.write ((const uint8_t*)&header, sizeof (header));
+    crc = lorawan_crc32 (data, len, crc);
+    written += file.write ((const uint8_t*)data, len);
+    while (len < record_size) {
+        size_t chunk = record_size - len < sizeof (padding) ? record_size - len : sizeof (padding);
+        crc = lorawan_crc32 (padding, chunk, crc);
+        written += file.write (padding, chunk);
+        len += chunk;
+    }
+    written += file.write ((const uint8_t*)&crc, sizeof (crc));
+    file.flush ();
+    if (written != slot_size ()) {
+        // Slot is now invalid. Next append will try the same slot again
+        return false;
+    }
+    latest_slot = slot;
+    sequence = header.sequence;
+    return true;
+}
+
+bool LoRaJournal::read_latest (void* data, size_t len) {
+    uint32_t seq;
+
+    if (latest_slot < 0) {
+        return false;
+    }
+    return read_slot (latest_slot, &seq, (uint8_t*)data, len);
+}
@@ -0,0 +1,111 @@
+/**
+  * @file lorawan_journal.h
+  * @version 0.0.2
+  * @date 05/10/2021
+  * @author German Martin
+  * @brief Append-only record journal on a preallocated file
+  *
+  * Records are written one after another into fixed-size slots of a file that is created at its final size.
+  * Each slot holds a sequence number and a CRC, so after a reset the newest intact record is found by scanning
+  * the slots. A record cut by a power loss fails its CRC and the previous one is used instead.
+  *
+  * Every record is a full snapshot, so only the newest one needs to survive compaction. When the last slot is used
+  * the journal wraps and overwrites the oldest slot, which is the whole compaction step.
+  */
+
+#ifndef LORAWAN_JOURNAL_H
+#define LORAWAN_JOURNAL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "FS.h"
+
+#define JOURNAL_RECORD_MAGIC 0x4A51 ///< @brief Slot signature ("QJ")
+
+/**
+  * @brief Header of every journal slot
+  */
+typedef struct __attribute__ ((packed)) {
+    uint16_t magic;     ///< @brief Must be `JOURNAL_RECORD_MAGIC`
+    uint16_t length;    ///< @brief Payload length
+    uint32_t sequence;  ///< @brief Increases by one on every append
+} journal_header_t;
+
+class LoRaJournal {
+public:
+    /**
+     * @brief Opens journal file and finds newest record. File is created and preallocated if it does not exist
+     *        or if its size does not match
+     * @param fs Filesystem
+     * @param path Journal file name
+     * @param record_size Payload size of every record
+     * @param slots Number of records that fit in the file
+     * @return `True` if journal is ready to be used
+     */
+    bool begin (FS* fs, const char* path, uint16_t record_size, uint16_t slots);
+
+    /**
+     * @brief Writes a record in next free slot
+     * @param data Record payload
+     * @param len Payload length. If it is shorter than `record_size` payload is padded with zeros
+     * @return `True` if record was written
+     */
+    bool append (const void* data, size_t len);
+
+    /**
+     * @brief Reads newest valid record
+     * @param data Buffer for record payload
+     * @param len Buffer length. Only first `len` bytes of payload are copied
+     * @return `True` if a valid record was found
+     */
+    bool read_latest (void* data, size_t len);
+
+    /**
+     * @brief Checks if journal holds any valid record
+     * @return `True` if there is at least one valid record
+     */
+    bool has_record () {
+        return latest_slot >= 0;
+    }
+
+    /**
+     * @brief Gets total size of a slot in file, including header and CRC
+     * @return Slot size in bytes
+     */
+    size_t slot_size () {
+        return sizeof (journal_header_t) + record_size + sizeof (uint32_t);
+    }
+
+private:
+    FS* file_system = 0;    ///< @brief Filesystem where journal lives
+    const char* path = 0;   ///< @brief Journal file name
+    File file;              ///< @brief Journal file. It is kept open between appends
+    uint16_t record_size = 0;   ///< @brief Payload size of every record
+    uint16_t slots = 0;     ///< @brief Number of slots in file
+    int32_t latest_slot = -1;   ///< @brief Slot of newest valid record. -1 if there is none
+    uint32_t sequence = 0;  ///< @brief Sequence number of newest record
+
+    /**
+     * @brief Creates journal file with all slots empty
+     * @return `True` if file was created
+     */
+    bool preallocate ();
+
+    /**
+     * @brief Checks a slot and reads its sequence number
+     * @param slot Slot number
+     * @param sequence Sequence number found in slot
+     * @param data Buffer for payload. May be `NULL` if only validation is needed
+     * @param len Buffer length
+     * @return `True` if slot holds a valid record
+     */
+    bool read_slot (uint16_t slot, uint32_t* sequence, uint8_t* data, size_t len);
+
+    /**
+     * @brief Makes sure journal file is open
+     * @return `True` if file is open
+     */
+    bool open_file ();
+};
+
+#endif // LORAWAN_JOURNAL_H
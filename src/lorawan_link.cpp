@@ -0,0 +1,105 @@
+#include "lorawan_link.h"
+
+int16_t LoRaLinkTracker::bandwidth_penalty (uint16_t bandwidth) {
+    int16_t penalty = 0;
+    // 3 dB every time bandwidth doubles
+    for (uint16_t bw = 125; bw < bandwidth; bw *= 2) {
+        penalty += 12;
+    }
+    return penalty;
+}
+
+int16_t LoRaLinkTracker::snr_floor (uint8_t dr) {
+    const datarate_info_t& info = lorawan_datarate (dr);
+
+    if (!info.sf) {
+        return LORAWAN_LINK_NO_MARGIN;
+    }
+    // -7.5 dB at SF7, 2.5 dB lower every SF step
+    return -30 - 10 * (info.sf - 7) + bandwidth_penalty (info.bandwidth);
+}
+
+void LoRaLinkTracker::add (int16_t rssi, int8_t snr, uint8_t dr, uint32_t now) {
+    const datarate_info_t& info = lorawan_datarate (dr);
+    int16_t normalized = snr + (info.sf ? bandwidth_penalty (info.bandwidth) : 0);
+
+    window[window_pos] = normalized;
+    window_pos = (window_pos + 1) % LORAWAN_LINK_WINDOW;
+    if (!quality.samples) {
+        rssi_acc = rssi * 16;
+        snr_acc = normalized * 16;
+    } else {
+        rssi_acc += (rssi * 16 - rssi_acc) / (1 << LORAWAN_LINK_AVERAGE_SHIFT);
+        snr_acc += (normalized * 16 - snr_acc) / (1 << LORAWAN_LINK_AVERAGE_SHIFT);
+    }
+    if (quality.samples < UINT16_MAX) {
+        quality.samples++;
+    }
+    quality.rssi = rssi;
+    quality.snr = snr;
+    quality.rssi_avg = rssi_acc / 16;
+    quality.snr_avg = snr_acc / 16;
+    uint8_t used = quality.samples < LORAWAN_LINK_WINDOW ? quality.samples : LORAWAN_LINK_WINDOW;
+    quality.snr_min = normalized;
+    for (uint8_t i = 0; i < used; i++) {
+        int16_t value = window[(window_pos + LORAWAN_LINK_WINDOW - 1 - i) % LORAWAN_LINK_WINDOW];
+        quality.snr_min = value < quality.snr_min ? value : quality.snr_min;
+    }
+    quality.misses = 0;
+    quality.timestamp = now;
+}
+
+void LoRaLinkTracker::reset () {
+    quality = link_quality_t ();
+    window_pos = 0;
+    rssi_acc = 0;
+    snr_acc = 0;
+}
+
+int16_t LoRaLinkTracker::margin (uint8_t dr) const {
+    int16_t floor = snr_floor (dr);
+
+    if (!quality.samples || floor == LORAWAN_LINK_NO_MARGIN) {
+        return LORAWAN_LINK_NO_MARGIN;
+    }
+    return quality.snr_min - floor;
+}
+
+bool LoRaLinkTracker::choose (const link_policy_t& policy, uint8_t len, uint32_t now, uint8_t* dr, int8_t* power) const {
+    if (!quality.samples || (policy.max_age_ms && now - quality.timestamp > policy.max_age_ms)) {
+        return false;
+    }
+    int16_t target = policy.target_margin * 4;
+    int16_t penalty = quality.misses * LORAWAN_LINK_MISS_PENALTY * 4;
+    int16_t chosen = -1;
+    int16_t slowest = -1;
+    int16_t chosen_margin = 0;
+
+    for (int16_t candidate = policy.max_dr; candidate >= policy.min_dr; candidate--) {
+        const datarate_info_t& info = lorawan_datarate (candidate);
+        if (!info.sf || info.max_payload < len) {
+            continue;
+        }
+        slowest = candidate;
+        int16_t candidate_margin = margin (candidate) - penalty;
+        if (chosen < 0 && candidate_margin >= target) {
+            chosen = candidate;
+            chosen_margin = candidate_margin;
+        }
+    }
+    if (chosen < 0) {
+        if (slowest < 0) {
+            return false;
+        }
+        *dr = slowest;
+        *power = policy.max_power;
+        return true;
+    }
+    // Margin over target is spent in whole power steps
+    int16_t excess = (chosen_margin - target) / 4;
+    int16_t cut = policy.power_step ? excess / policy.power_step * policy.power_step : 0;
+    int16_t level = policy.max_power - cut;
+    *dr = chosen;
+    *power = level > policy.min_power ? level : policy.min_power;
+    return true;
+}
@@ -0,0 +1,145 @@
+/**
+  * @file lorawan_link.h
+  * @version 0.0.2
+  * @date 05/10/2021
+  * @author German Martin
+  * @brief Link quality tracking and local datarate and power selection
+  *
+  * RSSI and SNR of every reception, downlinks, acks and JoinAccept, are kept as moving averages and as the lowest
+  * SNR of the last `LORAWAN_LINK_WINDOW` receptions. SNR is normalized to 125 kHz bandwidth, so that receptions at
+  * any datarate can be compared.
+  *
+  * Link margin at a datarate is that lowest SNR minus demodulation floor of its spreading factor, from -7.5 dB at
+  * SF7 to -20 dB at SF12, raised 3 dB every time bandwidth doubles. Margin is all in quarter dB, as LMIC reports SNR.
+  *
+  * Uplink quality is estimated from downlinks, so link is assumed to be symmetric. Confirmed uplinks that get no
+  * acknowledge are the only feedback on uplink side: every one of them takes `LORAWAN_LINK_MISS_PENALTY` dB from
+  * margin until next reception.
+  */
+
+#ifndef LORAWAN_LINK_H
+#define LORAWAN_LINK_H
+
+#include <stdint.h>
+#include "lorawan_datarate.h"
+
+#ifndef LORAWAN_LINK_WINDOW
+#define LORAWAN_LINK_WINDOW 8 ///< @brief Receptions whose lowest SNR is used for margin
+#endif // LORAWAN_LINK_WINDOW
+
+#ifndef LORAWAN_LINK_AVERAGE_SHIFT
+#define LORAWAN_LINK_AVERAGE_SHIFT 2 ///< @brief Moving averages take `1 / 2^shift` of every new value
+#endif // LORAWAN_LINK_AVERAGE_SHIFT
+
+#ifndef LORAWAN_LINK_TARGET_MARGIN
+#define LORAWAN_LINK_TARGET_MARGIN 10 ///< @brief Default link margin kept by datarate policy, in dB
+#endif // LORAWAN_LINK_TARGET_MARGIN
+
+#ifndef LORAWAN_LINK_MISS_PENALTY
+#define LORAWAN_LINK_MISS_PENALTY 3 ///< @brief Margin taken by every unacknowledged confirmed uplink, in dB
+#endif // LORAWAN_LINK_MISS_PENALTY
+
+#define LORAWAN_LINK_NO_MARGIN INT16_MIN ///< @brief Margin of a datarate that cannot be estimated
+
+/**
+  * @brief Link quality statistics
+  */
+typedef struct {
+    uint16_t samples = 0;   ///< @brief Receptions counted
+    int16_t rssi = 0;       ///< @brief RSSI of last reception in dBm
+    int8_t snr = 0;         ///< @brief SNR of last reception in 0.25 dB steps, as measured
+    int16_t rssi_avg = 0;   ///< @brief Moving average of RSSI in dBm
+    int16_t snr_avg = 0;    ///< @brief Moving average of SNR in 0.25 dB steps, normalized to 125 kHz
+    int16_t snr_min = 0;    ///< @brief Lowest SNR of last `LORAWAN_LINK_WINDOW` receptions in 0.25 dB steps, normalized to 125 kHz
+    uint8_t misses = 0;     ///< @brief Confirmed uplinks not acknowledged since last reception
+    uint32_t timestamp = 0; ///< @brief `millis()` on last reception
+} link_quality_t;
+
+/**
+  * @brief Local choice of datarate and TX power from link margin. Used only while ADR is disabled
+  */
+typedef struct {
+    bool enabled = false;   ///< @brief `True` to let library set datarate and power of every new message
+    int8_t target_margin = LORAWAN_LINK_TARGET_MARGIN;  ///< @brief Margin to keep over demodulation floor, in dB
+    uint8_t min_dr = 0;     ///< @brief Slowest datarate to use
+    uint8_t max_dr = DR_SF7;    ///< @brief Fastest datarate to use
+    int8_t min_power = 2;   ///< @brief Lowest TX power in dBm
+    int8_t max_power = 14;  ///< @brief Highest TX power in dBm
+    uint8_t power_step = 2; ///< @brief TX power is lowered in steps of this many dB. 0 keeps `max_power`
+    uint32_t max_age_ms = 0;    ///< @brief Datarate and power are left untouched if last reception is older than this. 0 disables it
+} link_policy_t;
+
+class LoRaLinkTracker {
+public:
+    /**
+     * @brief Counts a reception
+     * @param rssi RSSI in dBm
+     * @param snr SNR in 0.25 dB steps
+     * @param dr Datarate of reception
+     * @param now Current time in milliseconds
+     */
+    void add (int16_t rssi, int8_t snr, uint8_t dr, uint32_t now);
+
+    /**
+     * @brief Counts a confirmed uplink that got no acknowledge
+     */
+    void miss () {
+        if (quality.misses < UINT8_MAX) {
+            quality.misses++;
+        }
+    }
+
+    /**
+     * @brief Clears statistics
+     */
+    void reset ();
+
+    /**
+     * @brief Gets statistics
+     */
+    const link_quality_t& get () const {
+        return quality;
+    }
+
+    /**
+     * @brief Estimates link margin at a datarate. Unacknowledged uplinks are not taken into account
+     * @param dr Datarate
+     * @return Margin in 0.25 dB steps. `LORAWAN_LINK_NO_MARGIN` if there are no receptions or datarate is not LoRa
+     */
+    int16_t margin (uint8_t dr) const;
+
+    /**
+     * @brief Chooses fastest datarate that keeps target margin and lowest power that keeps it at that datarate. If
+     *        no datarate keeps target margin, slowest one at highest power is chosen
+     * @param policy Datarate and power limits
+     * @param len Payload length. Datarates where it does not fit are skipped
+     * @param now Current time in milliseconds
+     * @param dr Returns datarate
+     * @param power Returns TX power in dBm
+     * @return `False` if there is no recent reception or no datarate fits payload
+     */
+    bool choose (const link_policy_t& policy, uint8_t len, uint32_t now, uint8_t* dr, int8_t* power) const;
+
+    /**
+     * @brief Gets lowest SNR a datarate can be demodulated at
+     * @param dr Datarate
+     * @return SNR in 0.25 dB steps, normalized to 125 kHz. `LORAWAN_LINK_NO_MARGIN` if datarate is not LoRa
+     */
+    static int16_t snr_floor (uint8_t dr);
+
+private:
+    link_quality_t quality;     ///< @brief Current statistics
+    int16_t window[LORAWAN_LINK_WINDOW] = { 0 }; ///< @brief Normalized SNR of last receptions
+    uint8_t window_pos = 0;     ///< @brief Next position to write in `window`
+    int32_t rssi_acc = 0;       ///< @brief RSSI moving average, with 4 fractional bits
+    int32_t snr_acc = 0;        ///< @brief SNR moving average, with 4 fractional bits
+
+    /**
+     * @brief Gets how much SNR is lower than at 125 kHz for a bandwidth
+     * @param bandwidth Bandwidth in kHz
+     * @return SNR difference in 0.25 dB steps
+     */
+    static int16_t bandwidth_penalty (uint16_t bandwidth);
+};
+
+#endif // LORAWAN_LINK_H
@@ -0,0 +1,56 @@
+#include "lorawan.h"
+#include "lorawan_log.h"
+
+#if LORAWAN_LOG_LEVEL > LORAWAN_LOG_LEVEL_NONE
+LoRaLog lorawan_log;
+#endif
+
+void LoRaLog::push (uint8_t level, const char* format, const uint32_t* args) {
+    if (task) {
+        // Radio task and application both log while task runs
+        LoRaTaskGuard guard (*task);
+        store (level, format, args);
+    } else {
+        store (level, format, args);
+    }
+}
+
+void LoRaLog::store (uint8_t level, const char* format, const uint32_t* args) {
+    uint32_t index = write_index;
+
+    if (index - read_index >= LORAWAN_LOG_SIZE) {
+        // Newest entry is dropped, so that reader never sees an entry being overwritten
+        dropped++;
+        return;
+    }
+    log_entry_t* entry = &entries[index & (LORAWAN_LOG_SIZE - 1)];
+    entry->timestamp = millis ();
+    entry->format = format;
+    entry->level = level;
+    memcpy (entry->args, args, sizeof (entry->args));
+    write_index = index + 1;
+}
+
+size_t LoRaLog::drain (Print& out, size_t max_entries) {
+    static const char level_names[] = "-EWID";
+    char line[128];
+    size_t count = 0;
+
+    if (dropped != reported_dropped) {
+        snprintf (line, sizeof (line), "[log] %u entries dropped\n", (unsigned)(dropped - reported_dropped));
+        out.print (line);
+        reported_dropped = dropped;
+    }
+    while (count < max_entries && read_index != write_index) {
+        const log_entry_t* entry = &entries[read_index & (LORAWAN_LOG_SIZE - 1)];
+        int len = snprintf (line, sizeof (line), "[%lu][%c] ", (unsigned long)entry->timestamp,
+                            level_names[entry->level < sizeof (level_names) - 1 ? entry->level : 0]);
+        // Unused arguments are ignored by printf
+        snprintf_P (line + len, sizeof (line) - len, entry->format,
+                    entry->args[0], entry->args[1], entry->args[2], entry->args[3]);
+        out.print (line);
+        read_index = read_index + 1;
+        count++;
+    }
+    return count;
+}
@@ -0,0 +1,161 @@
+/**
+  * @file lorawan_log.h
+  * @version 0.0.2
+  * @date 05/10/2021
+  * @author German Martin
+  * @brief Deferred binary log for QuickLoRaWAN
+  *
+  * Log calls only store level, timestamp, a pointer to the constant format string and up to `LORAWAN_LOG_ARGS`
+  * integer arguments in a ring buffer. Text is formatted and printed later, when `LoRaWAN::loop()` drains the
+  * buffer, so logging from LMIC callbacks does not delay radio timing.
+  *
+  * Levels above `LORAWAN_LOG_LEVEL` are removed at compile time, together with their format strings.
+  */
+
+#ifndef LORAWAN_LOG_H
+#define LORAWAN_LOG_H
+
+#include <Arduino.h>
+#include "lorawan_task.h"
+
+#define LORAWAN_LOG_LEVEL_NONE 0    ///< @brief Logging disabled
+#define LORAWAN_LOG_LEVEL_ERROR 1   ///< @brief Errors only
+#define LORAWAN_LOG_LEVEL_WARN 2    ///< @brief Errors and warnings
+#define LORAWAN_LOG_LEVEL_INFO 3    ///< @brief Errors, warnings and main events
+#define LORAWAN_LOG_LEVEL_DEBUG 4   ///< @brief Everything
+
+#ifndef LORAWAN_LOG_LEVEL
+#if DEBUG_LORAWAN_LIB
+#define LORAWAN_LOG_LEVEL LORAWAN_LOG_LEVEL_DEBUG ///< @brief Maximum level compiled in
+#else
+#define LORAWAN_LOG_LEVEL LORAWAN_LOG_LEVEL_NONE
+#endif // DEBUG_LORAWAN_LIB
+#endif // LORAWAN_LOG_LEVEL
+
+#ifndef LORAWAN_LOG_SIZE
+#define LORAWAN_LOG_SIZE 32 ///< @brief Number of entries in log ring buffer. Must be a power of 2
+#endif // LORAWAN_LOG_SIZE
+
+#ifndef LORAWAN_LOG_DRAIN_MAX
+#define LORAWAN_LOG_DRAIN_MAX 4 ///< @brief Maximum number of entries printed on every `loop()` call
+#endif // LORAWAN_LOG_DRAIN_MAX
+
+#define LORAWAN_LOG_ARGS 4 ///< @brief Maximum number of arguments of a log entry
+
+/**
+  * @brief Log entry, as stored in ring buffer
+  */
+typedef struct {
+    uint32_t timestamp;     ///< @brief `millis()` when entry was recorded
+    const char* format;     ///< @brief Format string. It must be a literal, as it is used after the call returns
+    uint8_t level;          ///< @brief Entry level
+    uint32_t args[LORAWAN_LOG_ARGS];  ///< @brief Arguments, converted to 32 bit integers
+} log_entry_t;
+
+class LoRaLog {
+public:
+    /**
+     * @brief Stores a log entry. It takes constant time and does no formatting.
+     *
+     *        Arguments have to be integers. Strings, pointers and floating point values are not supported
+     *
+     * @param level Entry level
+     * @param format Format string. It must be a literal
+     * @param args Integer arguments
+     */
+    template <typename... Args>
+    void record (uint8_t level, const char* format, Args... args) {
+        static_assert (sizeof... (Args) <= LORAWAN_LOG_ARGS, "Too many log arguments");
+        const uint32_t values[LORAWAN_LOG_ARGS + 1] = { static_cast<uint32_t> (args)..., 0 };
+        push (level, format, values);
+    }
+
+    /**
+     * @brief Formats and prints stored entries, oldest first
+     * @param out Output stream
+     * @param max_entries Maximum number of entries to print
+     * @return Number of printed entries
+     */
+    size_t drain (Print& out, size_t max_entries);
+
+    /**
+     * @brief Gets number of entries waiting to be printed
+     * @return Stored entries
+     */
+    size_t length () {
+        return write_index - read_index;
+    }
+
+    /**
+     * @brief Gets number of entries lost because buffer was full
+     * @return Dropped entries since boot
+     */
+    uint32_t get_dropped () {
+        return dropped;
+    }
+
+    /**
+     * @brief Sets radio task whose lock serializes log calls while it runs. Without it, entries must come from a
+     *        single task
+     * @param task Radio task. `nullptr` to log without lock
+     */
+    void set_task (LoRaTask* task) {
+        this->task = task;
+    }
+
+private:
+    log_entry_t entries[LORAWAN_LOG_SIZE];  ///< @brief Ring buffer
+    volatile uint32_t write_index = 0;  ///< @brief Number of entries ever written
+    volatile uint32_t read_index = 0;   ///< @brief Number of entries ever read
+    uint32_t dropped = 0;   ///< @brief Entries lost because buffer was full
+    uint32_t reported_dropped = 0;  ///< @brief Dropped entries already reported in output
+    LoRaTask* task = nullptr;   ///< @brief Radio task. Its lock is held while an entry is written
+
+    /**
+     * @brief Copies an entry into ring buffer, if there is room
+     * @param level Entry level
+     * @param format Format string
+     * @param args Arguments
+     */
+    void push (uint8_t level, const char* format, const uint32_t* args);
+
+    /**
+     * @brief Copies an entry into ring buffer, if there is room. Caller must be the only writer
+     * @param level Entry level
+     * @param format Format string
+     * @param args Arguments
+     */
+    void store (uint8_t level, const char* format, const uint32_t* args);
+
+    static_assert ((LORAWAN_LOG_SIZE & (LORAWAN_LOG_SIZE - 1)) == 0, "LORAWAN_LOG_SIZE must be a power of 2");
+};
+
+#if LORAWAN_LOG_LEVEL > LORAWAN_LOG_LEVEL_NONE
+extern LoRaLog lorawan_log; ///< @brief Library log
+#endif
+
+#if LORAWAN_LOG_LEVEL >= LORAWAN_LOG_LEVEL_ERROR
+#define LORAWAN_LOG_ERROR(format,...) lorawan_log.record (LORAWAN_LOG_LEVEL_ERROR, PSTR (format), ##__VA_ARGS__)
+#else
+#define LORAWAN_LOG_ERROR(...) do {} while (0)
+#endif
+
+#if LORAWAN_LOG_LEVEL >= LORAWAN_LOG_LEVEL_WARN
+#define LORAWAN_LOG_WARN(format,...) lorawan_log.record (LORAWAN_LOG_LEVEL_WARN, PSTR (format), ##__VA_ARGS__)
+#else
+#define LORAWAN_LOG_WARN(...) do {} while (0)
+#endif
+
+#if LORAWAN_LOG_LEVEL >= LORAWAN_LOG_LEVEL_INFO
+#define LORAWAN_LOG_INFO(format,...) lorawan_log.record (LORAWAN_LOG_LEVEL_INFO, PSTR (format), ##__VA_ARGS__)
+#else
+#define LORAWAN_LOG_INFO(...) do {} while (0)
+#endif
+
+#if LORAWAN_LOG_LEVEL >= LORAWAN_LOG_LEVEL_DEBUG
+#define LORAWAN_LOG_DEBUG(format,...) lorawan_log.record (LORAWAN_LOG_LEVEL_DEBUG, PSTR (format), ##__VA_ARGS__)
+#else
+#define LORAWAN_LOG_DEBUG(...) do {} while (0)
+#endif
+
+#endif // LORAWAN_LOG_H
@@ -0,0 +1,179 @@
+#include "lorawan_series.h"
+#include "lorawan_codec.h"
+#include "lorawan_varint.h"
+
+/**
+  * @brief Gets number of significant bits of a value
+  */
+static inline uint8_t bit_width (uint32_t v) {
+    return v ? 32 - __builtin_clz (v) : 0;
+}
+
+void LoRaSeries::add (uint32_t timestamp, int32_t value) {
+    if (count == LORAWAN_SERIES_SAMPLES) {
+        head = (head + 1) % LORAWAN_SERIES_SAMPLES;
+        count--;
+        dropped++;
+    }
+    size_t index = (head + count) % LORAWAN_SERIES_SAMPLES;
+    timestamps[index] = timestamp;
+    values[index] = value;
+    count++;
+}
+
+uint8_t LoRaSeries::fit (size_t capacity, size_t* size) {
+    return measure (capacity, size, nullptr, nullptr);
+}
+
+uint8_t LoRaSeries::measure (size_t capacity, size_t* size, uint8_t* time_bits, uint8_t* value_bits) {
+    size_t limit = count < LORAWAN_SERIES_MAX_FRAME_SAMPLES ? count : LORAWAN_SERIES_MAX_FRAME_SAMPLES;
+    if (!limit) {
+        return 0;
+    }
+    size_t header = 1 + lorawan_varint_size (time_at (0));
+    header += lorawan_varint_size (lorawan_zigzag ((uint32_t)value_at (0)));
+    if (header > capacity) {
+        return 0;
+    }
+
+    uint8_t samples = 1;
+    size_t best = header;
+    uint8_t t_bits = 0;
+    uint8_t v_bits = 0;
+    uint8_t best_t_bits = 0;
+    uint8_t best_v_bits = 0;
+    uint32_t prev_delta = 0;
+    for (size_t i = 1; i < limit; i++) {
+        uint32_t delta = time_at (i) - time_at (i - 1);
+        if (i == 1) {
+            // First delta and both widths go to header
+            header += lorawan_varint_size (lorawan_zigzag (delta)) + 2;
+        } else {
+            uint8_t w = bit_width (lorawan_zigzag (delta - prev_delta));
+            t_bits = w > t_bits ? w : t_bits;
+        }
+        prev_delta = delta;
+        uint8_t w = bit_width (lorawan_zigzag ((uint32_t)value_at (i) - (uint32_t)value_at (i - 1)));
+        v_bits = w > v_bits ? w : v_bits;
+
+        // i + 1 samples: i - 1 timestamp fields and i value fields
+        size_t total = header + ((i - 1) * t_bits + i * v_bits + 7) / 8;
+        if (total > capacity) {
+            // Widths never decrease, so no longer run fits either
+            break;
+        }
+        samples = i + 1;
+        best = total;
+        best_t_bits = t_bits;
+        best_v_bits = v_bits;
+    }
+    if (size) {
+        *size = best;
+    }
+    if (time_bits) {
+        *time_bits = best_t_bits;
+    }
+    if (value_bits) {
+        *value_bits = best_v_bits;
+    }
+    return samples;
+}
+
+size_t LoRaSeries::encode (uint8_t* buffer, size_t capacity, uint8_t* samples) {
+    uint8_t time_bits;
+    uint8_t value_bits;
+    uint8_t n = measure (capacity, nullptr, &time_bits, &value_bits);
+
+    *samples = n;
+    if (!n) {
+        return 0;
+    }
+    size_t pos = 0;
+    buffer[pos++] = n;
+    pos += lorawan_put_varint (buffer + pos, time_at (0));
+    pos += lorawan_put_varint (buffer + pos, lorawan_zigzag ((uint32_t)value_at (0)));
+    if (n == 1) {
+        return pos;
+    }
+
+    uint32_t prev_delta = time_at (1) - time_at (0);
+    pos += lorawan_put_varint (buffer + pos, lorawan_zigzag (prev_delta));
+    buffer[pos++] = time_bits;
+    buffer[pos++] = value_bits;
+    LoRaBitWriter writer (buffer + pos, capacity - pos);
+    for (size_t i = 2; i < n; i++) {
+        uint32_t delta = time_at (i) - time_at (i - 1);
+        writer.put (lorawan_zigzag (delta - prev_delta), time_bits);
+        prev_delta = delta;
+    }
+    for (size_t i = 1; i < n; i++) {
+        writer.put (lorawan_zigzag ((uint32_t)value_at (i) - (uint32_t)value_at (i - 1)), value_bits);
+    }
+    return pos + writer.bytes ();
+}
+
+void LoRaSeries::consume (size_t samples) {
+    if (samples > count) {
+        samples = count;
+    }
+    head = (head + samples) % LORAWAN_SERIES_SAMPLES;
+    count -= samples;
+}
+
+size_t LoRaSeries::decode (const uint8_t* buffer, size_t len, uint32_t* timestamps, int32_t* values, size_t max_samples) {
+    if (!len) {
+        return 0;
+    }
+    size_t n = buffer[0];
+    if (!n || n > max_samples) {
+        return 0;
+    }
+
+    size_t pos = 1;
+    size_t used;
+    uint32_t raw;
+    if (!(used = lorawan_get_varint (buffer + pos, len - pos, &raw))) {
+        return 0;
+    }
+    pos += used;
+    timestamps[0] = raw;
+    if (!(used = lorawan_get_varint (buffer + pos, len - pos, &raw))) {
+        return 0;
+    }
+    pos += used;
+    values[0] = (int32_t)lorawan_unzigzag (raw);
+    if (n == 1) {
+        return 1;
+    }
+
+    if (!(used = lorawan_get_varint (buffer + pos, len - pos, &raw))) {
+        return 0;
+    }
+    pos += used;
+    uint32_t delta = lorawan_unzigzag (raw);
+    if (pos + 2 > len) {
+        return 0;
+    }
+    uint8_t time_bits = buffer[pos++];
+    uint8_t value_bits = buffer[pos++];
+    if (time_bits > 32 || value_bits > 32) {
+        return 0;
+    }
+
+    LoRaBitReader reader (buffer + pos, len - pos);
+    timestamps[1] = timestamps[0] + delta;
+    for (size_t i = 2; i < n; i++) {
+        if (!reader.get (&raw, time_bits)) {
+            return 0;
+        }
+        delta += lorawan_unzigzag (raw);
+        timestamps[i] = timestamps[i - 1] + delta;
+    }
+    for (size_t i = 1; i < n; i++) {
+        if (!reader.get (&raw, value_bits)) {
+            return 0;
+        }
+        values[i] = (int32_t)((uint32_t)values[i - 1] + lorawan_unzigzag (raw));
+    }
+    return n;
+}
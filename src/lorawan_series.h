@@ -0,0 +1,140 @@
+/**
+  * @file lorawan_series.h
+  * @version 0.0.2
+  * @date 05/10/2021
+  * @author German Martin
+  * @brief Time series compression for batched uplinks
+  *
+  * Samples are buffered in RAM and packed into frames as follows:
+  *
+  *     count           1 byte, number of samples in frame
+  *     t0              first timestamp, unsigned varint
+  *     v0              first value, zigzag varint
+  *     d1              t1 - t0, zigzag varint                  (only if count > 1)
+  *     time_bits       1 byte, width of timestamp fields       (only if count > 1)
+  *     value_bits      1 byte, width of value fields           (only if count > 1)
+  *     dod[count - 2]  delta of delta of timestamps, zigzag, time_bits each
+  *     dv[count - 1]   delta of values, zigzag, value_bits each
+  *
+  * Bit fields are packed most significant bit first, with no padding between them. Arithmetic is modulo 2^32,
+  * so any input sequence is restored exactly. Regular sampling intervals and slowly changing values take a few
+  * bits per sample.
+  *
+  * Varints use 7 bits per byte, least significant group first, with top bit set on all bytes but the last one.
+  */
+
+#ifndef LORAWAN_SERIES_H
+#define LORAWAN_SERIES_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifndef LORAWAN_SERIES_SAMPLES
+#define LORAWAN_SERIES_SAMPLES 128 ///< @brief Number of samples buffered before oldest ones are overwritten
+#endif // LORAWAN_SERIES_SAMPLES
+
+#define LORAWAN_SERIES_MAX_FRAME_SAMPLES 255 ///< @brief Samples in a frame are limited by count byte
+
+class LoRaSeries {
+public:
+    /**
+     * @brief Adds a sample. If buffer is full, oldest sample is overwritten and counted as dropped
+     * @param timestamp Sample time, in any unit. Constant intervals compress best
+     * @param value Sample value
+     */
+    void add (uint32_t timestamp, int32_t value);
+
+    /**
+     * @brief Packs as many of the oldest buffered samples as fit in a buffer. Samples are not removed
+     * @param buffer Output buffer
+     * @param capacity Buffer size. Normally maximum payload of current datarate
+     * @param samples Returns number of packed samples
+     * @return Encoded length. 0 if there are no samples or not even one fits
+     */
+    size_t encode (uint8_t* buffer, size_t capacity, uint8_t* samples);
+
+    /**
+     * @brief Calculates how many of the oldest buffered samples fit in a frame
+     * @param capacity Frame payload size
+     * @param size Returns encoded length
+     * @return Number of samples
+     */
+    uint8_t fit (size_t capacity, size_t* size = nullptr);
+
+    /**
+     * @brief Checks if a frame should be sent now: buffered samples are enough to fill it, or buffer is full
+     * @param capacity Frame payload size
+     * @return `True` if a frame would not hold all buffered samples, it holds the maximum per frame or next
+     *         sample would overwrite an unsent one
+     */
+    bool fills (size_t capacity) {
+        uint8_t n = fit (capacity);
+        return n && (n < count || n == LORAWAN_SERIES_MAX_FRAME_SAMPLES || count == LORAWAN_SERIES_SAMPLES);
+    }
+
+    /**
+     * @brief Removes oldest samples, normally after they have been queued for transmission
+     * @param samples Number of samples
+     */
+    void consume (size_t samples);
+
+    /**
+     * @brief Gets number of buffered samples
+     */
+    size_t length () {
+        return count;
+    }
+
+    /**
+     * @brief Gets number of samples overwritten because buffer was full
+     */
+    uint32_t get_dropped () {
+        return dropped;
+    }
+
+    /**
+     * @brief Unpacks a frame built by `encode()`
+     * @param buffer Frame payload
+     * @param len Payload length
+     * @param timestamps Decoded timestamps
+     * @param values Decoded values
+     * @param max_samples Size of output arrays
+     * @return Number of decoded samples. 0 if frame is malformed or output arrays are too small
+     */
+    static size_t decode (const uint8_t* buffer, size_t len, uint32_t* timestamps, int32_t* values, size_t max_samples);
+
+private:
+    uint32_t timestamps[LORAWAN_SERIES_SAMPLES];  ///< @brief Sample times ring buffer
+    int32_t values[LORAWAN_SERIES_SAMPLES];       ///< @brief Sample values ring buffer
+    size_t head = 0;    ///< @brief Index of oldest sample
+    size_t count = 0;   ///< @brief Number of buffered samples
+    uint32_t dropped = 0;   ///< @brief Samples overwritten because buffer was full
+
+    /**
+     * @brief Finds longest run of oldest samples that fits in a frame
+     * @param capacity Frame payload size
+     * @param size Returns encoded length. May be `nullptr`
+     * @param time_bits Returns width of timestamp fields. May be `nullptr`
+     * @param value_bits Returns width of value fields. May be `nullptr`
+     * @return Number of samples
+     */
+    uint8_t measure (size_t capacity, size_t* size, uint8_t* time_bits, uint8_t* value_bits);
+
+    /**
+     * @brief Gets timestamp of a buffered sample
+     * @param i Sample index, 0 being the oldest
+     */
+    uint32_t time_at (size_t i) {
+        return timestamps[(head + i) % LORAWAN_SERIES_SAMPLES];
+    }
+
+    /**
+     * @brief Gets value of a buffered sample
+     * @param i Sample index, 0 being the oldest
+     */
+    int32_t value_at (size_t i) {
+        return values[(head + i) % LORAWAN_SERIES_SAMPLES];
+    }
+};
+
+#endif // LORAWAN_SERIES_H
@@ -0,0 +1,110 @@
+#include <string.h>
+#include "lorawan_slots.h"
+#include "lorawan_crc.h"
+
+bool LoRaSlotPair::begin (FS* fs, const char* path_a, const char* path_b) {
+    slot_header_t header;
+
+    file_system = fs;
+    paths[0] = path_a;
+    paths[1] = path_b;
+    latest = -1;
+    last_written = 0;
+    generation = 0;
+    damaged = false;
+
+    if (!file_system) {
+        return false;
+    }
+    bool intact[2] = { false, false };
+    for (uint8_t i = 0; i < 2; i++) {
+        intact[i] = read_slot (i, &header, NULL, 0);
+        if (intact[i] && (latest < 0 || (int32_t)(header.generation - generation) > 0)) {
+            latest = i;
+            generation = header.generation;
+        }
+    }
+    if (latest < 0) {
+        // Nothing to keep. First write goes to B, so that a file in A written by an older version survives until then
+        return false;
+    }
+    last_written = latest;
+    damaged = !intact[1 - latest] && file_system->exists (paths[1 - latest]);
+    return true;
+}
+
+bool LoRaSlotPair::read_slot (uint8_t slot, slot_header_t* header, uint8_t* data, size_t size) {
+    uint8_t buffer[32];
+    uint32_t stored_crc;
+
+    if (!file_system->exists (paths[slot])) {
+        return false;
+    }
+    File file = file_system->open (paths[slot], "r");
+    if (!file) {
+        return false;
+    }
+    bool valid = file.read ((uint8_t*)header, sizeof (*header)) == sizeof (*header) &&
+                 header->magic == SLOT_RECORD_MAGIC &&
+                 file.size () == sizeof (*header) + header->length + sizeof (stored_crc);
+    uint32_t crc = lorawan_crc32 (header, sizeof (*header));
+    size_t offset = 0;
+    while (valid && offset < header->length) {
+        size_t chunk = header->length - offset < sizeof (buffer) ? header->length - offset : sizeof (buffer);
+        if (file.read (buffer, chunk) != chunk) {
+            valid = false;
+            break;
+        }
+        crc = lorawan_crc32 (buffer, chunk, crc);
+        if (data && offset < size) {
+            memcpy (data + offset, buffer, offset + chunk <= size ? chunk : size - offset);
+        }
+        offset += chunk;
+    }
+    valid = valid && file.read ((uint8_t*)&stored_crc, sizeof (stored_crc)) == sizeof (stored_crc) && stored_crc == crc;
+    file.close ();
+    return valid;
+}
+
+size_t LoRaSlotPair::read_latest (void* data, size_t size) {
+    slot_header_t header;
+
+    if (latest < 0 || !read_slot (latest, &header, (uint8_t*)data, size)) {
+        return 0;
+    }
+    return header.length;
+}
+
+bool LoRaSlotPair::write (const void* data, size_t len) {
+    slot_header_t header;
+
+    if (!file_system || len > UINT16_MAX) {
+        return false;
+    }
+    uint8_t target = 1 - last_written;
+    last_written = target;
+    header.magic = SLOT_RECORD_MAGIC;
+    header.length = len;
+    header.generation = ++generation;
+    uint32_t crc = lorawan_crc32 (&header, sizeof (header));
+    crc = lorawan_crc32 (data, len, crc);
+
+    if (latest == target) {
+        // Previous write to the other slot failed, so this one replaces the only intact copy
+        latest = -1;
+    }
+    File file = file_system->open (paths[target], "w");
+    if (!file) {
+        return false;
+    }
+    size_t written = file.write ((const uint8_t*)&header, sizeof (header));
+    written += file.write ((const uint8_t*)data, len);
+    written += file.write ((const uint8_t*)&crc, sizeof (crc));
+    file.flush ();
+    file.close ();
+    if (written != sizeof (header) + len + sizeof (crc)) {
+        return false;
+    }
+    latest = target;
+    return true;
+}
@@ -0,0 +1,104 @@
+/**
+  * @file lorawan_slots.h
+  * @version 0.0.2
+  * @date 05/10/2021
+  * @author German Martin
+  * @brief Pair of alternating record files with atomic commit
+  *
+  * A record is kept in two files, A and B. Every write goes to the file that was not written last, so the previous
+  * copy stays untouched while the new one is being written. Each file holds a header with a generation number, the
+  * record and a CRC. On restore the newest intact copy is used. A write cut by a power loss fails its CRC and the
+  * other copy, one generation older, is used instead.
+  *
+  * Writes alternate even when one fails: after a failed write to B the next one goes to A. So the intact copy is
+  * always the one written right before a damaged one, and if both writes fail nothing is restored, rather than a
+  * record several generations old.
+  */
+
+#ifndef LORAWAN_SLOTS_H
+#define LORAWAN_SLOTS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "FS.h"
+
+#define SLOT_RECORD_MAGIC 0x5351 ///< @brief Slot file signature ("QS")
+
+/**
+  * @brief Header of a slot file
+  */
+typedef struct __attribute__ ((packed)) {
+    uint16_t magic;         ///< @brief Must be `SLOT_RECORD_MAGIC`
+    uint16_t length;        ///< @brief Record length
+    uint32_t generation;    ///< @brief Increases by one on every write
+} slot_header_t;
+
+class LoRaSlotPair {
+public:
+    /**
+     * @brief Checks both files and finds newest intact record
+     * @param fs Filesystem
+     * @param path_a File name of slot A
+     * @param path_b File name of slot B
+     * @return `True` if an intact record was found
+     */
+    bool begin (FS* fs, const char* path_a, const char* path_b);
+
+    /**
+     * @brief Writes a record in the slot that was not written last
+     * @param data Record
+     * @param len Record length
+     * @return `True` if record was written completely
+     */
+    bool write (const void* data, size_t len);
+
+    /**
+     * @brief Reads newest intact record
+     * @param data Buffer for record
+     * @param size Buffer size. Only first `size` bytes of record are copied
+     * @return Record length. 0 if there is no intact record
+     */
+    size_t read_latest (void* data, size_t size);
+
+    /**
+     * @brief Checks if pair holds an intact record
+     */
+    bool has_record () {
+        return latest >= 0;
+    }
+
+    /**
+     * @brief Checks if newest intact record was found next to a damaged one, which means that a later write did not
+     *        complete. Caller may have to account for changes made after that record was written
+     */
+    bool recovered () {
+        return damaged;
+    }
+
+    /**
+     * @brief Gets generation of newest intact record
+     */
+    uint32_t get_generation () {
+        return generation;
+    }
+
+private:
+    FS* file_system = 0;        ///< @brief Filesystem where slot files live
+    const char* paths[2] = { 0, 0 };    ///< @brief Slot file names
+    int8_t latest = -1;         ///< @brief Slot of newest intact record. -1 if there is none
+    uint8_t last_written = 0;   ///< @brief Slot written last, or holding newest record. Next write goes to the other
+    uint32_t generation = 0;    ///< @brief Generation of last write
+    bool damaged = false;       ///< @brief Slot next to newest record exists but is not intact
+
+    /**
+     * @brief Checks a slot file
+     * @param slot Slot number, 0 for A and 1 for B
+     * @param header Returns slot header
+     * @param data Buffer for record. May be `NULL` if only validation is needed
+     * @param size Buffer size
+     * @return `True` if slot holds an intact record
+     */
+    bool read_slot (uint8_t slot, slot_header_t* header, uint8_t* data, size_t size);
+};
+
+#endif // LORAWAN_SLOTS_H
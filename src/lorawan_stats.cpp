@@ -0,0 +1,298 @@
+#include "lorawan_stats.h"
+#include "lorawan_varint.h"
+
+#define STATS_EMPTY_HISTOGRAM 0xF0 ///< @brief Histogram header with no buckets
+
+/**
+  * @brief Writes export fields, keeping track of whether they fit in buffer
+  */
+class StatsWriter {
+public:
+    StatsWriter (uint8_t* buffer, size_t size) : buffer (buffer), size (size) {}
+
+    void put_byte (uint8_t value) {
+        if (pos + 1 > size) {
+            overflow = true;
+            return;
+        }
+        buffer[pos++] = value;
+    }
+
+    void put_varint (uint32_t value) {
+        if (pos + lorawan_varint_size (value) > size) {
+            overflow = true;
+            return;
+        }
+        pos += lorawan_put_varint (buffer + pos, value);
+    }
+
+    void put_histogram (const LoRaHistogram& histogram) {
+        uint8_t first = LORAWAN_STATS_BUCKETS;
+        uint8_t last = 0;
+        for (uint8_t i = 0; i < LORAWAN_STATS_BUCKETS; i++) {
+            if (histogram.get (i)) {
+                if (first == LORAWAN_STATS_BUCKETS) {
+                    first = i;
+                }
+                last = i;
+            }
+        }
+        if (first == LORAWAN_STATS_BUCKETS) {
+            put_byte (STATS_EMPTY_HISTOGRAM);
+            return;
+        }
+        put_byte ((first << 4) | last);
+        for (uint8_t i = first; i <= last; i++) {
+            put_varint (histogram.get (i));
+        }
+    }
+
+    /**
+     * @brief Ends a section. A section that did not fit is removed
+     * @param start Position where section started
+     * @return `True` if section is complete
+     */
+    bool end_section (size_t start) {
+        if (overflow) {
+            pos = start;
+            overflow = false;
+            return false;
+        }
+        return true;
+    }
+
+    size_t pos = 0;
+
+private:
+    uint8_t* buffer;
+    size_t size;
+    bool overflow = false;
+};
+
+/**
+  * @brief Reads export fields. Any read past end of data marks it as malformed
+  */
+class StatsReader {
+public:
+    StatsReader (const uint8_t* buffer, size_t len) : buffer (buffer), len (len) {}
+
+    uint8_t get_byte () {
+        if (pos >= len) {
+            error = true;
+            return 0;
+        }
+        return buffer[pos++];
+    }
+
+    uint32_t get_varint () {
+        uint32_t value = 0;
+        size_t used = lorawan_get_varint (buffer + pos, len - pos, &value);
+        if (!used) {
+            error = true;
+            return 0;
+        }
+        pos += used;
+        return value;
+    }
+
+    void get_histogram (LoRaHistogram& histogram) {
+        uint8_t header = get_byte ();
+        uint8_t first = header >> 4;
+        uint8_t last = header & 0x0F;
+        for (uint8_t i = first; i <= last && !error; i++) {
+            histogram.set (i, get_varint ());
+        }
+    }
+
+    bool error = false;
+
+private:
+    const uint8_t* buffer;
+    size_t len;
+    size_t pos = 0;
+};
+
+uint32_t LoRaHistogram::count () const {
+    uint32_t total = 0;
+    for (uint8_t i = 0; i < LORAWAN_STATS_BUCKETS; i++) {
+        total += buckets[i];
+    }
+    return total;
+}
+
+uint32_t LoRaHistogram::percentile (uint8_t percent) const {
+    uint32_t total = count ();
+    if (!total) {
+        return 0;
+    }
+    // Rank of percentile value, rounded up, and at least the first one
+    uint32_t rank = (uint32_t)(((uint64_t)total * percent + 99) / 100);
+    rank = rank ? rank : 1;
+    uint32_t seen = 0;
+    for (uint8_t i = 0; i < LORAWAN_STATS_BUCKETS - 1; i++) {
+        seen += buckets[i];
+        if (seen >= rank) {
+            return bucket_floor (i + 1) - 1;
+        }
+    }
+    return bucket_floor (LORAWAN_STATS_BUCKETS - 1);
+}
+
+void lorawan_stats_count_port (node_stats_t& stats, uint8_t port) {
+    stats.downlinks++;
+    for (uint8_t i = 0; i < stats.port_count; i++) {
+        if (stats.ports[i].port == port) {
+            stats.ports[i].count++;
+            return;
+        }
+    }
+    if (stats.port_count < LORAWAN_STATS_PORTS) {
+        stats.ports[stats.port_count].port = port;
+        stats.ports[stats.port_count].count = 1;
+        stats.port_count++;
+    } else {
+        stats.other_ports++;
+    }
+}
+
+size_t lorawan_stats_export (const node_stats_t& stats, uint8_t* buffer, size_t size, uint8_t sections) {
+    StatsWriter writer (buffer, size);
+
+    writer.put_byte (LORAWAN_STATS_VERSION);
+    writer.put_byte (0);
+    if (!writer.end_section (0)) {
+        return 0;
+    }
+    uint8_t written = 0;
+    size_t start;
+
+    if (sections & STATS_COUNTERS) {
+        start = writer.pos;
+        writer.put_varint (stats.uplinks_queued);
+        writer.put_varint (stats.uplinks_sent);
+        writer.put_varint (stats.uplinks_dropped);
+        writer.put_varint (stats.confirmed_acked);
+        writer.put_varint (stats.confirmed_missed);
+        writer.put_varint (stats.joins);
+        writer.put_varint (stats.join_requests);
+        writer.put_varint (stats.link_dead);
+        writer.put_varint (stats.downlinks);
+        written |= writer.end_section (start) ? STATS_COUNTERS : 0;
+    }
+    if (sections & STATS_AIRTIME) {
+        start = writer.pos;
+        uint16_t map = 0;
+        for (uint8_t dr = 0; dr < LORAWAN_STATS_DATARATES; dr++) {
+            map |= stats.airtime_ms[dr] ? (1 << dr) : 0;
+        }
+        writer.put_byte (map & 0xFF);
+        writer.put_byte (map >> 8);
+        for (uint8_t dr = 0; dr < LORAWAN_STATS_DATARATES; dr++) {
+            if (stats.airtime_ms[dr]) {
+                writer.put_varint (stats.airtime_ms[dr]);
+            }
+        }
+        written |= writer.end_section (start) ? STATS_AIRTIME : 0;
+    }
+    if (sections & STATS_DOWNLINKS) {
+        start = writer.pos;
+        writer.put_byte (stats.port_count);
+        for (uint8_t i = 0; i < stats.port_count; i++) {
+            writer.put_byte (stats.ports[i].port);
+            writer.put_varint (stats.ports[i].count);
+        }
+        writer.put_varint (stats.other_ports);
+        written |= writer.end_section (start) ? STATS_DOWNLINKS : 0;
+    }
+    if (sections & STATS_STORAGE) {
+        start = writer.pos;
+        writer.put_varint (stats.counters_writes);
+        writer.put_varint (stats.counters_bytes);
+        writer.put_varint (stats.session_writes);
+        writer.put_varint (stats.session_bytes);
+        written |= writer.end_section (start) ? STATS_STORAGE : 0;
+    }
+    if (sections & STATS_WRITE_TIME) {
+        start = writer.pos;
+        writer.put_histogram (stats.counters_write_us);
+        writer.put_histogram (stats.session_write_us);
+        written |= writer.end_section (start) ? STATS_WRITE_TIME : 0;
+    }
+    if (sections & STATS_LOOP_TIME) {
+        start = writer.pos;
+        writer.put_histogram (stats.loop_us);
+        written |= writer.end_section (start) ? STATS_LOOP_TIME : 0;
+    }
+
+    if (!written) {
+        return 0;
+    }
+    buffer[1] = written;
+    return writer.pos;
+}
+
+bool lorawan_stats_import (const uint8_t* buffer, size_t len, node_stats_t* stats) {
+    StatsReader reader (buffer, len);
+    node_stats_t result;
+
+    if (reader.get_byte () != LORAWAN_STATS_VERSION) {
+        return false;
+    }
+    uint8_t sections = reader.get_byte ();
+
+    if (sections & STATS_COUNTERS) {
+        result.uplinks_queued = reader.get_varint ();
+        result.uplinks_sent = reader.get_varint ();
+        result.uplinks_dropped = reader.get_varint ();
+        result.confirmed_acked = reader.get_varint ();
+        result.confirmed_missed = reader.get_varint ();
+        result.joins = reader.get_varint ();
+        result.join_requests = reader.get_varint ();
+        result.link_dead = reader.get_varint ();
+        result.downlinks = reader.get_varint ();
+    }
+    if (sections & STATS_AIRTIME) {
+        uint16_t map = reader.get_byte ();
+        map |= reader.get_byte () << 8;
+        for (uint8_t dr = 0; dr < LORAWAN_STATS_DATARATES; dr++) {
+            if (map & (1 << dr)) {
+                result.airtime_ms[dr] = reader.get_varint ();
+            }
+        }
+    }
+    if (sections & STATS_DOWNLINKS) {
+        uint8_t ports = reader.get_byte ();
+        for (uint8_t i = 0; i < ports && !reader.error; i++) {
+            uint8_t port = reader.get_byte ();
+            uint32_t count = reader.get_varint ();
+            if (result.port_count < LORAWAN_STATS_PORTS) {
+                result.ports[result.port_count].port = port;
+                result.ports[result.port_count].count = count;
+                result.port_count++;
+            } else {
+                // Sender had a bigger table
+                result.other_ports += count;
+            }
+        }
+        result.other_ports += reader.get_varint ();
+    }
+    if (sections & STATS_STORAGE) {
+        result.counters_writes = reader.get_varint ();
+        result.counters_bytes = reader.get_varint ();
+        result.session_writes = reader.get_varint ();
+        result.session_bytes = reader.get_varint ();
+    }
+    if (sections & STATS_WRITE_TIME) {
+        reader.get_histogram (result.counters_write_us);
+        reader.get_histogram (result.session_write_us);
+    }
+    if (sections & STATS_LOOP_TIME) {
+        reader.get_histogram (result.loop_us);
+    }
+
+    if (reader.error) {
+        return false;
+    }
+    *stats = result;
+    return true;
+}
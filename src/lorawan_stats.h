@@ -0,0 +1,179 @@
+/**
+  * @file lorawan_stats.h
+  * @version 0.0.2
+  * @date 05/10/2021
+  * @author German Martin
+  * @brief Runtime metrics of QuickLoRaWAN and their compact binary export
+  *
+  * Durations are kept in histograms of `LORAWAN_STATS_BUCKETS` buckets, in microseconds. Bucket 0 counts values
+  * below 16 us and every next bucket doubles the range: bucket `i` counts values from `2^(i+3)` to `2^(i+4) - 1`.
+  * Last bucket counts everything from 262 ms on.
+  *
+  * Exported metrics start with two bytes, format version and a bitmap of sections that follow, in this order:
+  *
+  *     STATS_COUNTERS      9 varints: uplinks queued, transmissions, dropped, acked, missed, joins, join requests,
+  *                         link dead events and downlinks
+  *     STATS_AIRTIME       2 bytes, little endian, bitmap of datarates with airtime. A varint per set bit, airtime
+  *                         in milliseconds
+  *     STATS_DOWNLINKS     1 byte with number of ports N. N times port byte and varint count. Then a varint with
+  *                         downlinks on ports that did not fit in table
+  *     STATS_STORAGE       4 varints: counters writes, counters bytes, session writes and session bytes
+  *     STATS_WRITE_TIME    Counters and session write histograms
+  *     STATS_LOOP_TIME     `loop()` latency histogram
+  *
+  * A histogram is a byte with first non empty bucket in high nibble and last one in low nibble, then a varint per
+  * bucket in that range. Empty buckets at both ends are not sent. Empty histogram is `0xF0`.
+  *
+  * Sections are written in order while they fit in buffer. Those that do not fit are left out and their bit is
+  * cleared.
+  */
+
+#ifndef LORAWAN_STATS_H
+#define LORAWAN_STATS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifndef LORAWAN_STATS_PORTS
+#define LORAWAN_STATS_PORTS 8 ///< @brief Number of downlink ports counted separately
+#endif // LORAWAN_STATS_PORTS
+
+#ifndef LORAWAN_STATS_PORT
+#define LORAWAN_STATS_PORT 202 ///< @brief Default port for diagnostics uplinks
+#endif // LORAWAN_STATS_PORT
+
+#define LORAWAN_STATS_VERSION 1     ///< @brief Export format version
+#define LORAWAN_STATS_BUCKETS 16    ///< @brief Histogram buckets. Export format holds up to 16
+#define LORAWAN_STATS_BUCKET_SHIFT 4    ///< @brief Values below `1 << LORAWAN_STATS_BUCKET_SHIFT` go to bucket 0
+#define LORAWAN_STATS_DATARATES 16  ///< @brief Datarates with airtime accounting
+
+/**
+  * @brief Sections of exported metrics
+  */
+typedef enum {
+    STATS_COUNTERS = 0x01,      ///< @brief Uplink, join and downlink counters
+    STATS_AIRTIME = 0x02,       ///< @brief Airtime per datarate
+    STATS_DOWNLINKS = 0x04,     ///< @brief Downlinks per port
+    STATS_STORAGE = 0x08,       ///< @brief Storage writes and bytes
+    STATS_WRITE_TIME = 0x10,    ///< @brief Storage write duration histograms
+    STATS_LOOP_TIME = 0x20,     ///< @brief `loop()` latency histogram
+    STATS_ALL = 0x3F            ///< @brief All sections
+} stats_section_t;
+
+/**
+  * @brief Fixed bucket histogram of durations in microseconds
+  */
+class LoRaHistogram {
+public:
+    /**
+     * @brief Counts a value
+     * @param value Duration in microseconds
+     */
+    void add (uint32_t value) {
+        value >>= LORAWAN_STATS_BUCKET_SHIFT;
+        // Bucket is number of significant bits left
+        uint8_t bucket = value ? 32 - __builtin_clz (value) : 0;
+        buckets[bucket < LORAWAN_STATS_BUCKETS ? bucket : LORAWAN_STATS_BUCKETS - 1]++;
+    }
+
+    /**
+     * @brief Gets number of values in a bucket
+     */
+    uint32_t get (uint8_t bucket) const {
+        return bucket < LORAWAN_STATS_BUCKETS ? buckets[bucket] : 0;
+    }
+
+    /**
+     * @brief Sets number of values in a bucket. Used to rebuild a histogram from exported data
+     */
+    void set (uint8_t bucket, uint32_t count) {
+        if (bucket < LORAWAN_STATS_BUCKETS) {
+            buckets[bucket] = count;
+        }
+    }
+
+    /**
+     * @brief Gets number of values counted
+     */
+    uint32_t count () const;
+
+    /**
+     * @brief Estimates the value below which a fraction of counted values are
+     * @param percent Fraction, 0 to 100
+     * @return Upper limit of bucket where percentile falls, in microseconds. Floor of last bucket, which has no upper
+     *         limit. 0 if histogram is empty
+     */
+    uint32_t percentile (uint8_t percent) const;
+
+    /**
+     * @brief Gets lowest value counted in a bucket
+     */
+    static uint32_t bucket_floor (uint8_t bucket) {
+        return bucket ? 1UL << (bucket + LORAWAN_STATS_BUCKET_SHIFT - 1) : 0;
+    }
+
+private:
+    uint32_t buckets[LORAWAN_STATS_BUCKETS] = { 0 }; ///< @brief Values counted in every bucket
+};
+
+/**
+  * @brief Downlink count of a port
+  */
+typedef struct {
+    uint8_t port = 0;   ///< @brief LoRaWAN port
+    uint32_t count = 0; ///< @brief Downlinks received on it
+} port_count_t;
+
+/**
+  * @brief Runtime metrics. Counters start at `init()` and are not stored
+  */
+typedef struct {
+    uint32_t uplinks_queued = 0;    ///< @brief Messages accepted in uplink queue
+    uint32_t uplinks_sent = 0;      ///< @brief Data frames transmitted, retries included
+    uint32_t uplinks_dropped = 0;   ///< @brief Messages lost because of queue overflow or LMIC rejection
+    uint32_t confirmed_acked = 0;   ///< @brief Confirmed frames that got an acknowledge
+    uint32_t confirmed_missed = 0;  ///< @brief Confirmed frames with no acknowledge
+    uint32_t joins = 0;             ///< @brief Successful joins
+    uint32_t join_requests = 0;     ///< @brief JoinRequest frames transmitted
+    uint32_t link_dead = 0;         ///< @brief Times LMIC reported link as dead
+    uint32_t downlinks = 0;         ///< @brief Downlinks received
+    uint32_t airtime_ms[LORAWAN_STATS_DATARATES] = { 0 };   ///< @brief Airtime on every datarate, joins included
+    port_count_t ports[LORAWAN_STATS_PORTS];    ///< @brief Downlinks per port, in order of first reception
+    uint8_t port_count = 0;         ///< @brief Entries used in `ports`
+    uint32_t other_ports = 0;       ///< @brief Downlinks on ports that did not fit in `ports`
+    uint32_t counters_writes = 0;   ///< @brief Counters writes to storage
+    uint32_t counters_bytes = 0;    ///< @brief Bytes written to counters storage
+    uint32_t session_writes = 0;    ///< @brief Session writes to storage
+    uint32_t session_bytes = 0;     ///< @brief Bytes written to session storage
+    LoRaHistogram counters_write_us;    ///< @brief Duration of counters writes
+    LoRaHistogram session_write_us;     ///< @brief Duration of session writes
+    LoRaHistogram loop_us;          ///< @brief Duration of `loop()` calls
+} node_stats_t;
+
+/**
+  * @brief Counts a downlink on a port
+  * @param stats Metrics
+  * @param port LoRaWAN port
+  */
+void lorawan_stats_count_port (node_stats_t& stats, uint8_t port);
+
+/**
+  * @brief Exports metrics in compact binary format
+  * @param stats Metrics
+  * @param buffer Output buffer
+  * @param size Buffer size
+  * @param sections Bitmap of `stats_section_t` to export
+  * @return Exported length. 0 if buffer cannot hold header and at least one section
+  */
+size_t lorawan_stats_export (const node_stats_t& stats, uint8_t* buffer, size_t size, uint8_t sections = STATS_ALL);
+
+/**
+  * @brief Rebuilds metrics from exported data. Sections not present are left at zero
+  * @param buffer Exported data
+  * @param len Data length
+  * @param stats Returns metrics
+  * @return `False` if data is malformed or has another format version
+  */
+bool lorawan_stats_import (const uint8_t* buffer, size_t len, node_stats_t* stats);
+
+#endif // LORAWAN_STATS_H
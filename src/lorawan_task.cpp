@@ -0,0 +1,183 @@
+#include <Arduino.h>
+#include "lorawan_task.h"
+
+#if defined ESP32
+
+bool LoRaTask::start (task_func_t func, void* arg, int core, uint8_t priority) {
+    if (running) {
+        return false;
+    }
+    this->func = func;
+    this->arg = arg;
+    stopping = false;
+    finished = false;
+    mutex = xSemaphoreCreateRecursiveMutex ();
+    if (!mutex) {
+        return false;
+    }
+    running = true;
+    if (xTaskCreatePinnedToCore (entry, "lorawan", LORAWAN_TASK_STACK, this, priority, &handle, core) != pdPASS) {
+        running = false;
+        vSemaphoreDelete (mutex);
+        mutex = nullptr;
+        return false;
+    }
+    return true;
+}
+
+void LoRaTask::stop () {
+    if (!running) {
+        return;
+    }
+    stopping = true;
+    notify ();
+    while (!finished) {
+        vTaskDelay (1);
+    }
+    running = false;
+    vSemaphoreDelete (mutex);
+    mutex = nullptr;
+    handle = nullptr;
+}
+
+void LoRaTask::lock () {
+    xSemaphoreTakeRecursive (mutex, portMAX_DELAY);
+}
+
+void LoRaTask::unlock () {
+    xSemaphoreGiveRecursive (mutex);
+}
+
+void LoRaTask::notify () {
+    if (handle && xTaskGetCurrentTaskHandle () != handle) {
+        xTaskNotifyGive (handle);
+    }
+}
+
+void LoRaTask::wait (uint32_t ms) {
+    TickType_t ticks = portMAX_DELAY;
+    if (ms != LORAWAN_TASK_WAIT_FOREVER) {
+        ticks = pdMS_TO_TICKS (ms);
+        if (!ticks) {
+            ticks = 1;
+        }
+    }
+    ulTaskNotifyTake (pdTRUE, ticks);
+}
+
+void LoRaTask::entry (void* self) {
+    LoRaTask* task = (LoRaTask*)self;
+    task->func (task->arg);
+    task->finished = true;
+    vTaskDelete (NULL);
+}
+
+#elif LORAWAN_TASK_SUPPORTED
+
+bool LoRaTask::start (task_func_t func, void* arg, int core, uint8_t priority) {
+    if (running) {
+        return false;
+    }
+    this->func = func;
+    this->arg = arg;
+    stopping = false;
+    notified = false;
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init (&attr);
+    pthread_mutexattr_settype (&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init (&mutex, &attr);
+    pthread_mutexattr_destroy (&attr);
+    pthread_mutex_init (&wake_mutex, NULL);
+    pthread_cond_init (&wake, NULL);
+
+    running = true;
+    if (pthread_create (&thread, NULL, entry, this)) {
+        running = false;
+        pthread_cond_destroy (&wake);
+        pthread_mutex_destroy (&wake_mutex);
+        pthread_mutex_destroy (&mutex);
+        return false;
+    }
+    return true;
+}
+
+void LoRaTask::stop () {
+    if (!running) {
+        return;
+    }
+    stopping = true;
+    notify ();
+    pthread_join (thread, NULL);
+    running = false;
+    pthread_cond_destroy (&wake);
+    pthread_mutex_destroy (&wake_mutex);
+    pthread_mutex_destroy (&mutex);
+}
+
+void LoRaTask::lock () {
+    pthread_mutex_lock (&mutex);
+}
+
+void LoRaTask::unlock () {
+    pthread_mutex_unlock (&mutex);
+}
+
+void LoRaTask::notify () {
+    pthread_mutex_lock (&wake_mutex);
+    notified = true;
+    pthread_cond_signal (&wake);
+    pthread_mutex_unlock (&wake_mutex);
+}
+
+void LoRaTask::wait (uint32_t ms) {
+    if (ms > LORAWAN_TASK_HOST_POLL) {
+        ms = LORAWAN_TASK_HOST_POLL;
+    }
+    struct timespec deadline;
+    clock_gettime (CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += (long)ms * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+    }
+    pthread_mutex_lock (&wake_mutex);
+    while (!notified) {
+        if (pthread_cond_timedwait (&wake, &wake_mutex, &deadline)) {
+            break;
+        }
+    }
+    notified = false;
+    pthread_mutex_unlock (&wake_mutex);
+}
+
+void* LoRaTask::entry (void* self) {
+    LoRaTask* task = (LoRaTask*)self;
+    task->func (task->arg);
+    return NULL;
+}
+
+#else
+
+// No preemptive tasks on this platform. Task never starts, so lock is never used
+
+bool LoRaTask::start (task_func_t func, void* arg, int core, uint8_t priority) {
+    return false;
+}
+
+void LoRaTask::stop () {
+}
+
+void LoRaTask::lock () {
+}
+
+void LoRaTask::unlock () {
+}
+
+void LoRaTask::notify () {
+}
+
+void LoRaTask::wait (uint32_t ms) {
+}
+
+#endif
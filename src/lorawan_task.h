@@ -0,0 +1,155 @@
+/**
+  * @file lorawan_task.h
+  * @version 0.0.2
+  * @date 05/10/2021
+  * @author German Martin
+  * @brief Radio task and lock abstraction
+  *
+  * Runs LMIC in its own task, so that application code cannot delay RX windows. It uses FreeRTOS on ESP32 and
+  * pthreads on host builds. ESP8266 has no preemptive tasks, so task mode is not available there.
+  */
+
+#ifndef LORAWAN_TASK_H
+#define LORAWAN_TASK_H
+
+#include <stdint.h>
+
+#if defined ESP32
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/semphr.h>
+#define LORAWAN_TASK_SUPPORTED 1
+#elif defined ESP8266
+#define LORAWAN_TASK_SUPPORTED 0
+#else
+#include <pthread.h>
+#define LORAWAN_TASK_SUPPORTED 1
+#endif
+
+#ifndef LORAWAN_TASK_CORE
+#define LORAWAN_TASK_CORE 0 ///< @brief ESP32 core radio task is pinned to. Arduino `loop()` runs on core 1
+#endif // LORAWAN_TASK_CORE
+
+#ifndef LORAWAN_TASK_PRIORITY
+#define LORAWAN_TASK_PRIORITY 20 ///< @brief Radio task priority. Above application tasks, below WiFi stack
+#endif // LORAWAN_TASK_PRIORITY
+
+#ifndef LORAWAN_TASK_STACK
+#define LORAWAN_TASK_STACK 8192 ///< @brief Radio task stack size in bytes. Session files are written from this task
+#endif // LORAWAN_TASK_STACK
+
+#ifndef LORAWAN_TASK_HOST_POLL
+#define LORAWAN_TASK_HOST_POLL 1 ///< @brief Maximum wait of host radio task, in milliseconds. Simulated time does not follow wall clock
+#endif // LORAWAN_TASK_HOST_POLL
+
+#define LORAWAN_TASK_WAIT_FOREVER UINT32_MAX ///< @brief Wait until notified
+
+class LoRaTask {
+public:
+    typedef void (*task_func_t) (void* arg);
+
+    /**
+     * @brief Creates lock and starts task
+     * @param func Task body. It must return when `is_stopping()` is `true`
+     * @param arg Argument passed to `func`
+     * @param core Core task is pinned to. Ignored on host
+     * @param priority Task priority. Ignored on host
+     * @return `True` if task was started
+     */
+    bool start (task_func_t func, void* arg, int core, uint8_t priority);
+
+    /**
+     * @brief Asks task to finish and waits until it does. Lock is destroyed
+     */
+    void stop ();
+
+    /**
+     * @brief Takes lock. It is recursive, so that it may be taken again from the same task
+     */
+    void lock ();
+
+    /**
+     * @brief Releases lock
+     */
+    void unlock ();
+
+    /**
+     * @brief Wakes task up if it is waiting
+     */
+    void notify ();
+
+    /**
+     * @brief Blocks calling task until notified or timeout. To be called from task body only
+     * @param ms Timeout in milliseconds. `LORAWAN_TASK_WAIT_FOREVER` waits until notified
+     */
+    void wait (uint32_t ms);
+
+    /**
+     * @brief Checks if task is running
+     * @return `True` if task is running
+     */
+    bool is_running () {
+        return running;
+    }
+
+    /**
+     * @brief Checks if task has been asked to finish
+     * @return `True` after `stop()` is called
+     */
+    bool is_stopping () {
+        return stopping;
+    }
+
+private:
+    task_func_t func = nullptr; ///< @brief Task body
+    void* arg = nullptr;        ///< @brief Task body argument
+    volatile bool running = false;  ///< @brief Task has been started and not stopped yet
+    volatile bool stopping = false; ///< @brief Task has been asked to finish
+#if defined ESP32
+    TaskHandle_t handle = nullptr;      ///< @brief Radio task
+    SemaphoreHandle_t mutex = nullptr;  ///< @brief Recursive mutex, with priority inheritance
+    volatile bool finished = false;     ///< @brief Task body has returned
+#elif LORAWAN_TASK_SUPPORTED
+    pthread_t thread;               ///< @brief Radio thread
+    pthread_mutex_t mutex;          ///< @brief Recursive mutex
+    pthread_mutex_t wake_mutex;     ///< @brief Protects `notified`
+    pthread_cond_t wake;            ///< @brief Signals notification
+    bool notified = false;          ///< @brief Notification pending
+#endif
+
+    /**
+     * @brief Platform task entry point
+     * @param self Task object
+     */
+#if defined ESP32
+    static void entry (void* self);
+#else
+    static void* entry (void* self);
+#endif
+};
+
+/**
+  * @brief Holds a task lock while in scope. Does nothing if task is not running
+  */
+class LoRaTaskGuard {
+public:
+    LoRaTaskGuard (LoRaTask& task) : task (task), locked (task.is_running ()) {
+        if (locked) {
+            task.lock ();
+        }
+    }
+
+    ~LoRaTaskGuard () {
+        if (locked) {
+            task.unlock ();
+            // State may have changed. Let radio task recalculate its deadline
+            task.notify ();
+        }
+    }
+
+private:
+    LoRaTask& task;
+    bool locked;
+};
+
+#endif // LORAWAN_TASK_H
@@ -0,0 +1,77 @@
+/**
+  * @file lorawan_varint.h
+  * @version 0.0.2
+  * @date 05/10/2021
+  * @author German Martin
+  * @brief Variable length integers used by QuickLoRaWAN compact encodings
+  *
+  * Values are written 7 bits per byte, least significant group first. Bit 7 is set in every byte but the last one.
+  */
+
+#ifndef LORAWAN_VARINT_H
+#define LORAWAN_VARINT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define LORAWAN_VARINT_MAX 5 ///< @brief Maximum length of a 32 bit varint
+
+/**
+  * @brief Maps signed values to unsigned ones, so that small magnitudes get small codes: 0, -1, 1, -2...
+  */
+inline uint32_t lorawan_zigzag (uint32_t n) {
+    return (n << 1) ^ (uint32_t)((int32_t)n >> 31);
+}
+
+inline uint32_t lorawan_unzigzag (uint32_t z) {
+    return (z >> 1) ^ (0u - (z & 1));
+}
+
+/**
+  * @brief Gets number of bytes a value takes as varint
+  */
+inline uint8_t lorawan_varint_size (uint32_t v) {
+    uint8_t size = 1;
+    while (v >= 0x80) {
+        v >>= 7;
+        size++;
+    }
+    return size;
+}
+
+/**
+  * @brief Writes a varint
+  * @param buffer Output buffer. It must have room for `lorawan_varint_size (v)` bytes
+  * @param v Value
+  * @return Bytes written
+  */
+inline size_t lorawan_put_varint (uint8_t* buffer, uint32_t v) {
+    size_t len = 0;
+    while (v >= 0x80) {
+        buffer[len++] = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    buffer[len++] = (uint8_t)v;
+    return len;
+}
+
+/**
+  * @brief Reads a varint
+  * @param buffer Input buffer
+  * @param len Bytes available in buffer
+  * @param v Returns value
+  * @return Bytes used. 0 if buffer ends before varint does
+  */
+inline size_t lorawan_get_varint (const uint8_t* buffer, size_t len, uint32_t* v) {
+    uint32_t result = 0;
+    for (size_t i = 0; i < len && i < LORAWAN_VARINT_MAX; i++) {
+        result |= (uint32_t)(buffer[i] & 0x7F) << (7 * i);
+        if (!(buffer[i] & 0x80)) {
+            *v = result;
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+#endif // LORAWAN_VARINT_H